@@ -0,0 +1,197 @@
+/*
+Market data collector for crypto exchanges.
+https://github.com/ilia-funtov/crypto-market-data-collector
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2022 Ilia Funtov.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Compares the decimal conversions of feed prices and dumped levels with the standard ones they replace.
+// Usage: decimal-bench [numbers]
+// Prices with 2 decimals and volumes with 8 decimals, like the ones exchanges send and the dump files take.
+
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <decimal_format.hpp>
+
+namespace
+{
+	struct decimal_value
+	{
+		std::string text;
+		double value;
+		int precision;
+	};
+
+	std::vector<decimal_value> generate_values(std::size_t count)
+	{
+		std::mt19937_64 random(42);
+		std::uniform_int_distribution<std::int64_t> price_distribution(2000000, 6000000); // cents
+		std::uniform_int_distribution<std::int64_t> volume_distribution(1, 1000000000); // 1e-8 units
+
+		std::vector<decimal_value> values;
+		values.reserve(count);
+
+		char buffer[64];
+		for (std::size_t n = 0; n != count; ++n)
+		{
+			const bool price = (n % 2 == 0);
+			const auto precision = price ? 2 : 8;
+			const auto value = price ? static_cast<double>(price_distribution(random)) / 100 : static_cast<double>(volume_distribution(random)) / 1e8;
+
+			const auto result = std::to_chars(std::begin(buffer), std::end(buffer), value, std::chars_format::fixed, precision);
+			values.push_back(decimal_value{ std::string(buffer, result.ptr), value, precision });
+		}
+
+		return values;
+	}
+
+	// Nanoseconds per number of the conversion, the checksum keeps the results alive.
+	template <typename function_t>
+	double measure(const std::vector<decimal_value> & values, function_t function, double & checksum)
+	{
+		const auto start = std::chrono::steady_clock::now();
+
+		for (const auto & value : values)
+		{
+			checksum += function(value);
+		}
+
+		const auto finish = std::chrono::steady_clock::now();
+		return std::chrono::duration<double, std::nano>(finish - start).count() / static_cast<double>(values.size());
+	}
+
+	double parse_stod(const decimal_value & value)
+	{
+		return std::stod(value.text);
+	}
+
+	double parse_stream(const decimal_value & value)
+	{
+		std::istringstream stream(value.text);
+		double result = 0;
+		stream >> result;
+		return result;
+	}
+
+	double parse_std_from_chars(const decimal_value & value)
+	{
+		double result = 0;
+		std::from_chars(value.text.data(), value.text.data() + value.text.size(), result);
+		return result;
+	}
+
+	double parse_decimal(const decimal_value & value)
+	{
+		double result = 0;
+		decimal_format::from_chars(value.text.data(), value.text.data() + value.text.size(), result);
+		return result;
+	}
+
+	double format_stream(const decimal_value & value)
+	{
+		std::ostringstream stream;
+		stream << std::fixed << std::setprecision(value.precision) << value.value;
+		return static_cast<double>(stream.str().size());
+	}
+
+	double format_std_to_chars(const decimal_value & value)
+	{
+		char buffer[64];
+		const auto result = std::to_chars(std::begin(buffer), std::end(buffer), value.value, std::chars_format::fixed, value.precision);
+		return static_cast<double>(result.ptr - buffer + buffer[0]);
+	}
+
+	double format_decimal(const decimal_value & value)
+	{
+		char buffer[64];
+		const auto result = decimal_format::to_chars_fixed(std::begin(buffer), std::end(buffer), value.value, value.precision);
+		return static_cast<double>(result.ptr - buffer + buffer[0]);
+	}
+
+	// The replacements have to give the results of the standard functions.
+	std::size_t count_mismatches(const std::vector<decimal_value> & values)
+	{
+		std::size_t mismatches = 0;
+		for (const auto & value : values)
+		{
+			char buffer[64];
+			const auto result = decimal_format::to_chars_fixed(std::begin(buffer), std::end(buffer), value.value, value.precision);
+			if (parse_decimal(value) != parse_std_from_chars(value) || std::string(buffer, result.ptr) != value.text)
+				++mismatches;
+		}
+
+		return mismatches;
+	}
+}
+
+int main(int argc, char * argv[])
+{
+	try
+	{
+		const std::size_t count = (argc > 1) ? std::stoul(argv[1]) : 2000000;
+		if (count == 0)
+		{
+			throw std::runtime_error("No numbers to convert");
+		}
+
+		const auto values = generate_values(count);
+		std::cout << "Numbers: " << values.size() << std::endl;
+
+		double checksum = 0;
+		const auto report = [&](const char * name, double ns)
+		{
+			std::cout << std::left << std::setw(36) << name << std::right << std::fixed << std::setprecision(1) << std::setw(8) << ns << " ns/number" << std::endl;
+		};
+
+		report("parse std::stod", measure(values, parse_stod, checksum));
+		report("parse std::istringstream", measure(values, parse_stream, checksum));
+		report("parse std::from_chars", measure(values, parse_std_from_chars, checksum));
+		report("parse decimal_format::from_chars", measure(values, parse_decimal, checksum));
+		report("format std::ostringstream", measure(values, format_stream, checksum));
+		report("format std::to_chars", measure(values, format_std_to_chars, checksum));
+		report("format decimal_format::to_chars_fixed", measure(values, format_decimal, checksum));
+
+		const auto mismatches = count_mismatches(values);
+		if (mismatches != 0)
+		{
+			std::cerr << "Conversions differ from the standard ones: " << mismatches << " number(s), checksum " << checksum << std::endl;
+			return 1;
+		}
+	}
+	catch (const std::exception & exc)
+	{
+		std::cerr << exc.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
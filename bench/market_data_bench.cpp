@@ -0,0 +1,300 @@
+/*
+Market data collector for crypto exchanges.
+https://github.com/ilia-funtov/crypto-market-data-collector
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2022 Ilia Funtov.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+
+// Replays a raw capture of the collector (--capture-file) through the websocket read handlers,
+// the market data subscribers and the market data providers, exchange by exchange.
+// Usage: market-data-bench --capture-file FILE [--symbol-config FILE] [--depth N] [--iterations N] [--format csv|binary] [--dynamic-depth]
+// The "feed" stage ends in the provider callbacks, the "pipeline" stage also dumps records to a temporary directory
+// and is measured until the dump queues are drained.
+// Kraken symbols of the config are looked up with a REST request unless they are websocket names like XBT/USD.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <new>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <boost/log/core.hpp>
+#include <boost/program_options.hpp>
+
+#include <logger.hpp>
+#include <capture_replay.hpp>
+#include <market_data_provider.hpp>
+#include <raw_capture.hpp>
+#include <symbol_config.hpp>
+
+namespace
+{
+	std::atomic<std::uint64_t> allocations_count{0};
+}
+
+void * operator new(std::size_t size)
+{
+	allocations_count.fetch_add(1, std::memory_order_relaxed);
+
+	if (auto ptr = std::malloc(size == 0 ? 1 : size))
+		return ptr;
+
+	throw std::bad_alloc();
+}
+
+void operator delete(void * ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete(void * ptr, std::size_t) noexcept
+{
+	std::free(ptr);
+}
+
+namespace
+{
+	using logger_t = logger::details::logger_t;
+
+	enum class stage_type
+	{
+		feed,
+		pipeline
+	};
+
+	struct stage_result
+	{
+		std::uint64_t messages = 0;
+		std::uint64_t allocations = 0;
+		double replay_ns = 0; // until the last message is handled
+		double total_ns = 0; // until the dump queues are drained
+	};
+
+	// The symbols of the config which are traded on the exchange, with the other exchanges removed.
+	std::vector<market_data::general_symbol_description> get_exchange_symbols(
+		const std::vector<market_data::general_symbol_description> & symbol_descriptions,
+		market_data::exchange_type exchange)
+	{
+		std::vector<market_data::general_symbol_description> result;
+		for (const auto & symbol_description : symbol_descriptions)
+		{
+			const auto iter = symbol_description.source_exchanges.find(exchange);
+			if (iter == symbol_description.source_exchanges.end())
+				continue;
+
+			auto exchange_symbol = symbol_description;
+			exchange_symbol.source_exchanges = { *iter };
+			result.push_back(std::move(exchange_symbol));
+		}
+
+		return result;
+	}
+
+	template <unsigned int fixed_depth>
+	stage_result run_stage(
+		logger_t logger,
+		raw_capture::reader & reader,
+		const std::vector<market_data::general_symbol_description> & symbol_descriptions,
+		market_data::exchange_type exchange,
+		stage_type stage,
+		const market_data::dump_options & options,
+		const std::filesystem::path & dump_path)
+	{
+		using clock_t = std::chrono::steady_clock;
+		using provider_t = market_data::market_data_provider<logger_t, fixed_depth>;
+
+		stage_result result;
+
+		const auto connections = std::make_shared<market_data::feed_connections<logger_t>>(logger, websocket_subscriber::replay_mode);
+
+		std::vector<std::unique_ptr<provider_t>> providers;
+		for (const auto & symbol_description : symbol_descriptions)
+		{
+			providers.push_back(std::make_unique<provider_t>(logger, symbol_description, market_data::market_data_subscriber{}, options, connections));
+			if (stage == stage_type::pipeline)
+				providers.back()->set_dump_quotes(true, dump_path.string(), 60);
+		}
+
+		reader.rewind();
+		market_data::capture_replay<logger_t> replay(reader, *connections);
+
+		const auto start_allocations = allocations_count.load(std::memory_order_relaxed);
+		const auto start = clock_t::now();
+
+		const auto counts = replay.run(market_data::replay_speed::max);
+		result.replay_ns = std::chrono::duration<double, std::nano>(clock_t::now() - start).count();
+
+		const auto queued_records = [&providers]()
+		{
+			std::size_t records = 0;
+			for (const auto & provider : providers)
+			{
+				records += provider->get_queued_records();
+			}
+			return records;
+		};
+
+		// the last popped records may be still written, which is negligible on captures of real sessions
+		while (queued_records() != 0)
+		{
+			std::this_thread::yield();
+		}
+
+		result.total_ns = std::chrono::duration<double, std::nano>(clock_t::now() - start).count();
+		result.allocations = allocations_count.load(std::memory_order_relaxed) - start_allocations;
+
+		const auto iter = counts.find(exchange);
+		result.messages = (iter != counts.end()) ? iter->second : 0;
+
+		return result;
+	}
+
+	void report(market_data::exchange_type exchange, const char * stage_name, const std::vector<stage_result> & results)
+	{
+		// the best iteration, the others are disturbed by the rest of the system
+		const auto best = *std::min_element(results.cbegin(), results.cend(),
+			[](const stage_result & a, const stage_result & b) { return a.total_ns < b.total_ns; });
+
+		const auto messages = static_cast<double>(best.messages);
+
+		std::cout << std::left << std::setw(10) << market_data::get_exchange_name(exchange) << std::setw(10) << stage_name
+			<< std::right << std::fixed << std::setprecision(0)
+			<< std::setw(12) << messages * 1e9 / best.total_ns << " msgs/s"
+			<< std::setprecision(1)
+			<< std::setw(10) << best.replay_ns / messages << " ns/msg handled"
+			<< std::setw(10) << best.total_ns / messages << " ns/msg total"
+			<< std::setprecision(2)
+			<< std::setw(8) << static_cast<double>(best.allocations) / messages << " allocs/msg" << std::endl;
+	}
+}
+
+int main(int argc, char * argv[])
+{
+	namespace po = boost::program_options;
+
+	constexpr auto opt_help = "help";
+	constexpr auto opt_capture_file = "capture-file";
+	constexpr auto opt_symbol_config = "symbol-config";
+	constexpr auto opt_depth = "depth";
+	constexpr auto opt_iterations = "iterations";
+	constexpr auto opt_format = "format";
+	constexpr auto opt_dynamic_depth = "dynamic-depth";
+
+	try
+	{
+		po::options_description desc("Allowed options");
+		desc.add_options()
+			(opt_help, "produce help message")
+			(opt_capture_file, po::value<std::string>(), "raw capture written by the collector with --capture-file")
+			(opt_symbol_config, po::value<std::string>()->default_value("config/symbol_mapping.json"), "symbol mapping used during the capture")
+			(opt_depth, po::value<unsigned int>()->default_value(10), "order book depth")
+			(opt_iterations, po::value<unsigned int>()->default_value(5), "replays of every stage, the best one is reported")
+			(opt_format, po::value<std::string>()->default_value("binary"), "format of dumped records: csv or binary")
+			(opt_dynamic_depth, "keep levels of records in vectors also for depths with inline levels");
+
+		po::variables_map vm;
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		po::notify(vm);
+
+		if (vm.count(opt_help) != 0 || vm.count(opt_capture_file) == 0)
+		{
+			std::cout << desc << std::endl;
+			return vm.count(opt_help) != 0 ? 0 : 1;
+		}
+
+		const auto depth = vm[opt_depth].as<unsigned int>();
+		const auto iterations = vm[opt_iterations].as<unsigned int>();
+		const auto dynamic_depth = vm.count(opt_dynamic_depth) != 0;
+		if (depth == 0 || iterations == 0)
+		{
+			throw std::runtime_error("Depth and iterations have to be positive");
+		}
+
+		boost::log::core::get()->set_logging_enabled(false);
+		const auto logger = std::make_shared<logger::details::severity_logger_t>();
+
+		market_data::dump_options options;
+		options.format = dump_writer::get_file_format(vm[opt_format].as<std::string>());
+
+		raw_capture::reader reader(vm[opt_capture_file].as<std::string>());
+
+		const auto symbol_descriptions = market_data::get_symbol_descriptions(
+			vm[opt_symbol_config].as<std::string>(),
+			market_data::get_supported_exchanges(),
+			depth);
+
+		const auto dump_root = std::filesystem::temp_directory_path() / ("market-data-bench-" + std::to_string(std::chrono::system_clock::now().time_since_epoch().count()));
+
+		unsigned int dump_index = 0;
+		for (const auto exchange : market_data::get_supported_exchanges())
+		{
+			const auto exchange_symbols = get_exchange_symbols(symbol_descriptions, exchange);
+			if (exchange_symbols.empty())
+				continue;
+
+			for (const auto & [stage, stage_name] : { std::make_pair(stage_type::feed, "feed"), std::make_pair(stage_type::pipeline, "pipeline") })
+			{
+				std::vector<stage_result> results;
+				for (unsigned int n = 0; n != iterations; ++n)
+				{
+					// every run dumps to its own directory, files of the same block are appended otherwise
+					const auto dump_path = dump_root / std::to_string(dump_index++);
+					std::filesystem::create_directories(dump_path);
+
+					const auto run = [&](auto fixed_depth)
+					{
+						return run_stage<decltype(fixed_depth)::value>(logger, reader, exchange_symbols, exchange, stage, options, dump_path);
+					};
+
+					results.push_back(dynamic_depth ? run(std::integral_constant<unsigned int, 0>{}) : market_data::visit_fixed_depth(depth, run));
+				}
+
+				if (results.front().messages == 0)
+					break; // no messages of the exchange in the capture
+
+				report(exchange, stage_name, results);
+			}
+		}
+
+		std::filesystem::remove_all(dump_root);
+	}
+	catch (const std::exception & exc)
+	{
+		std::cerr << exc.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,327 @@
+/*
+Market data collector for crypto exchanges.
+https://github.com/ilia-funtov/crypto-market-data-collector
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2022 Ilia Funtov.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Compares the flat price level book with the std::map based book on BTC-USD level2 traffic.
+// Usage: order-book-bench [coinbase feed capture with one JSON message per line] [depth]
+// Without a capture a synthetic level2_batch-like stream is generated.
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+#include <json_helpers.hpp>
+#include <price_levels.hpp>
+
+namespace
+{
+	struct book_change
+	{
+		bool bid;
+		double price;
+		double volume;
+	};
+
+	// One feed message: a snapshot replaces the book, an update applies its changes.
+	struct book_message
+	{
+		bool snapshot;
+		std::vector<book_change> changes;
+	};
+
+	std::vector<book_message> load_capture(const std::string & file_name, const std::string & product_id)
+	{
+		using json = nlohmann::json;
+
+		std::ifstream input(file_name);
+		if (!input.is_open())
+		{
+			throw std::runtime_error("Could not open capture file: " + file_name);
+		}
+
+		std::vector<book_message> messages;
+
+		std::string line;
+		while (std::getline(input, line))
+		{
+			if (line.empty())
+				continue;
+
+			const auto object = json::parse(line, nullptr, false);
+			if (!object.is_object())
+				continue;
+
+			const auto type = json_helpers::get_value<std::string>(object, "type");
+			if (!product_id.empty() && json_helpers::get_value<std::string>(object, "product_id") != product_id)
+				continue;
+
+			book_message message;
+			if (type == "snapshot")
+			{
+				message.snapshot = true;
+				for (const auto & [name, bid] : { std::make_pair("bids", true), std::make_pair("asks", false) })
+				{
+					for (const auto & order : object.at(name))
+					{
+						message.changes.push_back({ bid, json_helpers::get_double(order.at(0)), json_helpers::get_double(order.at(1)) });
+					}
+				}
+			}
+			else if (type == "l2update")
+			{
+				message.snapshot = false;
+				for (const auto & change : object.at("changes"))
+				{
+					const auto side = change.at(0).get<std::string>();
+					message.changes.push_back({ side == "buy", json_helpers::get_double(change.at(1)), json_helpers::get_double(change.at(2)) });
+				}
+			}
+			else
+			{
+				continue;
+			}
+
+			messages.push_back(std::move(message));
+		}
+
+		return messages;
+	}
+
+	// Random walk of the mid price with updates concentrated near the top of the book,
+	// the way level2_batch traffic for BTC-USD looks like.
+	std::vector<book_message> generate_traffic(std::size_t messages_num)
+	{
+		constexpr double tick = 0.01;
+		constexpr int initial_levels = 20000;
+
+		std::mt19937_64 random(42);
+		std::geometric_distribution<int> distance_distribution(0.05);
+		std::uniform_real_distribution<double> unit_distribution(0.0, 1.0);
+		std::discrete_distribution<int> changes_num_distribution({ 0, 50, 25, 12, 6, 4, 3 });
+
+		std::int64_t mid_ticks = 4301255;
+
+		const auto random_volume = [&]() { return 0.0001 + unit_distribution(random) * 2.0; };
+
+		std::vector<book_message> messages;
+		messages.reserve(messages_num + 1);
+
+		book_message snapshot{ true, {} };
+		for (int n = 1; n <= initial_levels; ++n)
+		{
+			snapshot.changes.push_back({ true, (mid_ticks - n) * tick, random_volume() });
+			snapshot.changes.push_back({ false, (mid_ticks + n) * tick, random_volume() });
+		}
+		messages.push_back(std::move(snapshot));
+
+		for (std::size_t n = 0; n != messages_num; ++n)
+		{
+			const auto move = unit_distribution(random);
+			if (move < 0.05)
+				--mid_ticks;
+			else if (move > 0.95)
+				++mid_ticks;
+
+			book_message message{ false, {} };
+			const auto changes_num = changes_num_distribution(random);
+			for (int c = 0; c != changes_num; ++c)
+			{
+				const bool bid = unit_distribution(random) < 0.5;
+				const auto distance = 1 + distance_distribution(random);
+				const auto price = (bid ? mid_ticks - distance : mid_ticks + distance) * tick;
+				const auto volume = (unit_distribution(random) < 0.3) ? 0.0 : random_volume();
+				message.changes.push_back({ bid, price, volume });
+			}
+
+			messages.push_back(std::move(message));
+		}
+
+		return messages;
+	}
+
+	// The order book as it was kept before the flat layout was introduced.
+	struct map_book
+	{
+		std::map<double, double> asks;
+		std::map<double, double> bids;
+
+		void apply(const book_message & message)
+		{
+			if (message.snapshot)
+			{
+				asks.clear();
+				bids.clear();
+			}
+
+			for (const auto & change : message.changes)
+			{
+				auto & side = change.bid ? bids : asks;
+				if (change.volume <= 0)
+					side.erase(change.price);
+				else
+					side[change.price] = change.volume;
+			}
+		}
+
+		void top(unsigned int depth, std::vector<std::pair<double, double>> & levels) const
+		{
+			levels.clear();
+			auto iter_bid = bids.crbegin();
+			auto iter_ask = asks.cbegin();
+			for (unsigned int n = 0; n != depth && iter_bid != bids.crend() && iter_ask != asks.cend(); ++n, ++iter_bid, ++iter_ask)
+			{
+				levels.emplace_back(iter_bid->first, iter_bid->second);
+				levels.emplace_back(iter_ask->first, iter_ask->second);
+			}
+		}
+	};
+
+	struct flat_book
+	{
+		market_data_common::ask_levels_t asks;
+		market_data_common::bid_levels_t bids;
+
+		void apply(const book_message & message)
+		{
+			if (message.snapshot)
+			{
+				asks.clear();
+				bids.clear();
+
+				for (const auto & change : message.changes)
+				{
+					if (change.bid)
+						bids.emplace_unsorted(change.price, change.volume);
+					else
+						asks.emplace_unsorted(change.price, change.volume);
+				}
+
+				asks.sort_levels();
+				bids.sort_levels();
+				return;
+			}
+
+			for (const auto & change : message.changes)
+			{
+				if (change.bid)
+					bids.update(change.price, change.volume);
+				else
+					asks.update(change.price, change.volume);
+			}
+		}
+
+		void top(unsigned int depth, std::vector<std::pair<double, double>> & levels) const
+		{
+			levels.clear();
+			auto iter_bid = bids.cbegin();
+			auto iter_ask = asks.cbegin();
+			for (unsigned int n = 0; n != depth && iter_bid != bids.cend() && iter_ask != asks.cend(); ++n, ++iter_bid, ++iter_ask)
+			{
+				levels.emplace_back(iter_bid->price, iter_bid->volume);
+				levels.emplace_back(iter_ask->price, iter_ask->volume);
+			}
+		}
+	};
+
+	template <typename book_t>
+	double run(const std::vector<book_message> & messages, unsigned int depth, double & checksum)
+	{
+		book_t book;
+		std::vector<std::pair<double, double>> levels;
+		levels.reserve(depth * 2);
+
+		const auto start = std::chrono::steady_clock::now();
+
+		for (const auto & message : messages)
+		{
+			book.apply(message);
+			book.top(depth, levels);
+
+			for (const auto & level : levels)
+			{
+				checksum += level.first * level.second;
+			}
+		}
+
+		const auto finish = std::chrono::steady_clock::now();
+		return std::chrono::duration<double, std::nano>(finish - start).count();
+	}
+}
+
+int main(int argc, char * argv[])
+{
+	try
+	{
+		const auto messages = (argc > 1) ? load_capture(argv[1], "BTC-USD") : generate_traffic(2000000);
+		const unsigned int depth = (argc > 2) ? std::stoul(argv[2]) : 10;
+
+		std::size_t changes_num = 0;
+		for (const auto & message : messages)
+		{
+			changes_num += message.changes.size();
+		}
+
+		if (messages.empty())
+		{
+			throw std::runtime_error("No book messages to replay");
+		}
+
+		std::cout << "Messages: " << messages.size() << ", changes: " << changes_num << ", depth: " << depth << std::endl;
+
+		double map_checksum = 0, flat_checksum = 0;
+		const auto map_ns = run<map_book>(messages, depth, map_checksum);
+		const auto flat_ns = run<flat_book>(messages, depth, flat_checksum);
+
+		const auto report = [&](const char * name, double ns)
+		{
+			std::cout << name << ": " << ns / messages.size() << " ns/message, " << ns / changes_num << " ns/change" << std::endl;
+		};
+
+		report("std::map book", map_ns);
+		report("flat price levels", flat_ns);
+		std::cout << "Speedup: " << map_ns / flat_ns << "x" << std::endl;
+
+		if (map_checksum != flat_checksum)
+		{
+			std::cerr << "Books diverged: " << map_checksum << " != " << flat_checksum << std::endl;
+			return 1;
+		}
+	}
+	catch (const std::exception & exc)
+	{
+		std::cerr << exc.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,177 @@
+/*
+Market data collector for crypto exchanges.
+https://github.com/ilia-funtov/crypto-market-data-collector
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2022 Ilia Funtov.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Compares the ISO-8601 parser of feed timestamps with sscanf and timegm.
+// Usage: timestamp-bench [timestamps]
+// Timestamps with microseconds (Coinbase) and milliseconds (BitMEX), in one day and spread over a year.
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <timestamp_parser.hpp>
+
+namespace
+{
+	std::time_t make_utc_time(struct tm & timeinfo)
+	{
+#if defined(_WIN32)
+		return _mkgmtime(&timeinfo);
+#else
+		return timegm(&timeinfo);
+#endif
+	}
+
+	void split_utc_time(std::time_t seconds, struct tm & timeinfo)
+	{
+#if defined(_WIN32)
+		gmtime_s(&timeinfo, &seconds);
+#else
+		gmtime_r(&seconds, &timeinfo);
+#endif
+	}
+
+	// The previous parser, correct for fractions of 6 digits only.
+	std::uint64_t parse_sscanf_timegm(const std::string & iso_time)
+	{
+		unsigned int year = 0, month = 0, day = 0, hour = 0, minute = 0, second = 0, fractional = 0;
+		if (sscanf(iso_time.c_str(), "%u-%u-%uT%u:%u:%u.%uZ", &year, &month, &day, &hour, &minute, &second, &fractional) < 6)
+			throw std::runtime_error("Could not parse ISO time string.");
+
+		struct tm timeinfo = {};
+		timeinfo.tm_year = static_cast<int>(year) - 1900;
+		timeinfo.tm_mon = static_cast<int>(month) - 1;
+		timeinfo.tm_mday = static_cast<int>(day);
+		timeinfo.tm_hour = static_cast<int>(hour);
+		timeinfo.tm_min = static_cast<int>(minute);
+		timeinfo.tm_sec = static_cast<int>(second);
+
+		return static_cast<std::uint64_t>(make_utc_time(timeinfo)) * 1000000 + fractional;
+	}
+
+	// Microseconds since the epoch with the strings, fractions have the digits after the point.
+	std::vector<std::pair<std::string, std::uint64_t>> generate_timestamps(std::size_t count, std::uint64_t range_seconds, int digits)
+	{
+		constexpr std::uint64_t start = 1651363200; // 2022-05-01T00:00:00Z
+
+		std::mt19937_64 random(42);
+		std::uniform_int_distribution<std::uint64_t> distribution(0, range_seconds * 1000000 - 1);
+
+		std::vector<std::pair<std::string, std::uint64_t>> timestamps;
+		timestamps.reserve(count);
+
+		for (std::size_t n = 0; n != count; ++n)
+		{
+			auto microseconds = distribution(random);
+			if (digits == 3)
+				microseconds -= microseconds % 1000;
+
+			const auto seconds = static_cast<std::time_t>(start + microseconds / 1000000);
+			struct tm timeinfo;
+			split_utc_time(seconds, timeinfo);
+
+			std::array<char, 64> buffer;
+			const auto fraction = (digits == 3) ? (microseconds % 1000000) / 1000 : microseconds % 1000000;
+			std::snprintf(buffer.data(), buffer.size(), "%04d-%02d-%02dT%02d:%02d:%02d.%0*uZ",
+				timeinfo.tm_year + 1900, timeinfo.tm_mon + 1, timeinfo.tm_mday, timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_sec,
+				digits, static_cast<unsigned int>(fraction));
+
+			timestamps.emplace_back(buffer.data(), start * 1000000 + microseconds);
+		}
+
+		return timestamps;
+	}
+
+	// Nanoseconds per timestamp, every result is checked against the generated time.
+	template <typename function_t>
+	double measure(const std::vector<std::pair<std::string, std::uint64_t>> & timestamps, function_t function, std::size_t & mismatches)
+	{
+		const auto start = std::chrono::steady_clock::now();
+
+		for (const auto & [str, timestamp] : timestamps)
+		{
+			if (function(str) != timestamp)
+				++mismatches;
+		}
+
+		const auto finish = std::chrono::steady_clock::now();
+		return std::chrono::duration<double, std::nano>(finish - start).count() / static_cast<double>(timestamps.size());
+	}
+}
+
+int main(int argc, char * argv[])
+{
+	try
+	{
+		const std::size_t count = (argc > 1) ? std::stoul(argv[1]) : 1000000;
+		if (count == 0)
+		{
+			throw std::runtime_error("No timestamps to parse");
+		}
+
+		std::cout << "Timestamps: " << count << std::endl;
+
+		std::size_t mismatches = 0;
+		const auto report = [](const char * name, double ns)
+		{
+			std::cout << std::left << std::setw(44) << name << std::right << std::fixed << std::setprecision(1) << std::setw(8) << ns << " ns/timestamp" << std::endl;
+		};
+
+		for (const auto & [name, range_seconds] : { std::make_pair("one day", 86400), std::make_pair("one year", 365 * 86400) })
+		{
+			const auto microseconds = generate_timestamps(count, range_seconds, 6);
+			const auto milliseconds = generate_timestamps(count, range_seconds, 3);
+
+			std::cout << name << ":" << std::endl;
+			report("sscanf + timegm, microseconds", measure(microseconds, parse_sscanf_timegm, mismatches));
+			report("timestamp_parser, microseconds", measure(microseconds,
+				[](const std::string & str) { return timestamp_parser::parse_iso_timestamp_with_microseconds(str); }, mismatches));
+			report("timestamp_parser, milliseconds", measure(milliseconds,
+				[](const std::string & str) { return timestamp_parser::parse_iso_timestamp_with_milliseconds(str); }, mismatches));
+		}
+
+		if (mismatches != 0)
+		{
+			std::cerr << "Parsed timestamps differ from the generated ones: " << mismatches << std::endl;
+			return 1;
+		}
+	}
+	catch (const std::exception & exc)
+	{
+		std::cerr << exc.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,501 @@
+/*
+Market data collector for crypto exchanges.
+https://github.com/ilia-funtov/crypto-market-data-collector
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2022 Ilia Funtov.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Binary block files: a fixed size header, fixed size little-endian records and an index footer.
+//
+// header (64 bytes):
+//   char[4] magic "MDCB", u16 version, u8 record type, u8 price encoding,
+//   u32 header size, u32 record size, u32 depth, u32 index interval, i64 creation time (microseconds), char[32] symbol
+// trade record (32 bytes):
+//   u8 exchange, u8 taker side (0 buy, 1 sell), 6 bytes padding, i64 timestamp, f64 price, f64 volume
+// price record (32 + depth * 32 bytes):
+//   u8 exchange, u8 padding, u16 number of valid levels, 4 bytes padding, i64 timestamp,
+//   i64 exchange event time (0 when unknown), i64 socket receive time,
+//   depth times (f64 bid price, f64 bid volume, f64 ask price, f64 ask volume), invalid levels are zeros
+// bar record (96 bytes):
+//   u8 exchange (255 for all exchanges), 3 bytes padding, u32 interval (seconds), i64 start time,
+//   f64 open, f64 high, f64 low, f64 close, f64 buy volume, f64 sell volume, f64 vwap, u64 trades count, 8 bytes padding
+// footer:
+//   index entries (i64 min timestamp, i64 max timestamp, u64 first record number), one per index interval records,
+//   trailer (24 bytes): u64 entries count, u64 records count, u32 version, char[4] magic "MDCI"
+//
+// A file without a valid trailer (the collector was killed) still has valid header and records,
+// a partial record at the end has to be ignored.
+namespace binary_format
+{
+	constexpr char file_magic[4] = { 'M', 'D', 'C', 'B' };
+	constexpr char index_magic[4] = { 'M', 'D', 'C', 'I' };
+	constexpr std::uint16_t version = 2; // 2 added exchange and receive times to price records
+
+	constexpr std::uint32_t header_size = 64;
+	constexpr std::uint32_t trailer_size = 24;
+	constexpr std::uint32_t index_entry_size = 24;
+	constexpr std::uint32_t trade_record_size = 32;
+	constexpr std::uint32_t price_record_header_size = 32;
+	constexpr std::uint32_t price_level_size = 32;
+	constexpr std::uint32_t bar_record_size = 96;
+	constexpr std::uint32_t default_index_interval = 1024;
+	constexpr std::size_t symbol_size = 32;
+
+	enum class record_type : std::uint8_t
+	{
+		trade = 1,
+		price = 2,
+		bar = 3
+	};
+
+	enum class price_encoding : std::uint8_t
+	{
+		raw_double = 0
+	};
+
+	inline std::uint32_t price_record_size(std::uint32_t depth)
+	{
+		return price_record_header_size + depth * price_level_size;
+	}
+
+	struct file_header
+	{
+		std::uint16_t version = binary_format::version;
+		record_type type = record_type::trade;
+		price_encoding encoding = price_encoding::raw_double;
+		std::uint32_t record_size = 0;
+		std::uint32_t depth = 0;
+		std::uint32_t index_interval = default_index_interval;
+		std::int64_t creation_time = 0;
+		std::string symbol;
+	};
+
+	struct index_entry
+	{
+		std::int64_t min_timestamp;
+		std::int64_t max_timestamp;
+		std::uint64_t first_record;
+	};
+
+	namespace details
+	{
+		template <typename T>
+		std::uint64_t to_bits(T value)
+		{
+			if constexpr (std::is_floating_point_v<T>)
+			{
+				static_assert(sizeof(T) == sizeof(std::uint64_t));
+				std::uint64_t bits = 0;
+				std::memcpy(&bits, &value, sizeof(bits));
+				return bits;
+			}
+			else
+			{
+				return static_cast<std::uint64_t>(value);
+			}
+		}
+
+		template <typename T>
+		T from_bits(std::uint64_t bits)
+		{
+			if constexpr (std::is_floating_point_v<T>)
+			{
+				T value;
+				std::memcpy(&value, &bits, sizeof(value));
+				return value;
+			}
+			else
+			{
+				return static_cast<T>(bits);
+			}
+		}
+	}
+
+	// Appends the value in little-endian byte order to any buffer with append(char).
+	template <typename T, typename buffer_t>
+	void put(buffer_t & buffer, T value)
+	{
+		const auto bits = details::to_bits(value);
+		for (std::size_t n = 0; n != sizeof(T); ++n)
+		{
+			buffer.append(static_cast<char>((bits >> (8 * n)) & 0xff));
+		}
+	}
+
+	template <typename buffer_t>
+	void put_padding(buffer_t & buffer, std::size_t size)
+	{
+		for (std::size_t n = 0; n != size; ++n)
+		{
+			buffer.append('\0');
+		}
+	}
+
+	template <typename T>
+	T get(const unsigned char * data)
+	{
+		std::uint64_t bits = 0;
+		for (std::size_t n = 0; n != sizeof(T); ++n)
+		{
+			bits |= static_cast<std::uint64_t>(data[n]) << (8 * n);
+		}
+
+		return details::from_bits<T>(bits);
+	}
+
+	template <typename buffer_t>
+	void put_file_header(buffer_t & buffer, const file_header & header)
+	{
+		for (const auto c : file_magic)
+		{
+			buffer.append(c);
+		}
+
+		put<std::uint16_t>(buffer, header.version);
+		put<std::uint8_t>(buffer, static_cast<std::uint8_t>(header.type));
+		put<std::uint8_t>(buffer, static_cast<std::uint8_t>(header.encoding));
+		put<std::uint32_t>(buffer, header_size);
+		put<std::uint32_t>(buffer, header.record_size);
+		put<std::uint32_t>(buffer, header.depth);
+		put<std::uint32_t>(buffer, header.index_interval);
+		put<std::int64_t>(buffer, header.creation_time);
+
+		const auto symbol_length = std::min(header.symbol.size(), symbol_size);
+		for (std::size_t n = 0; n != symbol_length; ++n)
+		{
+			buffer.append(header.symbol[n]);
+		}
+
+		put_padding(buffer, symbol_size - symbol_length);
+	}
+
+	inline std::optional<file_header> parse_file_header(const unsigned char * data, std::size_t size)
+	{
+		if (size < header_size || std::memcmp(data, file_magic, sizeof(file_magic)) != 0)
+			return std::nullopt;
+
+		file_header header;
+		header.version = get<std::uint16_t>(data + 4);
+		header.type = static_cast<record_type>(data[6]);
+		header.encoding = static_cast<price_encoding>(data[7]);
+
+		if (header.version != version || get<std::uint32_t>(data + 8) != header_size)
+			return std::nullopt;
+
+		header.record_size = get<std::uint32_t>(data + 12);
+		header.depth = get<std::uint32_t>(data + 16);
+		header.index_interval = get<std::uint32_t>(data + 20);
+		header.creation_time = get<std::int64_t>(data + 24);
+
+		const auto symbol = reinterpret_cast<const char *>(data + 32);
+		header.symbol.assign(symbol, std::find(symbol, symbol + symbol_size, '\0'));
+
+		if (header.record_size == 0 || header.index_interval == 0)
+			return std::nullopt;
+
+		return header;
+	}
+
+	template <typename buffer_t>
+	void put_trade_record(buffer_t & buffer, std::uint8_t exchange, bool sell, std::int64_t timestamp, double price, double volume)
+	{
+		put<std::uint8_t>(buffer, exchange);
+		put<std::uint8_t>(buffer, sell ? 1 : 0);
+		put_padding(buffer, 6);
+		put<std::int64_t>(buffer, timestamp);
+		put<double>(buffer, price);
+		put<double>(buffer, volume);
+	}
+
+	// Levels are (price, volume) pairs ordered as bid, ask, bid, ask... from the best level.
+	template <typename buffer_t, typename levels_t>
+	void put_price_record(
+		buffer_t & buffer,
+		std::uint8_t exchange,
+		std::int64_t timestamp,
+		std::int64_t exchange_timestamp,
+		std::int64_t receive_timestamp,
+		std::uint32_t depth,
+		const levels_t & levels)
+	{
+		const auto levels_num = std::min<std::size_t>(depth, levels.size() / 2);
+
+		put<std::uint8_t>(buffer, exchange);
+		put_padding(buffer, 1);
+		put<std::uint16_t>(buffer, static_cast<std::uint16_t>(levels_num));
+		put_padding(buffer, 4);
+		put<std::int64_t>(buffer, timestamp);
+		put<std::int64_t>(buffer, exchange_timestamp);
+		put<std::int64_t>(buffer, receive_timestamp);
+
+		for (std::size_t n = 0; n != levels_num * 2; ++n)
+		{
+			put<double>(buffer, levels[n].first);
+			put<double>(buffer, levels[n].second);
+		}
+
+		put_padding(buffer, (depth - levels_num) * price_level_size);
+	}
+
+	template <typename buffer_t>
+	void put_bar_record(
+		buffer_t & buffer,
+		std::uint8_t exchange,
+		std::uint32_t interval,
+		std::int64_t start,
+		double open,
+		double high,
+		double low,
+		double close,
+		double buy_volume,
+		double sell_volume,
+		double vwap,
+		std::uint64_t trades)
+	{
+		put<std::uint8_t>(buffer, exchange);
+		put_padding(buffer, 3);
+		put<std::uint32_t>(buffer, interval);
+		put<std::int64_t>(buffer, start);
+
+		for (const auto value : { open, high, low, close, buy_volume, sell_volume, vwap })
+		{
+			put<double>(buffer, value);
+		}
+
+		put<std::uint64_t>(buffer, trades);
+		put_padding(buffer, 8);
+	}
+
+	// Timestamp of a record, it is at the same offset for all record types.
+	inline std::int64_t get_record_timestamp(const unsigned char * record)
+	{
+		return get<std::int64_t>(record + 8);
+	}
+
+	struct trade_record
+	{
+		std::uint8_t exchange;
+		bool sell;
+		std::int64_t timestamp;
+		double price;
+		double volume;
+	};
+
+	struct price_record
+	{
+		std::uint8_t exchange;
+		std::int64_t timestamp;
+		std::int64_t exchange_timestamp;
+		std::int64_t receive_timestamp;
+		std::vector<std::pair<double, double>> levels; // valid levels only, bid, ask, bid, ask... as in put_price_record()
+	};
+
+	inline trade_record parse_trade_record(const unsigned char * record)
+	{
+		return trade_record{ record[0], record[1] != 0, get<std::int64_t>(record + 8), get<double>(record + 16), get<double>(record + 24) };
+	}
+
+	// Reuses the levels vector of the result, so records of the same depth are parsed without allocations.
+	inline void parse_price_record(const unsigned char * record, std::uint32_t depth, price_record & result)
+	{
+		result.exchange = record[0];
+		result.timestamp = get<std::int64_t>(record + 8);
+		result.exchange_timestamp = get<std::int64_t>(record + 16);
+		result.receive_timestamp = get<std::int64_t>(record + 24);
+
+		const auto levels_num = std::min<std::uint32_t>(get<std::uint16_t>(record + 2), depth);
+
+		result.levels.clear();
+		for (std::uint32_t n = 0; n != levels_num * 2; ++n)
+		{
+			const auto level = record + price_record_header_size + n * (price_level_size / 2);
+			result.levels.emplace_back(get<double>(level), get<double>(level + 8));
+		}
+	}
+
+	// Index of records in a block file, one entry per index interval.
+	class block_index
+	{
+	public:
+		explicit block_index(std::uint32_t interval = default_index_interval) : _interval(interval)
+		{
+		}
+
+		void reset()
+		{
+			_entries.clear();
+			_records_count = 0;
+		}
+
+		void reset(std::vector<index_entry> entries, std::uint64_t records_count)
+		{
+			_entries = std::move(entries);
+			_records_count = records_count;
+		}
+
+		void add(std::int64_t timestamp)
+		{
+			if (_records_count % _interval == 0)
+			{
+				_entries.push_back(index_entry{ timestamp, timestamp, _records_count });
+			}
+			else
+			{
+				auto & entry = _entries.back();
+				entry.min_timestamp = std::min(entry.min_timestamp, timestamp);
+				entry.max_timestamp = std::max(entry.max_timestamp, timestamp);
+			}
+
+			++_records_count;
+		}
+
+		std::uint64_t records_count() const noexcept
+		{
+			return _records_count;
+		}
+
+		const std::vector<index_entry> & entries() const noexcept
+		{
+			return _entries;
+		}
+
+		template <typename buffer_t>
+		void put_footer(buffer_t & buffer) const
+		{
+			for (const auto & entry : _entries)
+			{
+				put<std::int64_t>(buffer, entry.min_timestamp);
+				put<std::int64_t>(buffer, entry.max_timestamp);
+				put<std::uint64_t>(buffer, entry.first_record);
+			}
+
+			put<std::uint64_t>(buffer, _entries.size());
+			put<std::uint64_t>(buffer, _records_count);
+			put<std::uint32_t>(buffer, version);
+
+			for (const auto c : index_magic)
+			{
+				buffer.append(c);
+			}
+		}
+
+	private:
+		const std::uint32_t _interval;
+		std::vector<index_entry> _entries;
+		std::uint64_t _records_count = 0;
+	};
+
+	struct file_layout
+	{
+		file_header header;
+		std::uint64_t records_count = 0;
+		std::vector<index_entry> index; // empty when the file has no footer
+		bool has_footer = false;
+	};
+
+	namespace details
+	{
+		inline bool read_at(FILE * file, std::uint64_t offset, unsigned char * data, std::size_t size)
+		{
+#if (defined(_WIN32) || defined(__WIN32__) || defined(WIN32))
+			if (_fseeki64(file, static_cast<__int64>(offset), SEEK_SET) != 0)
+#else
+			if (fseeko(file, static_cast<off_t>(offset), SEEK_SET) != 0)
+#endif
+				return false;
+
+			return fread(data, 1, size, file) == size;
+		}
+	}
+
+	// Reads header and footer of a block file of the given size.
+	// Without a footer the number of complete records is derived from the file size.
+	inline std::optional<file_layout> read_file_layout(FILE * file, std::uint64_t file_size)
+	{
+		unsigned char header_data[header_size];
+		if (!details::read_at(file, 0, header_data, header_size))
+			return std::nullopt;
+
+		auto header = parse_file_header(header_data, header_size);
+		if (!header)
+			return std::nullopt;
+
+		file_layout layout;
+		layout.header = std::move(*header);
+
+		const auto record_size = layout.header.record_size;
+		const auto data_size = file_size - header_size;
+
+		if (file_size >= header_size + trailer_size)
+		{
+			unsigned char trailer[trailer_size];
+			if (details::read_at(file, file_size - trailer_size, trailer, trailer_size) &&
+				std::memcmp(trailer + 20, index_magic, sizeof(index_magic)) == 0 &&
+				get<std::uint32_t>(trailer + 16) == version)
+			{
+				const auto entries_count = get<std::uint64_t>(trailer);
+				const auto records_count = get<std::uint64_t>(trailer + 8);
+				const auto footer_size = entries_count * index_entry_size + trailer_size;
+
+				if (footer_size <= data_size && records_count * record_size == data_size - footer_size)
+				{
+					std::vector<unsigned char> entries_data(entries_count * index_entry_size);
+					if (entries_data.empty() || details::read_at(file, file_size - footer_size, entries_data.data(), entries_data.size()))
+					{
+						layout.index.reserve(entries_count);
+						for (std::uint64_t n = 0; n != entries_count; ++n)
+						{
+							const auto entry = entries_data.data() + n * index_entry_size;
+							layout.index.push_back(index_entry{ get<std::int64_t>(entry), get<std::int64_t>(entry + 8), get<std::uint64_t>(entry + 16) });
+						}
+
+						layout.records_count = records_count;
+						layout.has_footer = true;
+						return layout;
+					}
+				}
+			}
+		}
+
+		layout.records_count = data_size / record_size;
+		return layout;
+	}
+
+	// Rebuilds the index of a file without a footer by reading timestamps of all records.
+	inline bool rebuild_index(FILE * file, const file_layout & layout, block_index & index)
+	{
+		const auto record_size = layout.header.record_size;
+		const std::size_t records_per_chunk = std::max<std::size_t>(1, (1024 * 1024) / record_size);
+		std::vector<unsigned char> chunk(records_per_chunk * record_size);
+
+		index.reset();
+
+		for (std::uint64_t record = 0; record < layout.records_count; record += records_per_chunk)
+		{
+			const auto num = std::min<std::uint64_t>(records_per_chunk, layout.records_count - record);
+			if (!details::read_at(file, header_size + record * record_size, chunk.data(), num * record_size))
+				return false;
+
+			for (std::uint64_t n = 0; n != num; ++n)
+			{
+				index.add(get_record_timestamp(chunk.data() + n * record_size));
+			}
+		}
+
+		return true;
+	}
+}
@@ -8,14 +8,23 @@ Copyright (c) 2022 Ilia Funtov.
 
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <charconv>
 #include <cmath>
+#include <cstdint>
 #include <map>
+#include <memory>
 #include <vector>
 #include <string>
+#include <string_view>
+#include <system_error>
+
+#include <zlib.h>
 
 #include <bitfinex_ws_subscriber.hpp>
-#include <json_helpers.hpp>
+#include <json_scanner.hpp>
 #include <market_data_common.hpp>
 
 namespace bitfinex
@@ -29,14 +38,34 @@ namespace bitfinex
 			const market_data_common::book_handler_t & book_handler,
 			const market_data_common::trade_handler_t & trade_handler,
 			const market_data_common::error_handler_t & error_handler,
+			const market_data_common::order_book_options & book_options = market_data_common::order_book_options{},
 			const std::string & api_address = bitfinex_ws_subscriber::default_api_address,
 			unsigned int port = bitfinex_ws_subscriber::default_port) :
-			order_book_subscriber_base(symbol, book_handler),
+			bitfinex_market_data_subscriber(
+				symbol,
+				depth,
+				book_handler,
+				trade_handler,
+				std::make_shared<bitfinex_ws_subscriber>(error_handler, api_address, port),
+				book_options)
+		{
+		}
+
+		// Subscribes through a connection shared with subscribers of other symbols.
+		bitfinex_market_data_subscriber(
+			const std::string & symbol,
+			unsigned int depth,
+			const market_data_common::book_handler_t & book_handler,
+			const market_data_common::trade_handler_t & trade_handler,
+			const std::shared_ptr<bitfinex_ws_subscriber> & ws_subscriber,
+			const market_data_common::order_book_options & book_options = market_data_common::order_book_options{}) :
+			order_book_subscriber_base("bitfinex", symbol, book_handler, book_options),
 			_trade_handler(trade_handler),
-			_ws_subscriber(error_handler, api_address, port)
+			_ws_subscriber(ws_subscriber)
 		{
 			assert(depth != 0);
 			assert(trade_handler);
+			assert(_ws_subscriber);
 
 			{
 				const auto len = (depth <= 25) ? 25 : 100;
@@ -48,10 +77,11 @@ namespace bitfinex
 					{ "len" , std::to_string(len) }
 				};
 
-				_ws_subscriber.subscribe(
-					"book",
+				_ws_subscriber->subscribe(
+					book_channel,
 					params,
-					[this](const nlohmann::json & object) { order_book_event_handler(object); });
+					[this](json_helpers::json_scanner & scanner) { order_book_event_handler(scanner); },
+					true);
 			}
 
 			{
@@ -60,10 +90,10 @@ namespace bitfinex
 					{ "symbol" , symbol }
 				};
 
-				_ws_subscriber.subscribe(
-					"trades",
+				_ws_subscriber->subscribe(
+					trades_channel,
 					params,
-					[this](const nlohmann::json & object) { trades_event_handler(object); });
+					[this](json_helpers::json_scanner & scanner) { trades_event_handler(scanner); });
 			}
 		}
 
@@ -71,101 +101,222 @@ namespace bitfinex
 		bitfinex_market_data_subscriber& operator = (const bitfinex_market_data_subscriber &) = delete;
 		bitfinex_market_data_subscriber(bitfinex_market_data_subscriber &&) = delete;
 		bitfinex_market_data_subscriber& operator = (bitfinex_market_data_subscriber &&) = delete;
+
+		~bitfinex_market_data_subscriber()
+		{
+			_ws_subscriber->unsubscribe(book_channel, _symbol);
+			_ws_subscriber->unsubscribe(trades_channel, _symbol);
+		}
+
+		// Number of channels the subscriber takes on its connection.
+		static constexpr std::size_t subscriptions_count = 2;
 	private:
-		using json = nlohmann::json;
+		using token_type = json_helpers::json_scanner::token_type;
 
-		void order_book_event_handler(const json & object)
+		// [chanId, [price, count, amount]] for updates, [chanId, [[price, count, amount], ...]] for snapshots
+		// and [chanId, "cs", checksum] for checksums of the top levels.
+		void order_book_event_handler(json_helpers::json_scanner & scanner)
 		{
-			if (!object.is_array())
+			if (!scanner.next_element())
 				return;
 
-			const auto & value = object.at(0);
-			if (!value.is_array())
+			if (scanner.peek() == token_type::string)
+			{
+				if (scanner.get_string() == "cs" && scanner.next_element() && _snapshot_received)
+				{
+					const auto checksum = static_cast<std::int32_t>(static_cast<std::int64_t>(scanner.get_double()));
+					if (checksum != get_checksum())
+					{
+						book_inconsistent();
+						resubscribe_book();
+					}
+				}
+
 				return;
+			}
 
-			const auto & items = value.get<std::vector<json>>();
-			if (items.empty())
+			if (scanner.peek() != token_type::array)
 				return;
 
-			const auto parse = [this](const auto & items) -> bool
+			std::array<std::string_view, 3> level;
+
+			const auto parse = [this, &level]()
 			{
-				if (items.size() != 3)
-					return false;
+				const auto price = json_helpers::parse_double(level[0]);
+				const auto count = json_helpers::parse_double(level[1]);
+				const auto amount = json_helpers::parse_double(level[2]);
 
-				if (items[0].is_number() && items[1].is_number() && items[2].is_number())
+				if (count > 0)
 				{
-					const auto price = items[0].template get<double>();
-					const auto count = items[1].template get<unsigned int>();
-					const auto amount = items[2].template get<double>();
-
-					if (count > 0)
+					if (amount > 0)
+					{
+						bids_price_levels.insert_or_assign(price, amount);
+					}
+					else if (amount < 0)
+					{
+						asks_price_levels.insert_or_assign(price, -amount);
+					}
+				}
+				else if (count == 0)
+				{
+					if (amount == 1)
 					{
-						if (amount > 0)
-						{
-							bids_price_volume_map[price] = amount;
-						}
-						else if (amount < 0)
-						{
-							asks_price_volume_map[price] = -amount;
-						}
+						bids_price_levels.erase(price);
 					}
-					else if (count == 0)
+					else if (amount == -1)
 					{
-						if (amount == 1)
-						{
-							bids_price_volume_map.erase(price);
-						}
-						else if (amount == -1)
-						{
-							asks_price_volume_map.erase(price);
-						}
+						asks_price_levels.erase(price);
 					}
+				}
+			};
 
-					return true;
+			json_helpers::json_scanner items = scanner;
+			items.begin_array();
+			if (!items.next_element())
+				return;
+
+			if (items.peek() == token_type::array)
+			{
+				asks_price_levels.clear();
+				bids_price_levels.clear();
+				_snapshot_received = true;
+
+				do
+				{
+					if (items.peek() == token_type::array && items.get_array(level) == level.size())
+					{
+						parse();
+					}
+					else
+					{
+						items.skip_value();
+					}
 				}
+				while (items.next_element());
+			}
+			else if (_snapshot_received && scanner.get_array(level) == level.size())
+			{
+				parse();
+			}
+			else
+			{
+				return;
+			}
+
+			// book messages carry no event time
+			set_event_timestamps(_ws_subscriber->receive_timestamp());
+
+			if (!handle_order_book_if_consistent())
+			{
+				resubscribe_book();
+			}
+		}
+
+		void resubscribe_book()
+		{
+			// updates are skipped until the snapshot of the new subscription
+			_snapshot_received = false;
+			_ws_subscriber->resubscribe(book_channel, _symbol);
+		}
+
+		// CRC32 of the top levels interleaved as "bid price:bid amount:ask price:ask amount:...", asks with negative amounts.
+		std::int32_t get_checksum()
+		{
+			std::array<char, 64> buffer;
+			auto & text = _checksum_text; // keeps its capacity between checksums
+			text.clear();
+
+			const auto add_value = [&buffer, &text](double value)
+			{
+				if (!text.empty())
+					text.push_back(':');
 
-				return false;
+				text.append(buffer.data(), format_number(buffer, value));
 			};
 
-			if (!parse(items))
+			for (std::size_t i = 0; i != checksum_depth; ++i)
 			{
-				asks_price_volume_map.clear();
-				bids_price_volume_map.clear();
+				if (i < bids_price_levels.size())
+				{
+					add_value(bids_price_levels[i].price);
+					add_value(bids_price_levels[i].volume);
+				}
 
-				for (const auto & item : items)
+				if (i < asks_price_levels.size())
 				{
-					parse(item);
+					add_value(asks_price_levels[i].price);
+					add_value(-asks_price_levels[i].volume);
 				}
 			}
 
-			if (!handle_order_book_if_consistent())
+			const auto crc = crc32(0L, reinterpret_cast<const Bytef *>(text.data()), static_cast<uInt>(text.size()));
+			return static_cast<std::int32_t>(static_cast<std::uint32_t>(crc));
+		}
+
+		// Numbers are formatted like the exchange (javascript) does: the shortest exact digits,
+		// in exponential form like 1e-7 for values below 1e-6 only.
+		static std::size_t format_number(std::array<char, 64> & buffer, double value)
+		{
+			const auto begin = buffer.data();
+			const auto end = buffer.data() + buffer.size();
+
+			const auto magnitude = std::fabs(value);
+			if (magnitude == 0 || (magnitude >= 1e-6 && magnitude < 1e21))
 			{
-				_ws_subscriber.restart();
+				const auto result = std::to_chars(begin, end, value, std::chars_format::fixed);
+				return (result.ec == std::errc()) ? static_cast<std::size_t>(result.ptr - begin) : 0;
 			}
+
+			const auto result = std::to_chars(begin, end, value, std::chars_format::scientific);
+			if (result.ec != std::errc())
+				return 0;
+
+			// 1.5e-07 to 1.5e-7
+			auto size = static_cast<std::size_t>(result.ptr - begin);
+			const auto exponent = std::string_view(begin, size).find('e');
+			auto digits = exponent + 2;
+			while (digits + 1 < size && buffer[digits] == '0')
+			{
+				std::copy(begin + digits + 1, begin + size, begin + digits);
+				--size;
+			}
+
+			return size;
 		}
 
-		void trades_event_handler(const json & object)
+		// [chanId, "te", [id, mts, amount, price]], snapshots and "tu" messages are skipped.
+		void trades_event_handler(json_helpers::json_scanner & scanner)
 		{
-			if (!object.is_array())
+			if (!scanner.next_element() || scanner.peek() != token_type::string)
 				return;
 
-			const auto & message_type = object.at(0);
-			if (!message_type.is_string() || message_type != "te")
+			if (scanner.get_string() != "te")
 				return;
 
-			const auto & message_content = object.at(1);
-			if (!message_content.is_array() || message_content.size() < 4)
+			if (!scanner.next_element() || scanner.peek() != token_type::array)
 				return;
-			
-			const auto timestamp = message_content[1].get<std::uint64_t>() * 1000; // convert to microsec
-			const auto amount = message_content[2].get<double>();
-			const auto price = message_content[3].get<double>();
+
+			std::array<std::string_view, 4> trade;
+			if (scanner.get_array(trade) < trade.size())
+				return;
+
+			const auto timestamp = static_cast<std::uint64_t>(json_helpers::parse_double(trade[1])) * 1000; // convert to microsec
+			const auto amount = json_helpers::parse_double(trade[2]);
+			const auto price = json_helpers::parse_double(trade[3]);
 			const auto side = (amount < 0) ? market_data_common::taker_deal_type::sell : market_data_common::taker_deal_type::buy;
 
 			_trade_handler(_symbol, price, fabs(amount), timestamp, side);
 		}
-		
+
+		static constexpr char book_channel[] = "book";
+		static constexpr char trades_channel[] = "trades";
+
+		static constexpr std::size_t checksum_depth = 25;
+
 		const market_data_common::trade_handler_t _trade_handler;
-		bitfinex_ws_subscriber _ws_subscriber;
+		const std::shared_ptr<bitfinex_ws_subscriber> _ws_subscriber;
+
+		bool _snapshot_received = false;
+		std::string _checksum_text;
 	};
 }
\ No newline at end of file
@@ -8,10 +8,16 @@ Copyright (c) 2022 Ilia Funtov.
 
 #pragma once
 
+#include <atomic>
+#include <charconv>
+#include <cstdint>
 #include <functional>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <set>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <utility>
 
@@ -19,6 +25,7 @@ Copyright (c) 2022 Ilia Funtov.
 
 #include <nlohmann/json.hpp>
 #include <json_helpers.hpp>
+#include <json_scanner.hpp>
 
 namespace bitfinex
 {
@@ -27,7 +34,8 @@ namespace bitfinex
 	public:
 		using json = nlohmann::json;
 
-		using event_handler_t = std::function<void(const json &)>;
+		// Channel messages are arrays [chanId, ...], the handler gets the scanner positioned after the channel id.
+		using event_handler_t = std::function<void(json_helpers::json_scanner &)>;
 
 		constexpr static char default_api_address[] = "api-pub.bitfinex.com";
 		constexpr static unsigned int default_port = 443;
@@ -35,8 +43,18 @@ namespace bitfinex
 		bitfinex_ws_subscriber(
 			error_handler_t error_handler,
 			const std::string & api_address = default_api_address,
-			unsigned int port = default_port) :
-			websocket_subscriber_base(error_handler, api_address, port, "/ws/" + std::to_string(required_api_version))
+			unsigned int port = default_port,
+			const std::shared_ptr<websocket_wrapper::io_thread_pool> & pool = nullptr,
+			const std::shared_ptr<raw_capture::stream> & capture = nullptr,
+			const websocket_subscriber::connection_options & options = websocket_subscriber::connection_options{}) :
+			websocket_subscriber_base(error_handler, api_address, port, "/ws/" + std::to_string(required_api_version), pool, capture, options),
+			_sequence_gaps(get_sequence_gaps_counter(api_address))
+		{
+		}
+
+		bitfinex_ws_subscriber(websocket_subscriber::replay_mode_t, error_handler_t error_handler) :
+			websocket_subscriber_base(websocket_subscriber::replay_mode, error_handler, default_api_address),
+			_sequence_gaps(get_sequence_gaps_counter(default_api_address))
 		{
 		}
 
@@ -50,40 +68,121 @@ namespace bitfinex
 			stop();
 		}
 
+		// Channels of different symbols share the connection, the symbol is taken from the params.
+		// Channels which keep state like books are resubscribed after a gap in sequence numbers of the connection.
 		void subscribe(
 			const std::string & channel_name,
 			const std::map<std::string, std::string> & params,
-			event_handler_t event_handler)
+			event_handler_t event_handler,
+			bool resubscribe_on_gap = false)
 		{
+			const auto iter_symbol = params.find("symbol");
+			const auto symbol = (iter_symbol != params.end()) ? iter_symbol->second : std::string();
+
 			std::lock_guard<std::mutex> lock(_subscribe_mtx);
-			_subscriptions_requested.emplace(channel_name, subscribe_info{ params , event_handler });
+			_subscriptions_requested.emplace(channel_symbol_key{ channel_name, symbol }, subscribe_info{ params, event_handler, resubscribe_on_gap });
 		}
 
-		void unsubscribe(const std::string & channel_name)
+		// After return the event handler is not called anymore.
+		void unsubscribe(const std::string & channel_name, const std::string & symbol)
 		{
+			const channel_symbol_key key{ channel_name, symbol };
+
 			std::lock_guard<std::mutex> lock(_subscribe_mtx);
-			auto iter = _subscriptions_requested.find(channel_name);
-			if (iter != _subscriptions_requested.end())
+			_subscriptions_requested.erase(key);
+
+			if (_active_channels.find(key) != _active_channels.end())
 			{
-				_subscriptions_requested.erase(iter);
-				return;
+				_to_unsubscribe.insert(key);
 			}
+		}
 
-			_to_unsubscribe.insert(channel_name);
+		// Unsubscribes and subscribes the channel again on a watch step run right away, the book channel starts with a new snapshot.
+		// Can be called from the event handler.
+		void resubscribe(const std::string & channel_name, const std::string & symbol)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_resubscribe_mtx);
+				_to_resubscribe.insert(channel_symbol_key{ channel_name, symbol });
+			}
+
+			resubscription_requested();
 		}
 
+		std::size_t subscriptions_count()
+		{
+			std::lock_guard<std::mutex> lock(_subscribe_mtx);
+			return _subscriptions_requested.size();
+		}
+
+		// Bitfinex limits the number of public channels per connection.
+		static constexpr std::size_t max_subscriptions = 30;
+
 	private:
 		struct subscribe_info
 		{
 			std::map<std::string, std::string> params;
 			event_handler_t event_handler;
+			bool resubscribe_on_gap;
+		};
+
+		struct channel_symbol_key
+		{
+			std::string channel;
+			std::string symbol;
+
+			friend inline bool operator < (const channel_symbol_key & lhs, const channel_symbol_key & rhs)
+			{
+				if (lhs.channel < rhs.channel)
+				{
+					return true;
+				}
+				else if (lhs.channel == rhs.channel)
+				{
+					return lhs.symbol < rhs.symbol;
+				}
+
+				return false;
+			}
 		};
 
-		void read_handler(const std::string & str) override
+		void read_handler(std::string_view str) override
 		{
 			using namespace nlohmann;
 
-			json object = json::parse(str);
+			json_helpers::json_scanner scanner(str);
+
+			// data messages are scanned in place, only rare event objects are parsed into json
+			if (scanner.peek() == json_helpers::json_scanner::token_type::array)
+			{
+				if (!is_init_received())
+					return;
+
+				scanner.begin_array();
+				if (!scanner.next_element())
+					return;
+
+				const auto channel_id = scanner.get_uint64();
+
+				if (_sequence_enabled)
+					check_sequence(str);
+
+				// handlers are called under the lock, so symbols of one connection can be unsubscribed at any time
+				std::lock_guard<std::mutex> lock(_subscribe_mtx);
+				const auto iter_name = _channel_id_name_map.find(static_cast<unsigned int>(channel_id));
+				if (iter_name != _channel_id_name_map.end())
+				{
+					const auto iter_handler = _subscriptions_requested.find(iter_name->second);
+					if (iter_handler != _subscriptions_requested.end())
+					{
+						iter_handler->second.event_handler(scanner);
+					}
+				}
+
+				return;
+			}
+
+			json object = json::parse(str.begin(), str.end());
 
 			std::string event_name;
 			if (object.is_object())
@@ -93,37 +192,19 @@ namespace bitfinex
 
 			if (is_init_received())
 			{
-				if (object.is_array() && object.size() >= 2)
+				if (event_name == "subscribed")
 				{
-					const auto channel_id = object.at(0).get<unsigned int>();
-						
-					json data_object;
-					for (unsigned int n = 1; n != object.size(); ++n)
-					{
-						data_object.push_back(object.at(n));
-					}
-
-					event_handler_t event_handler;
-
-					{
-						std::lock_guard<std::mutex> lock(_subscribe_mtx);
-						const auto iter_name = _channel_id_name_map.find(channel_id);
-						if (iter_name != _channel_id_name_map.end())
-						{
-							const auto iter_handler = _subscriptions_requested.find(iter_name->second);
-							if (iter_handler != _subscriptions_requested.end())
-							{
-								event_handler = iter_handler->second.event_handler;
-							}
-						}
-					}
-
-					if (event_handler)
-						event_handler(data_object);
+					register_subscription(object);
 				}
-				else if (event_name == "subscribed")
+				else if (event_name == "conf")
 				{
-					register_subscription(object);
+					std::string status;
+					json_helpers::read_value(status, object, "status");
+
+					unsigned int flags = 0;
+					json_helpers::read_value(flags, object, "flags");
+
+					_sequence_enabled = (status == "OK") && (flags & seq_all_flag) != 0;
 				}
 				else if (event_name == "unsubscribed")
 				{
@@ -153,15 +234,20 @@ namespace bitfinex
 			std::string channel;
 			json_helpers::read_value(channel, object, "channel");
 
+			std::string symbol;
+			json_helpers::read_value(symbol, object, "symbol");
+
 			unsigned int channel_id = 0;
 			json_helpers::read_value(channel_id, object, "chanId");
 
 			if (!channel.empty() && channel_id != 0)
 			{
+				const channel_symbol_key key{ channel, symbol };
+
 				std::lock_guard<std::mutex> lock(_subscribe_mtx);
 
-				_channel_id_name_map.emplace(channel_id, channel);
-				_active_channels.emplace(channel, channel_id);
+				_channel_id_name_map.emplace(channel_id, key);
+				_active_channels.emplace(key, channel_id);
 			}
 		}
 
@@ -180,14 +266,64 @@ namespace bitfinex
 				const auto iter = _channel_id_name_map.find(channel_id);
 				if (iter != _channel_id_name_map.end())
 				{
-					_active_channels.erase(iter->second);
+					// a resubscribed channel can be active with a new id already
+					const auto iter_active = _active_channels.find(iter->second);
+					if (iter_active != _active_channels.end() && iter_active->second == channel_id)
+					{
+						_active_channels.erase(iter_active);
+					}
+
 					_channel_id_name_map.erase(iter);
 				}
 			}
 		}
 
+		// With sequence numbers every channel message ends with the number of the message on the connection.
+		void check_sequence(std::string_view str)
+		{
+			const auto end = str.find_last_of(']');
+			const auto begin = (end == std::string_view::npos) ? end : str.find_last_of(',', end);
+			if (begin == std::string_view::npos)
+				return;
+
+			std::uint64_t sequence = 0;
+			const auto result = std::from_chars(str.data() + begin + 1, str.data() + end, sequence);
+			if (result.ec != std::errc() || result.ptr != str.data() + end)
+				return;
+
+			const auto gap = (_last_sequence != 0 && sequence != _last_sequence + 1);
+			_last_sequence = sequence;
+
+			if (!gap)
+				return;
+
+			_sequence_gaps->add();
+
+			{
+				std::lock_guard<std::mutex> lock(_subscribe_mtx);
+				std::lock_guard<std::mutex> lock_resubscribe(_resubscribe_mtx);
+
+				for (const auto & sr : _subscriptions_requested)
+				{
+					if (sr.second.resubscribe_on_gap)
+						_to_resubscribe.insert(sr.first);
+				}
+			}
+
+			resubscription_requested();
+		}
+
 		void subscribe_events() override
 		{
+			if (!_conf_sent)
+			{
+				send_conf();
+				_conf_sent = true;
+			}
+
+			resubscribe_events();
+			unsubscribe_events();
+
 			std::vector<std::pair<std::string, subscribe_info>> to_subscribe;
 
 			{
@@ -195,12 +331,12 @@ namespace bitfinex
 
 				for (const auto & sr : _subscriptions_requested)
 				{
-					const auto & name = sr.first;
+					const auto & key = sr.first;
 
-					if (_active_channels.find(name) != _active_channels.end())
+					if (_active_channels.find(key) != _active_channels.end())
 						continue;
 
-					to_subscribe.emplace_back(name, sr.second);
+					to_subscribe.emplace_back(key.channel, sr.second);
 				}
 			}
 
@@ -234,9 +370,9 @@ namespace bitfinex
 			{
 				std::lock_guard<std::mutex> lock(_subscribe_mtx);
 
-				for (const auto & name : _to_unsubscribe)
+				for (const auto & key : _to_unsubscribe)
 				{
-					const auto iter = _active_channels.find(name);
+					const auto iter = _active_channels.find(key);
 					if (iter != _active_channels.end())
 					{
 						channels.insert(iter->second);
@@ -252,6 +388,50 @@ namespace bitfinex
 			}
 		}
 
+		// The channels are subscribed again by subscribe_events() as they are not active anymore.
+		void resubscribe_events()
+		{
+			std::set<channel_symbol_key> channels;
+
+			{
+				std::lock_guard<std::mutex> lock(_resubscribe_mtx);
+				channels.swap(_to_resubscribe);
+			}
+
+			std::set<unsigned int> ids;
+
+			{
+				std::lock_guard<std::mutex> lock(_subscribe_mtx);
+				for (const auto & key : channels)
+				{
+					const auto iter = _active_channels.find(key);
+					if (iter != _active_channels.end() && _subscriptions_requested.find(key) != _subscriptions_requested.end())
+					{
+						ids.insert(iter->second);
+						_active_channels.erase(iter);
+					}
+				}
+			}
+
+			for (const auto id : ids)
+			{
+				unsubscribe_channel(id);
+			}
+		}
+
+		// Sequence numbers and book checksums, the flags apply to the whole connection.
+		void send_conf()
+		{
+			using namespace nlohmann;
+
+			json object;
+			object["event"] = "conf";
+			object["flags"] = seq_all_flag | checksum_flag;
+
+			auto message = object.dump();
+			websocket().write(message);
+		}
+
 		void unsubscribe_channel(unsigned int id)
 		{
 			using namespace nlohmann;
@@ -269,14 +449,37 @@ namespace bitfinex
 			std::lock_guard<std::mutex> lock(_subscribe_mtx);
 			_channel_id_name_map.clear();
 			_active_channels.clear();
+			_to_unsubscribe.clear();
+
+			_conf_sent = false;
+			_sequence_enabled = false;
+			_last_sequence = 0;
+		}
+
+		static std::shared_ptr<metrics::counter> get_sequence_gaps_counter(const std::string & api_address)
+		{
+			return metrics::registry::instance().get_counter(
+				"md_feed_sequence_gaps_total",
+				"Gaps in sequence numbers of feed messages, the books of the connection are resubscribed.",
+				metrics::labels_t{ { "host", api_address } });
 		}
 
 		static constexpr unsigned int required_api_version = 2;
+		static constexpr unsigned int seq_all_flag = 65536;
+		static constexpr unsigned int checksum_flag = 131072;
 
 		std::mutex _subscribe_mtx;
-		std::map<std::string, subscribe_info> _subscriptions_requested;
-		std::map<unsigned int, std::string> _channel_id_name_map;
-		std::map<std::string, unsigned int> _active_channels;
-		std::set<std::string> _to_unsubscribe;
+		std::map<channel_symbol_key, subscribe_info> _subscriptions_requested;
+		std::map<unsigned int, channel_symbol_key> _channel_id_name_map;
+		std::map<channel_symbol_key, unsigned int> _active_channels;
+		std::set<channel_symbol_key> _to_unsubscribe;
+
+		std::mutex _resubscribe_mtx; // handlers are called under the subscribe mutex
+		std::set<channel_symbol_key> _to_resubscribe;
+
+		const std::shared_ptr<metrics::counter> _sequence_gaps;
+		std::atomic_bool _conf_sent{false};
+		std::atomic_bool _sequence_enabled{false};
+		std::uint64_t _last_sequence = 0; // of the current connection
 	};
 }
\ No newline at end of file
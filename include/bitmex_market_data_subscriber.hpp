@@ -8,13 +8,16 @@ Copyright (c) 2022 Ilia Funtov.
 
 #pragma once
 
+#include <array>
 #include <cassert>
 #include <exception>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <bitmex_ws_subscriber.hpp>
-#include <json_helpers.hpp>
+#include <json_scanner.hpp>
 #include <market_data_common.hpp>
 #include <timestamp_parser.hpp>
 
@@ -28,135 +31,229 @@ namespace bitmex
 			const market_data_common::book_handler_t & book_handler,
 			const market_data_common::trade_handler_t & trade_handler,
 			const market_data_common::error_handler_t & error_handler,
+			const market_data_common::order_book_options & book_options = market_data_common::order_book_options{},
 			const std::string & api_address = bitmex_ws_subscriber::default_api_address,
 			unsigned int port = bitmex_ws_subscriber::default_port) :
-			order_book_subscriber_base(symbol, book_handler),
+			bitmex_market_data_subscriber(
+				symbol,
+				book_handler,
+				trade_handler,
+				std::make_shared<bitmex_ws_subscriber>(error_handler, api_address, port),
+				book_options)
+		{
+		}
+
+		// Subscribes through a connection shared with subscribers of other symbols.
+		bitmex_market_data_subscriber(
+			const std::string & symbol,
+			const market_data_common::book_handler_t & book_handler,
+			const market_data_common::trade_handler_t & trade_handler,
+			const std::shared_ptr<bitmex_ws_subscriber> & ws_subscriber,
+			const market_data_common::order_book_options & book_options = market_data_common::order_book_options{}) :
+			order_book_subscriber_base("bitmex", symbol, book_handler, book_options),
 			_trade_handler(trade_handler),
 			_symbol(symbol),
-			_ws_subscriber(error_handler, api_address, port)
+			_ws_subscriber(ws_subscriber)
 		{
 			assert(_trade_handler);
+			assert(_ws_subscriber);
 
-			_ws_subscriber.subscribe(
-				"orderBook10",
+			_ws_subscriber->subscribe(
+				book_channel,
 				symbol,
-				[this](const json & object) { level2_top10_event_handler(object); });
+				[this](const json_helpers::json_object_view & message) { level2_top10_event_handler(message); });
 
-			_ws_subscriber.subscribe(
-				"trade",
+			_ws_subscriber->subscribe(
+				trade_channel,
 				symbol,
-				[this](const json & object) { trades_event_handler(object); });
+				[this](const json_helpers::json_object_view & message) { trades_event_handler(message); });
 		}
 
 		bitmex_market_data_subscriber(const bitmex_market_data_subscriber &) = delete;
 		bitmex_market_data_subscriber& operator = (const bitmex_market_data_subscriber &) = delete;
 		bitmex_market_data_subscriber(bitmex_market_data_subscriber &&) = delete;
 		bitmex_market_data_subscriber& operator = (bitmex_market_data_subscriber &&) = delete;
+
+		~bitmex_market_data_subscriber()
+		{
+			_ws_subscriber->unsubscribe(book_channel, _symbol);
+			_ws_subscriber->unsubscribe(trade_channel, _symbol);
+		}
 	private:
-		using json = nlohmann::json;
+		using token_type = json_helpers::json_scanner::token_type;
 
-		void level2_top10_event_handler(const json & object)
+		// Calls the handler for every record of the message data array with the keys and raw values of the record.
+		template <typename record_handler_t>
+		static void scan_records(const json_helpers::json_object_view & message, record_handler_t && record_handler)
 		{
-			if (!object.is_object())
+			auto scanner = message.scan("data");
+			if (scanner.peek() != token_type::array)
 				return;
 
-			const auto iter_action = object.find("action");
-			if (iter_action == object.end())
-				return;
+			scanner.begin_array();
+			while (scanner.next_element())
+			{
+				if (scanner.peek() != token_type::object)
+				{
+					scanner.skip_value();
+					continue;
+				}
+
+				record_handler(scanner);
+			}
+		}
 
-			const auto & action = iter_action->get<std::string>();
-			if (action != "update")
+		void level2_top10_event_handler(const json_helpers::json_object_view & message)
+		{
+			if (message.get_string("action") != "update")
 				return;
 
-			const auto parse_book_records = [](const auto & book_records, auto & book_map)
+			// [[price, size], ...], a snapshot loaded like the snapshots of other exchanges: a duplicated price keeps its last size
+			const auto parse_book_records = [](std::string_view book_records, auto & book_levels)
 			{
-				for (const auto & book_record : book_records)
+				json_helpers::json_scanner scanner(book_records);
+				if (scanner.peek() != token_type::array)
+					return;
+
+				std::array<std::string_view, 2> book_record;
+
+				scanner.begin_array();
+				while (scanner.next_element())
 				{
-					if (!book_record.is_array())
+					if (scanner.peek() != token_type::array)
+					{
+						scanner.skip_value();
 						continue;
+					}
 
-					const std::vector<json> & book_record_array = book_record.template get<std::vector<json>>();
-					if (book_record_array.size() != 2)
+					if (scanner.get_array(book_record) != book_record.size())
 						continue;
 
-					const auto price = book_record_array[0].get<double>();
-					const auto size = book_record_array[1].get<double>();
+					const auto price = json_helpers::parse_double(book_record[0]);
+					const auto size = json_helpers::parse_double(book_record[1]);
 
 					if (price != 0)
-						book_map.emplace(price, size / price);
+						book_levels.emplace_unsorted(price, size / price);
 				}
 			};
 
-			asks_price_volume_map.clear();
-			bids_price_volume_map.clear();
+			// the table is shared by all symbols of the connection
+			bool found = false;
+			std::uint64_t timestamp = 0;
 
-			const std::vector<json> & data = object["data"];
-			for (const auto & record : data)
+			scan_records(message, [&](json_helpers::json_scanner & scanner)
 			{
-				const auto & symbol = record["symbol"];
+				std::string_view symbol;
+				std::string_view asks;
+				std::string_view bids;
+				std::string_view timestamp_str;
+
+				scanner.begin_object();
+
+				std::string_view key;
+				while (scanner.next_key(key))
+				{
+					if (key == "symbol")
+						symbol = scanner.get_string();
+					else if (key == "asks")
+						asks = scanner.skip_value();
+					else if (key == "bids")
+						bids = scanner.skip_value();
+					else if (key == "timestamp")
+						timestamp_str = scanner.get_string();
+					else
+						scanner.skip_value();
+				}
+
 				if (symbol != _symbol)
-					continue;
+					return;
+
+				if (!timestamp_str.empty())
+					timestamp = timestamp_parser::parse_iso_timestamp_with_milliseconds(timestamp_str);
+
+				if (!found)
+				{
+					asks_price_levels.clear();
+					bids_price_levels.clear();
+					found = true;
+				}
+
+				parse_book_records(asks, asks_price_levels);
+				parse_book_records(bids, bids_price_levels);
+			});
+
+			if (!found)
+				return;
+
+			asks_price_levels.sort_levels();
+			bids_price_levels.sort_levels();
+
+			set_event_timestamps(_ws_subscriber->receive_timestamp(), timestamp);
 
-				parse_book_records(record["asks"], asks_price_volume_map);
-				parse_book_records(record["bids"], bids_price_volume_map);
-			}
-			
 			if (!handle_order_book_if_consistent())
 			{
-				_ws_subscriber.restart();
+				_ws_subscriber->resubscribe(book_channel, _symbol);
 			}
 		}
 
-		void trades_event_handler(const json & object)
+		void trades_event_handler(const json_helpers::json_object_view & message)
 		{
-			if (!object.is_object())
-				return;
-
-			const auto iter_action = object.find("action");
-			if (iter_action == object.end())
+			if (message.get_string("action") != "insert")
 				return;
 
-			const auto & action = iter_action->get<std::string>();
-			if (action == "insert")
+			scan_records(message, [this](json_helpers::json_scanner & scanner)
 			{
-				const std::vector<json> & data = object["data"];
-				for (const auto & record : data)
-				{
-					const auto & symbol = record["symbol"];
-					if (symbol != _symbol)
-						continue;
+				std::string_view symbol;
+				std::string_view side;
+				std::string_view timestamp_str;
+				double volume = 0;
+				double price = 0;
 
-					const auto & side = record["side"].get<std::string>();
-					if (side.empty())
-						continue;
+				scanner.begin_object();
 
-					const auto volume = record["homeNotional"].get<double>();
-					const auto price = record["price"].get<double>();
-					if (volume <= 0 || price <= 0)
-						continue;
+				std::string_view key;
+				while (scanner.next_key(key))
+				{
+					if (key == "symbol")
+						symbol = scanner.get_string();
+					else if (key == "side")
+						side = scanner.get_string();
+					else if (key == "timestamp")
+						timestamp_str = scanner.get_string();
+					else if (key == "homeNotional")
+						volume = scanner.get_double();
+					else if (key == "price")
+						price = scanner.get_double();
+					else
+						scanner.skip_value();
+				}
 
-					const auto & timestamp_str = record["timestamp"].get<std::string>();
-					if (timestamp_str.empty())
-						continue;
+				if (symbol != _symbol || side.empty() || timestamp_str.empty())
+					return;
 
-					const auto timestamp = timestamp_parser::parse_iso_timestamp_with_milliseconds(timestamp_str);
+				if (volume <= 0 || price <= 0)
+					return;
 
-					const auto side_char = side.at(0);
-					if (side_char == 'S' || side_char == 's')
-					{
-						_trade_handler(_symbol, price, volume, timestamp, market_data_common::taker_deal_type::sell);
-					}
-					else if (side_char == 'B' || side_char == 'b')
-					{
-						_trade_handler(_symbol, price, volume, timestamp, market_data_common::taker_deal_type::buy);
-					}
+				const auto timestamp = timestamp_parser::parse_iso_timestamp_with_milliseconds(timestamp_str);
+
+				const auto side_char = side.front();
+				if (side_char == 'S' || side_char == 's')
+				{
+					_trade_handler(_symbol, price, volume, timestamp, market_data_common::taker_deal_type::sell);
 				}
-			}
+				else if (side_char == 'B' || side_char == 'b')
+				{
+					_trade_handler(_symbol, price, volume, timestamp, market_data_common::taker_deal_type::buy);
+				}
+			});
 		}
 
+		static constexpr char book_channel[] = "orderBook10";
+		static constexpr char trade_channel[] = "trade";
+
 		const market_data_common::trade_handler_t _trade_handler;
 		const std::string _symbol;
 
-		bitmex_ws_subscriber _ws_subscriber;
+		const std::shared_ptr<bitmex_ws_subscriber> _ws_subscriber;
 	};
 } // namespace bitmex
\ No newline at end of file
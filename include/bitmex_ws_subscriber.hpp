@@ -10,9 +10,11 @@ Copyright (c) 2022 Ilia Funtov.
 
 #include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <set>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <utility>
 
@@ -20,6 +22,7 @@ Copyright (c) 2022 Ilia Funtov.
 
 #include <nlohmann/json.hpp>
 #include <json_helpers.hpp>
+#include <json_scanner.hpp>
 
 #ifndef BITMEX_API_PUBLIC_ONLY
 #include <bitmex_authentication.hpp>
@@ -32,7 +35,8 @@ namespace bitmex
 	public:
 		using json = nlohmann::json;
 
-		using event_handler_t = std::function<void(const json &)>;
+		// Receives the top-level fields of a table message, the values are parsed by the handler.
+		using event_handler_t = std::function<void(const json_helpers::json_object_view &)>;
 
 		constexpr static char default_api_address[] = "ws.bitmex.com";
 		constexpr static char target[] = "/realtime";
@@ -41,8 +45,11 @@ namespace bitmex
 		bitmex_ws_subscriber(
 			error_handler_t error_handler,
 			const std::string & api_address = default_api_address,
-			unsigned int port = default_port) :
-			bitmex_ws_subscriber(error_handler, std::string(), std::string(), api_address, port)
+			unsigned int port = default_port,
+			const std::shared_ptr<websocket_wrapper::io_thread_pool> & pool = nullptr,
+			const std::shared_ptr<raw_capture::stream> & capture = nullptr,
+			const websocket_subscriber::connection_options & options = websocket_subscriber::connection_options{}) :
+			bitmex_ws_subscriber(error_handler, std::string(), std::string(), api_address, port, pool, capture, options)
 		{
 		}
 
@@ -51,13 +58,21 @@ namespace bitmex
 			const std::string & key,
 			const std::string & secret,
 			const std::string & api_address = default_api_address,
-			unsigned int port = default_port) :
-			websocket_subscriber_base(error_handler, api_address, port, target),
+			unsigned int port = default_port,
+			const std::shared_ptr<websocket_wrapper::io_thread_pool> & pool = nullptr,
+			const std::shared_ptr<raw_capture::stream> & capture = nullptr,
+			const websocket_subscriber::connection_options & options = websocket_subscriber::connection_options{}) :
+			websocket_subscriber_base(error_handler, api_address, port, target, pool, capture, options),
 			_key(key),
 			_secret(secret)
 		{
 		}
 
+		bitmex_ws_subscriber(websocket_subscriber::replay_mode_t, error_handler_t error_handler) :
+			websocket_subscriber_base(websocket_subscriber::replay_mode, error_handler, default_api_address)
+		{
+		}
+
 		bitmex_ws_subscriber(const bitmex_ws_subscriber &) = delete;
 		bitmex_ws_subscriber & operator =(const bitmex_ws_subscriber &) = delete;
 		bitmex_ws_subscriber(bitmex_ws_subscriber &&) = delete;
@@ -68,61 +83,87 @@ namespace bitmex
 			stop();
 		}
 
+		// Tables of different symbols share the connection, every handler of a table receives all its messages.
 		void subscribe(
 			const std::string & channel_name,
 			const std::string & symbol,
 			event_handler_t event_handler)
 		{
 			std::lock_guard<std::mutex> lock(_subscribe_mtx);
-			_subscriptions_requested.emplace(channel_name, subscribe_info{ symbol , event_handler });
+			_subscriptions_requested.emplace(get_subscription_name(channel_name, symbol), subscribe_info{ channel_name, event_handler });
 		}
 
-		void unsubscribe(const std::string & channel_name)
+		// After return the event handler is not called anymore.
+		void unsubscribe(const std::string & channel_name, const std::string & symbol)
 		{
+			const auto name = get_subscription_name(channel_name, symbol);
+
 			std::lock_guard<std::mutex> lock(_subscribe_mtx);
-			auto iter = _subscriptions_requested.find(channel_name);
+			auto iter = _subscriptions_requested.find(name);
 			if (iter != _subscriptions_requested.end())
 			{
 				_subscriptions_requested.erase(iter);
-				_to_unsubscribe.insert(channel_name);
+				_to_unsubscribe.insert(name);
+			}
+		}
+
+		// Unsubscribes and subscribes the table again on a watch step run right away. Can be called from the event handler.
+		void resubscribe(const std::string & channel_name, const std::string & symbol)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_resubscribe_mtx);
+				_to_resubscribe.insert(get_subscription_name(channel_name, symbol));
 			}
+
+			resubscription_requested();
 		}
 
 	private:
 		struct subscribe_info
 		{
-			std::string symbol;
+			std::string channel;
 			event_handler_t event_handler;
 		};
 
-		void read_handler(const std::string & str) override
+		static std::string get_subscription_name(const std::string & channel_name, const std::string & symbol)
 		{
-			using namespace nlohmann;
+			return channel_name + ':' + symbol;
+		}
 
-			json object = json::parse(str);
+		void read_handler(std::string_view str) override
+		{
+			_message.parse(str);
 
 			if (is_init_received())
 			{
-				const auto iter_table = object.find("table");
-				if (iter_table != object.end())
+				const auto channel_name = _message.get_string("table");
+				if (!channel_name.empty())
 				{
-					const auto channel_name = iter_table->get<std::string>();
-
 					std::lock_guard<std::mutex> lock(_subscribe_mtx);
-					if (_active_channels.find(channel_name) == _active_channels.end())
-						return;
-
-					const auto iter_subscription = _subscriptions_requested.find(channel_name);
-					if (iter_subscription != _subscriptions_requested.end())
-						iter_subscription->second.event_handler(object);
+					for (const auto & subscription : _subscriptions_requested)
+					{
+						if (subscription.second.channel == channel_name && _active_channels.find(subscription.first) != _active_channels.end())
+						{
+							subscription.second.event_handler(_message);
+						}
+					}
 				}
-				else if (object.find("subscribe") != object.end() && object.find("success") != object.end())
+				else if (_message.contains("success"))
 				{
-					if (object["success"].get<bool>())
-						register_subscription(object["subscribe"].get<std::string>());
+					const bool success = _message.scan("success").get_bool();
+					if (_message.contains("subscribe"))
+					{
+						if (success)
+							register_subscription(std::string(_message.get_string("subscribe")));
+					}
+					else if (_message.contains("unsubscribe"))
+					{
+						if (success)
+							unregister_subscription(std::string(_message.get_string("unsubscribe")));
+					}
 				}
 			}
-			else if (object.find("info") != object.end())
+			else if (_message.contains("info"))
 			{
 				init_received();
 			}
@@ -130,25 +171,22 @@ namespace bitmex
 
 		void register_subscription(const std::string & subscription_name)
 		{
-			const auto index = subscription_name.find(':');
-			const auto channel_name = subscription_name.substr(0, index);
-
 			std::lock_guard<std::mutex> lock(_subscribe_mtx);
-			_active_channels.emplace(channel_name);
+			_active_channels.emplace(subscription_name);
 		}
 
 		void unregister_subscription(const std::string & subscription_name)
 		{
-			const auto index = subscription_name.find(':');
-			const auto channel_name = subscription_name.substr(0, index);
-
 			std::lock_guard<std::mutex> lock(_subscribe_mtx);
-			_active_channels.erase(channel_name);
+			_active_channels.erase(subscription_name);
 		}
 
 		void subscribe_events() override
 		{
-			std::vector<std::pair<std::string, subscribe_info>> to_subscribe;
+			resubscribe_events();
+			unsubscribe_events();
+
+			std::vector<std::string> to_subscribe;
 
 			{
 				std::lock_guard<std::mutex> lock(_subscribe_mtx);
@@ -160,23 +198,24 @@ namespace bitmex
 					if (_active_channels.find(name) != _active_channels.end())
 						continue;
 
-					to_subscribe.emplace_back(name, sr.second);
+					to_subscribe.push_back(name);
 				}
 			}
 
-			for (const auto & s : to_subscribe)
+			if (!to_subscribe.empty())
 			{
-				subscribe_event(s.first, s.second);
+				subscribe_event(to_subscribe);
 			}
 		}
 
-		void subscribe_event(const std::string & channel, const subscribe_info & info)
+		// All pending subscriptions go in one request.
+		void subscribe_event(const std::vector<std::string> & subscriptions)
 		{
 			using namespace nlohmann;
 
 			json object;
 			object["op"] = "subscribe";
-			object["args"] = json::array({ channel + ':' + info.symbol });
+			object["args"] = subscriptions;
 
 			auto subscribe_message = object.dump();
 			websocket().write(subscribe_message);
@@ -207,6 +246,35 @@ namespace bitmex
 			}
 		}
 
+		void resubscribe_events()
+		{
+			std::set<std::string> names;
+
+			{
+				std::lock_guard<std::mutex> lock(_resubscribe_mtx);
+				names.swap(_to_resubscribe);
+			}
+
+			std::vector<std::string> channels;
+
+			{
+				std::lock_guard<std::mutex> lock(_subscribe_mtx);
+				for (const auto & name : names)
+				{
+					// the table is subscribed again by subscribe_events() as it is not active anymore
+					if (_subscriptions_requested.find(name) != _subscriptions_requested.end() && _active_channels.erase(name) != 0)
+					{
+						channels.push_back(name);
+					}
+				}
+			}
+
+			for (const auto & channel : channels)
+			{
+				unsubscribe_channel(channel);
+			}
+		}
+
 		void unsubscribe_channel(const std::string & channel)
 		{
 			using namespace nlohmann;
@@ -223,6 +291,7 @@ namespace bitmex
 		{
 			std::lock_guard<std::mutex> lock(_subscribe_mtx);
 			_active_channels.clear();
+			_to_unsubscribe.clear();
 		}
 
 #ifndef BITMEX_API_PUBLIC_ONLY
@@ -252,5 +321,10 @@ namespace bitmex
 		std::map<std::string, subscribe_info> _subscriptions_requested;
 		std::set<std::string> _active_channels;
 		std::set<std::string> _to_unsubscribe;
+
+		std::mutex _resubscribe_mtx; // handlers are called under the subscribe mutex
+		std::set<std::string> _to_resubscribe;
+
+		json_helpers::json_object_view _message;
 	};
 }
\ No newline at end of file
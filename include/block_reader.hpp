@@ -0,0 +1,774 @@
+/*
+Market data collector for crypto exchanges.
+https://github.com/ilia-funtov/crypto-market-data-collector
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2022 Ilia Funtov.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <bitset>
+#include <charconv>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <map>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <zlib.h>
+
+#include <binary_format.hpp>
+#include <decimal_format.hpp>
+#include <dump_writer.hpp>
+
+// Streaming reader of block files written by the collector: csv and binary, plain or gzip compressed.
+// Files are read in chunks, so memory does not depend on the file size.
+namespace block_reader
+{
+	constexpr std::uint8_t all_exchanges_id = 0xff;
+
+	// Exchange ids of binary files for names of csv files, "consolidated" (prices) and "all" (bars) are all exchanges.
+	inline std::optional<std::uint8_t> get_exchange_id(std::string_view name)
+	{
+		static const std::map<std::string_view, std::uint8_t> name_id = {
+			{ "bitfinex", 0 },
+			{ "coinbase", 1 },
+			{ "kraken", 2 },
+			{ "bitmex", 3 },
+			{ "consolidated", all_exchanges_id },
+			{ "all", all_exchanges_id }
+		};
+
+		const auto iter = name_id.find(name);
+		if (iter == name_id.cend())
+			return std::nullopt;
+
+		return iter->second;
+	}
+
+	inline const char * get_exchange_name(std::uint8_t id, binary_format::record_type type)
+	{
+		static const char * const names[] = { "bitfinex", "coinbase", "kraken", "bitmex" };
+
+		if (id == all_exchanges_id)
+			return (type == binary_format::record_type::bar) ? "all" : "consolidated";
+
+		return (id < std::size(names)) ? names[id] : "unknown";
+	}
+
+	// Record of any stream, only the fields of its type are set.
+	struct market_record
+	{
+		binary_format::record_type type = binary_format::record_type::trade;
+		std::uint8_t exchange = 0;
+		std::int64_t timestamp = 0; // start time of bars
+
+		// trades
+		bool sell = false;
+		double price = 0;
+		double volume = 0;
+
+		// prices, levels are bid, ask, bid, ask... from the best level as in binary_format::put_price_record()
+		std::int64_t exchange_timestamp = 0;
+		std::int64_t receive_timestamp = 0;
+		std::vector<std::pair<double, double>> levels;
+
+		// bars
+		std::uint32_t interval = 0; // seconds
+		double open = 0;
+		double high = 0;
+		double low = 0;
+		double close = 0;
+		double buy_volume = 0;
+		double sell_volume = 0;
+		double vwap = 0;
+		std::uint64_t trades = 0;
+	};
+
+	struct record_filter
+	{
+		std::int64_t from = std::numeric_limits<std::int64_t>::min();
+		std::int64_t to = std::numeric_limits<std::int64_t>::max(); // inclusive
+		std::bitset<256> exchanges; // all exchanges when none is set
+
+		bool accepts_time(std::int64_t timestamp) const noexcept
+		{
+			return timestamp >= from && timestamp <= to;
+		}
+
+		bool accepts_exchange(std::uint8_t exchange) const noexcept
+		{
+			return exchanges.none() || exchanges.test(exchange);
+		}
+	};
+
+	// Format of a block file by its name: <symbol>_<block>[.<n>].{csv,bin}[.gz].
+	inline std::optional<dump_writer::file_format> get_file_format(const std::filesystem::path & path)
+	{
+		auto name = path.filename().string();
+		if (name.size() > 3 && name.compare(name.size() - 3, 3, ".gz") == 0)
+		{
+			name.resize(name.size() - 3);
+		}
+
+		if (name.size() > 4 && name.compare(name.size() - 4, 4, ".csv") == 0)
+			return dump_writer::file_format::csv;
+
+		if (name.size() > 4 && name.compare(name.size() - 4, 4, ".bin") == 0)
+			return dump_writer::file_format::binary;
+
+		return std::nullopt;
+	}
+
+	// File name without the format extension, like BTCUSD_3 or BTCUSD_3.1.
+	inline std::string get_base_name(const std::filesystem::path & path)
+	{
+		auto name = path.filename().string();
+		for (const auto extension : { ".gz", ".csv", ".bin" })
+		{
+			const auto length = std::strlen(extension);
+			if (name.size() > length && name.compare(name.size() - length, length, extension) == 0)
+			{
+				name.resize(name.size() - length);
+			}
+		}
+
+		return name;
+	}
+
+	// Record type of csv files by the stream directory they are in.
+	inline std::optional<binary_format::record_type> get_stream_type(const std::filesystem::path & path)
+	{
+		const auto stream = path.parent_path().filename().string();
+
+		if (stream == "trades")
+			return binary_format::record_type::trade;
+
+		if (stream == "prices" || stream == "consolidated")
+			return binary_format::record_type::price;
+
+		if (stream == "bars")
+			return binary_format::record_type::bar;
+
+		return std::nullopt;
+	}
+
+	namespace details
+	{
+		struct gz_closer
+		{
+			void operator()(gzFile file) const
+			{
+				gzclose(file);
+			}
+		};
+
+		struct file_closer
+		{
+			void operator()(FILE * file) const
+			{
+				fclose(file);
+			}
+		};
+
+		template <typename T>
+		bool parse_number(std::string_view str, T & value)
+		{
+			std::from_chars_result result;
+			if constexpr (std::is_same_v<T, double>)
+			{
+				result = decimal_format::from_chars(str.data(), str.data() + str.size(), value);
+			}
+			else
+			{
+				result = std::from_chars(str.data(), str.data() + str.size(), value);
+			}
+
+			return result.ec == std::errc() && result.ptr == str.data() + str.size();
+		}
+
+		// Splits a csv line into reused fields.
+		inline void split_line(std::string_view line, std::vector<std::string_view> & fields)
+		{
+			fields.clear();
+
+			std::size_t start = 0;
+			for (;;)
+			{
+				const auto pos = line.find(',', start);
+				if (pos == std::string_view::npos)
+				{
+					fields.push_back(line.substr(start));
+					return;
+				}
+
+				fields.push_back(line.substr(start, pos - start));
+				start = pos + 1;
+			}
+		}
+
+		inline bool parse_levels(const std::vector<std::string_view> & fields, std::size_t first, std::vector<std::pair<double, double>> & levels)
+		{
+			levels.clear();
+			if ((fields.size() - first) % 4 != 0)
+				return false;
+
+			for (auto n = first; n != fields.size(); n += 2)
+			{
+				std::pair<double, double> level;
+				if (!parse_number(fields[n], level.first) || !parse_number(fields[n + 1], level.second))
+					return false;
+
+				levels.push_back(level);
+			}
+
+			return true;
+		}
+	}
+
+	// Reads records of one block file passing the filter.
+	// The type of csv files has to be given, binary files have it in their header.
+	class file_reader
+	{
+	public:
+		file_reader(const std::filesystem::path & path, std::optional<binary_format::record_type> csv_type, const record_filter & filter) :
+			_path(path.string()),
+			_filter(filter)
+		{
+			const auto format = get_file_format(path);
+			if (!format)
+				throw std::runtime_error("Not a block file: " + _path);
+
+			_format = *format;
+
+			// the index of a plain binary file tells which parts of the file have records of the time range
+			const auto compressed = path.extension() == ".gz";
+			if (_format == dump_writer::file_format::binary && !compressed)
+			{
+				read_layout();
+			}
+
+			_file.reset(gzopen(_path.c_str(), "rb"));
+			if (_file == nullptr)
+				throw std::runtime_error("Could not open block file: " + _path);
+
+			gzbuffer(_file.get(), read_chunk_size);
+
+			if (_format == dump_writer::file_format::binary)
+			{
+				open_binary();
+
+				if (!_ranges.empty())
+				{
+					seek_record(_ranges.front().first);
+				}
+			}
+			else
+			{
+				if (!csv_type)
+					throw std::runtime_error("Record type of csv file is not known: " + _path);
+
+				_type = *csv_type;
+
+				// <symbol>_<block>
+				const auto base_name = get_base_name(path);
+				_symbol = base_name.substr(0, base_name.rfind('_'));
+			}
+		}
+
+		file_reader(const file_reader &) = delete;
+		file_reader & operator = (const file_reader &) = delete;
+		file_reader(file_reader &&) = delete;
+		file_reader & operator = (file_reader &&) = delete;
+
+		binary_format::record_type type() const noexcept
+		{
+			return _type;
+		}
+
+		dump_writer::file_format format() const noexcept
+		{
+			return _format;
+		}
+
+		// Depth of binary price files, 0 for csv files.
+		std::uint32_t depth() const noexcept
+		{
+			return _depth;
+		}
+
+		const std::string & symbol() const noexcept
+		{
+			return _symbol;
+		}
+
+		const std::string & path() const noexcept
+		{
+			return _path;
+		}
+
+		// Csv lines which could not be parsed, delta records without a snapshot before them are counted too.
+		std::uint64_t invalid_records() const noexcept
+		{
+			return _invalid_records;
+		}
+
+		// The file ends with a broken gzip stream, records up to the break were read.
+		bool truncated() const noexcept
+		{
+			return _truncated;
+		}
+
+		// Returns false at the end of the file.
+		bool next(market_record & record)
+		{
+			for (;;)
+			{
+				const auto found = (_format == dump_writer::file_format::binary) ? next_binary(record) : next_csv(record);
+				if (!found)
+					return false;
+
+				if (_filter.accepts_time(record.timestamp))
+					return true;
+			}
+		}
+
+	private:
+		static constexpr std::size_t read_chunk_size = 1024 * 1024;
+
+		// Fills the buffer behind the unread data, returns false at the end of the file.
+		bool read_more()
+		{
+			if (_end_of_file)
+				return false;
+
+			if (_begin != 0)
+			{
+				std::memmove(_buffer.data(), _buffer.data() + _begin, _end - _begin);
+				_end -= _begin;
+				_begin = 0;
+			}
+
+			if (_buffer.size() < _end + read_chunk_size)
+			{
+				_buffer.resize(_end + read_chunk_size);
+			}
+
+			const auto result = gzread(_file.get(), _buffer.data() + _end, static_cast<unsigned int>(read_chunk_size));
+			if (result <= 0)
+			{
+				// gzread() returns the data of a stream cut by a killed collector and then the end, gzerror() tells about the cut
+				int error = Z_OK;
+				gzerror(_file.get(), &error);
+
+				_end_of_file = true;
+				_truncated = (result < 0 || error != Z_OK);
+				return false;
+			}
+
+			_end += static_cast<std::size_t>(result);
+			_read_bytes += static_cast<std::uint64_t>(result);
+			return true;
+		}
+
+		void read_layout()
+		{
+			std::unique_ptr<FILE, details::file_closer> file(fopen(_path.c_str(), "rb"));
+			if (file == nullptr)
+				throw std::runtime_error("Could not open block file: " + _path);
+
+			const auto layout = binary_format::read_file_layout(file.get(), std::filesystem::file_size(_path));
+			if (!layout)
+				throw std::runtime_error("Invalid binary block file: " + _path);
+
+			_records_count = layout->records_count;
+
+			// ranges of index entries which may have records of the time range
+			if (layout->has_footer)
+			{
+				for (std::size_t n = 0; n != layout->index.size(); ++n)
+				{
+					const auto & entry = layout->index[n];
+					if (entry.max_timestamp < _filter.from || entry.min_timestamp > _filter.to)
+						continue;
+
+					const auto last = (n + 1 != layout->index.size()) ? layout->index[n + 1].first_record : layout->records_count;
+					if (!_ranges.empty() && _ranges.back().second == entry.first_record)
+						_ranges.back().second = last;
+					else
+						_ranges.emplace_back(entry.first_record, last);
+				}
+			}
+			else if (*_records_count != 0)
+			{
+				_ranges.emplace_back(0, *_records_count);
+			}
+		}
+
+		void open_binary()
+		{
+			unsigned char header_data[binary_format::header_size];
+			if (gzread(_file.get(), header_data, binary_format::header_size) != static_cast<int>(binary_format::header_size))
+				throw std::runtime_error("Invalid binary block file: " + _path);
+
+			const auto header = binary_format::parse_file_header(header_data, binary_format::header_size);
+			if (!header)
+				throw std::runtime_error("Invalid binary block file: " + _path);
+
+			_type = header->type;
+			_depth = header->depth;
+			_symbol = header->symbol;
+			_record_size = header->record_size;
+			_index_interval = header->index_interval;
+
+			const auto min_record_size = (_type == binary_format::record_type::price) ? binary_format::price_record_size(_depth) :
+				(_type == binary_format::record_type::bar) ? binary_format::bar_record_size : binary_format::trade_record_size;
+			if (_record_size < min_record_size)
+				throw std::runtime_error("Invalid binary block file: " + _path);
+		}
+
+		void seek_record(std::uint64_t record)
+		{
+			if (record == _record)
+				return;
+
+			_record = record;
+			_begin = _end = 0;
+			if (gzseek(_file.get(), static_cast<z_off_t>(binary_format::header_size + record * _record_size), SEEK_SET) < 0)
+				throw std::runtime_error("Could not read block file: " + _path);
+		}
+
+		// Bytes at the end of a compressed file which may be the footer, they are records only if the file has no footer.
+		std::size_t footer_reserve() const noexcept
+		{
+			const auto records = _read_bytes / _record_size;
+			return binary_format::trailer_size + binary_format::index_entry_size * static_cast<std::size_t>(records / _index_interval + 1);
+		}
+
+		// At the end of a compressed file drops its footer from the data.
+		void drop_footer() noexcept
+		{
+			const auto size = _end - _begin;
+			if (size < binary_format::trailer_size)
+				return;
+
+			const auto trailer = _buffer.data() + _end - binary_format::trailer_size;
+			if (std::memcmp(trailer + 20, binary_format::index_magic, sizeof(binary_format::index_magic)) != 0 ||
+				binary_format::get<std::uint32_t>(trailer + 16) != binary_format::version)
+				return;
+
+			const auto entries_count = binary_format::get<std::uint64_t>(trailer);
+			const auto records_count = binary_format::get<std::uint64_t>(trailer + 8);
+			const auto footer_size = entries_count * binary_format::index_entry_size + binary_format::trailer_size;
+
+			if (footer_size <= size && records_count * _record_size == _read_bytes - footer_size)
+				_end -= static_cast<std::size_t>(footer_size);
+		}
+
+		bool next_binary(market_record & record)
+		{
+			for (;;)
+			{
+				const unsigned char * data = nullptr;
+
+				if (_records_count)
+				{
+					// plain file: records of the index ranges
+					if (_range == _ranges.size())
+						return false;
+
+					if (_record == _ranges[_range].second)
+					{
+						if (++_range == _ranges.size())
+							return false;
+
+						seek_record(_ranges[_range].first);
+					}
+
+					if (_end - _begin < _record_size && !read_more())
+						return false;
+
+					if (_end - _begin < _record_size)
+						continue;
+
+					data = _buffer.data() + _begin;
+					++_record;
+				}
+				else
+				{
+					// compressed file: the footer is known at the end only
+					while (!_end_of_file && _end - _begin < _record_size + footer_reserve())
+					{
+						if (!read_more())
+							drop_footer();
+					}
+
+					if (_end - _begin < _record_size)
+						return false;
+
+					data = _buffer.data() + _begin;
+				}
+
+				_begin += _record_size;
+
+				record.type = _type;
+				record.exchange = data[0];
+				if (!_filter.accepts_exchange(record.exchange))
+					continue;
+
+				parse_binary_record(data, record);
+				return true;
+			}
+		}
+
+		void parse_binary_record(const unsigned char * data, market_record & record)
+		{
+			using binary_format::get;
+
+			record.timestamp = get<std::int64_t>(data + 8);
+
+			switch (_type)
+			{
+			case binary_format::record_type::trade:
+				record.sell = data[1] != 0;
+				record.price = get<double>(data + 16);
+				record.volume = get<double>(data + 24);
+				break;
+			case binary_format::record_type::price:
+			{
+				record.exchange_timestamp = get<std::int64_t>(data + 16);
+				record.receive_timestamp = get<std::int64_t>(data + 24);
+
+				const auto levels_num = std::min<std::uint32_t>(get<std::uint16_t>(data + 2), _depth);
+				record.levels.resize(levels_num * 2);
+				for (std::uint32_t n = 0; n != levels_num * 2; ++n)
+				{
+					const auto level = data + binary_format::price_record_header_size + n * (binary_format::price_level_size / 2);
+					record.levels[n] = std::make_pair(get<double>(level), get<double>(level + 8));
+				}
+
+				break;
+			}
+			case binary_format::record_type::bar:
+				record.interval = get<std::uint32_t>(data + 4);
+				record.open = get<double>(data + 16);
+				record.high = get<double>(data + 24);
+				record.low = get<double>(data + 32);
+				record.close = get<double>(data + 40);
+				record.buy_volume = get<double>(data + 48);
+				record.sell_volume = get<double>(data + 56);
+				record.vwap = get<double>(data + 64);
+				record.trades = get<std::uint64_t>(data + 72);
+				break;
+			}
+		}
+
+		// Returns the next complete line, a line without the end of line (the collector was killed while writing it) is not a record.
+		bool next_line(std::string_view & line)
+		{
+			for (;;)
+			{
+				const auto data = reinterpret_cast<const char *>(_buffer.data());
+				const auto end_of_line = static_cast<const char *>(std::memchr(data + _begin, '\n', _end - _begin));
+				if (end_of_line != nullptr)
+				{
+					line = std::string_view(data + _begin, end_of_line - (data + _begin));
+					_begin = static_cast<std::size_t>(end_of_line - data) + 1;
+					return true;
+				}
+
+				if (!read_more())
+					return false;
+			}
+		}
+
+		bool next_csv(market_record & record)
+		{
+			std::string_view line;
+			while (next_line(line))
+			{
+				if (line.empty())
+					continue;
+
+				details::split_line(line, _fields);
+
+				const auto exchange = get_exchange_id(_fields[0]);
+				if (!exchange)
+				{
+					++_invalid_records;
+					continue;
+				}
+
+				record.type = _type;
+				record.exchange = *exchange;
+
+				if (!_filter.accepts_exchange(record.exchange))
+					continue;
+
+				const auto parsed = (_type == binary_format::record_type::trade) ? parse_csv_trade(record) :
+					(_type == binary_format::record_type::price) ? parse_csv_price(record) : parse_csv_bar(record);
+				if (parsed)
+					return true;
+
+				++_invalid_records;
+			}
+
+			return false;
+		}
+
+		// exchange, price, volume (negative for taker sell), timestamp
+		bool parse_csv_trade(market_record & record)
+		{
+			if (_fields.size() != 4 ||
+				!details::parse_number(_fields[1], record.price) ||
+				!details::parse_number(_fields[2], record.volume) ||
+				!details::parse_number(_fields[3], record.timestamp))
+				return false;
+
+			record.sell = record.volume < 0;
+			record.volume = std::abs(record.volume);
+			return true;
+		}
+
+		// exchange, timestamp, [exchange timestamp, receive timestamp], [S|D], levels
+		// Delta records are applied to the book of the exchange, which is returned as a snapshot.
+		bool parse_csv_price(market_record & record)
+		{
+			if (_fields.size() < 2 || !details::parse_number(_fields[1], record.timestamp))
+				return false;
+
+			// with event timestamps the levels of a snapshot are 4 fields after the exchange and timestamps, without them 2
+			const auto mode_field = (_fields.size() > 2 && (_fields[2] == "S" || _fields[2] == "D")) ? 2u :
+				(_fields.size() > 4 && (_fields[4] == "S" || _fields[4] == "D")) ? 4u : 0u;
+			const auto event_timestamps = (mode_field != 0) ? (mode_field == 4) : (_fields.size() % 4 == 0);
+
+			record.exchange_timestamp = 0;
+			record.receive_timestamp = 0;
+			if (event_timestamps &&
+				(_fields.size() < 4 || !details::parse_number(_fields[2], record.exchange_timestamp) || !details::parse_number(_fields[3], record.receive_timestamp)))
+				return false;
+
+			const auto first_level = event_timestamps ? 4u : 2u;
+
+			if (mode_field == 0)
+				return details::parse_levels(_fields, first_level, record.levels);
+
+			auto & book = _books[record.exchange];
+
+			if (_fields[mode_field] == "S")
+			{
+				if (!details::parse_levels(_fields, mode_field + 1, book.levels))
+				{
+					book.valid = false;
+					return false;
+				}
+
+				book.valid = true;
+				record.levels = book.levels;
+				return true;
+			}
+
+			if (!book.valid || (_fields.size() - mode_field - 1) % 5 != 0)
+				return false;
+
+			// level index, bid price, bid volume, ask price, ask volume
+			for (auto n = mode_field + 1; n != _fields.size(); n += 5)
+			{
+				unsigned int level = 0;
+				std::pair<double, double> bid;
+				std::pair<double, double> ask;
+				if (!details::parse_number(_fields[n], level) ||
+					!details::parse_number(_fields[n + 1], bid.first) || !details::parse_number(_fields[n + 2], bid.second) ||
+					!details::parse_number(_fields[n + 3], ask.first) || !details::parse_number(_fields[n + 4], ask.second))
+				{
+					book.valid = false;
+					return false;
+				}
+
+				const auto index = static_cast<std::size_t>(level) * 2;
+				if (book.levels.size() < index + 2)
+				{
+					book.levels.resize(index + 2, std::make_pair(0.0, 0.0));
+				}
+
+				book.levels[index] = bid;
+				book.levels[index + 1] = ask;
+			}
+
+			// levels which are not visible anymore are zeros
+			while (book.levels.size() >= 2 &&
+				book.levels[book.levels.size() - 1] == std::make_pair(0.0, 0.0) &&
+				book.levels[book.levels.size() - 2] == std::make_pair(0.0, 0.0))
+			{
+				book.levels.resize(book.levels.size() - 2);
+			}
+
+			record.levels = book.levels;
+			return true;
+		}
+
+		// exchange, interval, start, open, high, low, close, buy volume, sell volume, VWAP, trades
+		bool parse_csv_bar(market_record & record)
+		{
+			return _fields.size() == 11 &&
+				details::parse_number(_fields[1], record.interval) &&
+				details::parse_number(_fields[2], record.timestamp) &&
+				details::parse_number(_fields[3], record.open) &&
+				details::parse_number(_fields[4], record.high) &&
+				details::parse_number(_fields[5], record.low) &&
+				details::parse_number(_fields[6], record.close) &&
+				details::parse_number(_fields[7], record.buy_volume) &&
+				details::parse_number(_fields[8], record.sell_volume) &&
+				details::parse_number(_fields[9], record.vwap) &&
+				details::parse_number(_fields[10], record.trades);
+		}
+
+		struct delta_book
+		{
+			bool valid = false; // a snapshot was read
+			std::vector<std::pair<double, double>> levels;
+		};
+
+		const std::string _path;
+		const record_filter _filter;
+
+		dump_writer::file_format _format = dump_writer::file_format::csv;
+		binary_format::record_type _type = binary_format::record_type::trade;
+		std::uint32_t _depth = 0;
+		std::string _symbol;
+
+		std::unique_ptr<gzFile_s, details::gz_closer> _file;
+		std::vector<unsigned char> _buffer;
+		std::size_t _begin = 0;
+		std::size_t _end = 0;
+		std::uint64_t _read_bytes = 0; // after the header of binary files
+		bool _end_of_file = false;
+		bool _truncated = false;
+
+		// binary files
+		std::uint32_t _record_size = 0;
+		std::uint32_t _index_interval = binary_format::default_index_interval;
+		std::optional<std::uint64_t> _records_count; // known for plain files
+		std::vector<std::pair<std::uint64_t, std::uint64_t>> _ranges; // records to read of plain files
+		std::size_t _range = 0;
+		std::uint64_t _record = 0;
+
+		// csv files
+		std::vector<std::string_view> _fields;
+		std::map<std::uint8_t, delta_book> _books;
+		std::uint64_t _invalid_records = 0;
+	};
+}
@@ -0,0 +1,156 @@
+/*
+Market data collector for crypto exchanges.
+https://github.com/ilia-funtov/crypto-market-data-collector
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2022 Ilia Funtov.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <market_data_provider.hpp>
+#include <raw_capture.hpp>
+#include <ws_subscriber_base.hpp>
+
+namespace market_data
+{
+	enum class replay_speed : unsigned int
+	{
+		max, // messages are handled one after another
+		recorded // messages are handled at the intervals they were received
+	};
+
+	inline replay_speed get_replay_speed(const std::string & str)
+	{
+		if (str == "max")
+			return replay_speed::max;
+
+		if (str == "recorded")
+			return replay_speed::recorded;
+
+		throw std::invalid_argument("Unknown replay speed: " + str);
+	}
+
+	// Passes messages of a capture to the connections of feed connections created in replay mode.
+	// The n-th capture stream of an exchange goes to its n-th connection, so the providers have to be created
+	// for the same symbols as during the capture. Messages of streams without a connection are skipped.
+	template <typename logger_t>
+	class capture_replay
+	{
+	public:
+		struct message
+		{
+			exchange_type exchange;
+			websocket_subscriber::websocket_subscriber_base * connection;
+			std::string_view payload;
+			std::uint64_t receive_timestamp;
+		};
+
+		capture_replay(raw_capture::reader & reader, feed_connections<logger_t> & connections) :
+			_reader(reader),
+			_connections(connections)
+		{
+		}
+
+		capture_replay(const capture_replay &) = delete;
+		capture_replay & operator = (const capture_replay &) = delete;
+		capture_replay(capture_replay &&) = delete;
+		capture_replay & operator = (capture_replay &&) = delete;
+
+		// Moves to the next message with a connection, returns false at the end of the capture.
+		bool next(message & result)
+		{
+			raw_capture::record record;
+			while (_reader.next(record))
+			{
+				if (record.type == raw_capture::record_type::stream)
+				{
+					add_stream(record.stream_id, std::string(record.payload));
+					continue;
+				}
+
+				if (record.type != raw_capture::record_type::message)
+					continue;
+
+				const auto iter = _streams.find(record.stream_id);
+				if (iter == _streams.end() || iter->second.connection == nullptr)
+					continue;
+
+				result.exchange = iter->second.exchange;
+				result.connection = iter->second.connection.get();
+				result.payload = record.payload;
+				result.receive_timestamp = record.receive_timestamp;
+				return true;
+			}
+
+			return false;
+		}
+
+		// Replays the rest of the capture, returns the number of messages by exchange.
+		std::map<exchange_type, std::uint64_t> run(replay_speed speed = replay_speed::max)
+		{
+			std::map<exchange_type, std::uint64_t> counts;
+
+			const auto start_time = std::chrono::steady_clock::now();
+			std::uint64_t first_timestamp = 0;
+
+			message current;
+			while (next(current))
+			{
+				if (speed == replay_speed::recorded && current.receive_timestamp != 0)
+				{
+					if (first_timestamp == 0)
+						first_timestamp = current.receive_timestamp;
+
+					if (current.receive_timestamp > first_timestamp)
+					{
+						std::this_thread::sleep_until(start_time + std::chrono::microseconds(current.receive_timestamp - first_timestamp));
+					}
+				}
+
+				current.connection->replay_message(current.payload, current.receive_timestamp);
+				++counts[current.exchange];
+			}
+
+			return counts;
+		}
+
+	private:
+		struct stream_info
+		{
+			exchange_type exchange;
+			std::shared_ptr<websocket_subscriber::websocket_subscriber_base> connection;
+		};
+
+		void add_stream(std::uint16_t stream_id, const std::string & feed_name)
+		{
+			stream_info stream{ get_exchange_type(feed_name), nullptr };
+
+			const auto index = _exchange_streams[stream.exchange]++;
+			const auto connections = _connections.get_connections(stream.exchange);
+			if (index < connections.size())
+			{
+				stream.connection = connections[index];
+			}
+
+			_streams[stream_id] = stream;
+		}
+
+		raw_capture::reader & _reader;
+		feed_connections<logger_t> & _connections;
+
+		std::map<std::uint16_t, stream_info> _streams;
+		std::map<exchange_type, std::size_t> _exchange_streams;
+	};
+}
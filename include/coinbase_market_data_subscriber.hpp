@@ -8,15 +8,18 @@ Copyright (c) 2022 Ilia Funtov.
 
 #pragma once
 
+#include <array>
 #include <cassert>
 #include <cstdio>
 #include <ctime>
 #include <exception>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <coinbase_ws_subscriber.hpp>
-#include <json_helpers.hpp>
+#include <json_scanner.hpp>
 #include <market_data_common.hpp>
 #include <timestamp_parser.hpp>
 
@@ -30,126 +33,189 @@ namespace coinbase
 			const market_data_common::book_handler_t & book_handler,
 			const market_data_common::trade_handler_t & trade_handler,
 			const market_data_common::error_handler_t & error_handler,
+			const market_data_common::order_book_options & book_options = market_data_common::order_book_options{},
 			const std::string & api_address = coinbase_ws_subscriber::default_api_address,
 			unsigned int port = coinbase_ws_subscriber::default_port) :
-			order_book_subscriber_base(symbol, book_handler),
+			coinbase_market_data_subscriber(
+				symbol,
+				book_handler,
+				trade_handler,
+				std::make_shared<coinbase_ws_subscriber>(error_handler, api_address, port),
+				book_options)
+		{
+		}
+
+		// Subscribes through a connection shared with subscribers of other products.
+		coinbase_market_data_subscriber(
+			const std::string & symbol,
+			const market_data_common::book_handler_t & book_handler,
+			const market_data_common::trade_handler_t & trade_handler,
+			const std::shared_ptr<coinbase_ws_subscriber> & ws_subscriber,
+			const market_data_common::order_book_options & book_options = market_data_common::order_book_options{}) :
+			order_book_subscriber_base("coinbase", symbol, book_handler, book_options),
 			_trade_handler(trade_handler),
-			_ws_subscriber(error_handler, api_address, port)
+			_ws_subscriber(ws_subscriber),
+			_trade_gaps(metrics::registry::instance().get_counter(
+				"md_trade_gaps_total",
+				"Gaps in trade ids of the feed, trades missed by the collector.",
+				metrics::labels_t{ { "feed", "coinbase" }, { "symbol", symbol } }))
 		{
 			assert(_trade_handler);
+			assert(_ws_subscriber);
 
-			_ws_subscriber.subscribe(
-				"level2_batch",
+			_ws_subscriber->subscribe(
+				level2_channel,
 				symbol,
 				{ "snapshot", "l2update" },
-				[this](const json & object) { level2_event_handler(object); });
+				[this](const json_helpers::json_object_view & message) { level2_event_handler(message); });
 
-			_ws_subscriber.subscribe(
-				"matches",
+			_ws_subscriber->subscribe(
+				matches_channel,
 				symbol,
 				{ "match" },
-				[this](const json & object) { matches_event_handler(object); });
+				[this](const json_helpers::json_object_view & message) { matches_event_handler(message); });
 		}
 
 		coinbase_market_data_subscriber(const coinbase_market_data_subscriber &) = delete;
 		coinbase_market_data_subscriber& operator = (const coinbase_market_data_subscriber &) = delete;
 		coinbase_market_data_subscriber(coinbase_market_data_subscriber &&) = delete;
 		coinbase_market_data_subscriber& operator = (coinbase_market_data_subscriber &&) = delete;
-	private:
-		using json = nlohmann::json;
 
-		void level2_event_handler(const json & object)
+		~coinbase_market_data_subscriber()
 		{
-			if (!object.is_object())
-				return;
-
-			const auto & product_id = object["product_id"];
-			if (product_id != _symbol)
+			_ws_subscriber->unsubscribe(level2_channel, _symbol);
+			_ws_subscriber->unsubscribe(matches_channel, _symbol);
+		}
+	private:
+		// The channel has no sequence numbers, a broken book is recovered with a new snapshot of the channel subscribed again.
+		void level2_event_handler(const json_helpers::json_object_view & message)
+		{
+			if (message.get_string("product_id") != _symbol)
 			{
-				_ws_subscriber.restart();
+				resubscribe_book();
 				return;
 			}
 
-			const auto & type = object["type"];
+			const auto type = message.get_string("type");
 			if (type == "snapshot")
 			{
-				asks_price_volume_map.clear();
-				bids_price_volume_map.clear();
+				asks_price_levels.clear();
+				bids_price_levels.clear();
+				_snapshot_received = true;
 
-				const auto parse_orders = [](const auto & object, const auto & name, auto & dest_map)
+				// [["price","size"],...]
+				const auto parse_orders = [&message](std::string_view name, auto & dest_levels)
 				{
-					const std::vector<json> & orders = object[name];
-					for (const auto & order : orders)
+					auto scanner = message.scan(name);
+					if (scanner.peek() != json_helpers::json_scanner::token_type::array)
+						return;
+
+					std::array<std::string_view, 2> order;
+
+					scanner.begin_array();
+					while (scanner.next_element())
 					{
-						if (order.is_array() && order.size() >= 2)
+						if (scanner.peek() != json_helpers::json_scanner::token_type::array)
 						{
-							const auto price = json_helpers::get_double(order[0]);
-							const auto volume = json_helpers::get_double(order[1]);
+							scanner.skip_value();
+							continue;
+						}
+
+						if (scanner.get_array(order) >= order.size())
+						{
+							const auto price = json_helpers::parse_double(order[0]);
+							const auto volume = json_helpers::parse_double(order[1]);
 							if (price >= 0 && volume >= 0)
-								dest_map.emplace(price, volume);
+								dest_levels.emplace_unsorted(price, volume);
 						}
 					}
+
+					dest_levels.sort_levels();
 				};
 
-				parse_orders(object, "bids", bids_price_volume_map);
-				parse_orders(object, "asks", asks_price_volume_map);
+				parse_orders("bids", bids_price_levels);
+				parse_orders("asks", asks_price_levels);
 			}
-			else if (type == "l2update")
+			else if (type == "l2update" && _snapshot_received)
 			{
-				const std::vector<json> & changes = object["changes"];
-				for (const auto & change : changes)
+				// [["side","price","size"],...]
+				auto scanner = message.scan("changes");
+				if (scanner.peek() == json_helpers::json_scanner::token_type::array)
 				{
-					if (change.is_array() && change.size() >= 3 && change[0].is_string())
+					std::array<std::string_view, 3> change;
+
+					scanner.begin_array();
+					while (scanner.next_element())
 					{
-						const auto & side = change[0].get<std::string>();
-						const double price = json_helpers::get_double(change[1]);
-						const double volume = json_helpers::get_double(change[2]);
+						if (scanner.peek() != json_helpers::json_scanner::token_type::array)
+						{
+							scanner.skip_value();
+							continue;
+						}
+
+						if (scanner.get_array(change) < change.size())
+							continue;
+
+						const auto side = change[0];
+						const double price = json_helpers::parse_double(change[1]);
+						const double volume = json_helpers::parse_double(change[2]);
 
-						market_data_common::order_map_t * map = nullptr;
+						if (price < 0)
+							continue;
 
 						if (side == "buy")
 						{
-							map = &bids_price_volume_map;
+							bids_price_levels.update(price, volume);
 						}
 						else if (side == "sell")
 						{
-							map = &asks_price_volume_map;
-						}
-
-						if (map != nullptr && price >= 0)
-						{
-							if (volume <= 0)
-							{
-								map->erase(price);
-							}
-							else
-							{
-								(*map)[price] = volume;
-							}
+							asks_price_levels.update(price, volume);
 						}
 					}
 				}
 			}
 
+			if (!_snapshot_received)
+				return;
+
+			const auto iso_time = message.get_string("time");
+			set_event_timestamps(
+				_ws_subscriber->receive_timestamp(),
+				iso_time.empty() ? 0 : timestamp_parser::parse_iso_timestamp_with_microseconds(iso_time));
+
 			if (!handle_order_book_if_consistent())
 			{
-				_ws_subscriber.restart();
+				resubscribe_book();
 			}
 		}
 
-		void matches_event_handler(const json & object)
+		void resubscribe_book()
 		{
-			if (!object.is_object())
+			// updates are skipped until the snapshot of the new subscription
+			_snapshot_received = false;
+			_ws_subscriber->resubscribe(level2_channel, _symbol);
+		}
+
+		// Trade ids of a product go one by one: a repeated id is skipped, a gap is counted. The sequence numbers
+		// of match messages are shared with other messages of the product, so they have gaps anyway.
+		void matches_event_handler(const json_helpers::json_object_view & message)
+		{
+			if (message.get_string("product_id") != _symbol)
 				return;
 
-			const auto & product_id = object["product_id"];
-			if (product_id != _symbol)
+			const auto trade_id = message.contains("trade_id") ? message.scan("trade_id").get_uint64() : 0;
+			if (trade_id != 0 && _last_trade_id != 0)
 			{
-				_ws_subscriber.restart();
-				return;
+				if (trade_id <= _last_trade_id)
+					return;
+
+				if (trade_id != _last_trade_id + 1)
+					_trade_gaps->add();
 			}
 
-			const auto & side = object["side"].get<std::string>();
+			_last_trade_id = trade_id;
+
+			const auto side = message.get_string("side");
 			market_data_common::taker_deal_type deal;
 			if (side == "buy")
 				deal = market_data_common::taker_deal_type::sell;
@@ -158,16 +224,23 @@ namespace coinbase
 			else
 				throw std::runtime_error("Could not parse deal type");
 
-			const auto & iso_time = object["time"].get<std::string>();
-			const double price = json_helpers::get_double(object["price"]);
-			const double volume = json_helpers::get_double(object["size"]);
+			const auto iso_time = message.get_string("time");
+			const double price = message.scan("price").get_double();
+			const double volume = message.scan("size").get_double();
 			const auto timestamp = timestamp_parser::parse_iso_timestamp_with_microseconds(iso_time);
 
 			_trade_handler(_symbol, price, volume, timestamp, deal);
 		}
 
+		static constexpr char level2_channel[] = "level2_batch";
+		static constexpr char matches_channel[] = "matches";
+
 		const market_data_common::trade_handler_t _trade_handler;
 
-		coinbase_ws_subscriber _ws_subscriber;
+		const std::shared_ptr<coinbase_ws_subscriber> _ws_subscriber;
+		const std::shared_ptr<metrics::counter> _trade_gaps;
+
+		bool _snapshot_received = false;
+		std::uint64_t _last_trade_id = 0;
 	};
 } // namespace coinbase
\ No newline at end of file
@@ -10,9 +10,11 @@ Copyright (c) 2022 Ilia Funtov.
 
 #include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <set>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <utility>
 
@@ -20,6 +22,7 @@ Copyright (c) 2022 Ilia Funtov.
 
 #include <nlohmann/json.hpp>
 #include <json_helpers.hpp>
+#include <json_scanner.hpp>
 
 namespace coinbase
 {
@@ -28,7 +31,8 @@ namespace coinbase
 	public:
 		using json = nlohmann::json;
 
-		using event_handler_t = std::function<void(const json &)>;
+		// Receives the top-level fields of the message, the values are parsed by the handler.
+		using event_handler_t = std::function<void(const json_helpers::json_object_view &)>;
 
 		constexpr static char default_api_address[] = "ws-feed.exchange.coinbase.com";
 		constexpr static unsigned int default_port = 443;
@@ -36,8 +40,16 @@ namespace coinbase
 		coinbase_ws_subscriber(
 			error_handler_t error_handler,
 			const std::string & api_address = default_api_address,
-			unsigned int port = default_port) :
-			websocket_subscriber_base(error_handler, api_address, port, "//")
+			unsigned int port = default_port,
+			const std::shared_ptr<websocket_wrapper::io_thread_pool> & pool = nullptr,
+			const std::shared_ptr<raw_capture::stream> & capture = nullptr,
+			const websocket_subscriber::connection_options & options = websocket_subscriber::connection_options{}) :
+			websocket_subscriber_base(error_handler, api_address, port, "//", pool, capture, get_options(options))
+		{
+		}
+
+		coinbase_ws_subscriber(websocket_subscriber::replay_mode_t, error_handler_t error_handler) :
+			websocket_subscriber_base(websocket_subscriber::replay_mode, error_handler, default_api_address)
 		{
 		}
 
@@ -70,6 +82,25 @@ namespace coinbase
 				_event_to_channel_map.emplace(event, channel_name);
 			}
 		}
+
+		// After return the event handler is not called anymore.
+		void unsubscribe(const std::string & channel_name, const std::string & product_id)
+		{
+			std::lock_guard<std::mutex> lock(_subscribe_mtx);
+			_subscriptions_requested.erase(channel_product_key{ channel_name, product_id });
+		}
+
+		// Unsubscribes and subscribes the channel again on a watch step run right away, level2 starts with a new snapshot.
+		// Can be called from the event handler.
+		void resubscribe(const std::string & channel_name, const std::string & product_id)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_resubscribe_mtx);
+				_to_resubscribe.insert(channel_product_key{ channel_name, product_id });
+			}
+
+			resubscription_requested();
+		}
 	protected:
 		void init_received(bool) noexcept override
 		{
@@ -81,6 +112,13 @@ namespace coinbase
 			return true;
 		}
 	private:
+		// Coinbase drops connections without subscriptions after a few seconds, a standby connection would only reconnect.
+		static websocket_subscriber::connection_options get_options(websocket_subscriber::connection_options options)
+		{
+			options.standby = false;
+			return options;
+		}
+
 		struct channel_product_key
 		{
 			std::string channel;
@@ -101,44 +139,51 @@ namespace coinbase
 			}
 		};
 
-		void read_handler(const std::string & str) override
+		// Handlers are looked up with the names in the message, so no key strings are made per message.
+		struct channel_product_view
 		{
-			using namespace nlohmann;
-
-			json object = json::parse(str);
+			std::string_view channel;
+			std::string_view product_id;
+		};
 
-			std::string event_type;
-			std::string product_id;
+		struct channel_product_less
+		{
+			using is_transparent = void;
 
-			if (object.is_object())
+			template <typename lhs_t, typename rhs_t>
+			bool operator () (const lhs_t & lhs, const rhs_t & rhs) const noexcept
 			{
-				json_helpers::read_value(event_type, object, "type");
-				json_helpers::read_value(product_id, object, "product_id");
+				return std::make_pair(std::string_view(lhs.channel), std::string_view(lhs.product_id)) <
+					std::make_pair(std::string_view(rhs.channel), std::string_view(rhs.product_id));
 			}
+		};
+
+		void read_handler(std::string_view str) override
+		{
+			using namespace nlohmann;
+
+			_message.parse(str);
+
+			const auto event_type = _message.get_string("type");
+			const auto product_id = _message.get_string("product_id");
 
 			if (!event_type.empty() && !product_id.empty())
 			{
-				event_handler_t event_handler;
-
+				// handlers are called under the lock, so products of one connection can be unsubscribed at any time
+				std::lock_guard<std::mutex> lock(_subscribe_mtx);
+				const auto iter_event = _event_to_channel_map.find(event_type);
+				if (iter_event != _event_to_channel_map.end())
 				{
-					std::lock_guard<std::mutex> lock(_subscribe_mtx);
-					const auto iter_event = _event_to_channel_map.find(event_type);
-					if (iter_event != _event_to_channel_map.end())
+					const auto iter_handler = _subscriptions_requested.find(channel_product_view{ iter_event->second, product_id });
+					if (iter_handler != _subscriptions_requested.end())
 					{
-						const auto iter_handler = _subscriptions_requested.find({ iter_event->second , product_id });
-						if (iter_handler != _subscriptions_requested.end())
-						{
-							event_handler = iter_handler->second;
-						}
+						iter_handler->second(_message);
 					}
 				}
-
-				if (event_handler)
-					event_handler(object);
 			}
 			else if (event_type == "subscriptions")
 			{
-				register_subscription(object);
+				register_subscription(json::parse(str.begin(), str.end()));
 			}
 		}
 
@@ -147,10 +192,10 @@ namespace coinbase
 			std::vector<json> channels;
 			json_helpers::read_value(channels, object, "channels");
 
-			if (channels.empty())
-				return;
-
+			// the message lists all channels of the connection after every subscribe and unsubscribe request
 			std::lock_guard<std::mutex> lock(_subscribe_mtx);
+			_active_channels.clear();
+
 			for (const auto & channel : channels)
 			{
 				std::string name;
@@ -174,6 +219,8 @@ namespace coinbase
 
 		void subscribe_events() override
 		{
+			resubscribe_events();
+
 			std::multimap<std::string, std::string> to_subscribe;
 
 			{
@@ -188,14 +235,46 @@ namespace coinbase
 				}
 			}
 
+			send_request("subscribe", to_subscribe);
+		}
+
+		void resubscribe_events()
+		{
+			std::set<channel_product_key> channels;
+
+			{
+				std::lock_guard<std::mutex> lock(_resubscribe_mtx);
+				channels.swap(_to_resubscribe);
+			}
+
+			std::multimap<std::string, std::string> to_unsubscribe;
+
+			{
+				std::lock_guard<std::mutex> lock(_subscribe_mtx);
+				for (const auto & key : channels)
+				{
+					// the channel is subscribed again by subscribe_events() as it is not active anymore
+					if (_subscriptions_requested.find(key) != _subscriptions_requested.end() && _active_channels.erase(key) != 0)
+					{
+						to_unsubscribe.emplace(key.channel, key.product_id);
+					}
+				}
+			}
+
+			send_request("unsubscribe", to_unsubscribe);
+		}
+
+		// One request for products grouped by channel.
+		void send_request(const char * type, const std::multimap<std::string, std::string> & channel_products)
+		{
 			using namespace nlohmann;
 
 			std::vector<json> channels;
 
-			for (auto iter = to_subscribe.cbegin(); iter != to_subscribe.cend();)
+			for (auto iter = channel_products.cbegin(); iter != channel_products.cend();)
 			{
 				const auto & channel = iter->first;
-				const auto range = to_subscribe.equal_range(channel);
+				const auto range = channel_products.equal_range(channel);
 
 				std::set<std::string> products;
 				for (auto iter_range = range.first; iter_range != range.second; ++iter_range)
@@ -215,11 +294,11 @@ namespace coinbase
 			if (!channels.empty())
 			{
 				json object;
-				object["type"] = "subscribe";
+				object["type"] = type;
 				object["channels"] = channels;
 
-				auto subscribe_message = object.dump();
-				websocket().write(subscribe_message);
+				auto message = object.dump();
+				websocket().write(message);
 			}
 		}
 
@@ -230,8 +309,13 @@ namespace coinbase
 		}
 
 		std::mutex _subscribe_mtx;
-		std::map<channel_product_key, event_handler_t> _subscriptions_requested;
-		std::map<std::string, std::string> _event_to_channel_map;
+		std::map<channel_product_key, event_handler_t, channel_product_less> _subscriptions_requested;
+		std::map<std::string, std::string, std::less<>> _event_to_channel_map;
 		std::set<channel_product_key> _active_channels;
+
+		std::mutex _resubscribe_mtx; // handlers are called under the subscribe mutex
+		std::set<channel_product_key> _to_resubscribe;
+
+		json_helpers::json_object_view _message;
 	};
 } // namespace coinbase
\ No newline at end of file
@@ -0,0 +1,195 @@
+/*
+Market data collector for crypto exchanges.
+https://github.com/ilia-funtov/crypto-market-data-collector
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2022 Ilia Funtov.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <market_data_common.hpp>
+
+namespace market_data_common
+{
+	// Top levels merged from the visible levels of several sources (exchanges). Volumes of equal prices are summed
+	// and every level keeps the set of sources quoting it. Sources are not arbitraged, so the book can be crossed.
+	class consolidated_book
+	{
+	public:
+		static constexpr std::size_t max_sources = 32;
+
+		struct level
+		{
+			double price;
+			double volume;
+			std::uint32_t sources; // bit per source index
+
+			friend inline bool operator == (const level & lhs, const level & rhs)
+			{
+				return lhs.price == rhs.price && lhs.volume == rhs.volume && lhs.sources == rhs.sources;
+			}
+
+			friend inline bool operator != (const level & lhs, const level & rhs)
+			{
+				return !(lhs == rhs);
+			}
+		};
+
+		using levels_t = std::vector<level>;
+
+		consolidated_book(std::size_t sources_num, unsigned int depth) :
+			_depth(depth),
+			_sources(sources_num),
+			_positions(sources_num)
+		{
+			assert(sources_num <= max_sources);
+			assert(depth != 0);
+
+			for (auto & source_levels : _sources)
+			{
+				source_levels.reserve(depth);
+			}
+
+			for (auto levels : { &_bids, &_asks, &_merged_bids, &_merged_asks })
+			{
+				levels->reserve(depth);
+			}
+		}
+
+		consolidated_book(const consolidated_book &) = delete;
+		consolidated_book & operator = (const consolidated_book &) = delete;
+		consolidated_book(consolidated_book &&) = delete;
+		consolidated_book & operator = (consolidated_book &&) = delete;
+
+		// Replaces the visible levels of the source, returns true when the merged levels changed.
+		template <typename levels_t>
+		bool update(std::size_t source, const levels_t & levels)
+		{
+			assert(source < _sources.size());
+
+			auto & source_levels = _sources[source];
+			source_levels.assign(levels.cbegin(), levels.cbegin() + std::min<std::size_t>(levels.size(), _depth));
+
+			// a source outside of both full merged sides stays outside, nothing to merge
+			if (!contributes(source) && !can_enter(source_levels))
+				return false;
+
+			merge(_merged_bids, [](const top_of_book_level & l) { return l.bid_price; }, [](const top_of_book_level & l) { return l.bid_volume; },
+				[](double lhs, double rhs) { return lhs > rhs; });
+			merge(_merged_asks, [](const top_of_book_level & l) { return l.ask_price; }, [](const top_of_book_level & l) { return l.ask_volume; },
+				[](double lhs, double rhs) { return lhs < rhs; });
+
+			if (_merged_bids == _bids && _merged_asks == _asks)
+				return false;
+
+			_bids.swap(_merged_bids);
+			_asks.swap(_merged_asks);
+			return true;
+		}
+
+		// Levels from the best one, the sides can have different sizes.
+		const levels_t & bids() const noexcept
+		{
+			return _bids;
+		}
+
+		const levels_t & asks() const noexcept
+		{
+			return _asks;
+		}
+
+		unsigned int depth() const noexcept
+		{
+			return _depth;
+		}
+
+	private:
+		bool contributes(std::size_t source) const noexcept
+		{
+			const auto bit = std::uint32_t(1) << source;
+			for (const auto levels : { &_bids, &_asks })
+			{
+				for (const auto & merged_level : *levels)
+				{
+					if (merged_level.sources & bit)
+						return true;
+				}
+			}
+
+			return false;
+		}
+
+		bool can_enter(const std::vector<top_of_book_level> & source_levels) const noexcept
+		{
+			if (source_levels.empty())
+				return false;
+
+			const auto & best = source_levels.front();
+			return _bids.size() < _depth || _asks.size() < _depth ||
+				best.bid_price >= _bids.back().price || best.ask_price <= _asks.back().price;
+		}
+
+		// K-way merge of one side of the sources, they are sorted from the best level.
+		template <typename price_t, typename volume_t, typename better_t>
+		void merge(levels_t & result, price_t price, volume_t volume, better_t better)
+		{
+			_positions.assign(_sources.size(), 0);
+			result.clear();
+
+			while (result.size() < _depth)
+			{
+				bool found = false;
+				double best_price = 0;
+				for (std::size_t s = 0; s != _sources.size(); ++s)
+				{
+					if (_positions[s] == _sources[s].size())
+						continue;
+
+					const auto source_price = price(_sources[s][_positions[s]]);
+					if (!found || better(source_price, best_price))
+					{
+						best_price = source_price;
+						found = true;
+					}
+				}
+
+				if (!found)
+					break;
+
+				level merged_level{ best_price, 0, 0 };
+				for (std::size_t s = 0; s != _sources.size(); ++s)
+				{
+					if (_positions[s] == _sources[s].size())
+						continue;
+
+					const auto & source_level = _sources[s][_positions[s]];
+					if (price(source_level) == best_price)
+					{
+						merged_level.volume += volume(source_level);
+						merged_level.sources |= std::uint32_t(1) << s;
+						++_positions[s];
+					}
+				}
+
+				result.push_back(merged_level);
+			}
+		}
+
+		const unsigned int _depth;
+
+		std::vector<std::vector<top_of_book_level>> _sources;
+		std::vector<std::size_t> _positions;
+
+		levels_t _bids;
+		levels_t _asks;
+		levels_t _merged_bids;
+		levels_t _merged_asks;
+	};
+}
@@ -10,9 +10,11 @@ Copyright (c) 2022 Ilia Funtov.
 
 #include <curl/curl.h>
 
+#include <array>
 #include <cassert>
 #include <cstdlib>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <stdexcept>
 #include <sstream>
@@ -41,6 +43,12 @@ namespace curl
 				throw std::runtime_error("Failed to register curl_global_cleanup at exit.");
 			}
 		}
+
+		inline void initialize_global_once()
+		{
+			static std::once_flag global_init;
+			std::call_once(global_init, initialize_global);
+		}
 	}
 
 	class curl_error : public std::runtime_error
@@ -57,14 +65,94 @@ namespace curl
 		CURLcode code_;
 	};
 
+	// Shares the DNS cache, TLS sessions and kept alive connections between the curl handles using it,
+	// so requests of different objects to one host reuse a single connection.
+	class curl_share
+	{
+	public:
+		curl_share()
+		{
+			details::initialize_global_once();
+
+			share_ = curl_share_init();
+			if (share_ == nullptr)
+			{
+				throw std::runtime_error("can't create curl share handle");
+			}
+
+			try
+			{
+				setopt(CURLSHOPT_LOCKFUNC, lock_cb);
+				setopt(CURLSHOPT_UNLOCKFUNC, unlock_cb);
+				setopt(CURLSHOPT_USERDATA, static_cast<void*>(this));
+
+				setopt(CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+				setopt(CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+				setopt(CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+			}
+			catch (...)
+			{
+				curl_share_cleanup(share_);
+				throw;
+			}
+		}
+
+		curl_share(const curl_share&) = delete;
+		curl_share& operator=(const curl_share&) = delete;
+		curl_share(curl_share&&) = delete;
+		curl_share& operator=(curl_share&&) = delete;
+
+		~curl_share()
+		{
+			curl_share_cleanup(share_);
+		}
+
+		CURLSH * handle() const noexcept
+		{
+			return share_;
+		}
+
+		// One share for the whole process, handles keep it alive while they use it.
+		static std::shared_ptr<curl_share> process_share()
+		{
+			static const auto share = std::make_shared<curl_share>();
+			return share;
+		}
+
+	private:
+		template<typename ...Args>
+		void setopt(CURLSHoption option, Args... args)
+		{
+			const auto code = curl_share_setopt(share_, option, args...);
+			if (code != CURLSHE_OK)
+			{
+				throw std::runtime_error(std::string("curl_share_setopt() failed: ") + curl_share_strerror(code));
+			}
+		}
+
+		static void lock_cb(CURL *, curl_lock_data data, curl_lock_access, void * userptr)
+		{
+			static_cast<curl_share*>(userptr)->mutexes_[data].lock();
+		}
+
+		static void unlock_cb(CURL *, curl_lock_data data, void * userptr)
+		{
+			static_cast<curl_share*>(userptr)->mutexes_[data].unlock();
+		}
+
+		CURLSH * share_ = nullptr;
+		std::array<std::mutex, CURL_LOCK_DATA_LAST> mutexes_;
+	};
+
 	class curl_wrapper
 	{
 	public:
 		using header_fields_t = std::map<ci_string, std::string>;
 
-		curl_wrapper()
+		explicit curl_wrapper(const std::shared_ptr<curl_share> & share = nullptr) :
+			share_(share)
 		{
-			std::call_once(global_init_, [] { details::initialize_global(); });
+			details::initialize_global_once();
 
 			curl_ = curl_easy_init();
 			if (curl_ == nullptr)
@@ -73,6 +161,11 @@ namespace curl
 			}
 
 			setopt(CURLOPT_WRITEFUNCTION, curl_wrapper::write_cb);
+
+			if (share_)
+			{
+				setopt(CURLOPT_SHARE, share_->handle());
+			}
 		}
 
 		curl_wrapper(const curl_wrapper&) = delete;
@@ -255,7 +348,7 @@ namespace curl
 			}
 		}
 
+		const std::shared_ptr<curl_share> share_; // released after the handle
 		CURL * curl_ = nullptr; // CURL handle
-		inline static std::once_flag global_init_;
 	};
 }
\ No newline at end of file
@@ -0,0 +1,205 @@
+/*
+Market data collector for crypto exchanges.
+https://github.com/ilia-funtov/crypto-market-data-collector
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2022 Ilia Funtov.
+*/
+
+#pragma once
+
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <system_error>
+
+// Conversions of the plain decimals exchanges send and the dump files take (43012.55, 0.01230000),
+// drop-in replacements of std::from_chars and std::to_chars with fixed precision, which give the same results.
+// Digits are converted eight at a time inside a 64-bit register, numbers outside of the exact fast path
+// (exponents, more than 19 digits, values without an exact double product) are converted by the standard functions.
+namespace decimal_format
+{
+	namespace details
+	{
+		constexpr double powers_of_ten[] = {
+			1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+			1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+		};
+
+		constexpr int max_exact_power = 22; // powers of ten which are exact doubles
+		constexpr int max_digits = 19; // any 19 digits fit into 64 bits
+		constexpr int max_fixed_precision = 18; // the scale is a 64-bit integer
+		constexpr std::uint64_t max_exact_integer = std::uint64_t(1) << 53;
+
+		constexpr char digit_pairs[] =
+			"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+			"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+			"8081828384858687888990919293949596979899";
+
+		inline bool is_digit(char c) noexcept
+		{
+			return c >= '0' && c <= '9';
+		}
+
+		inline std::uint64_t load_eight(const char * str) noexcept
+		{
+			std::uint64_t value;
+			std::memcpy(&value, str, sizeof(value));
+			return value;
+		}
+
+		// All eight bytes are ASCII digits.
+		inline bool is_eight_digits(std::uint64_t value) noexcept
+		{
+			return (((value & 0xf0f0f0f0f0f0f0f0) | (((value + 0x0606060606060606) & 0xf0f0f0f0f0f0f0f0) >> 4)) == 0x3333333333333333);
+		}
+
+		// The first character in the lowest byte: pairs, quads and octets of digits are combined with three multiplications.
+		inline std::uint64_t parse_eight_digits(std::uint64_t value) noexcept
+		{
+			value = ((value & 0x0f0f0f0f0f0f0f0f) * 2561) >> 8;
+			value = ((value & 0x00ff00ff00ff00ff) * 6553601) >> 16;
+			return ((value & 0x0000ffff0000ffff) * 42949672960001) >> 32;
+		}
+
+		// Appends digits of the run to the mantissa, returns the end of the run.
+		// Leading zeros are counted as digits too, which only leaves long numbers to the standard functions.
+		inline const char * parse_digits(const char * first, const char * last, std::uint64_t & mantissa, int & digits) noexcept
+		{
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+			while (last - first >= 8 && digits + 8 <= max_digits)
+			{
+				const auto chunk = load_eight(first);
+				if (!is_eight_digits(chunk))
+					break;
+
+				mantissa = mantissa * 100000000 + parse_eight_digits(chunk);
+				digits += 8;
+				first += 8;
+			}
+#endif
+			const auto begin = first;
+			for (; first != last && is_digit(*first); ++first)
+			{
+				mantissa = mantissa * 10 + static_cast<std::uint64_t>(*first - '0');
+			}
+
+			digits += static_cast<int>(first - begin);
+			return first;
+		}
+
+		// Writes the count lowest digits of the value (with leading zeros) before the end.
+		inline void write_digits(char * end, std::uint64_t value, int count) noexcept
+		{
+			for (; count >= 2; count -= 2)
+			{
+				const auto pair = static_cast<std::size_t>(value % 100) * 2;
+				value /= 100;
+				*--end = digit_pairs[pair + 1];
+				*--end = digit_pairs[pair];
+			}
+
+			if (count != 0)
+			{
+				*--end = static_cast<char>('0' + value % 10);
+			}
+		}
+
+		inline int count_digits(std::uint64_t value) noexcept
+		{
+			int count = 1;
+			for (; value >= 10; value /= 10)
+			{
+				++count;
+			}
+
+			return count;
+		}
+	}
+
+	// Same as std::from_chars(first, last, value), decimals with mantissas up to 2^53 are converted without it.
+	inline std::from_chars_result from_chars(const char * first, const char * last, double & value) noexcept
+	{
+		using namespace details;
+
+		auto ptr = first;
+		const bool negative = (ptr != last && *ptr == '-');
+		if (negative)
+			++ptr;
+
+		std::uint64_t mantissa = 0;
+		int digits = 0;
+
+		const auto integer_begin = ptr;
+		ptr = parse_digits(ptr, last, mantissa, digits);
+		auto digits_seen = ptr != integer_begin;
+
+		int fraction_digits = 0;
+		if (ptr != last && *ptr == '.')
+		{
+			const auto fraction_begin = ++ptr;
+			ptr = parse_digits(ptr, last, mantissa, digits);
+
+			fraction_digits = static_cast<int>(ptr - fraction_begin);
+			digits_seen = digits_seen || ptr != fraction_begin;
+		}
+
+		const auto exponent_follows = (ptr != last && (*ptr == 'e' || *ptr == 'E'));
+		if (!digits_seen || exponent_follows || digits > max_digits || mantissa > max_exact_integer || fraction_digits > max_exact_power)
+			return std::from_chars(first, last, value);
+
+		// both operands are exact, so the quotient is the correctly rounded value like the one of std::from_chars
+		const auto result = static_cast<double>(mantissa) / powers_of_ten[fraction_digits];
+		value = negative ? -result : result;
+
+		return std::from_chars_result{ ptr, std::errc() };
+	}
+
+	// Same as std::to_chars(first, last, value, std::chars_format::fixed, precision).
+	// Values whose scaled product is exact enough to round are written as integers, the others by std::to_chars.
+	inline std::to_chars_result to_chars_fixed(char * first, char * last, double value, int precision) noexcept
+	{
+		using namespace details;
+
+		if (precision < 0 || precision > max_fixed_precision)
+			return std::to_chars(first, last, value, std::chars_format::fixed, precision);
+
+		const auto scaled = std::fabs(value) * powers_of_ten[precision];
+		if (!(scaled < static_cast<double>(max_exact_integer))) // also not a number
+			return std::to_chars(first, last, value, std::chars_format::fixed, precision);
+
+		// the product is off by half an ulp at most, a fraction that close to one half could round either way
+		const auto floor = std::floor(scaled);
+		const auto fraction = scaled - floor;
+		if (std::fabs(fraction - 0.5) <= scaled * 0x1p-52)
+			return std::to_chars(first, last, value, std::chars_format::fixed, precision);
+
+		const auto rounded = static_cast<std::uint64_t>(floor) + (fraction > 0.5 ? 1 : 0);
+
+		const auto divisor = static_cast<std::uint64_t>(powers_of_ten[precision]);
+		const auto integer = rounded / divisor;
+		const auto integer_digits = count_digits(integer);
+
+		const auto negative = std::signbit(value);
+		const auto length = (negative ? 1 : 0) + integer_digits + (precision != 0 ? precision + 1 : 0);
+		if (last - first < length)
+			return std::to_chars_result{ last, std::errc::value_too_large };
+
+		auto ptr = first;
+		if (negative)
+			*ptr++ = '-';
+
+		write_digits(ptr + integer_digits, integer, integer_digits);
+		ptr += integer_digits;
+
+		if (precision != 0)
+		{
+			*ptr++ = '.';
+			write_digits(ptr + precision, rounded - integer * divisor, precision);
+			ptr += precision;
+		}
+
+		return std::to_chars_result{ ptr, std::errc() };
+	}
+}
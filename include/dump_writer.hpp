@@ -0,0 +1,839 @@
+/*
+Market data collector for crypto exchanges.
+https://github.com/ilia-funtov/crypto-market-data-collector
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2022 Ilia Funtov.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <zlib.h>
+
+#include <binary_format.hpp>
+#include <decimal_format.hpp>
+#include <preallocated_file.hpp>
+
+#if (defined(_WIN32) || defined(__WIN32__) || defined(WIN32))
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace dump_writer
+{
+	enum class fsync_policy : unsigned int
+	{
+		none, // leave it to the OS
+		on_flush, // after every flush of the buffer
+		on_close // when a block file is closed
+	};
+
+	inline fsync_policy get_fsync_policy(const std::string & str)
+	{
+		static const std::map<std::string, fsync_policy> name_policy = {
+			{ "none", fsync_policy::none },
+			{ "flush", fsync_policy::on_flush },
+			{ "close", fsync_policy::on_close }
+		};
+
+		const auto iter = name_policy.find(str);
+		if (iter == name_policy.cend())
+			throw std::runtime_error("Unsupported fsync policy: " + str);
+
+		return iter->second;
+	}
+
+	enum class file_format : unsigned int
+	{
+		csv,
+		binary
+	};
+
+	inline file_format get_file_format(const std::string & str)
+	{
+		static const std::map<std::string, file_format> name_format = {
+			{ "csv", file_format::csv },
+			{ "binary", file_format::binary }
+		};
+
+		const auto iter = name_format.find(str);
+		if (iter == name_format.cend())
+			throw std::runtime_error("Unsupported file format: " + str);
+
+		return iter->second;
+	}
+
+	enum class compression_type : unsigned int
+	{
+		none,
+		gzip
+	};
+
+	inline compression_type get_compression_type(const std::string & str)
+	{
+		static const std::map<std::string, compression_type> name_compression = {
+			{ "none", compression_type::none },
+			{ "gzip", compression_type::gzip }
+		};
+
+		const auto iter = name_compression.find(str);
+		if (iter == name_compression.cend())
+			throw std::runtime_error("Unsupported compression: " + str);
+
+		return iter->second;
+	}
+
+	enum class file_backend : unsigned int
+	{
+		stdio, // buffered appends of the C library
+		preallocated, // disk space reserved ahead of the data, the next block file created ahead of time (Linux only)
+		direct // preallocated files written with O_DIRECT (Linux only)
+	};
+
+	inline file_backend get_file_backend(const std::string & str)
+	{
+		static const std::map<std::string, file_backend> name_backend = {
+			{ "stdio", file_backend::stdio },
+			{ "preallocate", file_backend::preallocated },
+			{ "direct", file_backend::direct }
+		};
+
+		const auto iter = name_backend.find(str);
+		if (iter == name_backend.cend())
+			throw std::runtime_error("Unsupported file backend: " + str);
+
+		return iter->second;
+	}
+
+	inline std::string get_file_extension(file_format format, compression_type compression = compression_type::none)
+	{
+		std::string extension = (format == file_format::binary) ? ".bin" : ".csv";
+		if (compression == compression_type::gzip)
+		{
+			extension += ".gz";
+		}
+
+		return extension;
+	}
+
+	struct flush_options
+	{
+		std::size_t flush_size = 1024 * 1024; // bytes
+		std::chrono::milliseconds flush_period{1000};
+		fsync_policy fsync = fsync_policy::none;
+		compression_type compression = compression_type::none;
+		int compression_level = Z_DEFAULT_COMPRESSION;
+		file_backend backend = file_backend::stdio;
+		bool completion_markers = false; // block files closed cleanly get a marker file, see block_file
+	};
+
+	// Streaming gzip compression. Every flush ends on a byte boundary decodable without the rest of the stream,
+	// finishing completes a gzip member, and the next data starts a new member in the same file,
+	// so appended and killed files stay readable with standard tools.
+	class gzip_encoder
+	{
+	public:
+		explicit gzip_encoder(int level) : _level(level)
+		{
+		}
+
+		gzip_encoder(const gzip_encoder &) = delete;
+		gzip_encoder & operator = (const gzip_encoder &) = delete;
+		gzip_encoder(gzip_encoder &&) = delete;
+		gzip_encoder & operator = (gzip_encoder &&) = delete;
+
+		~gzip_encoder()
+		{
+			if (_initialized)
+			{
+				deflateEnd(&_stream);
+			}
+		}
+
+		// Replaces the output with compressed data.
+		void compress(const char * data, std::size_t size, bool finish, std::vector<char> & output)
+		{
+			output.clear();
+
+			if (size == 0 && !_member_started)
+				return;
+
+			if (!_initialized)
+			{
+				_stream = z_stream{};
+				if (deflateInit2(&_stream, _level, Z_DEFLATED, gzip_window_bits, default_memory_level, Z_DEFAULT_STRATEGY) != Z_OK)
+					throw std::runtime_error("Could not initialize gzip compression");
+
+				_initialized = true;
+			}
+
+			_member_started = true;
+
+			_stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+			_stream.avail_in = static_cast<uInt>(size);
+
+			const auto flush = finish ? Z_FINISH : Z_SYNC_FLUSH;
+
+			int result = Z_OK;
+			do
+			{
+				const auto used = output.size();
+				output.resize(used + std::max<std::size_t>(deflateBound(&_stream, _stream.avail_in), min_output_chunk));
+
+				_stream.next_out = reinterpret_cast<Bytef *>(output.data() + used);
+				_stream.avail_out = static_cast<uInt>(output.size() - used);
+
+				result = deflate(&_stream, flush);
+				if (result == Z_STREAM_ERROR)
+					throw std::runtime_error("Gzip compression error");
+
+				output.resize(output.size() - _stream.avail_out);
+			}
+			while (_stream.avail_out == 0 || (finish && result != Z_STREAM_END));
+
+			if (finish)
+			{
+				deflateReset(&_stream);
+				_member_started = false;
+			}
+		}
+
+	private:
+		static constexpr int gzip_window_bits = 15 + 16; // maximum window with gzip header and trailer
+		static constexpr int default_memory_level = 8;
+		static constexpr std::size_t min_output_chunk = 64 * 1024;
+
+		const int _level;
+		z_stream _stream{};
+		bool _initialized = false;
+		bool _member_started = false;
+	};
+
+	// Growable character buffer reused between flushes, with allocation-free number formatting.
+	class text_buffer
+	{
+	public:
+		explicit text_buffer(std::size_t capacity = 0)
+		{
+			_data.reserve(capacity);
+		}
+
+		const char * data() const noexcept { return _data.data(); }
+		std::size_t size() const noexcept { return _data.size(); }
+		bool empty() const noexcept { return _data.empty(); }
+		void clear() noexcept { _data.clear(); }
+		void swap(text_buffer & other) noexcept { _data.swap(other._data); }
+
+		text_buffer & append(char c)
+		{
+			_data.push_back(c);
+			return *this;
+		}
+
+		text_buffer & append(std::string_view str)
+		{
+			_data.insert(_data.end(), str.begin(), str.end());
+			return *this;
+		}
+
+		template <typename integer_t>
+		text_buffer & append_integer(integer_t value)
+		{
+			char buffer[24];
+			const auto result = std::to_chars(std::begin(buffer), std::end(buffer), value);
+			assert(result.ec == std::errc());
+			return append(std::string_view(buffer, result.ptr - buffer));
+		}
+
+		text_buffer & append_fixed(double value, int precision)
+		{
+			char buffer[max_fixed_length];
+			const auto result = decimal_format::to_chars_fixed(std::begin(buffer), std::end(buffer), value, precision);
+			if (result.ec != std::errc())
+			{
+				// too big for the fixed notation buffer
+				const auto general_result = std::to_chars(std::begin(buffer), std::end(buffer), value);
+				assert(general_result.ec == std::errc());
+				return append(std::string_view(buffer, general_result.ptr - buffer));
+			}
+
+			return append(std::string_view(buffer, result.ptr - buffer));
+		}
+
+	private:
+		static constexpr std::size_t max_fixed_length = 128;
+
+		std::vector<char> _data;
+	};
+
+	// Append-only file which collects records in memory and writes them with one call
+	// when the buffer reaches the flush size or the flush period expires.
+	// A compressed file is compressed and written by its own thread: a flush hands the buffer over and waits
+	// only when max_pending_buffers buffers are still queued; errors of the thread are returned by the next flush or close.
+	class buffered_file
+	{
+	public:
+		explicit buffered_file(const flush_options & options) :
+			_options(options),
+			_buffer(options.flush_size + max_record_size)
+		{
+			if (options.backend != file_backend::stdio)
+			{
+				_preallocated = std::make_unique<preallocated_file>(options.backend == file_backend::direct);
+			}
+
+			if (options.compression == compression_type::gzip)
+			{
+				_encoder = std::make_unique<gzip_encoder>(options.compression_level);
+				_compression_thread = std::thread([this] { compression_loop(); });
+			}
+		}
+
+		buffered_file(const buffered_file &) = delete;
+		buffered_file & operator = (const buffered_file &) = delete;
+		buffered_file(buffered_file &&) = delete;
+		buffered_file & operator = (buffered_file &&) = delete;
+
+		~buffered_file()
+		{
+			try
+			{
+				close();
+			}
+			catch (const std::exception &)
+			{
+			}
+
+			if (_compression_thread.joinable())
+			{
+				{
+					std::lock_guard<std::mutex> lock(_mutex);
+					_stopping = true;
+				}
+
+				_queue_changed.notify_all();
+				_compression_thread.join();
+			}
+		}
+
+		bool open(const std::string & path)
+		{
+			close();
+
+			if (_preallocated)
+			{
+				if (!_preallocated->open(path))
+					return false;
+			}
+			else
+			{
+				_file.reset(fopen(path.c_str(), "ab"));
+				if (_file == nullptr)
+					return false;
+
+				setbuf(_file.get(), nullptr);
+			}
+
+			_last_flush = clock_t::now();
+
+			return true;
+		}
+
+		// Creates the file of the path ahead of its open() when the backend supports it.
+		bool prepare(const std::string & path)
+		{
+			if (!_preallocated)
+				return false;
+
+			const auto result = wait_written();
+			return _preallocated->prepare(path) && result;
+		}
+
+		bool preallocates() const noexcept
+		{
+			return _preallocated != nullptr;
+		}
+
+		bool is_open() const noexcept
+		{
+			return _preallocated ? _preallocated->is_open() : (_file != nullptr);
+		}
+
+		// Returns false when buffered data could not be written completely.
+		bool close()
+		{
+			if (!is_open())
+				return true;
+
+			auto result = write_buffer(true);
+			result = wait_written() && result;
+
+			if (_options.fsync == fsync_policy::on_close)
+				result = sync() && result;
+
+			if (_preallocated)
+				result = _preallocated->close() && result;
+			else
+				_file.reset();
+
+			return result;
+		}
+
+		text_buffer & buffer() noexcept
+		{
+			return _buffer;
+		}
+
+		bool flush_if_needed()
+		{
+			if (_buffer.size() >= _options.flush_size || (!_buffer.empty() && clock_t::now() - _last_flush >= _options.flush_period))
+			{
+				return flush();
+			}
+
+			return true;
+		}
+
+		bool flush()
+		{
+			return write_buffer(false);
+		}
+
+	private:
+		using clock_t = std::chrono::steady_clock;
+
+		struct file_closer
+		{
+			void operator()(FILE * file) const
+			{
+				fclose(file);
+			}
+		};
+
+		struct pending_buffer
+		{
+			text_buffer data;
+			bool finish = false;
+		};
+
+		// A compressed stream is finished when the file is closed, so block files always end with complete members.
+		bool write_buffer(bool finish)
+		{
+			_last_flush = clock_t::now();
+
+			if (!is_open() || (_buffer.empty() && !finish))
+				return true;
+
+			if (!_encoder)
+			{
+				const auto result = write_data(_buffer.data(), _buffer.size());
+				_buffer.clear();
+				return result;
+			}
+
+			std::unique_lock<std::mutex> lock(_mutex);
+			_queue_changed.wait(lock, [this] { return _pending.size() < max_pending_buffers; });
+
+			pending_buffer pending;
+			if (_free_buffers.empty())
+			{
+				pending.data = text_buffer(_options.flush_size + max_record_size);
+			}
+			else
+			{
+				pending.data = std::move(_free_buffers.back());
+				_free_buffers.pop_back();
+			}
+
+			pending.data.swap(_buffer);
+			pending.finish = finish;
+			_pending.push_back(std::move(pending));
+
+			const auto result = take_compression_result();
+
+			lock.unlock();
+			_queue_changed.notify_all();
+
+			return result;
+		}
+
+		// Waits until the compression thread has written all handed over buffers.
+		bool wait_written()
+		{
+			if (!_encoder)
+				return true;
+
+			std::unique_lock<std::mutex> lock(_mutex);
+			_queue_changed.wait(lock, [this] { return _pending.empty(); });
+			return take_compression_result();
+		}
+
+		// Called with the mutex locked, rethrows an exception of the compression thread.
+		bool take_compression_result()
+		{
+			if (_compression_exception)
+				std::rethrow_exception(std::exchange(_compression_exception, nullptr));
+
+			return !std::exchange(_compression_failed, false);
+		}
+
+		void compression_loop()
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			for (;;)
+			{
+				_queue_changed.wait(lock, [this] { return _stopping || !_pending.empty(); });
+				if (_pending.empty())
+					return;
+
+				// the buffer stays queued until it is written, so waiting for an empty queue waits for the write
+				auto & pending = _pending.front();
+				lock.unlock();
+
+				bool result = false;
+				std::exception_ptr exception;
+				try
+				{
+					_encoder->compress(pending.data.data(), pending.data.size(), pending.finish, _compressed);
+					result = write_data(_compressed.data(), _compressed.size());
+				}
+				catch (const std::exception &)
+				{
+					exception = std::current_exception();
+				}
+
+				pending.data.clear();
+
+				lock.lock();
+				_free_buffers.push_back(std::move(pending.data));
+				_pending.pop_front();
+
+				if (exception)
+					_compression_exception = exception;
+				else if (!result)
+					_compression_failed = true;
+
+				_queue_changed.notify_all();
+			}
+		}
+
+		bool write_data(const char * data, std::size_t size)
+		{
+			if (size == 0)
+				return true;
+
+			const auto result = _preallocated ? _preallocated->write(data, size) : (fwrite(data, 1, size, _file.get()) == size);
+
+			if (result && _options.fsync == fsync_policy::on_flush)
+				return sync();
+
+			return result;
+		}
+
+		bool sync()
+		{
+			if (_preallocated)
+				return _preallocated->sync();
+
+#if (defined(_WIN32) || defined(__WIN32__) || defined(WIN32))
+			return _commit(_fileno(_file.get())) == 0;
+#else
+			return fsync(fileno(_file.get())) == 0;
+#endif
+		}
+
+		static constexpr std::size_t max_record_size = 64 * 1024;
+		static constexpr std::size_t max_pending_buffers = 4;
+
+		const flush_options _options;
+		text_buffer _buffer;
+		std::unique_ptr<preallocated_file> _preallocated;
+		std::unique_ptr<FILE, file_closer> _file;
+		clock_t::time_point _last_flush;
+
+		// compression thread, the encoder and the compressed data are used only by it
+		std::unique_ptr<gzip_encoder> _encoder;
+		std::vector<char> _compressed;
+		std::mutex _mutex;
+		std::condition_variable _queue_changed;
+		std::deque<pending_buffer> _pending;
+		std::vector<text_buffer> _free_buffers;
+		std::exception_ptr _compression_exception;
+		bool _compression_failed = false;
+		bool _stopping = false;
+		std::thread _compression_thread;
+	};
+
+	// Block file in one of the dump formats. Binary files get a header when created,
+	// an index of records and a footer with the index when closed.
+	class block_file
+	{
+	public:
+		block_file(const flush_options & options, file_format format, const binary_format::file_header & header) :
+			_file(options),
+			_format(format),
+			_compressed(options.compression != compression_type::none),
+			_markers(options.completion_markers),
+			_header(header),
+			_index(header.index_interval)
+		{
+		}
+
+		file_format format() const noexcept
+		{
+			return _format;
+		}
+
+		// Opens the file for appending. An existing binary file loses its footer, which is written again on close.
+		// Data cut by a killed writer is dropped up to the last whole record (the last line of csv files).
+		// Compressed binary files can not be appended to, they have to be opened with a new path,
+		// compressed csv files only when they were closed cleanly.
+		bool open(const std::string & path)
+		{
+			close();
+
+			_index.reset();
+
+			// a continued file is not complete until it is closed again
+			std::error_code ec;
+			std::filesystem::remove(get_marker_path(path), ec);
+
+			if (_format == file_format::binary && !_compressed && !prepare_binary_file(path))
+				return false;
+
+			if (_format == file_format::csv && !_compressed && !prepare_text_file(path))
+				return false;
+
+			if (!_file.open(path))
+				return false;
+
+			_path = path;
+
+			if (_format == file_format::binary && _index.records_count() == 0 && std::filesystem::file_size(path) == 0)
+			{
+				binary_format::put_file_header(_file.buffer(), _header);
+			}
+
+			return true;
+		}
+
+		bool is_open() const noexcept
+		{
+			return _file.is_open();
+		}
+
+		// Creates the file of the next block ahead of time with the preallocated backends, a no-op for stdio.
+		bool prepare(const std::string & path)
+		{
+			return _file.prepare(path);
+		}
+
+		bool preallocates() const noexcept
+		{
+			return _file.preallocates();
+		}
+
+		// With completion markers a cleanly closed file gets a marker with its size: a block file without one
+		// is being written or was cut by a killed writer.
+		bool close()
+		{
+			if (!_file.is_open())
+				return true;
+
+			if (_format == file_format::binary)
+			{
+				_index.put_footer(_file.buffer());
+			}
+
+			const auto result = _file.close();
+			return (result && _markers) ? write_marker() : result;
+		}
+
+		static std::string get_marker_path(const std::string & path)
+		{
+			return path + ".done";
+		}
+
+		static bool is_complete(const std::string & path)
+		{
+			std::error_code ec;
+			return std::filesystem::exists(get_marker_path(path), ec);
+		}
+
+		text_buffer & buffer() noexcept
+		{
+			return _file.buffer();
+		}
+
+		// Has to be called for every record appended to the buffer.
+		void record_added(std::int64_t timestamp)
+		{
+			if (_format == file_format::binary)
+			{
+				_index.add(timestamp);
+			}
+		}
+
+		bool flush_if_needed()
+		{
+			return _file.flush_if_needed();
+		}
+
+		bool flush()
+		{
+			return _file.flush();
+		}
+
+	private:
+		bool prepare_binary_file(const std::string & path)
+		{
+			namespace fs = std::filesystem;
+
+			std::error_code ec;
+			const auto file_size = fs::file_size(path, ec);
+			if (ec || file_size == 0)
+				return true;
+
+			std::optional<binary_format::file_layout> layout;
+
+			{
+				std::unique_ptr<FILE, file_closer> file(fopen(path.c_str(), "rb"));
+				if (file == nullptr)
+					return false;
+
+				layout = binary_format::read_file_layout(file.get(), file_size);
+
+				if (layout && is_compatible(layout->header))
+				{
+					if (layout->has_footer)
+					{
+						_index.reset(std::move(layout->index), layout->records_count);
+					}
+					else if (!binary_format::rebuild_index(file.get(), *layout, _index))
+					{
+						return false;
+					}
+				}
+				else
+				{
+					layout.reset();
+				}
+			}
+
+			if (!layout)
+			{
+				// keep data written in another layout aside and start the block from scratch
+				fs::rename(path, path + ".invalid", ec);
+				return !ec;
+			}
+
+			fs::resize_file(path, binary_format::header_size + layout->records_count * layout->header.record_size, ec);
+			return !ec;
+		}
+
+		static bool prepare_text_file(const std::string & path)
+		{
+			namespace fs = std::filesystem;
+
+			std::error_code ec;
+			const auto file_size = fs::file_size(path, ec);
+			if (ec || file_size == 0)
+				return true;
+
+			std::uint64_t size = file_size;
+
+			{
+				std::unique_ptr<FILE, file_closer> file(fopen(path.c_str(), "rb"));
+				if (file == nullptr)
+					return false;
+
+				// back from the end to the last line break, records are short
+				char chunk[4096];
+				for (;;)
+				{
+					const auto chunk_size = static_cast<std::size_t>(std::min<std::uint64_t>(size, sizeof(chunk)));
+					if (chunk_size == 0 || fseek(file.get(), static_cast<long>(size - chunk_size), SEEK_SET) != 0 ||
+						fread(chunk, 1, chunk_size, file.get()) != chunk_size)
+						break;
+
+					const auto end = std::find(std::make_reverse_iterator(chunk + chunk_size), std::make_reverse_iterator(chunk), '\n');
+					if (end != std::make_reverse_iterator(chunk))
+					{
+						size -= static_cast<std::uint64_t>(end - std::make_reverse_iterator(chunk + chunk_size));
+						break;
+					}
+
+					size -= chunk_size;
+				}
+			}
+
+			if (size == file_size)
+				return true;
+
+			fs::resize_file(path, size, ec);
+			return !ec;
+		}
+
+		bool write_marker() const
+		{
+			std::error_code ec;
+			const auto size = std::filesystem::file_size(_path, ec);
+			if (ec)
+				return false;
+
+			std::unique_ptr<FILE, file_closer> file(fopen(get_marker_path(_path).c_str(), "wb"));
+			if (file == nullptr)
+				return false;
+
+			const auto content = "{\"size\":" + std::to_string(size) + "}\n";
+			return fwrite(content.data(), 1, content.size(), file.get()) == content.size();
+		}
+
+		bool is_compatible(const binary_format::file_header & header) const
+		{
+			return header.type == _header.type && header.encoding == _header.encoding &&
+				header.record_size == _header.record_size && header.depth == _header.depth &&
+				header.index_interval == _header.index_interval;
+		}
+
+		struct file_closer
+		{
+			void operator()(FILE * file) const
+			{
+				fclose(file);
+			}
+		};
+
+		buffered_file _file;
+		const file_format _format;
+		const bool _compressed;
+		const bool _markers;
+		const binary_format::file_header _header;
+		binary_format::block_index _index;
+		std::string _path;
+	};
+}
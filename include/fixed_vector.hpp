@@ -0,0 +1,115 @@
+/*
+Market data collector for crypto exchanges.
+https://github.com/ilia-funtov/crypto-market-data-collector
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2022 Ilia Funtov.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace market_data_common
+{
+	// Vector of plain elements stored inline up to a capacity known at compile time.
+	// A record holding it is one block of memory, so copying it through a ring touches no other cache lines,
+	// and copies take only the elements in use.
+	template <typename T, std::size_t max_size>
+	class fixed_vector
+	{
+		static_assert(std::is_trivially_destructible_v<T>, "Elements of fixed vectors are overwritten without destruction.");
+		static_assert(max_size != 0, "Fixed vectors need a capacity.");
+
+	public:
+		using value_type = T;
+		using size_type = std::size_t;
+		using iterator = T *;
+		using const_iterator = const T *;
+
+		fixed_vector() = default;
+
+		fixed_vector(const fixed_vector & other) noexcept
+		{
+			*this = other;
+		}
+
+		fixed_vector & operator = (const fixed_vector & other) noexcept
+		{
+			if (this != &other)
+			{
+				std::copy(other.begin(), other.end(), _data.begin());
+				_size = other._size;
+			}
+
+			return *this;
+		}
+
+		template <typename allocator_t>
+		fixed_vector & operator = (const std::vector<T, allocator_t> & other) noexcept
+		{
+			assign(other.cbegin(), other.cend());
+			return *this;
+		}
+
+		template <typename iterator_t>
+		void assign(iterator_t first, iterator_t last) noexcept
+		{
+			assert(static_cast<std::size_t>(std::distance(first, last)) <= max_size);
+			_size = static_cast<std::size_t>(std::copy(first, last, _data.begin()) - _data.begin());
+		}
+
+		static constexpr std::size_t capacity() noexcept { return max_size; }
+
+		// Only checks the capacity, the storage is always there.
+		void reserve([[maybe_unused]] std::size_t size) const noexcept
+		{
+			assert(size <= max_size);
+		}
+
+		std::size_t size() const noexcept { return _size; }
+		bool empty() const noexcept { return _size == 0; }
+		void clear() noexcept { _size = 0; }
+
+		void push_back(const T & value) noexcept
+		{
+			assert(_size < max_size);
+			_data[_size++] = value;
+		}
+
+		template <typename ...args_t>
+		T & emplace_back(args_t && ...args) noexcept
+		{
+			assert(_size < max_size);
+			return _data[_size++] = T{ std::forward<args_t>(args)... };
+		}
+
+		T & operator[](std::size_t index) noexcept { return _data[index]; }
+		const T & operator[](std::size_t index) const noexcept { return _data[index]; }
+
+		T * data() noexcept { return _data.data(); }
+		const T * data() const noexcept { return _data.data(); }
+
+		iterator begin() noexcept { return _data.data(); }
+		iterator end() noexcept { return _data.data() + _size; }
+		const_iterator begin() const noexcept { return _data.data(); }
+		const_iterator end() const noexcept { return _data.data() + _size; }
+		const_iterator cbegin() const noexcept { return begin(); }
+		const_iterator cend() const noexcept { return end(); }
+
+	private:
+		std::array<T, max_size> _data;
+		std::size_t _size = 0;
+	};
+
+	// Inline storage of a fixed capacity, a vector when the capacity is only known at run time (zero).
+	template <typename T, std::size_t max_size>
+	using level_vector = std::conditional_t<max_size == 0, std::vector<T>, fixed_vector<T, max_size>>;
+}
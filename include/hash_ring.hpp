@@ -0,0 +1,97 @@
+/*
+Market data collector for crypto exchanges.
+https://github.com/ilia-funtov/crypto-market-data-collector
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2022 Ilia Funtov.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Consistent hashing of keys to nodes: every node owns points on a ring of 64-bit hashes and a key belongs to the nodes
+// whose points follow its hash. Adding or removing a node moves only the keys of its points.
+// Hashes do not depend on the platform or the standard library, so all nodes compute the same assignment independently.
+namespace sharding
+{
+	// FNV-1a with the splitmix64 finalizer, which spreads similar keys like node#1 and node#2 over the ring.
+	inline std::uint64_t hash(std::string_view str) noexcept
+	{
+		std::uint64_t value = 14695981039346656037ull;
+		for (const auto c : str)
+		{
+			value = (value ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+		}
+
+		value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+		value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+		return value ^ (value >> 31);
+	}
+
+	class hash_ring
+	{
+	public:
+		// The node gets as many points as its weight, more points give it a larger and more even share of keys.
+		void add_node(const std::string & name, unsigned int points)
+		{
+			if (name.empty() || points == 0)
+				throw std::invalid_argument("Invalid node of hash ring: " + name);
+
+			if (std::find(_nodes.cbegin(), _nodes.cend(), name) != _nodes.cend())
+				throw std::invalid_argument("Node is added to hash ring more than once: " + name);
+
+			const auto node_index = _nodes.size();
+			_nodes.push_back(name);
+
+			for (unsigned int n = 0; n != points; ++n)
+			{
+				_points.emplace_back(hash(name + '#' + std::to_string(n)), node_index);
+			}
+
+			std::sort(_points.begin(), _points.end());
+		}
+
+		const std::vector<std::string> & nodes() const noexcept
+		{
+			return _nodes;
+		}
+
+		// Distinct nodes of the key, clockwise from its hash; the first one is the primary owner.
+		std::vector<std::string> get_nodes(std::string_view key, std::size_t count) const
+		{
+			count = std::min(count, _nodes.size());
+
+			std::vector<std::string> result;
+			if (count == 0)
+				return result;
+
+			std::vector<bool> taken(_nodes.size());
+
+			const auto start = std::lower_bound(_points.cbegin(), _points.cend(), std::make_pair(hash(key), std::size_t(0)));
+			const auto start_offset = static_cast<std::size_t>(start - _points.cbegin());
+
+			for (std::size_t n = 0; n != _points.size() && result.size() != count; ++n)
+			{
+				const auto node_index = _points[(start_offset + n) % _points.size()].second;
+				if (!taken[node_index])
+				{
+					taken[node_index] = true;
+					result.push_back(_nodes[node_index]);
+				}
+			}
+
+			return result;
+		}
+
+	private:
+		std::vector<std::pair<std::uint64_t, std::size_t>> _points; // hash and node index, sorted
+		std::vector<std::string> _nodes;
+	};
+}
@@ -0,0 +1,149 @@
+/*
+Market data collector for crypto exchanges.
+https://github.com/ilia-funtov/crypto-market-data-collector
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2022 Ilia Funtov.
+*/
+
+#pragma once
+
+#include <cassert>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+
+namespace websocket_wrapper
+{
+	// Shared by all pending operations of an object running on the pool:
+	// the promise is fulfilled when the last of them completes and releases it.
+	struct pool_session
+	{
+		std::promise<void> done;
+
+		~pool_session()
+		{
+			done.set_value();
+		}
+	};
+
+	using pool_session_ptr = std::shared_ptr<pool_session>;
+
+	// Threads running one io_context shared by many websocket connections and their timers.
+	// Threads can be pinned to CPUs, the n-th thread goes to cpus[n % cpus.size()].
+	class io_thread_pool
+	{
+	public:
+		using error_handler_t = std::function<void(const std::exception &)>;
+
+		io_thread_pool(
+			unsigned int threads_num,
+			const std::vector<unsigned int> & cpus = std::vector<unsigned int>{},
+			error_handler_t error_handler = error_handler_t{}) :
+			_work(boost::asio::make_work_guard(_io_context)),
+			_error_handler(error_handler)
+		{
+			if (threads_num == 0)
+				throw std::invalid_argument("Number of io threads must not be zero.");
+
+			try
+			{
+				for (unsigned int n = 0; n != threads_num; ++n)
+				{
+					_threads.emplace_back([this]() { thread_loop(); });
+
+					if (!cpus.empty())
+					{
+						pin_thread(_threads.back(), cpus[n % cpus.size()]);
+					}
+				}
+			}
+			catch (...)
+			{
+				stop();
+				throw;
+			}
+		}
+
+		io_thread_pool(const io_thread_pool &) = delete;
+		io_thread_pool & operator = (const io_thread_pool &) = delete;
+		io_thread_pool(io_thread_pool &&) = delete;
+		io_thread_pool & operator = (io_thread_pool &&) = delete;
+
+		~io_thread_pool()
+		{
+			stop();
+		}
+
+		boost::asio::io_context & context() noexcept
+		{
+			return _io_context;
+		}
+
+		// Connections and timers have to be stopped before, their handlers are not called after the pool stops.
+		void stop()
+		{
+			_work.reset();
+			_io_context.stop();
+
+			for (auto & thread : _threads)
+			{
+				if (thread.joinable())
+					thread.join();
+			}
+
+			_threads.clear();
+		}
+
+	private:
+		void thread_loop() noexcept
+		{
+			while (!_io_context.stopped())
+			{
+				try
+				{
+					_io_context.run();
+				}
+				catch (const std::exception & exc)
+				{
+					if (_error_handler)
+						_error_handler(exc);
+				}
+			}
+		}
+
+		static void pin_thread(std::thread & thread, unsigned int cpu)
+		{
+#if defined(__linux__)
+			cpu_set_t cpu_set;
+			CPU_ZERO(&cpu_set);
+			CPU_SET(cpu, &cpu_set);
+
+			if (pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set), &cpu_set) != 0)
+				throw std::runtime_error("Could not pin io thread to CPU " + std::to_string(cpu));
+#else
+			(void)thread;
+			(void)cpu;
+			throw std::runtime_error("Pinning io threads to CPUs is not supported on this platform.");
+#endif
+		}
+
+		boost::asio::io_context _io_context;
+		boost::asio::executor_work_guard<boost::asio::io_context::executor_type> _work;
+		const error_handler_t _error_handler;
+		std::vector<std::thread> _threads;
+	};
+}
@@ -9,19 +9,36 @@ Copyright (c) 2022 Ilia Funtov.
 #pragma once
 
 #include <cassert>
+#include <charconv>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <system_error>
 #include <type_traits>
 
 #include <nlohmann/json.hpp>
 
+#include <decimal_format.hpp>
+
 namespace json_helpers
 {
 	using json = nlohmann::json;
 
+	// Exchanges send prices as decimal strings, they are parsed without locale lookups and copies.
+	inline double parse_double(std::string_view str)
+	{
+		double value = 0;
+		const auto result = decimal_format::from_chars(str.data(), str.data() + str.size(), value);
+		if (result.ec != std::errc() || result.ptr != str.data() + str.size())
+			throw std::runtime_error("Could not parse number: " + std::string(str));
+
+		return value;
+	}
+
 	inline double get_double(const json & object)
 	{
-		return object.is_number() ? object.get<double>() : std::stod(object.get<std::string>());
+		return object.is_number() ? object.get<double>() : parse_double(object.get_ref<const std::string &>());
 	};
 
 	inline unsigned long get_ulong(const json & object)
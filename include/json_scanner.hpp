@@ -0,0 +1,416 @@
+/*
+Market data collector for crypto exchanges.
+https://github.com/ilia-funtov/crypto-market-data-collector
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2022 Ilia Funtov.
+*/
+
+#pragma once
+
+#include <array>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <json_helpers.hpp>
+
+namespace json_helpers
+{
+	// Forward-only reader of a JSON text which does not build a DOM and does not allocate.
+	// Strings are returned as views of the text with escape sequences left as is,
+	// which is fine for the symbols, sides and numbers of market data messages.
+	// Every key returned by next_key() has to be followed by reading or skipping its value.
+	class json_scanner
+	{
+	public:
+		enum class token_type : unsigned int
+		{
+			none, // end of the text, a closing bracket or a separator
+			object,
+			array,
+			string,
+			number,
+			boolean,
+			null
+		};
+
+		explicit json_scanner(std::string_view text) noexcept :
+			_text(text)
+		{
+		}
+
+		token_type peek() noexcept
+		{
+			skip_whitespace();
+			if (_pos == _text.size())
+				return token_type::none;
+
+			const auto ch = _text[_pos];
+			switch (ch)
+			{
+			case '{':
+				return token_type::object;
+			case '[':
+				return token_type::array;
+			case '"':
+				return token_type::string;
+			case 't':
+			case 'f':
+				return token_type::boolean;
+			case 'n':
+				return token_type::null;
+			default:
+				break;
+			}
+
+			return (ch == '-' || (ch >= '0' && ch <= '9')) ? token_type::number : token_type::none;
+		}
+
+		void begin_object()
+		{
+			skip_whitespace();
+			if (!consume('{'))
+				fail("object expected");
+		}
+
+		void begin_array()
+		{
+			skip_whitespace();
+			if (!consume('['))
+				fail("array expected");
+		}
+
+		// Moves to the next key of the current object, returns false after its closing bracket.
+		bool next_key(std::string_view & key)
+		{
+			skip_whitespace();
+			if (consume('}'))
+				return false;
+
+			if (consume(','))
+				skip_whitespace();
+
+			if (peek() != token_type::string)
+				fail("object key expected");
+
+			key = read_string();
+
+			skip_whitespace();
+			if (!consume(':'))
+				fail("':' expected");
+
+			return true;
+		}
+
+		// Moves to the next element of the current array, returns false after its closing bracket.
+		bool next_element()
+		{
+			skip_whitespace();
+			if (consume(']'))
+				return false;
+
+			consume(',');
+			return true;
+		}
+
+		// Skips the remaining keys or elements of the current object or array including its closing bracket.
+		void skip_rest()
+		{
+			for (;;)
+			{
+				skip_whitespace();
+				if (consume(']') || consume('}'))
+					return;
+
+				if (consume(','))
+					continue;
+
+				skip_value();
+
+				skip_whitespace();
+				if (consume(':'))
+					skip_value();
+			}
+		}
+
+		std::string_view get_string()
+		{
+			if (peek() != token_type::string)
+				fail("string expected");
+
+			return read_string();
+		}
+
+		// Numbers can be sent both as JSON numbers and as strings.
+		double get_double()
+		{
+			const auto type = peek();
+			if (type == token_type::number)
+				return parse_double(read_number());
+
+			if (type == token_type::string)
+				return parse_double(read_string());
+
+			fail("number expected");
+		}
+
+		std::uint64_t get_uint64()
+		{
+			const auto type = peek();
+			if (type != token_type::number && type != token_type::string)
+				fail("number expected");
+
+			const auto str = (type == token_type::number) ? read_number() : read_string();
+
+			std::uint64_t value = 0;
+			const auto result = std::from_chars(str.data(), str.data() + str.size(), value);
+			if (result.ec == std::errc() && result.ptr == str.data() + str.size())
+				return value;
+
+			return static_cast<std::uint64_t>(parse_double(str));
+		}
+
+		bool get_bool()
+		{
+			if (peek() != token_type::boolean)
+				fail("boolean expected");
+
+			const auto literal = read_literal();
+			if (literal == "true")
+				return true;
+
+			if (literal != "false")
+				fail("boolean expected");
+
+			return false;
+		}
+
+		// Reads a flat array like a price level, strings are returned without quotes.
+		// Returns the number of its elements, the ones which do not fit are skipped.
+		template <std::size_t size>
+		std::size_t get_array(std::array<std::string_view, size> & values)
+		{
+			begin_array();
+
+			std::size_t count = 0;
+			while (next_element())
+			{
+				const auto value = skip_value();
+				if (count < size)
+					values[count] = (value.front() == '"') ? value.substr(1, value.size() - 2) : value;
+
+				++count;
+			}
+
+			return count;
+		}
+
+		// Returns the raw text of the value, strings keep their quotes.
+		std::string_view skip_value()
+		{
+			skip_whitespace();
+			const auto begin = _pos;
+
+			switch (peek())
+			{
+			case token_type::object:
+			case token_type::array:
+				skip_nested();
+				break;
+			case token_type::string:
+				read_string();
+				break;
+			case token_type::number:
+				read_number();
+				break;
+			case token_type::boolean:
+			case token_type::null:
+				read_literal();
+				break;
+			default:
+				fail("value expected");
+			}
+
+			return _text.substr(begin, _pos - begin);
+		}
+
+	private:
+		[[noreturn]] void fail(const char * what) const
+		{
+			throw std::runtime_error("Could not parse JSON at position " + std::to_string(_pos) + ": " + what);
+		}
+
+		void skip_whitespace() noexcept
+		{
+			while (_pos != _text.size())
+			{
+				const auto ch = _text[_pos];
+				if (ch != ' ' && ch != '\t' && ch != '\n' && ch != '\r')
+					break;
+
+				++_pos;
+			}
+		}
+
+		bool consume(char ch) noexcept
+		{
+			if (_pos != _text.size() && _text[_pos] == ch)
+			{
+				++_pos;
+				return true;
+			}
+
+			return false;
+		}
+
+		std::string_view read_string()
+		{
+			const auto begin = ++_pos;
+
+			for (; _pos != _text.size(); ++_pos)
+			{
+				const auto ch = _text[_pos];
+				if (ch == '"')
+				{
+					return _text.substr(begin, _pos++ - begin);
+				}
+				else if (ch == '\\')
+				{
+					++_pos;
+					if (_pos == _text.size())
+						break;
+				}
+			}
+
+			fail("unterminated string");
+		}
+
+		std::string_view read_number() noexcept
+		{
+			const auto begin = _pos;
+
+			for (; _pos != _text.size(); ++_pos)
+			{
+				const auto ch = _text[_pos];
+				if (!((ch >= '0' && ch <= '9') || ch == '-' || ch == '+' || ch == '.' || ch == 'e' || ch == 'E'))
+					break;
+			}
+
+			return _text.substr(begin, _pos - begin);
+		}
+
+		std::string_view read_literal() noexcept
+		{
+			const auto begin = _pos;
+
+			while (_pos != _text.size() && _text[_pos] >= 'a' && _text[_pos] <= 'z')
+			{
+				++_pos;
+			}
+
+			return _text.substr(begin, _pos - begin);
+		}
+
+		void skip_nested()
+		{
+			std::size_t depth = 0;
+
+			for (; _pos != _text.size(); ++_pos)
+			{
+				const auto ch = _text[_pos];
+				if (ch == '"')
+				{
+					read_string();
+					--_pos;
+				}
+				else if (ch == '{' || ch == '[')
+				{
+					++depth;
+				}
+				else if (ch == '}' || ch == ']')
+				{
+					if (--depth == 0)
+					{
+						++_pos;
+						return;
+					}
+				}
+			}
+
+			fail("unterminated object or array");
+		}
+
+		const std::string_view _text;
+		std::size_t _pos = 0;
+	};
+
+	// Top-level fields of an object message with the raw texts of their values,
+	// the values are scanned only when a handler asks for them.
+	// The storage is reused from message to message.
+	class json_object_view
+	{
+	public:
+		void parse(std::string_view text)
+		{
+			_text = text;
+			_fields.clear();
+
+			json_scanner scanner(text);
+			scanner.begin_object();
+
+			std::string_view key;
+			while (scanner.next_key(key))
+			{
+				_fields.emplace_back(key, scanner.skip_value());
+			}
+		}
+
+		std::string_view text() const noexcept
+		{
+			return _text;
+		}
+
+		bool contains(std::string_view key) const noexcept
+		{
+			return !find(key).empty();
+		}
+
+		// Returns an empty view when there is no such key.
+		std::string_view find(std::string_view key) const noexcept
+		{
+			for (const auto & field : _fields)
+			{
+				if (field.first == key)
+					return field.second;
+			}
+
+			return std::string_view();
+		}
+
+		// Returns an empty view when there is no such key or the value is not a string.
+		std::string_view get_string(std::string_view key) const noexcept
+		{
+			const auto value = find(key);
+			if (value.size() < 2 || value.front() != '"')
+				return std::string_view();
+
+			return value.substr(1, value.size() - 2);
+		}
+
+		json_scanner scan(std::string_view key) const noexcept
+		{
+			return json_scanner(find(key));
+		}
+
+	private:
+		std::string_view _text;
+		std::vector<std::pair<std::string_view, std::string_view>> _fields;
+	};
+} // namespace json_helpers
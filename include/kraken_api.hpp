@@ -757,6 +757,25 @@ namespace kraken
 			return out;
 		}
 
+		// The websocket api names pairs differently, like XBT/USD for XXBTZUSD.
+		std::string get_ws_pair_name(const std::string & pair)
+		{
+			using namespace details;
+
+			input_params input;
+			input.emplace("pair", pair);
+
+			const auto & response = public_method("AssetPairs", input);
+			const auto & result = parse_response(response);
+
+			const auto & pair_item = get_value<json>(result, pair);
+			const auto wsname = get_value<std::string>(pair_item, "wsname");
+			if (wsname.empty())
+				throw kraken_api_error("Could not find websocket name of pair " + pair);
+
+			return wsname;
+		}
+
 #ifndef KRAKEN_API_PUBLIC_ONLY 
 		get_account_balance_response get_account_balance()
 		{
@@ -922,6 +941,12 @@ namespace kraken
 			//curl_.setopt(CURLOPT_CAINFO, "cacert.pem");
 			curl_.setopt(CURLOPT_USERAGENT, "Kraken C++ API Client");
 			curl_.setopt(CURLOPT_POST, 1L);
+
+			// requests of all instances go through the kept alive connections of the process share
+			curl_.setopt(CURLOPT_HTTP_VERSION, static_cast<long>(CURL_HTTP_VERSION_2TLS));
+			curl_.setopt(CURLOPT_ACCEPT_ENCODING, ""); // all encodings supported by curl
+			curl_.setopt(CURLOPT_TCP_KEEPALIVE, 1L);
+			curl_.setopt(CURLOPT_TCP_NODELAY, 1L);
 			
 			nonce_ = (std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch())).count();
 		}
@@ -1028,7 +1053,7 @@ namespace kraken
 		std::string url_;     // API base URL
 		std::string version_; // API version
 
-		curl::curl_wrapper curl_;
+		curl::curl_wrapper curl_{ curl::curl_share::process_share() };
 		
 		std::atomic<std::uint64_t> nonce_ {0};
 	};
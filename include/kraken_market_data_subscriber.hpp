@@ -6,30 +6,380 @@ Licensed under the MIT License <http://opensource.org/licenses/MIT>.
 Copyright (c) 2022 Ilia Funtov.
 */
 
-#include <chrono>
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include <zlib.h>
 
-#include <kraken_order_book_subscriber.hpp>
-#include <kraken_trades_subscriber.hpp>
+#include <json_scanner.hpp>
+#include <kraken_api.hpp>
+#include <kraken_ws_subscriber.hpp>
+#include <market_data_common.hpp>
 
 namespace kraken
 {
-	class kraken_market_data_subscriber
+	// Book and trades from the websocket feed. The book is built from the snapshot sent on subscription
+	// and incremental updates, every update is validated with the checksum of the top levels.
+	// When validation fails the book channel is subscribed again to get a new snapshot.
+	class kraken_market_data_subscriber: public market_data_common::order_book_subscriber_base
 	{
 	public:
 		kraken_market_data_subscriber(
 			const std::string & symbol,
-            unsigned int order_book_size,
-            const std::chrono::milliseconds & poll_period,
+			unsigned int order_book_size,
 			const market_data_common::book_handler_t & book_handler,
 			const market_data_common::trade_handler_t & trade_handler,
-			const market_data_common::error_handler_t & error_handler):
-            _order_book_subscriber(symbol, order_book_size, poll_period, book_handler, error_handler),
-            _trades_subscriber(symbol, poll_period, trade_handler, error_handler)
+			const market_data_common::error_handler_t & error_handler,
+			const market_data_common::order_book_options & book_options = market_data_common::order_book_options{},
+			const std::string & api_address = kraken_ws_subscriber::default_api_address,
+			unsigned int port = kraken_ws_subscriber::default_port) :
+			kraken_market_data_subscriber(
+				symbol,
+				order_book_size,
+				book_handler,
+				trade_handler,
+				std::make_shared<kraken_ws_subscriber>(error_handler, api_address, port),
+				book_options)
+		{
+		}
+
+		// Subscribes through a connection shared with subscribers of other pairs.
+		// Symbols can be given both as websocket names (XBT/USD) and as REST pair names (XXBTZUSD),
+		// the latter are resolved with the AssetPairs request.
+		kraken_market_data_subscriber(
+			const std::string & symbol,
+			unsigned int order_book_size,
+			const market_data_common::book_handler_t & book_handler,
+			const market_data_common::trade_handler_t & trade_handler,
+			const std::shared_ptr<kraken_ws_subscriber> & ws_subscriber,
+			const market_data_common::order_book_options & book_options = market_data_common::order_book_options{}) :
+			order_book_subscriber_base("kraken", symbol, book_handler, book_options),
+			_trade_handler(trade_handler),
+			_ws_subscriber(ws_subscriber),
+			_pair(get_ws_pair_name(symbol)),
+			_depth(get_book_depth(order_book_size))
+		{
+			assert(_trade_handler);
+			assert(_ws_subscriber);
+
+			_ws_subscriber->subscribe(
+				book_channel,
+				_pair,
+				_depth,
+				[this](const std::vector<std::string_view> & payloads) { book_event_handler(payloads); });
+
+			_ws_subscriber->subscribe(
+				trade_channel,
+				_pair,
+				0,
+				[this](const std::vector<std::string_view> & payloads) { trades_event_handler(payloads); });
+		}
+
+		kraken_market_data_subscriber(const kraken_market_data_subscriber &) = delete;
+		kraken_market_data_subscriber& operator = (const kraken_market_data_subscriber &) = delete;
+		kraken_market_data_subscriber(kraken_market_data_subscriber &&) = delete;
+		kraken_market_data_subscriber& operator = (kraken_market_data_subscriber &&) = delete;
+
+		~kraken_market_data_subscriber()
+		{
+			_ws_subscriber->unsubscribe(book_channel, _pair);
+			_ws_subscriber->unsubscribe(trade_channel, _pair);
+		}
+	private:
+		using token_type = json_helpers::json_scanner::token_type;
+
+		static std::string get_ws_pair_name(const std::string & symbol)
+		{
+			if (symbol.find('/') != std::string::npos)
+				return symbol;
+
+			KAPI kapi;
+			return kapi.get_ws_pair_name(symbol);
+		}
+
+		// Depths supported by the book channel.
+		static unsigned int get_book_depth(unsigned int order_book_size)
 		{
+			for (const auto depth : { 10u, 25u, 100u, 500u })
+			{
+				if (order_book_size <= depth)
+					return depth;
+			}
+
+			return 1000;
 		}
-    private:
-        kraken_order_book_subscriber _order_book_subscriber;
-        kraken_trades_subscriber _trades_subscriber;
-    };
-}
\ No newline at end of file
+
+		// Snapshot: [channelID, {"as":[[price, volume, timestamp], ...], "bs":[...]}, "book-N", pair]
+		// Update: [channelID, {"a":[[price, volume, timestamp(, "r")], ...]}(, {"b":[...])}, {... "c":"checksum"}, "book-N", pair]
+		void book_event_handler(const std::vector<std::string_view> & payloads)
+		{
+			bool snapshot = false;
+			bool checksum_found = false;
+			std::uint64_t checksum = 0;
+			std::uint64_t timestamp = 0; // the latest time of changed levels
+
+			for (const auto & payload : payloads)
+			{
+				json_helpers::json_scanner scanner(payload);
+				if (scanner.peek() != token_type::object)
+					continue;
+
+				scanner.begin_object();
+
+				std::string_view key;
+				while (scanner.next_key(key))
+				{
+					if (key == "as" || key == "bs")
+					{
+						if (!snapshot)
+						{
+							asks_price_levels.clear();
+							bids_price_levels.clear();
+							snapshot = true;
+						}
+
+						if (key == "as")
+							parse_levels(scanner, asks_price_levels, true, timestamp);
+						else
+							parse_levels(scanner, bids_price_levels, true, timestamp);
+					}
+					else if ((key == "a" || key == "b") && _snapshot_received)
+					{
+						if (key == "a")
+							parse_levels(scanner, asks_price_levels, false, timestamp);
+						else
+							parse_levels(scanner, bids_price_levels, false, timestamp);
+					}
+					else if (key == "c")
+					{
+						checksum = scanner.get_uint64();
+						checksum_found = true;
+					}
+					else
+					{
+						scanner.skip_value();
+					}
+				}
+			}
+
+			if (snapshot)
+			{
+				asks_price_levels.sort_levels();
+				bids_price_levels.sort_levels();
+				_snapshot_received = true;
+			}
+
+			if (!_snapshot_received)
+				return;
+
+			// levels pushed out of the subscribed depth are not updated anymore
+			asks_price_levels.truncate(_depth);
+			bids_price_levels.truncate(_depth);
+
+			set_event_timestamps(_ws_subscriber->receive_timestamp(), timestamp);
+
+			const auto checksum_valid = !checksum_found || checksum == get_checksum();
+			if (!checksum_valid)
+				book_inconsistent();
+
+			if (!checksum_valid || !handle_order_book_if_consistent())
+			{
+				_snapshot_received = false;
+				_ws_subscriber->resubscribe(book_channel, _pair);
+			}
+		}
+
+		template <typename levels_t>
+		void parse_levels(json_helpers::json_scanner & scanner, levels_t & levels, bool snapshot, std::uint64_t & timestamp)
+		{
+			if (scanner.peek() != token_type::array)
+			{
+				scanner.skip_value();
+				return;
+			}
+
+			std::array<std::string_view, 3> level;
+
+			scanner.begin_array();
+			while (scanner.next_element())
+			{
+				if (scanner.peek() != token_type::array)
+				{
+					scanner.skip_value();
+					continue;
+				}
+
+				if (scanner.get_array(level) < level.size())
+					continue;
+
+				const auto price = json_helpers::parse_double(level[0]);
+				const auto volume = json_helpers::parse_double(level[1]);
+				timestamp = std::max(timestamp, parse_timestamp(level[2]));
+
+				if (snapshot)
+				{
+					// the checksum is taken over the levels formatted with the precision of the pair
+					_price_decimals = get_decimals(level[0]);
+					_volume_decimals = get_decimals(level[1]);
+
+					levels.emplace_unsorted(price, volume);
+				}
+				else
+				{
+					levels.update(price, volume);
+				}
+			}
+		}
+
+		static int get_decimals(std::string_view str) noexcept
+		{
+			const auto pos = str.find('.');
+			return (pos == std::string_view::npos) ? 0 : static_cast<int>(str.size() - pos - 1);
+		}
+
+		// CRC32 of the top ten asks and bids, every level is its price and volume with the decimal point and leading zeros removed.
+		std::uint32_t get_checksum() const
+		{
+			auto crc = crc32(0L, Z_NULL, 0);
+
+			const auto add_levels = [this, &crc](const auto & levels)
+			{
+				std::size_t count = 0;
+				for (const auto & level : levels)
+				{
+					if (count++ == checksum_depth)
+						break;
+
+					crc = add_checksum_value(crc, level.price, _price_decimals);
+					crc = add_checksum_value(crc, level.volume, _volume_decimals);
+				}
+			};
+
+			add_levels(asks_price_levels);
+			add_levels(bids_price_levels);
+
+			return static_cast<std::uint32_t>(crc);
+		}
+
+		static uLong add_checksum_value(uLong crc, double value, int decimals)
+		{
+			std::array<char, 64> buffer;
+			const auto result = std::to_chars(buffer.data(), buffer.data() + buffer.size(), value, std::chars_format::fixed, decimals);
+			if (result.ec != std::errc())
+				return crc;
+
+			std::array<char, 64> digits;
+			std::size_t size = 0;
+			for (auto ptr = buffer.data(); ptr != result.ptr; ++ptr)
+			{
+				if (*ptr == '.' || (size == 0 && *ptr == '0'))
+					continue;
+
+				digits[size++] = *ptr;
+			}
+
+			return crc32(crc, reinterpret_cast<const Bytef *>(digits.data()), static_cast<uInt>(size));
+		}
+
+		// [channelID, [[price, volume, time, side, orderType, misc], ...], "trade", pair]
+		void trades_event_handler(const std::vector<std::string_view> & payloads)
+		{
+			std::array<std::string_view, 5> trade;
+
+			for (const auto & payload : payloads)
+			{
+				json_helpers::json_scanner scanner(payload);
+				if (scanner.peek() != token_type::array)
+					continue;
+
+				scanner.begin_array();
+				while (scanner.next_element())
+				{
+					if (scanner.peek() != token_type::array)
+					{
+						scanner.skip_value();
+						continue;
+					}
+
+					if (scanner.get_array(trade) < trade.size())
+						continue;
+
+					// like the REST trades subscriber, only trades of market orders are taken
+					if (trade[4] != "m")
+						continue;
+
+					const auto price = json_helpers::parse_double(trade[0]);
+					const auto volume = json_helpers::parse_double(trade[1]);
+					if (price <= 0 || volume <= 0)
+						continue;
+
+					const auto timestamp = parse_timestamp(trade[2]);
+
+					if (trade[3] == "b")
+					{
+						_trade_handler(_symbol, price, volume, timestamp, market_data_common::taker_deal_type::buy);
+					}
+					else if (trade[3] == "s")
+					{
+						_trade_handler(_symbol, price, volume, timestamp, market_data_common::taker_deal_type::sell);
+					}
+				}
+			}
+		}
+
+		// Seconds with a fraction like 1534614057.321597 to microseconds.
+		static std::uint64_t parse_timestamp(std::string_view str)
+		{
+			const auto pos = str.find('.');
+			const auto seconds_str = str.substr(0, pos);
+
+			std::uint64_t seconds = 0;
+			const auto result = std::from_chars(seconds_str.data(), seconds_str.data() + seconds_str.size(), seconds);
+			if (result.ec != std::errc() || result.ptr != seconds_str.data() + seconds_str.size())
+				throw std::runtime_error("Could not parse timestamp: " + std::string(str));
+
+			std::uint64_t microseconds = 0;
+			if (pos != std::string_view::npos)
+			{
+				const auto fraction = str.substr(pos + 1, 6);
+
+				std::uint64_t multiplier = 100000;
+				for (const auto ch : fraction)
+				{
+					if (ch < '0' || ch > '9')
+						throw std::runtime_error("Could not parse timestamp: " + std::string(str));
+
+					microseconds += (ch - '0') * multiplier;
+					multiplier /= 10;
+				}
+			}
+
+			return seconds * 1000000 + microseconds;
+		}
+
+		static constexpr char book_channel[] = "book";
+		static constexpr char trade_channel[] = "trade";
+		static constexpr std::size_t checksum_depth = 10;
+
+		const market_data_common::trade_handler_t _trade_handler;
+		const std::shared_ptr<kraken_ws_subscriber> _ws_subscriber;
+
+		const std::string _pair;
+		const unsigned int _depth;
+
+		bool _snapshot_received = false;
+		int _price_decimals = 0;
+		int _volume_decimals = 0;
+	};
+} // namespace kraken
@@ -31,8 +31,9 @@ namespace kraken
 			unsigned int order_book_size,
 			const std::chrono::milliseconds & quote_period,
 			const market_data_common::book_handler_t & book_handler,
-			const market_data_common::error_handler_t & error_handler) :
-			order_book_subscriber_base(symbol, book_handler),
+			const market_data_common::error_handler_t & error_handler,
+			const market_data_common::order_book_options & book_options = market_data_common::order_book_options{}) :
+			order_book_subscriber_base("kraken", symbol, book_handler, book_options),
 			_order_book_size(order_book_size),
 			_quote_period(quote_period),
 			_symbol(symbol),
@@ -71,21 +72,18 @@ namespace kraken
 					const auto & orders = _kapi.get_order_book(_symbol, _order_book_size);
 					if (!orders.asks.empty() && !orders.bids.empty())
 					{
-						market_data_common::order_map_t bids;
+						bids_price_levels.clear();
 						for (const auto & bid : orders.bids)
 						{
-							bids.emplace(bid.price, bid.volume);
+							bids_price_levels.insert_or_assign(bid.price, bid.volume);
 						}
 
-						market_data_common::order_map_t asks;
+						asks_price_levels.clear();
 						for (const auto & ask : orders.asks)
 						{
-							asks.emplace(ask.price, ask.volume);
+							asks_price_levels.insert_or_assign(ask.price, ask.volume);
 						}
 
-						asks_price_volume_map = std::move(asks);
-						bids_price_volume_map = std::move(bids);
-
 						handle_order_book_if_consistent();
 					}
 
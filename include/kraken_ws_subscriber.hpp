@@ -0,0 +1,345 @@
+/*
+Market data collector for crypto exchanges.
+https://github.com/ilia-funtov/crypto-market-data-collector
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2022 Ilia Funtov.
+*/
+
+#pragma once
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
+
+#include <ws_subscriber_base.hpp>
+
+#include <nlohmann/json.hpp>
+#include <json_helpers.hpp>
+#include <json_scanner.hpp>
+
+namespace kraken
+{
+	class kraken_ws_subscriber: public websocket_subscriber::websocket_subscriber_base
+	{
+	public:
+		using json = nlohmann::json;
+
+		// Channel messages are arrays [channelID, payload, ..., channelName, pair],
+		// the handler gets the raw texts of the payloads.
+		using event_handler_t = std::function<void(const std::vector<std::string_view> &)>;
+
+		constexpr static char default_api_address[] = "ws.kraken.com";
+		constexpr static unsigned int default_port = 443;
+
+		kraken_ws_subscriber(
+			error_handler_t error_handler,
+			const std::string & api_address = default_api_address,
+			unsigned int port = default_port,
+			const std::shared_ptr<websocket_wrapper::io_thread_pool> & pool = nullptr,
+			const std::shared_ptr<raw_capture::stream> & capture = nullptr,
+			const websocket_subscriber::connection_options & options = websocket_subscriber::connection_options{}) :
+			websocket_subscriber_base(error_handler, api_address, port, "/", pool, capture, options)
+		{
+		}
+
+		kraken_ws_subscriber(websocket_subscriber::replay_mode_t, error_handler_t error_handler) :
+			websocket_subscriber_base(websocket_subscriber::replay_mode, error_handler, default_api_address)
+		{
+		}
+
+		kraken_ws_subscriber(const kraken_ws_subscriber &) = delete;
+		kraken_ws_subscriber & operator =(const kraken_ws_subscriber &) = delete;
+		kraken_ws_subscriber(kraken_ws_subscriber &&) = delete;
+		kraken_ws_subscriber & operator =(kraken_ws_subscriber &&) = delete;
+
+		~kraken_ws_subscriber()
+		{
+			stop();
+		}
+
+		// Pairs are websocket names like XBT/USD, depth is used by the book channel only.
+		void subscribe(
+			const std::string & channel_name,
+			const std::string & pair,
+			unsigned int depth,
+			event_handler_t event_handler)
+		{
+			std::lock_guard<std::mutex> lock(_subscribe_mtx);
+			_subscriptions_requested.emplace(channel_pair_key{ channel_name, pair }, subscribe_info{ depth, event_handler });
+		}
+
+		// After return the event handler is not called anymore.
+		void unsubscribe(const std::string & channel_name, const std::string & pair)
+		{
+			const channel_pair_key key{ channel_name, pair };
+
+			std::lock_guard<std::mutex> lock(_subscribe_mtx);
+			const auto iter = _subscriptions_requested.find(key);
+			if (iter == _subscriptions_requested.end())
+				return;
+
+			if (_active_channels.find(key) != _active_channels.end())
+			{
+				_to_unsubscribe.emplace(key, iter->second.depth);
+			}
+
+			_subscriptions_requested.erase(iter);
+		}
+
+		// Unsubscribes and subscribes the channel again on a watch step run right away, the book channel starts with a new snapshot.
+		// Can be called from the event handler.
+		void resubscribe(const std::string & channel_name, const std::string & pair)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_resubscribe_mtx);
+				_to_resubscribe.insert(channel_pair_key{ channel_name, pair });
+			}
+
+			resubscription_requested();
+		}
+
+	private:
+		struct subscribe_info
+		{
+			unsigned int depth;
+			event_handler_t event_handler;
+		};
+
+		struct channel_pair_key
+		{
+			std::string channel;
+			std::string pair;
+
+			friend inline bool operator < (const channel_pair_key & lhs, const channel_pair_key & rhs)
+			{
+				if (lhs.channel < rhs.channel)
+				{
+					return true;
+				}
+				else if (lhs.channel == rhs.channel)
+				{
+					return lhs.pair < rhs.pair;
+				}
+
+				return false;
+			}
+		};
+
+		void read_handler(std::string_view str) override
+		{
+			using namespace nlohmann;
+
+			json_helpers::json_scanner scanner(str);
+
+			// data messages are scanned in place, only event objects are parsed into json
+			if (scanner.peek() == json_helpers::json_scanner::token_type::array)
+			{
+				if (!is_init_received())
+					return;
+
+				_elements.clear();
+
+				scanner.begin_array();
+				while (scanner.next_element())
+				{
+					_elements.push_back(scanner.skip_value());
+				}
+
+				if (_elements.size() < 4)
+					return;
+
+				const auto pair = unquote(_elements.back());
+				auto channel = unquote(_elements[_elements.size() - 2]);
+
+				// book channels are named like book-10
+				channel = channel.substr(0, channel.find('-'));
+
+				// payloads are between the channel id and the channel name
+				_elements.pop_back();
+				_elements.pop_back();
+				_elements.erase(_elements.begin());
+
+				// handlers are called under the lock, so pairs of one connection can be unsubscribed at any time
+				std::lock_guard<std::mutex> lock(_subscribe_mtx);
+				const auto iter_handler = _subscriptions_requested.find(channel_pair_key{ std::string(channel), std::string(pair) });
+				if (iter_handler != _subscriptions_requested.end())
+				{
+					iter_handler->second.event_handler(_elements);
+				}
+
+				return;
+			}
+
+			json object = json::parse(str.begin(), str.end());
+
+			std::string event_name;
+			if (object.is_object())
+			{
+				json_helpers::read_value(event_name, object, "event");
+			}
+
+			if (event_name == "systemStatus")
+			{
+				std::string status;
+				json_helpers::read_value(status, object, "status");
+				if (status == "online")
+				{
+					init_received();
+				}
+			}
+			else if (event_name == "subscriptionStatus")
+			{
+				update_subscription(object);
+			}
+		}
+
+		void update_subscription(const json & object)
+		{
+			std::string status;
+			json_helpers::read_value(status, object, "status");
+
+			if (status == "error")
+			{
+				std::string error_message;
+				json_helpers::read_value(error_message, object, "errorMessage");
+				throw std::runtime_error("Kraken subscription error: " + error_message);
+			}
+
+			std::string pair;
+			json_helpers::read_value(pair, object, "pair");
+
+			std::string channel;
+			const auto iter_subscription = object.find("subscription");
+			if (iter_subscription != object.end())
+			{
+				json_helpers::read_value(channel, *iter_subscription, "name");
+			}
+
+			if (channel.empty() || pair.empty())
+				return;
+
+			const channel_pair_key key{ channel, pair };
+
+			std::lock_guard<std::mutex> lock(_subscribe_mtx);
+
+			if (status == "subscribed")
+			{
+				_active_channels.insert(key);
+			}
+			else if (status == "unsubscribed")
+			{
+				_active_channels.erase(key);
+			}
+		}
+
+		void subscribe_events() override
+		{
+			resubscribe_events();
+			unsubscribe_events();
+
+			std::vector<std::pair<channel_pair_key, unsigned int>> to_subscribe;
+
+			{
+				std::lock_guard<std::mutex> lock(_subscribe_mtx);
+
+				for (const auto & sr : _subscriptions_requested)
+				{
+					if (_active_channels.find(sr.first) != _active_channels.end())
+						continue;
+
+					to_subscribe.emplace_back(sr.first, sr.second.depth);
+				}
+			}
+
+			for (const auto & s : to_subscribe)
+			{
+				send_subscription("subscribe", s.first, s.second);
+			}
+		}
+
+		void unsubscribe_events()
+		{
+			std::map<channel_pair_key, unsigned int> channels;
+
+			{
+				std::lock_guard<std::mutex> lock(_subscribe_mtx);
+				channels.swap(_to_unsubscribe);
+			}
+
+			for (const auto & channel : channels)
+			{
+				send_subscription("unsubscribe", channel.first, channel.second);
+			}
+		}
+
+		void resubscribe_events()
+		{
+			std::set<channel_pair_key> channels;
+
+			{
+				std::lock_guard<std::mutex> lock(_resubscribe_mtx);
+				channels.swap(_to_resubscribe);
+			}
+
+			std::lock_guard<std::mutex> lock(_subscribe_mtx);
+			for (const auto & key : channels)
+			{
+				const auto iter = _subscriptions_requested.find(key);
+				if (iter != _subscriptions_requested.end() && _active_channels.erase(key) != 0)
+				{
+					_to_unsubscribe.emplace(key, iter->second.depth);
+				}
+			}
+		}
+
+		void send_subscription(const char * event, const channel_pair_key & key, unsigned int depth)
+		{
+			using namespace nlohmann;
+
+			json subscription;
+			subscription["name"] = key.channel;
+			if (depth != 0)
+			{
+				subscription["depth"] = depth;
+			}
+
+			json object;
+			object["event"] = event;
+			object["pair"] = json::array({ key.pair });
+			object["subscription"] = subscription;
+
+			auto message = object.dump();
+			websocket().write(message);
+		}
+
+		void reset_active_channels() override
+		{
+			std::lock_guard<std::mutex> lock(_subscribe_mtx);
+			_active_channels.clear();
+			_to_unsubscribe.clear();
+		}
+
+		static std::string_view unquote(std::string_view str) noexcept
+		{
+			return (str.size() >= 2 && str.front() == '"') ? str.substr(1, str.size() - 2) : str;
+		}
+
+		std::mutex _subscribe_mtx;
+		std::map<channel_pair_key, subscribe_info> _subscriptions_requested;
+		std::set<channel_pair_key> _active_channels;
+		std::map<channel_pair_key, unsigned int> _to_unsubscribe; // with book depth
+
+		std::mutex _resubscribe_mtx; // handlers are called under the subscribe mutex
+		std::set<channel_pair_key> _to_resubscribe;
+
+		std::vector<std::string_view> _elements;
+	};
+} // namespace kraken
@@ -0,0 +1,122 @@
+/*
+Market data collector for crypto exchanges.
+https://github.com/ilia-funtov/crypto-market-data-collector
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2022 Ilia Funtov.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace market_data_common
+{
+	// Lock-free histogram of latencies in microseconds for one writer thread (or a few) and a reporting reader.
+	// Every power of two range is split into four buckets, so quantiles are exact within 25%.
+	class latency_histogram
+	{
+	public:
+		struct summary
+		{
+			std::uint64_t count = 0;
+			std::uint64_t p50 = 0;
+			std::uint64_t p99 = 0;
+			std::uint64_t p999 = 0;
+			std::uint64_t max = 0;
+		};
+
+		latency_histogram() = default;
+
+		latency_histogram(const latency_histogram &) = delete;
+		latency_histogram & operator = (const latency_histogram &) = delete;
+		latency_histogram(latency_histogram &&) = delete;
+		latency_histogram & operator = (latency_histogram &&) = delete;
+
+		void add(std::uint64_t value) noexcept
+		{
+			_buckets[get_bucket(value)].fetch_add(1, std::memory_order_relaxed);
+
+			auto max = _max.load(std::memory_order_relaxed);
+			while (value > max && !_max.compare_exchange_weak(max, value, std::memory_order_relaxed))
+			{
+			}
+		}
+
+		// Quantiles are the upper bounds of their buckets. Values added concurrently may be lost by the reset.
+		summary get_summary(bool reset = false) noexcept
+		{
+			std::array<std::uint64_t, buckets_num> counts;
+
+			summary result;
+			for (std::size_t n = 0; n != buckets_num; ++n)
+			{
+				counts[n] = reset ? _buckets[n].exchange(0, std::memory_order_relaxed) : _buckets[n].load(std::memory_order_relaxed);
+				result.count += counts[n];
+			}
+
+			result.max = reset ? _max.exchange(0, std::memory_order_relaxed) : _max.load(std::memory_order_relaxed);
+
+			if (result.count == 0)
+				return result;
+
+			const auto quantile = [&counts, &result](std::uint64_t per_mille) -> std::uint64_t
+			{
+				const auto rank = (result.count * per_mille + 999) / 1000;
+
+				std::uint64_t total = 0;
+				for (std::size_t n = 0; n != buckets_num; ++n)
+				{
+					total += counts[n];
+					if (total >= rank)
+						return std::min(get_bucket_upper_bound(n), result.max);
+				}
+
+				return result.max;
+			};
+
+			result.p50 = quantile(500);
+			result.p99 = quantile(990);
+			result.p999 = quantile(999);
+
+			return result;
+		}
+
+	private:
+		static constexpr std::size_t sub_buckets_bits = 2;
+		static constexpr std::size_t sub_buckets_num = 1 << sub_buckets_bits;
+		static constexpr std::size_t buckets_num = 64 * sub_buckets_num;
+
+		static std::size_t get_bucket(std::uint64_t value) noexcept
+		{
+			if (value < sub_buckets_num)
+				return static_cast<std::size_t>(value);
+
+			std::size_t msb = 63;
+			while ((value >> msb) == 0)
+			{
+				--msb;
+			}
+
+			const auto sub_bucket = (value >> (msb - sub_buckets_bits)) & (sub_buckets_num - 1);
+			return (msb - sub_buckets_bits + 1) * sub_buckets_num + static_cast<std::size_t>(sub_bucket);
+		}
+
+		static std::uint64_t get_bucket_upper_bound(std::size_t bucket) noexcept
+		{
+			if (bucket < sub_buckets_num)
+				return bucket;
+
+			const auto shift = bucket / sub_buckets_num - 1;
+			const auto sub_bucket = bucket % sub_buckets_num;
+			return ((sub_buckets_num + sub_bucket + 1) << shift) - 1;
+		}
+
+		std::array<std::atomic<std::uint64_t>, buckets_num> _buckets{};
+		std::atomic<std::uint64_t> _max{0};
+	};
+}
@@ -8,12 +8,22 @@ Copyright (c) 2022 Ilia Funtov.
 
 #pragma once
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
 #include <cstdint>
 #include <functional>
 #include <exception>
+#include <limits>
 #include <map>
+#include <stdexcept>
 #include <string>
+#include <vector>
+
+#include <metrics.hpp>
+#include <price_levels.hpp>
 
 namespace market_data_common
 {
@@ -23,12 +33,102 @@ namespace market_data_common
 		sell
 	};
 
-	using order_map_t = std::map<double, double>;
+	enum class book_update_mode : unsigned int
+	{
+		every_update, // book handler is called after every message
+		visible_changes // book handler is called only when top levels within visible depth change
+	};
+
+	// Which book updates passed by the update mode reach the book handler. Skipped updates are merged into the changes of the next handled one.
+	enum class book_sampling_mode : unsigned int
+	{
+		every_update,
+		visible_changes, // a level within the visible depth changed
+		top_of_book, // the best bid or ask price or volume changed
+		interval, // the first update after every tick of the interval, ticks are aligned to the system clock
+		min_move // the best bid or ask price or volume moved by the minimum since the last handled update
+	};
+
+	inline book_sampling_mode get_book_sampling_mode(const std::string & str)
+	{
+		static const std::map<std::string, book_sampling_mode> name_mode = {
+			{ "all", book_sampling_mode::every_update },
+			{ "changes", book_sampling_mode::visible_changes },
+			{ "top", book_sampling_mode::top_of_book },
+			{ "interval", book_sampling_mode::interval },
+			{ "move", book_sampling_mode::min_move }
+		};
+
+		const auto iter = name_mode.find(str);
+		if (iter == name_mode.cend())
+			throw std::runtime_error("Unsupported book sampling mode: " + str);
+
+		return iter->second;
+	}
+
+	struct book_sampling
+	{
+		book_sampling_mode mode = book_sampling_mode::every_update;
+		std::chrono::microseconds interval{0}; // interval mode
+		double min_price_move = 0; // min_move mode, 0 ignores prices
+		double min_volume_move = 0; // min_move mode, 0 ignores volumes
+	};
+
+	struct order_book_options
+	{
+		unsigned int visible_depth = 0; // 0 means that visible levels are not tracked
+		book_update_mode update_mode = book_update_mode::every_update;
+		book_sampling sampling; // modes other than every_update need visible levels
+	};
+
+	struct top_of_book_level
+	{
+		double bid_price;
+		double bid_volume;
+		double ask_price;
+		double ask_volume;
+
+		friend inline bool operator == (const top_of_book_level & lhs, const top_of_book_level & rhs)
+		{
+			return lhs.bid_price == rhs.bid_price && lhs.bid_volume == rhs.bid_volume &&
+				lhs.ask_price == rhs.ask_price && lhs.ask_volume == rhs.ask_volume;
+		}
+
+		friend inline bool operator != (const top_of_book_level & lhs, const top_of_book_level & rhs)
+		{
+			return !(lhs == rhs);
+		}
+	};
+
+	// Visible part of the book and indices of its levels changed since the previous book handler call.
+	// Indices not less than levels.size() denote levels which disappeared from the visible window.
+	struct visible_book_changes
+	{
+		std::vector<top_of_book_level> levels;
+		std::vector<unsigned int> changed_levels;
+	};
+
+	// Microseconds since epoch by the system clock.
+	inline std::uint64_t get_current_timestamp()
+	{
+		const auto time = std::chrono::system_clock::now().time_since_epoch();
+		return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(time).count());
+	}
+
+	// Times of a book update in microseconds since epoch, zero when unknown.
+	struct event_timestamps
+	{
+		std::uint64_t exchange = 0; // event time sent by the exchange
+		std::uint64_t received = 0; // the message was read from the socket
+		std::uint64_t processed = 0; // the message was parsed and the book was updated
+	};
 
 	using book_handler_t = std::function<void(
 		const std::string & symbol,
-		const order_map_t & asks,
-		const order_map_t & bids)>;
+		const ask_levels_t & asks,
+		const bid_levels_t & bids,
+		const visible_book_changes & changes,
+		const event_timestamps & timestamps)>;
 
 	using trade_handler_t = std::function<void(
 		const std::string & symbol,
@@ -42,14 +142,36 @@ namespace market_data_common
 	class order_book_subscriber_base
 	{
 	public:
+		// The feed name labels metrics of the book.
 		order_book_subscriber_base(
+			const std::string & feed_name,
 			const std::string & symbol,
-			const book_handler_t & book_handler) :
+			const book_handler_t & book_handler,
+			const order_book_options & book_options) :
 			_symbol(symbol),
-			_book_handler(book_handler)
+			_book_handler(book_handler),
+			_book_options(book_options),
+			_book_updates(metrics::registry::instance().get_counter(
+				"md_book_updates_total",
+				"Order book updates passed to the book handler.",
+				metrics::labels_t{ { "feed", feed_name }, { "symbol", symbol } })),
+			_inconsistent_books(metrics::registry::instance().get_counter(
+				"md_book_inconsistencies_total",
+				"Order books found inconsistent (crossed, empty side, bad checksum) and requested again.",
+				metrics::labels_t{ { "feed", feed_name }, { "symbol", symbol } })),
+			_sampled_out(metrics::registry::instance().get_counter(
+				"md_book_updates_sampled_out_total",
+				"Order book updates skipped by the sampling mode of the feed.",
+				metrics::labels_t{ { "feed", feed_name }, { "symbol", symbol } }))
 		{
 			assert(!_symbol.empty());
 			assert(_book_handler);
+			assert(_book_options.visible_depth != 0 || _book_options.update_mode == book_update_mode::every_update);
+			assert(_book_options.visible_depth != 0 || _book_options.sampling.mode == book_sampling_mode::every_update);
+			assert(_book_options.sampling.mode != book_sampling_mode::interval || _book_options.sampling.interval.count() > 0);
+
+			_visible_changes.levels.reserve(_book_options.visible_depth);
+			_visible_changes.changed_levels.reserve(_book_options.visible_depth);
 		}
 	
 		order_book_subscriber_base(const order_book_subscriber_base &) = delete;
@@ -59,7 +181,7 @@ namespace market_data_common
 
 		virtual ~order_book_subscriber_base() {}
 	protected:
-		bool handle_order_book_if_consistent() const
+		bool handle_order_book_if_consistent()
 		{
 			if (is_order_book_consistent())
 			{
@@ -67,18 +189,25 @@ namespace market_data_common
 				return true;
 			}
 
+			book_inconsistent();
 			return false;
 		}
 
+		// For checks of subscribers like checksums, handle_order_book_if_consistent() counts its own failures.
+		void book_inconsistent() noexcept
+		{
+			_inconsistent_books->add();
+		}
+
 		bool is_order_book_consistent() const
 		{
 			double best_bid = 0, best_ask = 0;
 
-			if (!asks_price_volume_map.empty())
-				best_ask = asks_price_volume_map.cbegin()->first;
+			if (!asks_price_levels.empty())
+				best_ask = asks_price_levels.best().price;
 
-			if (!bids_price_volume_map.empty())
-				best_bid = bids_price_volume_map.crbegin()->first;
+			if (!bids_price_levels.empty())
+				best_bid = bids_price_levels.best().price;
 
 			if (best_bid <= 0 || best_ask <= 0 || best_bid > best_ask)
 			{
@@ -88,16 +217,145 @@ namespace market_data_common
 			return true;
 		}
 
-		void handle_order_book() const
+		void handle_order_book()
 		{
-			_book_handler(_symbol, asks_price_volume_map, bids_price_volume_map);
+			if (_book_options.visible_depth != 0)
+			{
+				update_visible_levels();
+
+				if (_book_options.update_mode == book_update_mode::visible_changes && _visible_changes.changed_levels.empty())
+					return;
+			}
+
+			const auto now = get_current_timestamp();
+
+			if (_book_options.sampling.mode != book_sampling_mode::every_update)
+			{
+				_sampling_pending = !is_sampled(now);
+				if (_sampling_pending)
+				{
+					_sampled_out->add();
+					return;
+				}
+
+				if (!_visible_changes.levels.empty())
+					_sampled_top = _visible_changes.levels.front();
+
+				_sampled_tick = now / static_cast<std::uint64_t>(std::max<std::int64_t>(_book_options.sampling.interval.count(), 1));
+			}
+
+			_timestamps.processed = now;
+			_book_updates->add();
+
+			_book_handler(_symbol, asks_price_levels, bids_price_levels, _visible_changes, _timestamps);
+		}
+
+		// Subscribers set the times of the message before handling the book.
+		void set_event_timestamps(std::uint64_t received, std::uint64_t exchange = 0) noexcept
+		{
+			_timestamps.received = received;
+			_timestamps.exchange = exchange;
 		}
 
 		const std::string _symbol;
 
-		order_map_t asks_price_volume_map;
-		order_map_t bids_price_volume_map;
+		ask_levels_t asks_price_levels;
+		bid_levels_t bids_price_levels;
 
 		const book_handler_t _book_handler;
+		const order_book_options _book_options;
+
+	private:
+		// Changes since the last handled update are in the visible changes.
+		bool is_sampled(std::uint64_t now) const
+		{
+			const auto & sampling = _book_options.sampling;
+			const auto & changes = _visible_changes;
+
+			switch (sampling.mode)
+			{
+			case book_sampling_mode::every_update:
+				return true;
+			case book_sampling_mode::visible_changes:
+				return !changes.changed_levels.empty();
+			case book_sampling_mode::top_of_book:
+				return !changes.changed_levels.empty() && changes.changed_levels.front() == 0;
+			case book_sampling_mode::interval:
+				return now / static_cast<std::uint64_t>(sampling.interval.count()) != _sampled_tick;
+			case book_sampling_mode::min_move:
+			{
+				if (changes.levels.empty() || _sampled_tick == no_tick)
+					return !changes.changed_levels.empty() && changes.changed_levels.front() == 0;
+
+				const auto & top = changes.levels.front();
+				const auto moved = [](double value, double previous, double min_move)
+				{
+					return min_move > 0 && std::abs(value - previous) >= min_move;
+				};
+
+				return moved(top.bid_price, _sampled_top.bid_price, sampling.min_price_move) ||
+					moved(top.ask_price, _sampled_top.ask_price, sampling.min_price_move) ||
+					moved(top.bid_volume, _sampled_top.bid_volume, sampling.min_volume_move) ||
+					moved(top.ask_volume, _sampled_top.ask_volume, sampling.min_volume_move);
+			}
+			}
+
+			return true;
+		}
+
+		void update_visible_levels()
+		{
+			auto & levels = _visible_changes.levels;
+			auto & changed_levels = _visible_changes.changed_levels;
+
+			// changes of skipped updates are kept for the next handled one, so deltas stay complete
+			const auto merge_changes = _sampling_pending && !changed_levels.empty();
+			if (!merge_changes)
+				changed_levels.clear();
+
+			const auto previous_size = levels.size();
+			const auto size = std::min<std::size_t>(
+				_book_options.visible_depth,
+				std::min(asks_price_levels.size(), bids_price_levels.size()));
+
+			levels.resize(size);
+
+			auto iter_bid = bids_price_levels.cbegin();
+			auto iter_ask = asks_price_levels.cbegin();
+			for (unsigned int n = 0; n != size; ++n, ++iter_bid, ++iter_ask)
+			{
+				const top_of_book_level level{ iter_bid->price, iter_bid->volume, iter_ask->price, iter_ask->volume };
+				if (n >= previous_size || levels[n] != level)
+				{
+					levels[n] = level;
+					changed_levels.push_back(n);
+				}
+			}
+
+			for (auto n = size; n < previous_size; ++n)
+			{
+				changed_levels.push_back(static_cast<unsigned int>(n));
+			}
+
+			if (merge_changes)
+			{
+				std::sort(changed_levels.begin(), changed_levels.end());
+				changed_levels.erase(std::unique(changed_levels.begin(), changed_levels.end()), changed_levels.end());
+			}
+		}
+
+		static constexpr std::uint64_t no_tick = std::numeric_limits<std::uint64_t>::max();
+
+		visible_book_changes _visible_changes;
+		event_timestamps _timestamps;
+
+		// sampling state of the last handled update
+		bool _sampling_pending = false;
+		top_of_book_level _sampled_top{};
+		std::uint64_t _sampled_tick = no_tick;
+
+		const std::shared_ptr<metrics::counter> _book_updates;
+		const std::shared_ptr<metrics::counter> _inconsistent_books;
+		const std::shared_ptr<metrics::counter> _sampled_out;
 	};
 }
\ No newline at end of file
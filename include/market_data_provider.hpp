@@ -11,24 +11,32 @@ Copyright (c) 2022 Ilia Funtov.
 #include <algorithm>
 #include <atomic>
 #include <cassert>
-#include <condition_variable>
 #include <chrono>
-#include <cstdio>
 #include <filesystem>
 #include <functional>
 #include <iterator>
-#include <iomanip>
 #include <string>
 #include <thread>
 #include <memory>
 #include <map>
 #include <mutex>
+#include <optional>
 #include <set>
-#include <sstream>
 #include <stdexcept>
-#include <queue>
+#include <type_traits>
+#include <vector>
 
 #include <market_data_common.hpp>
+#include <consolidated_book.hpp>
+#include <dump_writer.hpp>
+#include <fixed_vector.hpp>
+#include <latency_histogram.hpp>
+#include <metrics.hpp>
+#include <multicast_feed.hpp>
+#include <raw_capture.hpp>
+#include <shm_feed.hpp>
+#include <spsc_ring.hpp>
+#include <trade_bars.hpp>
 #include <coinbase_market_data_subscriber.hpp>
 #include <bitfinex_market_data_subscriber.hpp>
 #include <kraken_market_data_subscriber.hpp>
@@ -36,18 +44,6 @@ Copyright (c) 2022 Ilia Funtov.
 
 namespace market_data
 {
-	namespace details
-	{
-		template <typename T, auto fn>
-		struct deleter
-		{
-			void operator()(T *ptr)
-			{
-				fn(ptr);
-			}
-		};
-	}
-
 	enum class exchange_type : unsigned int
 	{
 		bitfinex,
@@ -99,10 +95,31 @@ namespace market_data
 		return iter->second;
 	}
 
+	inline std::string get_book_sampling_name(const market_data_common::book_sampling & sampling)
+	{
+		switch (sampling.mode)
+		{
+		case market_data_common::book_sampling_mode::every_update:
+			return "all";
+		case market_data_common::book_sampling_mode::visible_changes:
+			return "changes";
+		case market_data_common::book_sampling_mode::top_of_book:
+			return "top";
+		case market_data_common::book_sampling_mode::interval:
+			return "interval " + std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(sampling.interval).count()) + " ms";
+		case market_data_common::book_sampling_mode::min_move:
+			return "move (price " + std::to_string(sampling.min_price_move) + ", volume " + std::to_string(sampling.min_volume_move) + ")";
+		}
+
+		assert(false);
+		return "";
+	}
+
 	struct source_symbol_description
 	{
 		std::string symbol_name; // like BTC-USD
 		unsigned int order_book_size;
+		market_data_common::book_sampling sampling; // of book updates passed to the provider
 	};
 
 	struct general_symbol_description
@@ -112,13 +129,68 @@ namespace market_data
 		unsigned int price_levels_num;
 	};
 
+	enum class prices_dump_mode : unsigned int
+	{
+		every_update, // snapshot of visible levels after every book update
+		on_change, // snapshot of visible levels only when they change
+		delta // only changed visible levels, preceded by a snapshot in every block file
+	};
+
+	inline prices_dump_mode get_prices_dump_mode(const std::string & str)
+	{
+		static const std::map<std::string, prices_dump_mode> name_mode = {
+			{ "all", prices_dump_mode::every_update },
+			{ "changes", prices_dump_mode::on_change },
+			{ "delta", prices_dump_mode::delta }
+		};
+
+		const auto iter = name_mode.find(str);
+		if (iter == name_mode.cend())
+			throw std::runtime_error("Unsupported prices dump mode: " + str);
+
+		return iter->second;
+	}
+
+	// Normalized books and trades published by the publisher thread of a provider, so slow consumers do not stall the feeds.
+	struct publish_options
+	{
+		std::string shm_prefix; // the shared memory feed of a symbol is /<prefix>_<symbol>, none when empty
+		std::uint32_t shm_slots = 65536;
+		std::optional<boost::asio::ip::udp::endpoint> multicast;
+		unsigned int multicast_ttl = 1;
+
+		bool enabled() const noexcept
+		{
+			return !shm_prefix.empty() || multicast.has_value();
+		}
+	};
+
+	struct dump_options
+	{
+		prices_dump_mode prices_mode = prices_dump_mode::every_update;
+		std::size_t queue_capacity = 16384; // records per exchange and stream
+		lock_free::overflow_policy queue_overflow = lock_free::overflow_policy::block;
+		dump_writer::flush_options flush;
+		dump_writer::file_format format = dump_writer::file_format::csv; // in binary format prices are always snapshots
+		bool event_timestamps = false; // exchange and receive times in csv price records, binary records always have them
+		bool consolidated_book = false; // the book merged from all exchanges is dumped to its own stream
+		std::vector<std::chrono::seconds> bar_intervals; // trade bars dumped to their own stream, none when empty
+		std::chrono::milliseconds bar_close_delay{1000}; // wait for late trades of other exchanges before a bar is written
+		std::chrono::milliseconds bar_max_clock_skew{60000}; // trades further ahead of the host clock are not in bars, 0 takes all
+		// Streams of book states which keep only the latest pending record per exchange when the dump falls behind,
+		// trades are never conflated.
+		bool conflate_prices = false;
+		bool conflate_consolidated = false;
+		publish_options publish;
+	};
+
 	struct market_data_subscriber
 	{
 		std::function<void(
 			exchange_type,
 			const std::string &,
-			const market_data_common::order_map_t &,
-			const market_data_common::order_map_t &,
+			const market_data_common::ask_levels_t &,
+			const market_data_common::bid_levels_t &,
 			std::uint64_t)> order_book_subscriber;
 
 		std::function<void(
@@ -128,25 +200,240 @@ namespace market_data
 			double,
 			std::uint64_t,
 			market_data_common::taker_deal_type)> trade_subscriber;
+
+		// Called from the consolidation thread when the merged top levels change, level sources are bits of exchange_type values.
+		std::function<void(
+			const std::string &,
+			const market_data_common::consolidated_book &,
+			std::uint64_t)> consolidated_book_subscriber;
 	};
 
+	// Websocket connections shared by providers of different symbols, one per exchange
+	// (several for bitfinex, which limits the number of channels per connection).
 	template <typename logger_t>
+	class feed_connections
+	{
+	public:
+		// Without a pool every connection runs in its own threads.
+		// With a capture writer every connection records its messages to a stream of the capture.
+		explicit feed_connections(
+			logger_t logger,
+			const std::shared_ptr<websocket_wrapper::io_thread_pool> & pool = nullptr,
+			const std::shared_ptr<raw_capture::writer> & capture = nullptr,
+			const websocket_subscriber::connection_options & options = websocket_subscriber::connection_options{}) :
+			_logger(logger),
+			_pool(pool),
+			_capture(capture),
+			_options(options)
+		{
+		}
+
+		// Connections do not connect and get captured messages through replay_message().
+		feed_connections(logger_t logger, websocket_subscriber::replay_mode_t) :
+			_logger(logger),
+			_replay(true)
+		{
+		}
+
+		feed_connections(const feed_connections &) = delete;
+		feed_connections & operator = (const feed_connections &) = delete;
+		feed_connections(feed_connections &&) = delete;
+		feed_connections & operator = (feed_connections &&) = delete;
+
+		std::shared_ptr<coinbase::coinbase_ws_subscriber> get_coinbase()
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+
+			if (!_coinbase)
+			{
+				_coinbase = make_connection<coinbase::coinbase_ws_subscriber>(exchange_type::coinbase);
+			}
+
+			return _coinbase;
+		}
+
+		// Returns a connection with room for the given number of channels.
+		std::shared_ptr<bitfinex::bitfinex_ws_subscriber> get_bitfinex(std::size_t subscriptions_count)
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+
+			for (auto & connection : _bitfinex)
+			{
+				if (connection.first + subscriptions_count <= bitfinex::bitfinex_ws_subscriber::max_subscriptions)
+				{
+					connection.first += subscriptions_count;
+					return connection.second;
+				}
+			}
+
+			_bitfinex.emplace_back(subscriptions_count, make_connection<bitfinex::bitfinex_ws_subscriber>(exchange_type::bitfinex));
+
+			return _bitfinex.back().second;
+		}
+
+		std::shared_ptr<kraken::kraken_ws_subscriber> get_kraken()
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+
+			if (!_kraken)
+			{
+				_kraken = make_connection<kraken::kraken_ws_subscriber>(exchange_type::kraken);
+			}
+
+			return _kraken;
+		}
+
+		std::shared_ptr<bitmex::bitmex_ws_subscriber> get_bitmex()
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+
+			if (!_bitmex)
+			{
+				_bitmex = make_connection<bitmex::bitmex_ws_subscriber>(exchange_type::bitmex);
+			}
+
+			return _bitmex;
+		}
+
+		// Connections of the exchange in the order they were created, which is the order of their capture streams
+		// when the same symbols are collected.
+		std::vector<std::shared_ptr<websocket_subscriber::websocket_subscriber_base>> get_connections(exchange_type exchange)
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+
+			const auto iter = _connections.find(exchange);
+			return (iter != _connections.end()) ? iter->second : std::vector<std::shared_ptr<websocket_subscriber::websocket_subscriber_base>>{};
+		}
+
+	private:
+		template <typename subscriber_t>
+		std::shared_ptr<subscriber_t> make_connection(exchange_type exchange)
+		{
+			const auto connection_error_handler = [this, exchange](const std::exception & exc) { error_handler(exchange, exc); };
+
+			std::shared_ptr<subscriber_t> connection;
+			if (_replay)
+			{
+				connection = std::make_shared<subscriber_t>(websocket_subscriber::replay_mode, connection_error_handler);
+			}
+			else
+			{
+				connection = std::make_shared<subscriber_t>(
+					connection_error_handler,
+					subscriber_t::default_api_address,
+					subscriber_t::default_port,
+					_pool,
+					_capture ? _capture->add_stream(get_exchange_name(exchange)) : nullptr,
+					_options);
+			}
+
+			_connections[exchange].push_back(connection);
+			return connection;
+		}
+
+		void error_handler(exchange_type exchange, const std::exception & exc)
+		{
+			LOG_ERROR(_logger) << get_exchange_name(exchange) << ": " << exc.what();
+		}
+
+		logger_t _logger;
+		const std::shared_ptr<websocket_wrapper::io_thread_pool> _pool;
+		const std::shared_ptr<raw_capture::writer> _capture;
+		const websocket_subscriber::connection_options _options;
+		const bool _replay = false;
+
+		std::mutex _mtx;
+		std::shared_ptr<coinbase::coinbase_ws_subscriber> _coinbase;
+		std::vector<std::pair<std::size_t, std::shared_ptr<bitfinex::bitfinex_ws_subscriber>>> _bitfinex; // channels taken, connection
+		std::shared_ptr<kraken::kraken_ws_subscriber> _kraken;
+		std::shared_ptr<bitmex::bitmex_ws_subscriber> _bitmex;
+		std::map<exchange_type, std::vector<std::shared_ptr<websocket_subscriber::websocket_subscriber_base>>> _connections;
+	};
+
+	// Calls the function with std::integral_constant of the depth when providers have a fixed depth for it
+	// (1, 5, 10 and 25 levels), with zero otherwise. The depths are instantiated once each, other depths take the dynamic path.
+	template <typename function_t>
+	decltype(auto) visit_fixed_depth(unsigned int depth, function_t && function)
+	{
+		switch (depth)
+		{
+		case 1:
+			return function(std::integral_constant<unsigned int, 1>{});
+		case 5:
+			return function(std::integral_constant<unsigned int, 5>{});
+		case 10:
+			return function(std::integral_constant<unsigned int, 10>{});
+		case 25:
+			return function(std::integral_constant<unsigned int, 25>{});
+		default:
+			return function(std::integral_constant<unsigned int, 0>{});
+		}
+	}
+
+	// Market data of a symbol. With a fixed depth the depth of the symbol must be the same,
+	// the records take their levels inline and the writers loop over a depth known at compile time.
+	// Zero means any depth, with records keeping their levels in vectors reserved once.
+	template <typename logger_t, unsigned int fixed_depth = 0>
 	class market_data_provider
 	{
 	public:
 		market_data_provider(
 			logger_t logger,
 			const general_symbol_description & symbol_description,
-			const market_data_subscriber & subscriber = market_data_subscriber{}) :
+			const market_data_subscriber & subscriber = market_data_subscriber{},
+			const dump_options & options = dump_options{},
+			const std::shared_ptr<feed_connections<logger_t>> & connections = nullptr) :
 			_symbol_description(symbol_description),
 			_subscriber(subscriber),
-			_logger(logger)
+			_options(options),
+			_logger(logger),
+			_connections(connections ? connections : std::make_shared<feed_connections<logger_t>>(logger)),
+			_trades_channel(
+				get_exchanges(symbol_description),
+				options.queue_capacity,
+				options.queue_overflow),
+			_prices_channel(
+				get_exchanges(symbol_description),
+				options.queue_capacity,
+				options.conflate_prices ? lock_free::overflow_policy::conflate : options.queue_overflow,
+				[this](price_dump_record & record) { init_price_record(record); }),
+			_consolidate(options.consolidated_book || subscriber.consolidated_book_subscriber),
+			_books_channel(
+				get_exchanges(symbol_description),
+				options.queue_capacity,
+				options.conflate_consolidated ? lock_free::overflow_policy::conflate : options.queue_overflow,
+				[this](book_record & record) { init_book_record(record); }),
+			_publish(options.publish.enabled()),
+			_publish_channel(
+				get_exchanges(symbol_description),
+				_publish ? options.queue_capacity : 1,
+				options.queue_overflow,
+				[this](publish_record & record) { init_publish_record(record); })
 		{			
+			if (fixed_depth != 0 && _symbol_description.price_levels_num != fixed_depth)
+				throw std::invalid_argument("Depth of symbol " + symbol_description.symbol_name + " differs from the fixed depth of its provider.");
+
 			LOG_INFO(_logger) << "Adding market data feeds for symbol: " << symbol_description.symbol_name;
 
+			if (_publish)
+			{
+				create_publishers();
+			}
+
+			market_data_common::order_book_options book_options;
+			book_options.visible_depth = _symbol_description.price_levels_num;
+			// an external book subscriber gets every update, order_book_handler() passes on only visible changes of the other modes
+			book_options.update_mode = (_options.prices_mode == prices_dump_mode::every_update || _subscriber.order_book_subscriber) ?
+				market_data_common::book_update_mode::every_update : market_data_common::book_update_mode::visible_changes;
+
 			const auto & exchanges = _symbol_description.source_exchanges;
 			for (auto iter = exchanges.cbegin(); iter != exchanges.cend(); ++iter)
 			{
+				_latency.try_emplace(iter->first);
+
+				// sampled out updates stay in the subscriber, they never take a dump record
+				book_options.sampling = iter->second.sampling;
+
 				switch (iter->first)
 				{
 				case exchange_type::coinbase:
@@ -154,7 +441,8 @@ namespace market_data
 						iter->second.symbol_name,
 						[this](const auto & ...args) { order_book_handler(exchange_type::coinbase, args...); },
 						[this](const auto & ...args) { trade_handler(exchange_type::coinbase, args...); },
-						[this](const auto & ...args) { error_handler(exchange_type::coinbase, args...); });
+						_connections->get_coinbase(),
+						book_options);
 					break;
 				case exchange_type::bitfinex:
 					_bitfinex_subscriber = std::make_unique<bitfinex::bitfinex_market_data_subscriber>(
@@ -162,27 +450,40 @@ namespace market_data
 						iter->second.order_book_size,
 						[this](const auto & ...args) { order_book_handler(exchange_type::bitfinex, args...); },
 						[this](const auto & ...args) { trade_handler(exchange_type::bitfinex, args...); },
-						[this](const auto & ...args) { error_handler(exchange_type::bitfinex, args...); });
+						_connections->get_bitfinex(bitfinex::bitfinex_market_data_subscriber::subscriptions_count),
+						book_options);
 					break;
 				case exchange_type::kraken:
 					_kraken_subscriber = std::make_unique<kraken::kraken_market_data_subscriber>(
 						iter->second.symbol_name,
 						iter->second.order_book_size,
-						std::chrono::milliseconds(1000),
 						[this](const auto & ...args) { order_book_handler(exchange_type::kraken, args...); },
 						[this](const auto & ...args) { trade_handler(exchange_type::kraken, args...); },
-						[this](const auto & ...args) { error_handler(exchange_type::kraken, args...); });
+						_connections->get_kraken(),
+						book_options);
 					break;
 				case exchange_type::bitmex:
 					_bitmex_subscriber = std::make_unique<bitmex::bitmex_market_data_subscriber>(
 						iter->second.symbol_name,
 						[this](const auto & ...args) { order_book_handler(exchange_type::bitmex, args...); },
 						[this](const auto & ...args) { trade_handler(exchange_type::bitmex, args...); },
-						[this](const auto & ...args) { error_handler(exchange_type::bitmex, args...); });
+						_connections->get_bitmex(),
+						book_options);
 					break;
 				}
 
-				LOG_INFO(_logger) << get_exchange_name(iter->first) << " added as a market data feed: source symbol=" << iter->second.symbol_name << ", depth=" << iter->second.order_book_size;
+				LOG_INFO(_logger) << get_exchange_name(iter->first) << " added as a market data feed: source symbol=" << iter->second.symbol_name << ", depth=" << iter->second.order_book_size
+					<< ", sampling=" << get_book_sampling_name(iter->second.sampling);
+			}
+
+			if (_consolidate)
+			{
+				_consolidation_thread = std::thread([this] { consolidation_loop(); });
+			}
+
+			if (_publish)
+			{
+				_publish_thread = std::thread([this] { publish_loop(); });
 			}
 		}
 
@@ -191,26 +492,49 @@ namespace market_data
 		market_data_provider(market_data_provider &&) = delete;
 		market_data_provider& operator = (market_data_provider &&) = delete;
 
+		// Without a shutdown before, the dump threads stop at once and drop the queued records.
 		~market_data_provider()
 		{
-			{
-				std::lock_guard<std::mutex> lock(_trades_dump_queue_mtx);
-				_stop_dumping = true;
-				_trades_dump_queue_var.notify_one();
-			}
-
-			{
-				std::lock_guard<std::mutex> lock(_prices_dump_queue_mtx);
-				_prices_dump_queue_var.notify_one();
-			}
+			shutdown(std::chrono::steady_clock::now());
 
 			if (_trades_dump_queue_thread.joinable())
 				_trades_dump_queue_thread.join();
 
 			if (_prices_dump_queue_thread.joinable())
 				_prices_dump_queue_thread.join();
+
+			if (_consolidation_thread.joinable())
+				_consolidation_thread.join();
+
+			if (_publish_thread.joinable())
+				_publish_thread.join();
+		}
+
+		// Stops taking feed messages, the dump threads write the queued records until the deadline and close their files.
+		// Does not wait for them (the destructor does), so several providers drain in parallel.
+		void shutdown(std::chrono::steady_clock::time_point deadline)
+		{
+			if (_stopping.exchange(true))
+				return;
+
+			_drain_deadline = deadline.time_since_epoch().count();
+			_stop_dumping = true;
+
+			_trades_channel.close();
+			_trades_channel.notify();
+
+			_prices_channel.close();
+			_prices_channel.notify();
+
+			_books_channel.close();
+			_books_channel.notify();
+
+			_publish_channel.close();
+			_publish_channel.notify();
 		}
 
+		// The consolidation thread runs from the constructor and reads the dump settings once it sees dumping enabled,
+		// so the settings are written once, before the release store of the flag.
 		void set_dump_quotes(bool enabled, const std::string & path, unsigned int block_duration)
 		{			
 			assert(block_duration != 0);
@@ -220,29 +544,76 @@ namespace market_data
 				throw std::invalid_argument("Dump path is not defined.");
 			}
 
+			if (enabled && _dump_configured)
+			{
+				throw std::logic_error("Market data dumping is already configured.");
+			}
+
 			LOG_INFO(_logger) << "Configuration for market data dumping: enabled=" << enabled << ", path=" << path << ", block duration(minutes)=" << block_duration;
 
+			if (!enabled)
+			{
+				// queued records are still written with the settings they were dumped with
+				_dump_quotes.store(false, std::memory_order_release);
+				return;
+			}
+
 			_dump_path = path;
-			_dump_quotes = enabled;
 			_block_duration = std::chrono::minutes(block_duration);
+			_dump_start = std::chrono::system_clock::now();
+			_dump_configured = true;
+			_dump_quotes.store(true, std::memory_order_release);
 
-			if (enabled)
+			if (!_trades_dump_queue_thread.joinable())
 			{
-				_dump_start = std::chrono::system_clock::now();
-
-				if (!_trades_dump_queue_thread.joinable())
-				{
-					_trades_dump_queue_thread = std::thread([this] { trades_dump_loop(); });
-				}
+				_trades_dump_queue_thread = std::thread([this] { trades_dump_loop(); });
+			}
 
-				if (!_prices_dump_queue_thread.joinable())
-				{
-					_prices_dump_queue_thread = std::thread([this] { prices_dump_loop(); });
-				}
+			if (!_prices_dump_queue_thread.joinable())
+			{
+				_prices_dump_queue_thread = std::thread([this] { prices_dump_loop(); });
 			}
-			else
+		}
+
+		std::uint64_t get_dropped_trades() const noexcept
+		{
+			return _trades_channel.dropped();
+		}
+
+		std::uint64_t get_dropped_prices() const noexcept
+		{
+			return _prices_channel.dropped();
+		}
+
+		// Price records overwritten by newer ones in conflating queues.
+		std::uint64_t get_conflated_prices() const noexcept
+		{
+			return _prices_channel.conflated();
+		}
+
+		// Records waiting for the dump threads.
+		std::size_t get_queued_records() const noexcept
+		{
+			return _trades_channel.size() + _prices_channel.size() + _books_channel.size() + _publish_channel.size();
+		}
+
+		// Logs latency quantiles of order book events collected since the previous report.
+		void report_latency()
+		{
+			for (auto & exchange_latency : _latency)
 			{
-				_dump_start = std::chrono::system_clock::time_point();
+				const auto wire_to_callback = exchange_latency.second.wire_to_callback.get_summary(true);
+				if (wire_to_callback.count == 0)
+					continue;
+
+				const auto exchange_to_receive = exchange_latency.second.exchange_to_receive.get_summary(true);
+
+				LOG_INFO(_logger) << get_exchange_name(exchange_latency.first) << " " << _symbol_description.symbol_name <<
+					" book events=" << wire_to_callback.count <<
+					", receive to callback(mcs) p50=" << wire_to_callback.p50 << " p99=" << wire_to_callback.p99 <<
+					" p999=" << wire_to_callback.p999 << " max=" << wire_to_callback.max <<
+					", exchange to receive(mcs) p50=" << exchange_to_receive.p50 << " p99=" << exchange_to_receive.p99 <<
+					" p999=" << exchange_to_receive.p999 << " max=" << exchange_to_receive.max;
 			}
 		}
 
@@ -254,6 +625,13 @@ namespace market_data
 		};
 
 		using timestamp_type = std::int64_t;
+
+		struct exchange_latency
+		{
+			market_data_common::latency_histogram wire_to_callback;
+			market_data_common::latency_histogram exchange_to_receive; // clocks of the exchange and the host are not in sync
+		};
+
 		struct trade_dump_record
 		{
 			exchange_type exchange;
@@ -263,185 +641,968 @@ namespace market_data
 			market_data_common::taker_deal_type side;
 		};
 
+		// bid, ask, bid, ask... of the visible levels
+		using price_levels_t = market_data_common::level_vector<std::pair<double, double>, fixed_depth * 2>;
+
 		struct price_dump_record
 		{
 			exchange_type exchange;
 			timestamp_type timestamp;
-			std::vector<std::pair<double, double>> prices;
+			timestamp_type exchange_timestamp;
+			timestamp_type receive_timestamp;
+			price_levels_t prices;
+			market_data_common::level_vector<unsigned int, fixed_depth> changed_levels; // used in delta mode only
 		};
 
-		using file_handle = std::unique_ptr<FILE, details::deleter<FILE, fclose>>;
+		// Visible levels of an exchange book for the consolidation thread.
+		struct book_record
+		{
+			exchange_type exchange;
+			timestamp_type timestamp;
+			timestamp_type exchange_timestamp;
+			timestamp_type receive_timestamp;
+			market_data_common::level_vector<market_data_common::top_of_book_level, fixed_depth> levels;
+		};
 
-		void trades_dump_loop()
+		// Book or trade for the publisher thread.
+		struct publish_record
 		{
-			file_handle file;
-			
-			try
+			binary_format::record_type type;
+			exchange_type exchange;
+			timestamp_type timestamp;
+			timestamp_type exchange_timestamp; // books only
+			timestamp_type receive_timestamp; // books only
+			price_levels_t prices; // books only
+			double price; // trades only
+			double volume; // trades only
+			market_data_common::taker_deal_type side; // trades only
+		};
+
+		// Exchange id of records of all exchanges (consolidated book, bars) in binary dump files.
+		static constexpr std::uint8_t all_exchanges_id = 0xff;
+
+		static constexpr unsigned int dump_batch_size = 256;
+
+		// Records of all exchanges leave the dump channels in time order, see spsc_channel::pop_ordered().
+		struct record_timestamp
+		{
+			template <typename record_t>
+			timestamp_type operator()(const record_t & record) const noexcept
 			{
-				namespace fs = std::filesystem;
-				fs::path path(_dump_path);				
-				path /= "trades";
-				if (!fs::exists(path))
-				{
-					fs::create_directories(path);
-				}
+				return record.timestamp;
+			}
+		};
+		static constexpr std::chrono::milliseconds dump_wait_timeout{100};
 
-				unsigned int block_index = 0;
+		class dropped_records_reporter
+		{
+		public:
+			explicit dropped_records_reporter(const char * stream_name) : _stream_name(stream_name)
+			{
+			}
 
-				while (!_stop_dumping)
-				{
-					trade_dump_record trade_record;
+			void report(logger_t & logger, std::uint64_t dropped)
+			{
+				if (dropped == _reported)
+					return;
 
-					{
-						std::unique_lock<std::mutex> lock(_trades_dump_queue_mtx);
-						_trades_dump_queue_var.wait(
-							lock,
-							[this] { return _stop_dumping.load() || !_dump_queue_trades.empty(); });
+				const auto now = std::chrono::steady_clock::now();
+				if (now - _report_time < report_period)
+					return;
 
-						if (_stop_dumping)
-							break;
+				LOG_WARNING(logger) << "Dump queue for " << _stream_name << " is overloaded: " <<
+					(dropped - _reported) << " record(s) dropped, " << dropped << " in total";
 
-						if (_dump_queue_trades.empty())
-							continue;
+				_reported = dropped;
+				_report_time = now;
+			}
 
-						trade_record = _dump_queue_trades.front();
-						_dump_queue_trades.pop();
-					}
+		private:
+			static constexpr std::chrono::seconds report_period{10};
 
-					const auto record_block_index = get_block_index(trade_record.timestamp);
-					if (file == nullptr || record_block_index != block_index)
-					{
-						file.reset();
+			const char * const _stream_name;
+			std::uint64_t _reported = 0;
+			std::chrono::steady_clock::time_point _report_time;
+		};
 
-						const auto file_path = path / (_symbol_description.symbol_name + '_' + std::to_string(record_block_index) + ".csv");
+		// Metrics of a dump thread, updated once per loop iteration.
+		class dump_stream_metrics
+		{
+		public:
+			dump_stream_metrics(const std::string & symbol, const char * stream_name, const std::set<exchange_type> & exchanges)
+			{
+				auto & registry = metrics::registry::instance();
+				const metrics::labels_t labels{ { "symbol", symbol }, { "stream", stream_name } };
 
-						std::string str_path = file_path.string();
-						file.reset(fopen(str_path.c_str(), "at"));
-						if (file != nullptr)
-						{
-							setbuf(file.get(), nullptr);
-							block_index = record_block_index;
-						}
-					}
+				for (const auto exchange : exchanges)
+				{
+					auto exchange_labels = labels;
+					exchange_labels.emplace_back("exchange", get_exchange_name(exchange));
 
-					if (file != nullptr)
-					{
-						std::ostringstream ss;
-						ss << std::fixed;
-						ss << get_exchange_name(trade_record.exchange) << ',' <<
-							std::setprecision(2) << trade_record.price << ',' << std::setprecision(8) <<
-							((trade_record.side == market_data_common::taker_deal_type::buy) ? trade_record.volume : -trade_record.volume) << ',' << trade_record.timestamp << "\n";
-
-						const auto & str = ss.str();
-						if (fwrite(str.data(), 1, str.size(), file.get()) != str.size())
-						{
-							LOG_ERROR(_logger) << "File writing error for trades";
-						}
-					}
-				}			
+					_queue_depth.emplace(exchange, registry.get_gauge("md_dump_queue_depth", "Records waiting in a dump queue.", exchange_labels));
+				}
+
+				_records_written = registry.get_counter("md_dump_records_total", "Records formatted into dump files.", labels);
+				_records_dropped = registry.get_counter("md_dump_dropped_records_total", "Records dropped by full dump queues.", labels);
+				_records_conflated = registry.get_counter("md_dump_conflated_records_total", "Book records overwritten by newer ones in conflating dump queues.", labels);
+				_bytes_written = registry.get_counter("md_dump_written_bytes_total", "Bytes of formatted records written to dump files, before compression.", labels);
+				_write_time = registry.get_histogram("md_dump_write_microseconds", "Time of writing a buffer to a dump file, including fsync; a compressed buffer is handed over to the compression thread of the file.", labels);
 			}
-			catch (const std::exception & exc)
+
+			dump_stream_metrics(const dump_stream_metrics &) = delete;
+			dump_stream_metrics & operator = (const dump_stream_metrics &) = delete;
+			dump_stream_metrics(dump_stream_metrics &&) = delete;
+			dump_stream_metrics & operator = (dump_stream_metrics &&) = delete;
+
+			void record_written() noexcept
 			{
-				LOG_ERROR(_logger) << "Trades dump loop error: " << exc.what();
+				++_pending_records;
 			}
-		}
-
-		void prices_dump_loop()
-		{
-			file_handle file;
 
-			try
+			template <typename channel_t>
+			void update(const channel_t & channel)
 			{
-				namespace fs = std::filesystem;
-				fs::path path(_dump_path);
-				path /= "prices";
-				if (!fs::exists(path))
+				for (const auto & ring : channel.rings())
 				{
-					fs::create_directories(path);
+					_queue_depth.at(ring.first)->set(static_cast<std::int64_t>(ring.second->size()));
 				}
 
-				unsigned int block_index = 0;
+				const auto dropped = channel.dropped();
+				if (dropped > _dropped_reported)
+				{
+					_records_dropped->add(dropped - _dropped_reported);
+					_dropped_reported = dropped;
+				}
 
-				while (!_stop_dumping)
+				const auto conflated = channel.conflated();
+				if (conflated > _conflated_reported)
 				{
-					price_dump_record price_record;
+					_records_conflated->add(conflated - _conflated_reported);
+					_conflated_reported = conflated;
+				}
 
-					{
-						std::unique_lock<std::mutex> lock(_prices_dump_queue_mtx);
-						_prices_dump_queue_var.wait(
-							lock,
-							[this] { return _stop_dumping.load() || !_dump_queue_prices.empty(); });
+				update();
+			}
 
-						if (_stop_dumping)
-							break;
+			// For streams without their own queue.
+			void update()
+			{
+				if (_pending_records != 0)
+				{
+					_records_written->add(_pending_records);
+					_pending_records = 0;
+				}
+			}
 
-						if (_dump_queue_prices.empty())
-							continue;
+			bool flush_if_needed(dump_writer::block_file & file)
+			{
+				const auto buffered = file.buffer().size();
+				const auto start = std::chrono::steady_clock::now();
 
-						price_record = _dump_queue_prices.front();
-						_dump_queue_prices.pop();
-					}
+				const auto result = file.flush_if_needed();
 
-					const auto record_block_index = get_block_index(price_record.timestamp);
-					if (file == nullptr || record_block_index != block_index)
-					{
-						file.reset();
+				if (file.buffer().size() < buffered)
+				{
+					const auto write_time = std::chrono::steady_clock::now() - start;
+					_write_time->add(static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(write_time).count()));
+					_bytes_written->add(buffered);
+				}
 
-						const auto file_path = path / (_symbol_description.symbol_name + '_' + std::to_string(record_block_index) + ".csv");
+				return result;
+			}
 
-						std::string str_path = file_path.string();
-						file.reset(fopen(str_path.c_str(), "at"));
-						if (file != nullptr)
-						{
-							setbuf(file.get(), nullptr);
-							block_index = record_block_index;
-						}
-					}
+		private:
+			std::map<exchange_type, std::shared_ptr<metrics::gauge>> _queue_depth;
+			std::shared_ptr<metrics::counter> _records_written;
+			std::shared_ptr<metrics::counter> _records_dropped;
+			std::shared_ptr<metrics::counter> _records_conflated;
+			std::shared_ptr<metrics::counter> _bytes_written;
+			std::shared_ptr<metrics::histogram> _write_time;
+
+			std::uint64_t _pending_records = 0;
+			std::uint64_t _dropped_reported = 0;
+			std::uint64_t _conflated_reported = 0;
+		};
 
-					if (file != nullptr)
-					{
-						std::ostringstream ss;
-						ss << std::fixed;
-						ss << get_exchange_name(price_record.exchange) << ',' << price_record.timestamp;
-						for (const auto & price_pair : price_record.prices)
-						{
-							ss << ',' << std::setprecision(2) << price_pair.first << ',' << std::setprecision(8) << price_pair.second;
-						}
-						ss << '\n';
+		// Bars of the trades passing the trades dump thread, the bars stream is written by the same thread.
+		class trade_bars_writer
+		{
+		public:
+			explicit trade_bars_writer(market_data_provider & provider) : _provider(provider)
+			{
+				const auto & options = provider._options;
+				if (options.bar_intervals.empty())
+					return;
+
+				const auto & symbol = provider._symbol_description.symbol_name;
+
+				_aggregator.emplace(options.bar_intervals, get_supported_exchanges().size(), options.bar_close_delay, options.bar_max_clock_skew);
+				_file.emplace(options.flush, options.format, provider.make_file_header(binary_format::record_type::bar));
+				_path = provider.get_dump_directory("bars");
+				_stream_metrics.emplace(symbol, "bars", get_exchanges(provider._symbol_description));
+				_late_trades = metrics::registry::instance().get_counter(
+					"md_bar_late_trades_total",
+					"Trades which came after their bar had been written, they are not in bars.",
+					metrics::labels_t{ { "symbol", symbol } });
+				_future_trades = metrics::registry::instance().get_counter(
+					"md_bar_future_trades_total",
+					"Trades with a time further ahead of the host clock than the maximum clock skew, they are not in bars.",
+					metrics::labels_t{ { "symbol", symbol } });
+			}
 
-						const auto & str = ss.str();
-						if (fwrite(str.data(), 1, str.size(), file.get()) != str.size())
-						{
-							LOG_ERROR(_logger) << "File writing error for prices";
-						}
-					}
+			trade_bars_writer(const trade_bars_writer &) = delete;
+			trade_bars_writer & operator = (const trade_bars_writer &) = delete;
+			trade_bars_writer(trade_bars_writer &&) = delete;
+			trade_bars_writer & operator = (trade_bars_writer &&) = delete;
+
+			// Bars still open are not written, they would look complete.
+			~trade_bars_writer()
+			{
+				if (_file)
+				{
+					_provider.report_write_error(_file->close(), _write_error, "bars");
 				}
 			}
-			catch (const std::exception & exc)
+
+			void add(const trade_dump_record & record)
 			{
-				LOG_ERROR(_logger) << "Prices dump loop error: " << exc.what();
+				if (!_aggregator)
+					return;
+
+				_aggregator->add(
+					static_cast<std::size_t>(record.exchange),
+					record.price,
+					record.volume,
+					static_cast<std::uint64_t>(record.timestamp),
+					record.side == market_data_common::taker_deal_type::sell,
+					[this](const market_data_common::trade_bar & bar) { write(bar); });
 			}
-		}
 
-		unsigned int get_block_index(timestamp_type timestamp) const
+			// Called once per loop iteration.
+			void close_expired()
+			{
+				if (!_aggregator)
+					return;
+
+				_aggregator->close_expired([this](const market_data_common::trade_bar & bar) { write(bar); });
+
+				const auto late_trades = _aggregator->late_trades();
+				if (late_trades > _late_trades_reported)
+				{
+					_late_trades->add(late_trades - _late_trades_reported);
+					_late_trades_reported = late_trades;
+				}
+
+				const auto future_trades = _aggregator->future_trades();
+				if (future_trades > _future_trades_reported)
+				{
+					LOG_WARNING(_provider._logger) << "Trades ahead of the host clock skipped in bars of " <<
+						_provider._symbol_description.symbol_name << ": " << (future_trades - _future_trades_reported);
+					_future_trades->add(future_trades - _future_trades_reported);
+					_future_trades_reported = future_trades;
+				}
+
+				_provider.report_write_error(_stream_metrics->flush_if_needed(*_file), _write_error, "bars");
+				_stream_metrics->update();
+			}
+
+		private:
+			void write(const market_data_common::trade_bar & bar)
+			{
+				const auto timestamp = static_cast<timestamp_type>(bar.start);
+				const auto record_block_index = _provider.get_block_index(timestamp);
+				if (!_file->is_open() || record_block_index > _block_index)
+				{
+					_provider.open_block_file(*_file, _path, record_block_index, _write_error);
+					_block_index = record_block_index;
+				}
+
+				if (!_file->is_open())
+					return;
+
+				auto & buffer = _file->buffer();
+				_file->record_added(timestamp);
+				_stream_metrics->record_written();
+
+				const auto all_exchanges = (bar.source == get_supported_exchanges().size());
+				const auto interval_seconds = static_cast<std::uint32_t>(bar.interval / 1000000);
+
+				if (_file->format() == dump_writer::file_format::binary)
+				{
+					binary_format::put_bar_record(
+						buffer,
+						all_exchanges ? all_exchanges_id : static_cast<std::uint8_t>(bar.source),
+						interval_seconds,
+						timestamp,
+						bar.open,
+						bar.high,
+						bar.low,
+						bar.close,
+						bar.buy_volume,
+						bar.sell_volume,
+						bar.vwap(),
+						bar.trades);
+				}
+				else
+				{
+					buffer.append(all_exchanges ? "all" : get_exchange_name(static_cast<exchange_type>(bar.source))).append(',');
+					buffer.append_integer(interval_seconds).append(',');
+					buffer.append_integer(timestamp);
+
+					for (const auto price : { bar.open, bar.high, bar.low, bar.close })
+					{
+						buffer.append(',').append_fixed(price, 2);
+					}
+
+					buffer.append(',').append_fixed(bar.buy_volume, 8);
+					buffer.append(',').append_fixed(bar.sell_volume, 8);
+					buffer.append(',').append_fixed(bar.vwap(), 2);
+					buffer.append(',').append_integer(bar.trades).append('\n');
+				}
+			}
+
+			market_data_provider & _provider;
+
+			std::optional<market_data_common::trade_bar_aggregator> _aggregator;
+			std::optional<dump_writer::block_file> _file;
+			std::optional<dump_stream_metrics> _stream_metrics;
+			std::shared_ptr<metrics::counter> _late_trades;
+			std::shared_ptr<metrics::counter> _future_trades;
+
+			std::filesystem::path _path;
+			unsigned int _block_index = 0;
+			bool _write_error = false;
+			std::uint64_t _late_trades_reported = 0;
+			std::uint64_t _future_trades_reported = 0;
+		};
+
+		// A constant with a fixed depth, so the record writers are unrolled for it.
+		unsigned int get_depth() const noexcept
+		{
+			return (fixed_depth != 0) ? fixed_depth : _symbol_description.price_levels_num;
+		}
+
+		// Dump threads run until the shutdown, then until their queues are drained or the deadline passes.
+		template <typename channel_t>
+		bool keep_dumping(const channel_t & channel) const
+		{
+			if (!_stop_dumping)
+				return true;
+
+			return !channel.empty() && std::chrono::steady_clock::now().time_since_epoch().count() < _drain_deadline.load();
+		}
+
+		template <typename channel_t>
+		void report_undrained(const channel_t & channel, const char * stream_name) const
+		{
+			const auto records = channel.size();
+			if (records != 0)
+			{
+				LOG_WARNING(_logger) << _symbol_description.symbol_name << ": " << records << " " << stream_name << " record(s) not written before the shutdown deadline";
+			}
+		}
+
+		void init_price_record(price_dump_record & record) const
+		{
+			record.prices.reserve(_symbol_description.price_levels_num * 2);
+			record.changed_levels.reserve(_symbol_description.price_levels_num);
+		}
+
+		void init_book_record(book_record & record) const
+		{
+			record.levels.reserve(_symbol_description.price_levels_num);
+		}
+
+		void init_publish_record(publish_record & record) const
+		{
+			record.prices.reserve(_symbol_description.price_levels_num * 2);
+		}
+
+		void create_publishers()
+		{
+			const auto & options = _options.publish;
+			const auto & symbol = _symbol_description.symbol_name;
+			const auto creation_time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+			if (!options.shm_prefix.empty())
+			{
+				const auto name = '/' + options.shm_prefix + '_' + symbol;
+				_shm_writer = std::make_unique<shm_feed::writer>(name, symbol, _symbol_description.price_levels_num, options.shm_slots, creation_time);
+				LOG_INFO(_logger) << "Publishing " << symbol << " to shared memory feed: " << name;
+			}
+
+			if (options.multicast)
+			{
+				_multicast_sender = std::make_unique<multicast_feed::sender>(*options.multicast, symbol, _symbol_description.price_levels_num, options.multicast_ttl);
+				LOG_INFO(_logger) << "Publishing " << symbol << " to multicast group: " << options.multicast->address().to_string() << ':' << options.multicast->port();
+			}
+		}
+
+		void trades_dump_loop()
+		{
+			try
+			{
+				dump_writer::block_file file(_options.flush, _options.format, make_file_header(binary_format::record_type::trade));
+				const auto path = get_dump_directory("trades");
+				unsigned int block_index = 0;
+				bool write_error = false;
+
+				dump_stream_metrics stream_metrics(_symbol_description.symbol_name, "trades", get_exchanges(_symbol_description));
+
+				const auto write_record = [&](const trade_dump_record & trade_record)
+				{
+					// a record late by a block boundary stays in the current block, blocks are never opened again
+					const auto record_block_index = get_block_index(trade_record.timestamp);
+					if (!file.is_open() || record_block_index > block_index)
+					{
+						open_block_file(file, path, record_block_index, write_error);
+						block_index = record_block_index;
+					}
+
+					if (!file.is_open())
+						return;
+
+					auto & buffer = file.buffer();
+					file.record_added(trade_record.timestamp);
+					stream_metrics.record_written();
+
+					if (file.format() == dump_writer::file_format::binary)
+					{
+						binary_format::put_trade_record(
+							buffer,
+							static_cast<std::uint8_t>(trade_record.exchange),
+							trade_record.side == market_data_common::taker_deal_type::sell,
+							trade_record.timestamp,
+							trade_record.price,
+							trade_record.volume);
+					}
+					else
+					{
+						buffer.append(get_exchange_name(trade_record.exchange)).append(',');
+						buffer.append_fixed(trade_record.price, 2).append(',');
+						buffer.append_fixed((trade_record.side == market_data_common::taker_deal_type::buy) ? trade_record.volume : -trade_record.volume, 8).append(',');
+						buffer.append_integer(trade_record.timestamp).append('\n');
+					}
+				};
+
+				trade_bars_writer bars_writer(*this);
+
+				dropped_records_reporter dropped_reporter("trades");
+
+				while (keep_dumping(_trades_channel))
+				{
+					const auto popped = _trades_channel.pop_ordered(dump_batch_size, record_timestamp{},
+						[&](exchange_type, const trade_dump_record & trade_record, std::uint64_t)
+					{
+						write_record(trade_record);
+						bars_writer.add(trade_record);
+					});
+
+					bars_writer.close_expired();
+
+					report_write_error(stream_metrics.flush_if_needed(file), write_error, "trades");
+					dropped_reporter.report(_logger, _trades_channel.dropped());
+					stream_metrics.update(_trades_channel);
+
+					if (!popped)
+					{
+						_trades_channel.wait(_stop_dumping, dump_wait_timeout);
+					}
+				}
+
+				report_undrained(_trades_channel, "trades");
+
+				report_write_error(file.close(), write_error, "trades");
+			}
+			catch (const std::exception & exc)
+			{
+				LOG_ERROR(_logger) << "Trades dump loop error: " << exc.what();
+			}
+		}
+
+		void prices_dump_loop()
+		{
+			try
+			{
+				dump_writer::block_file file(_options.flush, _options.format, make_file_header(binary_format::record_type::price));
+				const auto path = get_dump_directory("prices");
+				unsigned int block_index = 0;
+				bool write_error = false;
+
+				dump_stream_metrics stream_metrics(_symbol_description.symbol_name, "prices", get_exchanges(_symbol_description));
+
+				std::set<exchange_type> snapshot_written;
+				std::map<exchange_type, std::uint64_t> ring_skipped; // dropped and conflated records
+
+				const auto write_record = [&](const price_dump_record & price_record)
+				{
+					const auto record_block_index = get_block_index(price_record.timestamp);
+					if (!file.is_open() || record_block_index > block_index)
+					{
+						open_block_file(file, path, record_block_index, write_error);
+						block_index = record_block_index;
+						snapshot_written.clear();
+					}
+
+					if (!file.is_open())
+						return;
+
+					auto & buffer = file.buffer();
+					file.record_added(price_record.timestamp);
+					stream_metrics.record_written();
+
+					if (file.format() == dump_writer::file_format::binary)
+					{
+						binary_format::put_price_record(
+							buffer,
+							static_cast<std::uint8_t>(price_record.exchange),
+							price_record.timestamp,
+							price_record.exchange_timestamp,
+							price_record.receive_timestamp,
+							get_depth(),
+							price_record.prices);
+					}
+					else
+					{
+						buffer.append(get_exchange_name(price_record.exchange)).append(',');
+						buffer.append_integer(price_record.timestamp);
+
+						if (_options.event_timestamps)
+						{
+							buffer.append(',').append_integer(price_record.exchange_timestamp);
+							buffer.append(',').append_integer(price_record.receive_timestamp);
+						}
+
+						if (_options.prices_mode != prices_dump_mode::delta)
+						{
+							write_price_levels(buffer, price_record.prices);
+						}
+						else if (snapshot_written.insert(price_record.exchange).second)
+						{
+							buffer.append(",S");
+							write_price_levels(buffer, price_record.prices);
+						}
+						else
+						{
+							buffer.append(",D");
+							write_changed_price_levels(buffer, price_record.prices, price_record.changed_levels);
+						}
+
+						buffer.append('\n');
+					}
+				};
+
+				dropped_records_reporter dropped_reporter("prices");
+
+				while (keep_dumping(_prices_channel))
+				{
+					const auto popped = _prices_channel.pop_ordered(dump_batch_size, record_timestamp{},
+						[&](exchange_type exchange, const price_dump_record & price_record, std::uint64_t skipped)
+					{
+						// deltas are relative to the previous record, so continue with a snapshot after a loss
+						auto & last_skipped = ring_skipped[exchange];
+						if (skipped != last_skipped)
+						{
+							last_skipped = skipped;
+							snapshot_written.erase(exchange);
+						}
+
+						write_record(price_record);
+					});
+
+					report_write_error(stream_metrics.flush_if_needed(file), write_error, "prices");
+					dropped_reporter.report(_logger, _prices_channel.dropped());
+					stream_metrics.update(_prices_channel);
+
+					if (!popped)
+					{
+						_prices_channel.wait(_stop_dumping, dump_wait_timeout);
+					}
+				}
+
+				report_undrained(_prices_channel, "prices");
+
+				report_write_error(file.close(), write_error, "prices");
+			}
+			catch (const std::exception & exc)
+			{
+				LOG_ERROR(_logger) << "Prices dump loop error: " << exc.what();
+			}
+		}
+
+		// Merges the exchange books and publishes the consolidated book, the dump stream is written only when dumping is enabled.
+		void consolidation_loop()
+		{
+			try
+			{
+				market_data_common::consolidated_book book(get_supported_exchanges().size(), _symbol_description.price_levels_num);
+
+				std::optional<dump_writer::block_file> file;
+				std::filesystem::path path;
+				unsigned int block_index = 0;
+				bool write_error = false;
+
+				dump_stream_metrics stream_metrics(_symbol_description.symbol_name, "consolidated", get_exchanges(_symbol_description));
+
+				price_levels_t prices;
+				prices.reserve(_symbol_description.price_levels_num * 2);
+
+				const auto write_record = [&](const book_record & record)
+				{
+					if (!file)
+					{
+						file.emplace(_options.flush, _options.format, make_file_header(binary_format::record_type::price));
+						path = get_dump_directory("consolidated");
+					}
+
+					const auto record_block_index = get_block_index(record.timestamp);
+					if (!file->is_open() || record_block_index > block_index)
+					{
+						open_block_file(*file, path, record_block_index, write_error);
+						block_index = record_block_index;
+					}
+
+					if (!file->is_open())
+						return;
+
+					// levels of both sides as in price records, a missing level of a shorter side is zeros
+					prices.clear();
+					const auto levels_num = std::max(book.bids().size(), book.asks().size());
+					for (std::size_t n = 0; n != levels_num; ++n)
+					{
+						const auto bid = (n < book.bids().size()) ? std::make_pair(book.bids()[n].price, book.bids()[n].volume) : std::make_pair(0.0, 0.0);
+						const auto ask = (n < book.asks().size()) ? std::make_pair(book.asks()[n].price, book.asks()[n].volume) : std::make_pair(0.0, 0.0);
+						prices.push_back(bid);
+						prices.push_back(ask);
+					}
+
+					auto & buffer = file->buffer();
+					file->record_added(record.timestamp);
+					stream_metrics.record_written();
+
+					if (file->format() == dump_writer::file_format::binary)
+					{
+						binary_format::put_price_record(
+							buffer,
+							all_exchanges_id,
+							record.timestamp,
+							record.exchange_timestamp,
+							record.receive_timestamp,
+							get_depth(),
+							prices);
+					}
+					else
+					{
+						buffer.append("consolidated,");
+						buffer.append_integer(record.timestamp);
+
+						if (_options.event_timestamps)
+						{
+							buffer.append(',').append_integer(record.exchange_timestamp);
+							buffer.append(',').append_integer(record.receive_timestamp);
+						}
+
+						write_price_levels(buffer, prices);
+						buffer.append('\n');
+					}
+				};
+
+				dropped_records_reporter dropped_reporter("consolidated book");
+
+				while (keep_dumping(_books_channel))
+				{
+					const auto popped = _books_channel.pop_ordered(dump_batch_size, record_timestamp{},
+						[&](exchange_type, const book_record & record, std::uint64_t)
+					{
+						if (!book.update(static_cast<std::size_t>(record.exchange), record.levels))
+							return;
+
+						if (_subscriber.consolidated_book_subscriber)
+						{
+							_subscriber.consolidated_book_subscriber(_symbol_description.symbol_name, book, static_cast<std::uint64_t>(record.timestamp));
+						}
+
+						if (_options.consolidated_book && _dump_quotes.load(std::memory_order_acquire))
+						{
+							write_record(record);
+						}
+					});
+
+					if (file)
+					{
+						report_write_error(stream_metrics.flush_if_needed(*file), write_error, "consolidated");
+					}
+
+					dropped_reporter.report(_logger, _books_channel.dropped());
+					stream_metrics.update(_books_channel);
+
+					if (!popped)
+					{
+						_books_channel.wait(_stop_dumping, dump_wait_timeout);
+					}
+				}
+
+				report_undrained(_books_channel, "consolidated book");
+
+				if (file)
+				{
+					report_write_error(file->close(), write_error, "consolidated");
+				}
+			}
+			catch (const std::exception & exc)
+			{
+				LOG_ERROR(_logger) << "Consolidation loop error: " << exc.what();
+			}
+		}
+
+		// The only writer of the shared memory feed and the multicast sender of the symbol.
+		void publish_loop()
+		{
+			try
+			{
+				dump_stream_metrics stream_metrics(_symbol_description.symbol_name, "publish", get_exchanges(_symbol_description));
+				std::shared_ptr<metrics::counter> multicast_dropped;
+				std::uint64_t multicast_dropped_reported = 0;
+				if (_multicast_sender)
+				{
+					multicast_dropped = metrics::registry::instance().get_counter(
+						"md_publish_multicast_dropped_total",
+						"Datagrams which could not be sent to the multicast group at once.",
+						metrics::labels_t{ { "symbol", _symbol_description.symbol_name } });
+				}
+
+				const auto depth = get_depth();
+				dump_writer::text_buffer buffer(binary_format::price_record_size(depth));
+				std::uint64_t number = 0;
+
+				dropped_records_reporter dropped_reporter("publish");
+
+				while (keep_dumping(_publish_channel))
+				{
+					const auto popped = _publish_channel.pop_ordered(dump_batch_size, record_timestamp{},
+						[&](exchange_type, const publish_record & record, std::uint64_t)
+					{
+						buffer.clear();
+						if (record.type == binary_format::record_type::price)
+						{
+							binary_format::put_price_record(
+								buffer,
+								static_cast<std::uint8_t>(record.exchange),
+								record.timestamp,
+								record.exchange_timestamp,
+								record.receive_timestamp,
+								depth,
+								record.prices);
+						}
+						else
+						{
+							binary_format::put_trade_record(
+								buffer,
+								static_cast<std::uint8_t>(record.exchange),
+								record.side == market_data_common::taker_deal_type::sell,
+								record.timestamp,
+								record.price,
+								record.volume);
+						}
+
+						const std::string_view data(buffer.data(), buffer.size());
+						if (_shm_writer)
+							_shm_writer->write(record.type, data);
+
+						if (_multicast_sender)
+							_multicast_sender->send(number, record.type, data);
+
+						++number;
+						stream_metrics.record_written();
+					});
+
+					if (_multicast_sender && _multicast_sender->dropped() > multicast_dropped_reported)
+					{
+						multicast_dropped->add(_multicast_sender->dropped() - multicast_dropped_reported);
+						multicast_dropped_reported = _multicast_sender->dropped();
+					}
+
+					dropped_reporter.report(_logger, _publish_channel.dropped());
+					stream_metrics.update(_publish_channel);
+
+					if (!popped)
+					{
+						_publish_channel.wait(_stop_dumping, dump_wait_timeout);
+					}
+				}
+
+				report_undrained(_publish_channel, "publish");
+			}
+			catch (const std::exception & exc)
+			{
+				LOG_ERROR(_logger) << "Publish loop error: " << exc.what();
+			}
+		}
+
+		std::filesystem::path get_dump_directory(const char * name) const
+		{
+			namespace fs = std::filesystem;
+			fs::path path(_dump_path);
+			path /= name;
+			if (!fs::exists(path))
+			{
+				fs::create_directories(path);
+			}
+
+			return path;
+		}
+
+		void open_block_file(dump_writer::block_file & file, const std::filesystem::path & directory, unsigned int block_index, bool & write_error)
+		{
+			report_write_error(file.close(), write_error, directory.filename().string().c_str());
+
+			const auto name = _symbol_description.symbol_name + '_' + std::to_string(block_index);
+			const auto extension = dump_writer::get_file_extension(_options.format, _options.flush.compression);
+			auto file_path = directory / (name + extension);
+
+			// a compressed file can not be continued after restart (a csv one only when it was closed cleanly),
+			// the rest of the block goes to the next free name
+			if (_options.flush.compression != dump_writer::compression_type::none)
+			{
+				const auto can_continue = [this](const std::filesystem::path & path)
+				{
+					return _options.format == dump_writer::file_format::csv && _options.flush.completion_markers &&
+						dump_writer::block_file::is_complete(path.string());
+				};
+
+				for (unsigned int n = 1; std::filesystem::exists(file_path) && !can_continue(file_path); ++n)
+				{
+					file_path = directory / (name + '.' + std::to_string(n) + extension);
+				}
+			}
+			if (!file.open(file_path.string()))
+			{
+				LOG_ERROR(_logger) << "Could not open dump file: " << file_path.string();
+			}
+			else if (file.preallocates())
+			{
+				// the file of the next block is created and reserved now, so the rotation to it is a rename
+				const auto next_path = directory / (_symbol_description.symbol_name + '_' + std::to_string(block_index + 1) + extension);
+				if (!std::filesystem::exists(next_path) && !file.prepare(next_path.string()))
+				{
+					LOG_WARNING(_logger) << "Could not prepare dump file: " << next_path.string();
+				}
+			}
+		}
+
+		binary_format::file_header make_file_header(binary_format::record_type type) const
+		{
+			binary_format::file_header header;
+			header.type = type;
+			header.symbol = _symbol_description.symbol_name;
+			header.creation_time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+			if (type == binary_format::record_type::price)
+			{
+				header.depth = _symbol_description.price_levels_num;
+				header.record_size = binary_format::price_record_size(header.depth);
+			}
+			else if (type == binary_format::record_type::bar)
+			{
+				header.record_size = binary_format::bar_record_size;
+			}
+			else
+			{
+				header.record_size = binary_format::trade_record_size;
+			}
+
+			return header;
+		}
+
+		// Logs the first error of a series only, so a full disk does not flood the log.
+		void report_write_error(bool success, bool & write_error, const char * stream_name)
+		{
+			if (!success && !write_error)
+			{
+				LOG_ERROR(_logger) << "File writing error for " << stream_name;
+			}
+
+			write_error = !success;
+		}
+
+		template <typename levels_t>
+		static void write_price_levels(dump_writer::text_buffer & buffer, const levels_t & prices)
+		{
+			for (const auto & price_pair : prices)
+			{
+				buffer.append(',').append_fixed(price_pair.first, 2).append(',').append_fixed(price_pair.second, 8);
+			}
+		}
+
+		template <typename levels_t, typename changed_levels_t>
+		static void write_changed_price_levels(
+			dump_writer::text_buffer & buffer,
+			const levels_t & prices,
+			const changed_levels_t & changed_levels)
+		{
+			for (const auto level : changed_levels)
+			{
+				buffer.append(',').append_integer(level);
+
+				const auto index = level * 2;
+				if (index + 1 < prices.size())
+				{
+					const auto & bid = prices[index];
+					const auto & ask = prices[index + 1];
+					buffer.append(',').append_fixed(bid.first, 2).append(',').append_fixed(bid.second, 8);
+					buffer.append(',').append_fixed(ask.first, 2).append(',').append_fixed(ask.second, 8);
+				}
+				else
+				{
+					buffer.append(",0,0,0,0"); // level is not visible anymore
+				}
+			}
+		}
+
+		static std::set<exchange_type> get_exchanges(const general_symbol_description & symbol_description)
+		{
+			std::set<exchange_type> exchanges;
+			for (const auto & exchange : symbol_description.source_exchanges)
+			{
+				exchanges.insert(exchange.first);
+			}
+
+			return exchanges;
+		}
+
+		static std::uint64_t get_latency(std::uint64_t from, std::uint64_t to) noexcept
+		{
+			return (to > from) ? (to - from) : 0;
+		}
+
+		unsigned int get_block_index(timestamp_type timestamp) const
 		{			
 			const auto dump_start_mcs = std::chrono::duration_cast<std::chrono::microseconds>(_dump_start.time_since_epoch()).count();
 			return (timestamp > dump_start_mcs && _block_duration.count() != 0) ? ((timestamp - dump_start_mcs) / std::chrono::duration_cast<std::chrono::microseconds>(_block_duration).count()) : 0;
 		}
 
-		void error_handler(exchange_type exchange, const std::exception & exc)
-		{
-			LOG_ERROR(_logger) << get_exchange_name(exchange) << ": " << exc.what();
-		};
-
 		void order_book_handler(
 			exchange_type exchange,
 			const std::string & symbol,
-			const market_data_common::order_map_t & asks,
-			const market_data_common::order_map_t & bids)
+			const market_data_common::ask_levels_t & asks,
+			const market_data_common::bid_levels_t & bids,
+			const market_data_common::visible_book_changes & changes,
+			const market_data_common::event_timestamps & timestamps)
 		{
-			const auto timestamp = std::chrono::system_clock::now();
-			const auto timestamp_mcs = std::chrono::duration_cast<std::chrono::microseconds>(timestamp.time_since_epoch()).count();
+			if (_stopping.load(std::memory_order_relaxed))
+				return;
+
+			const auto timestamp_mcs = static_cast<timestamp_type>(timestamps.processed);
+
+			auto & latency = _latency.at(exchange);
+			if (timestamps.received != 0)
+			{
+				latency.wire_to_callback.add(get_latency(timestamps.received, timestamps.processed));
+
+				if (timestamps.exchange != 0)
+					latency.exchange_to_receive.add(get_latency(timestamps.exchange, timestamps.received));
+			}
+
 			if (_subscriber.order_book_subscriber)
 			{
 				_subscriber.order_book_subscriber(
@@ -452,28 +1613,61 @@ namespace market_data
 					timestamp_mcs);
 			}
 
+			if (_options.prices_mode != prices_dump_mode::every_update && changes.changed_levels.empty())
+				return;
+
 			if (_dump_quotes)
 			{
-				std::vector<std::pair<double, double>> order_book_prices;
-				order_book_prices.reserve(_symbol_description.price_levels_num * 2);
-				auto iter_bid = bids.crbegin();
-				auto iter_ask = asks.cbegin();
-				for (unsigned int n = 0;
-					n != _symbol_description.price_levels_num && iter_bid != bids.crend() && iter_ask != asks.cend();
-					++n, ++iter_bid, ++iter_ask)
+				_prices_channel.push(exchange, [&](price_dump_record & record)
 				{
-					order_book_prices.emplace_back(iter_bid->first, iter_bid->second);
-					order_book_prices.emplace_back(iter_ask->first, iter_ask->second);
-				}
+					record.exchange = exchange;
+					record.timestamp = timestamp_mcs;
+					record.exchange_timestamp = static_cast<timestamp_type>(timestamps.exchange);
+					record.receive_timestamp = static_cast<timestamp_type>(timestamps.received);
 
-				price_dump_record record;
-				record.exchange = exchange;
-				record.prices = std::move(order_book_prices);
-				record.timestamp = timestamp_mcs;
+					record.prices.clear();
+					for (const auto & level : changes.levels)
+					{
+						record.prices.emplace_back(level.bid_price, level.bid_volume);
+						record.prices.emplace_back(level.ask_price, level.ask_volume);
+					}
 
-				std::lock_guard<std::mutex> lock(_prices_dump_queue_mtx);
-				_dump_queue_prices.push(record);
-				_prices_dump_queue_var.notify_one();
+					if (_options.prices_mode == prices_dump_mode::delta)
+					{
+						record.changed_levels = changes.changed_levels;
+					}
+				});
+			}
+
+			if (_publish)
+			{
+				_publish_channel.push(exchange, [&](publish_record & record)
+				{
+					record.type = binary_format::record_type::price;
+					record.exchange = exchange;
+					record.timestamp = timestamp_mcs;
+					record.exchange_timestamp = static_cast<timestamp_type>(timestamps.exchange);
+					record.receive_timestamp = static_cast<timestamp_type>(timestamps.received);
+
+					record.prices.clear();
+					for (const auto & level : changes.levels)
+					{
+						record.prices.emplace_back(level.bid_price, level.bid_volume);
+						record.prices.emplace_back(level.ask_price, level.ask_volume);
+					}
+				});
+			}
+
+			if (_consolidate && !changes.changed_levels.empty())
+			{
+				_books_channel.push(exchange, [&](book_record & record)
+				{
+					record.exchange = exchange;
+					record.timestamp = timestamp_mcs;
+					record.exchange_timestamp = static_cast<timestamp_type>(timestamps.exchange);
+					record.receive_timestamp = static_cast<timestamp_type>(timestamps.received);
+					record.levels = changes.levels;
+				});
 			}
 		}
 
@@ -485,6 +1679,9 @@ namespace market_data
 			timestamp_type timestamp,
 			market_data_common::taker_deal_type side)
 		{
+			if (_stopping.load(std::memory_order_relaxed))
+				return;
+
 			if (_subscriber.trade_subscriber)
 			{
 				_subscriber.trade_subscriber(
@@ -498,39 +1695,64 @@ namespace market_data
 
 			if (_dump_quotes)
 			{
-				trade_dump_record record = 
+				_trades_channel.push(exchange, [&](trade_dump_record & record)
 				{
-					exchange,
-					price,
-					volume,
-					timestamp,
-					side
-				};
+					record = trade_dump_record
+					{
+						exchange,
+						price,
+						volume,
+						timestamp,
+						side
+					};
+				});
+			}
 
-				std::lock_guard<std::mutex> lock(_trades_dump_queue_mtx);
-				_dump_queue_trades.push(record);
-				_trades_dump_queue_var.notify_one();
+			if (_publish)
+			{
+				_publish_channel.push(exchange, [&](publish_record & record)
+				{
+					record.type = binary_format::record_type::trade;
+					record.exchange = exchange;
+					record.timestamp = timestamp;
+					record.exchange_timestamp = 0;
+					record.receive_timestamp = 0;
+					record.price = price;
+					record.volume = volume;
+					record.side = side;
+				});
 			}
 		}
 
 		const general_symbol_description _symbol_description;
 		const market_data_subscriber _subscriber;
+		const dump_options _options;
 
 		logger_t _logger;
 
+		const std::shared_ptr<feed_connections<logger_t>> _connections;
+
 		std::string _dump_path;
-		std::chrono::minutes _block_duration;
+		std::chrono::minutes _block_duration{0};
 		std::chrono::system_clock::time_point _dump_start;
+		bool _dump_configured = false; // the dump settings above are not written again
 		std::atomic_bool _dump_quotes{false};
 		std::atomic_bool _stop_dumping{false};
+		std::atomic_bool _stopping{false}; // feed messages are ignored after the shutdown
+		std::atomic<std::chrono::steady_clock::rep> _drain_deadline{0};
 		
-		std::queue<trade_dump_record> _dump_queue_trades;
-		std::mutex _trades_dump_queue_mtx;
-		std::condition_variable _trades_dump_queue_var;
+		lock_free::spsc_channel<exchange_type, trade_dump_record> _trades_channel;
+		lock_free::spsc_channel<exchange_type, price_dump_record> _prices_channel;
+
+		const bool _consolidate;
+		lock_free::spsc_channel<exchange_type, book_record> _books_channel;
+
+		const bool _publish;
+		lock_free::spsc_channel<exchange_type, publish_record> _publish_channel;
+		std::unique_ptr<shm_feed::writer> _shm_writer;
+		std::unique_ptr<multicast_feed::sender> _multicast_sender;
 
-		std::queue<price_dump_record> _dump_queue_prices;
-		std::mutex _prices_dump_queue_mtx;
-		std::condition_variable _prices_dump_queue_var;
+		std::map<exchange_type, exchange_latency> _latency;
 
 		std::unique_ptr<coinbase::coinbase_market_data_subscriber> _coinbase_subscriber;
 		std::unique_ptr<bitfinex::bitfinex_market_data_subscriber> _bitfinex_subscriber;
@@ -539,5 +1761,7 @@ namespace market_data
 
 		std::thread _trades_dump_queue_thread;
 		std::thread _prices_dump_queue_thread;
+		std::thread _consolidation_thread;
+		std::thread _publish_thread;
 	};
 }
\ No newline at end of file
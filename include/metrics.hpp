@@ -0,0 +1,322 @@
+/*
+Market data collector for crypto exchanges.
+https://github.com/ilia-funtov/crypto-market-data-collector
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2022 Ilia Funtov.
+*/
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <latency_histogram.hpp>
+
+namespace metrics
+{
+	constexpr std::size_t cache_line_size = 64;
+
+	using labels_t = std::vector<std::pair<std::string, std::string>>;
+
+	namespace details
+	{
+		// Threads get consecutive slot numbers on their first update of any counter.
+		inline std::size_t get_thread_slot() noexcept
+		{
+			static std::atomic<std::size_t> next_slot{0};
+			thread_local const std::size_t slot = next_slot.fetch_add(1, std::memory_order_relaxed);
+			return slot;
+		}
+	}
+
+	// Monotonic counter updated from hot paths. Every thread adds to its own cache line,
+	// so threads of different connections do not contend, and the reader sums the slots.
+	class counter
+	{
+	public:
+		counter() = default;
+
+		counter(const counter &) = delete;
+		counter & operator = (const counter &) = delete;
+		counter(counter &&) = delete;
+		counter & operator = (counter &&) = delete;
+
+		void add(std::uint64_t value = 1) noexcept
+		{
+			_slots[details::get_thread_slot() % slots_num].value.fetch_add(value, std::memory_order_relaxed);
+		}
+
+		std::uint64_t value() const noexcept
+		{
+			std::uint64_t result = 0;
+			for (const auto & slot : _slots)
+			{
+				result += slot.value.load(std::memory_order_relaxed);
+			}
+
+			return result;
+		}
+
+	private:
+		struct alignas(cache_line_size) slot
+		{
+			std::atomic<std::uint64_t> value{0};
+		};
+
+		static constexpr std::size_t slots_num = 16;
+
+		std::array<slot, slots_num> _slots;
+	};
+
+	// Current value like a queue depth, set by one thread.
+	class gauge
+	{
+	public:
+		gauge() = default;
+
+		gauge(const gauge &) = delete;
+		gauge & operator = (const gauge &) = delete;
+		gauge(gauge &&) = delete;
+		gauge & operator = (gauge &&) = delete;
+
+		void set(std::int64_t value) noexcept
+		{
+			_value.store(value, std::memory_order_relaxed);
+		}
+
+		std::int64_t value() const noexcept
+		{
+			return _value.load(std::memory_order_relaxed);
+		}
+
+	private:
+		alignas(cache_line_size) std::atomic<std::int64_t> _value{0};
+	};
+
+	// Distribution of durations or sizes since start, exported as quantiles, sum and count.
+	class histogram
+	{
+	public:
+		histogram() = default;
+
+		histogram(const histogram &) = delete;
+		histogram & operator = (const histogram &) = delete;
+		histogram(histogram &&) = delete;
+		histogram & operator = (histogram &&) = delete;
+
+		void add(std::uint64_t value) noexcept
+		{
+			_histogram.add(value);
+			_sum.add(value);
+		}
+
+		market_data_common::latency_histogram::summary get_summary() noexcept
+		{
+			return _histogram.get_summary(false);
+		}
+
+		std::uint64_t sum() const noexcept
+		{
+			return _sum.value();
+		}
+
+	private:
+		market_data_common::latency_histogram _histogram;
+		counter _sum;
+	};
+
+	// Named metrics of the process. A metric is created on the first request for its name and labels
+	// and lives until the end of the process, so objects which are created again (connections, providers)
+	// continue the same series.
+	class registry
+	{
+	public:
+		registry() = default;
+
+		registry(const registry &) = delete;
+		registry & operator = (const registry &) = delete;
+		registry(registry &&) = delete;
+		registry & operator = (registry &&) = delete;
+
+		static registry & instance()
+		{
+			static registry process_registry;
+			return process_registry;
+		}
+
+		std::shared_ptr<counter> get_counter(const std::string & name, const std::string & help, const labels_t & labels = labels_t{})
+		{
+			return get_metric(_counters, name, help, labels);
+		}
+
+		std::shared_ptr<gauge> get_gauge(const std::string & name, const std::string & help, const labels_t & labels = labels_t{})
+		{
+			return get_metric(_gauges, name, help, labels);
+		}
+
+		std::shared_ptr<histogram> get_histogram(const std::string & name, const std::string & help, const labels_t & labels = labels_t{})
+		{
+			return get_metric(_histograms, name, help, labels);
+		}
+
+		// Prometheus text exposition format.
+		std::string to_text()
+		{
+			std::string text;
+
+			std::lock_guard<std::mutex> lock(_mtx);
+
+			for (const auto & family : _counters)
+			{
+				put_family_header(text, family.first, family.second.help, "counter");
+				for (const auto & metric : family.second.metrics)
+				{
+					put_sample(text, family.first, metric.first, std::to_string(metric.second->value()));
+				}
+			}
+
+			for (const auto & family : _gauges)
+			{
+				put_family_header(text, family.first, family.second.help, "gauge");
+				for (const auto & metric : family.second.metrics)
+				{
+					put_sample(text, family.first, metric.first, std::to_string(metric.second->value()));
+				}
+			}
+
+			for (const auto & family : _histograms)
+			{
+				put_family_header(text, family.first, family.second.help, "summary");
+				for (const auto & metric : family.second.metrics)
+				{
+					const auto summary = metric.second->get_summary();
+					const auto & labels = metric.first;
+					const auto separator = labels.empty() ? "" : ",";
+
+					put_sample(text, family.first, labels + separator + "quantile=\"0.5\"", std::to_string(summary.p50));
+					put_sample(text, family.first, labels + separator + "quantile=\"0.99\"", std::to_string(summary.p99));
+					put_sample(text, family.first, labels + separator + "quantile=\"0.999\"", std::to_string(summary.p999));
+					put_sample(text, family.first + "_sum", labels, std::to_string(metric.second->sum()));
+					put_sample(text, family.first + "_count", labels, std::to_string(summary.count));
+				}
+			}
+
+			return text;
+		}
+
+		// Replaces the file at once, so readers like the node exporter textfile collector never see a partial file.
+		bool write_file(const std::string & path)
+		{
+			const auto text = to_text();
+			const auto temp_path = path + ".tmp";
+
+			FILE * file = fopen(temp_path.c_str(), "wb");
+			if (file == nullptr)
+				return false;
+
+			const auto written = fwrite(text.data(), 1, text.size(), file);
+			const auto closed = (fclose(file) == 0);
+			if (written != text.size() || !closed)
+				return false;
+
+			std::error_code ec;
+			std::filesystem::rename(temp_path, path, ec);
+			return !ec;
+		}
+
+	private:
+		template <typename metric_t>
+		struct family
+		{
+			std::string help;
+			std::map<std::string, std::shared_ptr<metric_t>> metrics; // by label text
+		};
+
+		template <typename metric_t>
+		using families_t = std::map<std::string, family<metric_t>>;
+
+		template <typename metric_t>
+		std::shared_ptr<metric_t> get_metric(
+			families_t<metric_t> & families,
+			const std::string & name,
+			const std::string & help,
+			const labels_t & labels)
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+
+			auto & metric_family = families[name];
+			if (metric_family.help.empty())
+				metric_family.help = help;
+
+			auto & metric = metric_family.metrics[get_labels_text(labels)];
+			if (!metric)
+				metric = std::make_shared<metric_t>();
+
+			return metric;
+		}
+
+		static std::string get_labels_text(const labels_t & labels)
+		{
+			std::string text;
+			for (const auto & label : labels)
+			{
+				if (!text.empty())
+					text += ',';
+
+				text += label.first;
+				text += "=\"";
+				for (const auto ch : label.second)
+				{
+					if (ch == '\\' || ch == '"')
+					{
+						text += '\\';
+						text += ch;
+					}
+					else if (ch == '\n')
+					{
+						text += "\\n";
+					}
+					else
+					{
+						text += ch;
+					}
+				}
+				text += '"';
+			}
+
+			return text;
+		}
+
+		static void put_family_header(std::string & text, const std::string & name, const std::string & help, const char * type)
+		{
+			text.append("# HELP ").append(name).append(" ").append(help).append("\n");
+			text.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+		}
+
+		static void put_sample(std::string & text, const std::string & name, const std::string & labels, const std::string & value)
+		{
+			text.append(name);
+			if (!labels.empty())
+				text.append("{").append(labels).append("}");
+
+			text.append(" ").append(value).append("\n");
+		}
+
+		std::mutex _mtx;
+		families_t<counter> _counters;
+		families_t<gauge> _gauges;
+		families_t<histogram> _histograms;
+	};
+}
@@ -0,0 +1,214 @@
+/*
+Market data collector for crypto exchanges.
+https://github.com/ilia-funtov/crypto-market-data-collector
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2022 Ilia Funtov.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include <boost/asio/ip/multicast.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/io_context.hpp>
+
+#include <binary_format.hpp>
+
+// UDP multicast feed: every normalized record of a symbol is sent as one datagram.
+//
+// datagram header (56 bytes): char[4] magic "MDMF", u16 version, u8 record type, u8 padding, u32 depth, u32 padding,
+//   u64 record number (per symbol from 0, a gap means lost datagrams), char[32] symbol
+// followed by the record in binary_format (trade or price record of the depth), all little-endian.
+//
+// Senders never wait for the network, a datagram which can not be sent at once is counted as dropped.
+namespace multicast_feed
+{
+	constexpr char magic[4] = { 'M', 'D', 'M', 'F' };
+	constexpr std::uint16_t version = 1;
+
+	constexpr std::size_t header_size = 56;
+	constexpr std::size_t max_datagram_size = 65507; // UDP over IPv4
+
+	// Address like 239.255.0.1:30001.
+	inline boost::asio::ip::udp::endpoint get_endpoint(const std::string & str)
+	{
+		const auto pos = str.rfind(':');
+		if (pos == std::string::npos)
+			throw std::invalid_argument("Invalid multicast address: " + str);
+
+		boost::system::error_code error;
+		const auto address = boost::asio::ip::make_address(str.substr(0, pos), error);
+		if (error || !address.is_multicast())
+			throw std::invalid_argument("Invalid multicast address: " + str);
+
+		unsigned long port = 0;
+		try
+		{
+			port = std::stoul(str.substr(pos + 1));
+		}
+		catch (const std::exception &)
+		{
+			throw std::invalid_argument("Invalid multicast port: " + str);
+		}
+
+		if (port == 0 || port > 0xffff)
+			throw std::invalid_argument("Invalid multicast port: " + str);
+
+		return boost::asio::ip::udp::endpoint(address, static_cast<unsigned short>(port));
+	}
+
+	// Datagrams of one symbol.
+	class sender
+	{
+	public:
+		sender(const boost::asio::ip::udp::endpoint & endpoint, const std::string & symbol, std::uint32_t depth, unsigned int ttl = 1) :
+			_endpoint(endpoint),
+			_socket(_io_context, endpoint.protocol())
+		{
+			const auto record_size = std::max(binary_format::price_record_size(depth), binary_format::trade_record_size);
+			if (header_size + record_size > max_datagram_size)
+				throw std::invalid_argument("Records of the depth do not fit into a datagram.");
+
+			_socket.set_option(boost::asio::ip::multicast::hops(static_cast<int>(ttl)));
+			_socket.non_blocking(true);
+
+			for (std::size_t n = 0; n != sizeof(magic); ++n)
+			{
+				_header[n] = static_cast<unsigned char>(magic[n]);
+			}
+
+			put<std::uint16_t>(4, version);
+			put<std::uint32_t>(8, depth);
+			std::memcpy(_header.data() + 24, symbol.data(), std::min(symbol.size(), binary_format::symbol_size));
+		}
+
+		sender(const sender &) = delete;
+		sender & operator = (const sender &) = delete;
+		sender(sender &&) = delete;
+		sender & operator = (sender &&) = delete;
+
+		// Returns false when the datagram was dropped.
+		bool send(std::uint64_t number, binary_format::record_type type, std::string_view record)
+		{
+			_header[6] = static_cast<unsigned char>(type);
+			put<std::uint64_t>(16, number);
+
+			const std::array<boost::asio::const_buffer, 2> buffers = {
+				boost::asio::buffer(_header),
+				boost::asio::buffer(record.data(), record.size())
+			};
+
+			boost::system::error_code error;
+			_socket.send_to(buffers, _endpoint, 0, error);
+			if (error)
+			{
+				++_dropped;
+				return false;
+			}
+
+			return true;
+		}
+
+		std::uint64_t dropped() const noexcept
+		{
+			return _dropped;
+		}
+
+	private:
+		template <typename T>
+		void put(std::size_t offset, T value)
+		{
+			const auto bits = static_cast<std::uint64_t>(value);
+			for (std::size_t n = 0; n != sizeof(T); ++n)
+			{
+				_header[offset + n] = static_cast<unsigned char>((bits >> (8 * n)) & 0xff);
+			}
+		}
+
+		const boost::asio::ip::udp::endpoint _endpoint;
+		boost::asio::io_context _io_context;
+		boost::asio::ip::udp::socket _socket;
+		std::array<unsigned char, header_size> _header = {};
+		std::uint64_t _dropped = 0;
+	};
+
+	struct datagram
+	{
+		std::uint64_t number;
+		binary_format::record_type type;
+		std::uint32_t depth;
+		std::string_view symbol;
+		const unsigned char * record; // decode with binary_format::parse_trade_record() or parse_price_record()
+		std::size_t record_size;
+	};
+
+	// Views into the data, which has to outlive the result.
+	inline std::optional<datagram> parse_datagram(const unsigned char * data, std::size_t size)
+	{
+		if (size < header_size || std::memcmp(data, magic, sizeof(magic)) != 0 || binary_format::get<std::uint16_t>(data + 4) != version)
+			return std::nullopt;
+
+		datagram result;
+		result.type = static_cast<binary_format::record_type>(data[6]);
+		result.depth = binary_format::get<std::uint32_t>(data + 8);
+		result.number = binary_format::get<std::uint64_t>(data + 16);
+
+		const auto symbol = reinterpret_cast<const char *>(data + 24);
+		result.symbol = std::string_view(symbol, std::find(symbol, symbol + binary_format::symbol_size, '\0') - symbol);
+
+		result.record = data + header_size;
+		result.record_size = size - header_size;
+
+		const auto expected_size = (result.type == binary_format::record_type::price) ?
+			binary_format::price_record_size(result.depth) : binary_format::trade_record_size;
+		if (result.record_size < expected_size)
+			return std::nullopt;
+
+		return result;
+	}
+
+	// Blocking receiver of a multicast group, datagrams of all symbols sent to the group are received.
+	class receiver
+	{
+	public:
+		explicit receiver(const boost::asio::ip::udp::endpoint & endpoint) :
+			_socket(_io_context, endpoint.protocol())
+		{
+			_socket.set_option(boost::asio::ip::udp::socket::reuse_address(true));
+			_socket.bind(boost::asio::ip::udp::endpoint(endpoint.protocol(), endpoint.port()));
+			_socket.set_option(boost::asio::ip::multicast::join_group(endpoint.address()));
+		}
+
+		receiver(const receiver &) = delete;
+		receiver & operator = (const receiver &) = delete;
+		receiver(receiver &&) = delete;
+		receiver & operator = (receiver &&) = delete;
+
+		// Waits for the next valid datagram, the result is valid until the next call.
+		datagram receive()
+		{
+			for (;;)
+			{
+				const auto size = _socket.receive(boost::asio::buffer(_buffer));
+				const auto result = parse_datagram(_buffer.data(), size);
+				if (result)
+					return *result;
+			}
+		}
+
+	private:
+		boost::asio::io_context _io_context;
+		boost::asio::ip::udp::socket _socket;
+		std::array<unsigned char, max_datagram_size> _buffer;
+	};
+}
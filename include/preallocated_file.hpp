@@ -0,0 +1,331 @@
+/*
+Market data collector for crypto exchanges.
+https://github.com/ilia-funtov/crypto-market-data-collector
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2022 Ilia Funtov.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace dump_writer
+{
+	// Append-only file with disk space reserved ahead of the writes, so appends do not allocate blocks one by one.
+	// Space is reserved beyond the end of the file (the file size is always the size of the written data,
+	// a killed collector leaves no zeros at the end) and the rest of the reservation is released on close.
+	// The first reservation is the size of the previous file, so every block after the first one is reserved at once.
+	//
+	// With direct writes whole aligned blocks go to the disk with O_DIRECT, bypassing the page cache.
+	// The last partial block is written through the page cache and written again as a whole block with the next data,
+	// so the file size stays the size of the data. File systems without O_DIRECT (like tmpfs) get ordinary writes.
+	class preallocated_file
+	{
+	public:
+		explicit preallocated_file(bool direct) :
+			_direct(direct)
+		{
+#if defined(__linux__)
+			if (direct)
+			{
+				void * buffer = nullptr;
+				if (posix_memalign(&buffer, block_alignment, direct_buffer_size) != 0)
+					throw std::runtime_error("Could not allocate direct write buffer.");
+
+				_direct_buffer.reset(static_cast<char *>(buffer));
+			}
+#else
+			(void)_direct;
+			throw std::runtime_error("Preallocated dump files are not supported on this platform.");
+#endif
+		}
+
+		preallocated_file(const preallocated_file &) = delete;
+		preallocated_file & operator = (const preallocated_file &) = delete;
+		preallocated_file(preallocated_file &&) = delete;
+		preallocated_file & operator = (preallocated_file &&) = delete;
+
+		~preallocated_file()
+		{
+			close();
+			discard_prepared();
+		}
+
+		// Opens the file for appending, a file prepared for the path is taken over when the path does not exist yet.
+		bool open(const std::string & path)
+		{
+			close();
+
+			if (_prepared.fd >= 0 && _prepared.path == path && !std::filesystem::exists(path))
+			{
+				std::error_code ec;
+				std::filesystem::rename(get_prepared_path(path), path, ec);
+				if (!ec)
+				{
+					_current = _prepared;
+					_prepared = file_state{};
+					return true;
+				}
+			}
+
+			discard_prepared();
+			return open_file(path, path, false, _current);
+		}
+
+		// Creates and reserves the file of the next block under a temporary name, so open() of the path does not wait for the file system.
+		bool prepare(const std::string & path)
+		{
+			if (_prepared.fd >= 0 && _prepared.path == path)
+				return true;
+
+			discard_prepared();
+			return open_file(path, get_prepared_path(path), true, _prepared);
+		}
+
+		bool is_open() const noexcept
+		{
+			return _current.fd >= 0;
+		}
+
+		bool write(const char * data, std::size_t size)
+		{
+			if (_current.fd < 0)
+				return false;
+
+			reserve(_current, _current.size + size);
+
+#if defined(__linux__)
+			if (_current.direct_fd >= 0)
+				return write_direct(data, size);
+
+			if (!write_all(_current.fd, data, size, _current.size))
+				return false;
+
+			_current.size += size;
+#endif
+			return true;
+		}
+
+		bool sync()
+		{
+#if defined(__linux__)
+			return _current.fd >= 0 && fsync(_current.fd) == 0;
+#else
+			return false;
+#endif
+		}
+
+		// Releases the reserved space beyond the data.
+		bool close()
+		{
+			if (_current.fd < 0)
+				return true;
+
+			const auto result = close_file(_current, true);
+			_previous_size = std::max<std::uint64_t>(_current.size, min_reservation);
+			_current = file_state{};
+
+			return result;
+		}
+
+	private:
+		static constexpr std::size_t block_alignment = 4096;
+		static constexpr std::size_t direct_buffer_size = 1024 * 1024;
+		static constexpr std::uint64_t min_reservation = 16 * 1024 * 1024;
+
+		struct file_state
+		{
+			int fd = -1;
+			int direct_fd = -1; // O_DIRECT descriptor of direct writes
+			std::string path;
+			std::uint64_t size = 0; // data in the file
+			std::uint64_t reserved = 0; // end of the reserved space
+			std::size_t tail = 0; // data of the last partial block at the start of the direct buffer
+		};
+
+		struct aligned_free
+		{
+			void operator()(char * data) const
+			{
+				free(data);
+			}
+		};
+
+		static std::string get_prepared_path(const std::string & path)
+		{
+			return path + ".next";
+		}
+
+		bool open_file(const std::string & path, const std::string & file_path, bool truncate, file_state & state)
+		{
+#if defined(__linux__)
+			const auto flags = O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0);
+
+			state = file_state{};
+			state.path = path;
+
+			state.fd = ::open(file_path.c_str(), flags | O_WRONLY, 0644);
+			if (state.fd < 0)
+				return false;
+
+			if (_direct)
+			{
+				state.direct_fd = ::open(file_path.c_str(), O_RDWR | O_CLOEXEC | O_DIRECT);
+			}
+
+			struct stat info;
+			if (fstat(state.fd, &info) != 0 || (state.direct_fd >= 0 && !read_tail(state, static_cast<std::uint64_t>(info.st_size))))
+			{
+				close_file(state, false);
+				state = file_state{};
+				return false;
+			}
+
+			state.size = static_cast<std::uint64_t>(info.st_size);
+			state.reserved = state.size;
+
+			// the previous block tells how much the next one needs, a failed reservation only means ordinary appends
+			reserve(state, state.size + std::max(_previous_size, min_reservation));
+			return true;
+#else
+			(void)path;
+			(void)file_path;
+			(void)truncate;
+			(void)state;
+			return false;
+#endif
+		}
+
+		// Grows the reservation by at least its size, so a file needs few reservations however big it grows.
+		static void reserve(file_state & state, std::uint64_t end)
+		{
+#if defined(__linux__)
+			if (end <= state.reserved)
+				return;
+
+			const auto length = std::max(end - state.reserved, std::max(state.reserved, min_reservation));
+			if (fallocate(state.fd, FALLOC_FL_KEEP_SIZE, static_cast<off_t>(state.reserved), static_cast<off_t>(length)) == 0)
+			{
+				state.reserved += length;
+			}
+#else
+			(void)state;
+			(void)end;
+#endif
+		}
+
+		bool close_file(file_state & state, bool release)
+		{
+#if defined(__linux__)
+			if (release && state.reserved > state.size)
+			{
+				// truncation to the same size frees the blocks beyond the end of the file
+				(void)ftruncate(state.fd, static_cast<off_t>(state.size));
+			}
+
+			if (state.direct_fd >= 0)
+			{
+				::close(state.direct_fd);
+			}
+
+			return ::close(state.fd) == 0;
+#else
+			(void)state;
+			(void)release;
+			return false;
+#endif
+		}
+
+		void discard_prepared()
+		{
+			if (_prepared.fd < 0)
+				return;
+
+			close_file(_prepared, false);
+
+			std::error_code ec;
+			std::filesystem::remove(get_prepared_path(_prepared.path), ec);
+			_prepared = file_state{};
+		}
+
+#if defined(__linux__)
+		// An appended file continues in its last partial block.
+		bool read_tail(file_state & state, std::uint64_t size)
+		{
+			const auto offset = size - size % block_alignment;
+			state.tail = static_cast<std::size_t>(size - offset);
+			if (state.tail == 0)
+				return true;
+
+			return pread(state.direct_fd, _direct_buffer.get(), block_alignment, static_cast<off_t>(offset)) >= static_cast<ssize_t>(state.tail);
+		}
+
+		static bool write_all(int fd, const char * data, std::size_t size, std::uint64_t offset)
+		{
+			while (size != 0)
+			{
+				const auto written = pwrite(fd, data, size, static_cast<off_t>(offset));
+				if (written <= 0)
+					return false;
+
+				data += written;
+				size -= static_cast<std::size_t>(written);
+				offset += static_cast<std::uint64_t>(written);
+			}
+
+			return true;
+		}
+
+		bool write_direct(const char * data, std::size_t size)
+		{
+			auto & state = _current;
+			const auto buffer = _direct_buffer.get();
+
+			while (size != 0)
+			{
+				const auto chunk = std::min(size, direct_buffer_size - state.tail);
+				std::memcpy(buffer + state.tail, data, chunk);
+				data += chunk;
+				size -= chunk;
+
+				const auto offset = state.size - state.tail; // start of the buffer in the file, it is aligned
+				const auto filled = state.tail + chunk;
+				const auto full = filled - filled % block_alignment;
+
+				if (!write_all(state.direct_fd, buffer, full, offset) ||
+					!write_all(state.fd, buffer + full, filled - full, offset + full))
+					return false;
+
+				state.size = offset + filled;
+				state.tail = filled - full;
+				std::memmove(buffer, buffer + full, state.tail);
+			}
+
+			return true;
+		}
+#endif
+
+		const bool _direct;
+		std::unique_ptr<char, aligned_free> _direct_buffer;
+
+		file_state _current;
+		file_state _prepared;
+		std::uint64_t _previous_size = 0;
+	};
+}
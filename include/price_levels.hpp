@@ -0,0 +1,174 @@
+/*
+Market data collector for crypto exchanges.
+https://github.com/ilia-funtov/crypto-market-data-collector
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2022 Ilia Funtov.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace market_data_common
+{
+	enum class book_side : unsigned int
+	{
+		bid,
+		ask
+	};
+
+	using price_tick_t = std::int64_t;
+
+	// Prices are keyed by integer ticks of this size, fine enough for any instrument we collect.
+	constexpr double ticks_per_price_unit = 1e8;
+
+	inline price_tick_t price_to_tick(double price)
+	{
+		return static_cast<price_tick_t>(std::llround(price * ticks_per_price_unit));
+	}
+
+	struct price_level
+	{
+		price_tick_t tick;
+		double price;
+		double volume;
+	};
+
+	// One side of an order book kept as a contiguous array sorted from the worst price to the best one.
+	// Updates mostly hit the levels near the top, which live at the end of the array,
+	// so inserts and erases move only a few elements and never allocate once the capacity is reached.
+	// Iteration goes from the best level to the worst one.
+	template <book_side side>
+	class price_levels
+	{
+	public:
+		using container_t = std::vector<price_level>;
+		using const_iterator = container_t::const_reverse_iterator;
+
+		price_levels() = default;
+
+		const_iterator begin() const noexcept { return _levels.crbegin(); }
+		const_iterator end() const noexcept { return _levels.crend(); }
+		const_iterator cbegin() const noexcept { return _levels.crbegin(); }
+		const_iterator cend() const noexcept { return _levels.crend(); }
+
+		bool empty() const noexcept { return _levels.empty(); }
+		std::size_t size() const noexcept { return _levels.size(); }
+
+		void clear() noexcept { _levels.clear(); }
+		void reserve(std::size_t size) { _levels.reserve(size); }
+
+		const price_level & best() const
+		{
+			assert(!_levels.empty());
+			return _levels.back();
+		}
+
+		const price_level & operator [](std::size_t index) const
+		{
+			assert(index < _levels.size());
+			return _levels[_levels.size() - 1 - index];
+		}
+
+		void insert_or_assign(double price, double volume)
+		{
+			const auto tick = price_to_tick(price);
+			const auto iter = find_position(tick);
+			if (iter != _levels.end() && iter->tick == tick)
+			{
+				iter->volume = volume;
+			}
+			else
+			{
+				_levels.insert(iter, price_level{ tick, price, volume });
+			}
+		}
+
+		void erase(double price)
+		{
+			const auto tick = price_to_tick(price);
+			const auto iter = find_position(tick);
+			if (iter != _levels.end() && iter->tick == tick)
+			{
+				_levels.erase(iter);
+			}
+		}
+
+		// Sets the volume of the level or removes the level when volume is not positive.
+		void update(double price, double volume)
+		{
+			if (volume <= 0)
+			{
+				erase(price);
+			}
+			else
+			{
+				insert_or_assign(price, volume);
+			}
+		}
+
+		// Keeps only the given number of the best levels.
+		void truncate(std::size_t size)
+		{
+			if (_levels.size() > size)
+			{
+				_levels.erase(_levels.begin(), _levels.begin() + (_levels.size() - size));
+			}
+		}
+
+		// Bulk loading for snapshots: levels are appended in any order and sorted once by sort_levels().
+		void emplace_unsorted(double price, double volume)
+		{
+			_levels.push_back(price_level{ price_to_tick(price), price, volume });
+		}
+
+		void sort_levels()
+		{
+			std::stable_sort(
+				_levels.begin(),
+				_levels.end(),
+				[](const price_level & lhs, const price_level & rhs) { return is_worse(lhs.tick, rhs.tick); });
+
+			// keep the last received volume for duplicated prices
+			const auto last = std::unique(
+				_levels.rbegin(),
+				_levels.rend(),
+				[](const price_level & lhs, const price_level & rhs) { return lhs.tick == rhs.tick; });
+
+			_levels.erase(_levels.begin(), last.base());
+		}
+
+	private:
+		static bool is_worse(price_tick_t lhs, price_tick_t rhs) noexcept
+		{
+			if constexpr (side == book_side::bid)
+			{
+				return lhs < rhs;
+			}
+			else
+			{
+				return lhs > rhs;
+			}
+		}
+
+		container_t::iterator find_position(price_tick_t tick)
+		{
+			return std::lower_bound(
+				_levels.begin(),
+				_levels.end(),
+				tick,
+				[](const price_level & level, price_tick_t value) { return is_worse(level.tick, value); });
+		}
+
+		container_t _levels;
+	};
+
+	using bid_levels_t = price_levels<book_side::bid>;
+	using ask_levels_t = price_levels<book_side::ask>;
+}
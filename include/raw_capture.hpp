@@ -0,0 +1,225 @@
+/*
+Market data collector for crypto exchanges.
+https://github.com/ilia-funtov/crypto-market-data-collector
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2022 Ilia Funtov.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <binary_format.hpp>
+#include <dump_writer.hpp>
+
+// Raw capture files keep websocket messages exactly as they were received, for replays and benchmarks.
+//
+// header (8 bytes): char[4] magic "MDRC", u16 version, u16 padding
+// record header (16 bytes): u8 record type, u8 padding, u16 stream id, u32 payload size, u64 receive time (microseconds)
+//   stream record (type 1): a websocket connection was created, the payload is the feed name like "kraken"
+//   message record (type 2): the payload is the text of a message of the stream
+//
+// Streams are numbered in the order they were created. A partial record at the end (the collector was killed) is ignored.
+namespace raw_capture
+{
+	constexpr char file_magic[4] = { 'M', 'D', 'R', 'C' };
+	constexpr std::uint16_t version = 1;
+
+	constexpr std::size_t header_size = 8;
+	constexpr std::size_t record_header_size = 16;
+
+	enum class record_type : std::uint8_t
+	{
+		stream = 1,
+		message = 2
+	};
+
+	class writer;
+
+	// Messages of one websocket connection.
+	class stream
+	{
+	public:
+		stream(const std::shared_ptr<writer> & capture_writer, std::uint16_t id) :
+			_writer(capture_writer),
+			_id(id)
+		{
+		}
+
+		stream(const stream &) = delete;
+		stream & operator = (const stream &) = delete;
+		stream(stream &&) = delete;
+		stream & operator = (stream &&) = delete;
+
+		void write(std::uint64_t receive_timestamp, std::string_view message);
+
+	private:
+		const std::shared_ptr<writer> _writer;
+		const std::uint16_t _id;
+	};
+
+	// Capture file shared by all connections of the process, has to be created with std::make_shared.
+	// Records are written under a lock by io threads, so capturing is meant for recording sessions, not for production collection.
+	class writer: public std::enable_shared_from_this<writer>
+	{
+	public:
+		// An existing file is not overwritten, stream ids would be ambiguous in an appended file.
+		explicit writer(const std::string & path, const dump_writer::flush_options & options = dump_writer::flush_options{}) :
+			_file(get_options(options))
+		{
+			if (std::filesystem::exists(path))
+				throw std::runtime_error("Capture file exists already: " + path);
+
+			if (!_file.open(path))
+				throw std::runtime_error("Could not open capture file: " + path);
+
+			auto & buffer = _file.buffer();
+			for (const auto c : file_magic)
+			{
+				buffer.append(c);
+			}
+
+			binary_format::put<std::uint16_t>(buffer, version);
+			binary_format::put_padding(buffer, 2);
+		}
+
+		writer(const writer &) = delete;
+		writer & operator = (const writer &) = delete;
+		writer(writer &&) = delete;
+		writer & operator = (writer &&) = delete;
+
+		std::shared_ptr<stream> add_stream(const std::string & feed_name)
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+
+			if (_streams_count == max_streams_count)
+				throw std::runtime_error("Too many capture streams.");
+
+			const auto id = _streams_count++;
+			put_record(record_type::stream, id, 0, feed_name);
+
+			return std::make_shared<stream>(shared_from_this(), id);
+		}
+
+		void write(std::uint16_t stream_id, std::uint64_t receive_timestamp, std::string_view message)
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+			put_record(record_type::message, stream_id, receive_timestamp, message);
+		}
+
+		bool flush()
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+			return _file.flush();
+		}
+
+	private:
+		static constexpr std::uint16_t max_streams_count = 0xffff;
+
+		static dump_writer::flush_options get_options(dump_writer::flush_options options)
+		{
+			options.compression = dump_writer::compression_type::none; // the reader reads plain files only
+			return options;
+		}
+
+		void put_record(record_type type, std::uint16_t stream_id, std::uint64_t receive_timestamp, std::string_view payload)
+		{
+			auto & buffer = _file.buffer();
+
+			buffer.append(static_cast<char>(type));
+			binary_format::put_padding(buffer, 1);
+			binary_format::put<std::uint16_t>(buffer, stream_id);
+			binary_format::put<std::uint32_t>(buffer, static_cast<std::uint32_t>(payload.size()));
+			binary_format::put<std::uint64_t>(buffer, receive_timestamp);
+			buffer.append(payload);
+
+			_file.flush_if_needed();
+		}
+
+		std::mutex _mtx;
+		dump_writer::buffered_file _file;
+		std::uint16_t _streams_count = 0;
+	};
+
+	inline void stream::write(std::uint64_t receive_timestamp, std::string_view message)
+	{
+		_writer->write(_id, receive_timestamp, message);
+	}
+
+	struct record
+	{
+		record_type type;
+		std::uint16_t stream_id;
+		std::uint64_t receive_timestamp;
+		std::string_view payload; // valid while the reader exists
+	};
+
+	// Reads the whole file into memory, so replays do not wait for the disk.
+	class reader
+	{
+	public:
+		explicit reader(const std::string & path)
+		{
+			std::unique_ptr<FILE, int(*)(FILE *)> file(fopen(path.c_str(), "rb"), &fclose);
+			if (file == nullptr)
+				throw std::runtime_error("Could not open capture file: " + path);
+
+			_data.resize(std::filesystem::file_size(path));
+			if (fread(_data.data(), 1, _data.size(), file.get()) != _data.size())
+				throw std::runtime_error("Could not read capture file: " + path);
+
+			if (_data.size() < header_size || std::memcmp(_data.data(), file_magic, sizeof(file_magic)) != 0)
+				throw std::runtime_error("Not a capture file: " + path);
+
+			if (binary_format::get<std::uint16_t>(_data.data() + 4) != version)
+				throw std::runtime_error("Unsupported version of capture file: " + path);
+
+			rewind();
+		}
+
+		reader(const reader &) = delete;
+		reader & operator = (const reader &) = delete;
+		reader(reader &&) = delete;
+		reader & operator = (reader &&) = delete;
+
+		void rewind() noexcept
+		{
+			_pos = header_size;
+		}
+
+		// Returns false at the end of the file.
+		bool next(record & result) noexcept
+		{
+			if (_data.size() - _pos < record_header_size)
+				return false;
+
+			const auto data = _data.data() + _pos;
+			const auto payload_size = binary_format::get<std::uint32_t>(data + 4);
+			if (_data.size() - _pos - record_header_size < payload_size)
+				return false;
+
+			result.type = static_cast<record_type>(data[0]);
+			result.stream_id = binary_format::get<std::uint16_t>(data + 2);
+			result.receive_timestamp = binary_format::get<std::uint64_t>(data + 8);
+			result.payload = std::string_view(reinterpret_cast<const char *>(data + record_header_size), payload_size);
+
+			_pos += record_header_size + payload_size;
+			return true;
+		}
+
+	private:
+		std::vector<unsigned char> _data;
+		std::size_t _pos = 0;
+	};
+}
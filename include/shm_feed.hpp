@@ -0,0 +1,402 @@
+/*
+Market data collector for crypto exchanges.
+https://github.com/ilia-funtov/crypto-market-data-collector
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2022 Ilia Funtov.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__unix__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <binary_format.hpp>
+
+// Shared memory feed: normalized records of one symbol published by the collector to local readers.
+// A ring of fixed size slots has a single writer and any number of readers, every slot is guarded by a seqlock,
+// so readers never block the writer and a reader which falls behind by more than the ring size loses the overwritten records.
+//
+// header (128 bytes): char[4] magic "MDSF", u16 version, u16 padding, u32 slot size, u32 slots count, u32 depth, u32 padding,
+//   i64 creation time (microseconds), char[32] symbol, 8 bytes padding, then on its own cache line u64 number of published records
+// slot (slot size bytes): u64 version (2n + 1 while record n is written, 2n + 2 when it is complete), u32 record size,
+//   u8 record type, 3 bytes padding, record in binary_format (trade or price record of the depth of the header)
+//
+// Integers of the header and slot headers are in the host byte order, records are little-endian as in dump files.
+namespace shm_feed
+{
+	constexpr char magic[4] = { 'M', 'D', 'S', 'F' };
+	constexpr std::uint16_t version = 1;
+
+	constexpr std::size_t header_size = 128;
+	constexpr std::size_t published_offset = 64;
+	constexpr std::size_t slot_header_size = 16;
+	constexpr std::size_t slot_alignment = 64;
+
+	static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "Shared memory feed needs lock-free 64-bit atomics.");
+
+	// Slot size for records of the depth.
+	inline std::uint32_t get_slot_size(std::uint32_t depth)
+	{
+		const auto record_size = std::max(binary_format::price_record_size(depth), binary_format::trade_record_size);
+		const auto size = slot_header_size + record_size;
+		return static_cast<std::uint32_t>((size + slot_alignment - 1) / slot_alignment * slot_alignment);
+	}
+
+	namespace details
+	{
+		// Mapping of a POSIX shared memory object, names are like "/md_BTCUSD".
+		class shared_memory
+		{
+		public:
+			// Creates a new object replacing an existing one of the same name, readers of the old one keep their mapping.
+			shared_memory(const std::string & name, std::size_t size) :
+				_name(name),
+				_owner(true)
+			{
+#if defined(__unix__)
+				shm_unlink(name.c_str());
+
+				const auto fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+				if (fd < 0)
+					throw std::runtime_error("Could not create shared memory: " + name);
+
+				if (ftruncate(fd, static_cast<off_t>(size)) != 0)
+				{
+					close(fd);
+					shm_unlink(name.c_str());
+					throw std::runtime_error("Could not allocate shared memory: " + name);
+				}
+
+				map(fd, size, PROT_READ | PROT_WRITE);
+#else
+				(void)size;
+				throw std::runtime_error("Shared memory feeds are not supported on this platform.");
+#endif
+			}
+
+			// Opens an existing object for reading.
+			explicit shared_memory(const std::string & name) :
+				_name(name),
+				_owner(false)
+			{
+#if defined(__unix__)
+				const auto fd = shm_open(name.c_str(), O_RDONLY, 0);
+				if (fd < 0)
+					throw std::runtime_error("Could not open shared memory: " + name);
+
+				struct stat info;
+				if (fstat(fd, &info) != 0)
+				{
+					close(fd);
+					throw std::runtime_error("Could not open shared memory: " + name);
+				}
+
+				map(fd, static_cast<std::size_t>(info.st_size), PROT_READ);
+#else
+				throw std::runtime_error("Shared memory feeds are not supported on this platform.");
+#endif
+			}
+
+			shared_memory(const shared_memory &) = delete;
+			shared_memory & operator = (const shared_memory &) = delete;
+			shared_memory(shared_memory &&) = delete;
+			shared_memory & operator = (shared_memory &&) = delete;
+
+			~shared_memory()
+			{
+#if defined(__unix__)
+				munmap(_data, _size);
+
+				if (_owner)
+					shm_unlink(_name.c_str());
+#endif
+			}
+
+			unsigned char * data() const noexcept
+			{
+				return _data;
+			}
+
+			std::size_t size() const noexcept
+			{
+				return _size;
+			}
+
+		private:
+#if defined(__unix__)
+			void map(int fd, std::size_t size, int protection)
+			{
+				const auto data = mmap(nullptr, size, protection, MAP_SHARED, fd, 0);
+				close(fd);
+
+				if (data == MAP_FAILED)
+				{
+					if (_owner)
+						shm_unlink(_name.c_str());
+
+					throw std::runtime_error("Could not map shared memory: " + _name);
+				}
+
+				_data = static_cast<unsigned char *>(data);
+				_size = size;
+			}
+#endif
+
+			const std::string _name;
+			const bool _owner;
+			unsigned char * _data = nullptr;
+			std::size_t _size = 0;
+		};
+
+		template <typename T>
+		void put(unsigned char * data, T value)
+		{
+			std::memcpy(data, &value, sizeof(value));
+		}
+
+		template <typename T>
+		T get(const unsigned char * data)
+		{
+			T value;
+			std::memcpy(&value, data, sizeof(value));
+			return value;
+		}
+
+		inline std::atomic<std::uint64_t> & get_atomic(unsigned char * data)
+		{
+			return *reinterpret_cast<std::atomic<std::uint64_t> *>(data);
+		}
+
+		inline const std::atomic<std::uint64_t> & get_atomic(const unsigned char * data)
+		{
+			return *reinterpret_cast<const std::atomic<std::uint64_t> *>(data);
+		}
+	}
+
+	// The only writer of a feed, it is removed when the writer is destroyed.
+	class writer
+	{
+	public:
+		writer(const std::string & name, const std::string & symbol, std::uint32_t depth, std::uint32_t slots_count, std::int64_t creation_time) :
+			_slot_size(get_slot_size(depth)),
+			_slots_count(slots_count),
+			_memory(name, header_size + static_cast<std::size_t>(get_slot_size(depth)) * check_slots_count(slots_count))
+		{
+			const auto data = _memory.data();
+
+			details::put<std::uint16_t>(data + 4, version);
+			details::put<std::uint32_t>(data + 8, _slot_size);
+			details::put<std::uint32_t>(data + 12, _slots_count);
+			details::put<std::uint32_t>(data + 16, depth);
+			details::put<std::int64_t>(data + 24, creation_time);
+			std::memcpy(data + 32, symbol.data(), std::min(symbol.size(), binary_format::symbol_size));
+
+			// readers check the magic last
+			std::atomic_thread_fence(std::memory_order_release);
+			std::memcpy(data, magic, sizeof(magic));
+		}
+
+		writer(const writer &) = delete;
+		writer & operator = (const writer &) = delete;
+		writer(writer &&) = delete;
+		writer & operator = (writer &&) = delete;
+
+		// Publishes a record, returns its number.
+		std::uint64_t write(binary_format::record_type type, std::string_view record)
+		{
+			if (record.size() > _slot_size - slot_header_size)
+				throw std::invalid_argument("Record does not fit into a shared memory feed slot.");
+
+			const auto number = _published;
+			const auto slot = _memory.data() + header_size + (number % _slots_count) * _slot_size;
+			auto & slot_version = details::get_atomic(slot);
+
+			slot_version.store(number * 2 + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+
+			details::put<std::uint32_t>(slot + 8, static_cast<std::uint32_t>(record.size()));
+			slot[12] = static_cast<unsigned char>(type);
+			std::memcpy(slot + slot_header_size, record.data(), record.size());
+
+			slot_version.store(number * 2 + 2, std::memory_order_release);
+
+			_published = number + 1;
+			details::get_atomic(_memory.data() + published_offset).store(_published, std::memory_order_release);
+
+			return number;
+		}
+
+		std::uint64_t published() const noexcept
+		{
+			return _published;
+		}
+
+	private:
+		static std::uint32_t check_slots_count(std::uint32_t slots_count)
+		{
+			if (slots_count == 0)
+				throw std::invalid_argument("Shared memory feed must have slots.");
+
+			return slots_count;
+		}
+
+		const std::uint32_t _slot_size;
+		const std::uint32_t _slots_count;
+		details::shared_memory _memory;
+		std::uint64_t _published = 0;
+	};
+
+	struct record
+	{
+		std::uint64_t number; // records of a feed are numbered from 0, a gap means lost records
+		binary_format::record_type type;
+		const unsigned char * data; // valid until the next call of the reader
+		std::size_t size;
+	};
+
+	// Reader of a feed, it starts with records published after it was opened.
+	// Decode records with binary_format::parse_trade_record() and binary_format::parse_price_record() with depth().
+	class reader
+	{
+	public:
+		explicit reader(const std::string & name) :
+			_memory(name)
+		{
+			const auto data = _memory.data();
+			if (_memory.size() < header_size || std::memcmp(data, magic, sizeof(magic)) != 0)
+				throw std::runtime_error("Not a shared memory feed: " + name);
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+
+			if (details::get<std::uint16_t>(data + 4) != version)
+				throw std::runtime_error("Unsupported version of shared memory feed: " + name);
+
+			_slot_size = details::get<std::uint32_t>(data + 8);
+			_slots_count = details::get<std::uint32_t>(data + 12);
+			_depth = details::get<std::uint32_t>(data + 16);
+			_creation_time = details::get<std::int64_t>(data + 24);
+
+			const auto symbol = reinterpret_cast<const char *>(data + 32);
+			_symbol.assign(symbol, std::find(symbol, symbol + binary_format::symbol_size, '\0'));
+
+			if (_slots_count == 0 || _slot_size < get_slot_size(_depth) || _memory.size() < header_size + static_cast<std::size_t>(_slot_size) * _slots_count)
+				throw std::runtime_error("Invalid shared memory feed: " + name);
+
+			_buffer.resize(_slot_size - slot_header_size);
+			seek_latest();
+		}
+
+		reader(const reader &) = delete;
+		reader & operator = (const reader &) = delete;
+		reader(reader &&) = delete;
+		reader & operator = (reader &&) = delete;
+
+		// Skips records which were not read yet.
+		void seek_latest() noexcept
+		{
+			_next = published();
+		}
+
+		// Moves to the oldest record still in the ring.
+		void seek_oldest() noexcept
+		{
+			const auto last = published();
+			_next = (last > _slots_count) ? last - _slots_count : 0;
+		}
+
+		// Returns false when there is no new record. Never blocks, readers poll at the rate they need.
+		bool next(record & result)
+		{
+			for (;;)
+			{
+				const auto last = published();
+				if (_next >= last)
+					return false;
+
+				if (last - _next > _slots_count)
+				{
+					_lost += last - _next - _slots_count;
+					_next = last - _slots_count;
+				}
+
+				const auto slot = _memory.data() + header_size + (_next % _slots_count) * _slot_size;
+				const auto & slot_version = details::get_atomic(slot);
+				const auto expected = _next * 2 + 2;
+
+				const auto before = slot_version.load(std::memory_order_acquire);
+				if (before == expected)
+				{
+					const auto size = std::min<std::size_t>(details::get<std::uint32_t>(slot + 8), _buffer.size());
+					const auto type = static_cast<binary_format::record_type>(slot[12]);
+					std::memcpy(_buffer.data(), slot + slot_header_size, size);
+
+					std::atomic_thread_fence(std::memory_order_acquire);
+					if (slot_version.load(std::memory_order_relaxed) == before)
+					{
+						result = record{ _next++, type, _buffer.data(), size };
+						return true;
+					}
+				}
+
+				// the writer overwrote the slot with a newer record
+				++_lost;
+				++_next;
+			}
+		}
+
+		// Records overwritten before they were read.
+		std::uint64_t lost() const noexcept
+		{
+			return _lost;
+		}
+
+		const std::string & symbol() const noexcept
+		{
+			return _symbol;
+		}
+
+		std::uint32_t depth() const noexcept
+		{
+			return _depth;
+		}
+
+		// A writer restarted by the collector creates a new feed, such a reader has to be opened again to get its records.
+		std::int64_t creation_time() const noexcept
+		{
+			return _creation_time;
+		}
+
+	private:
+		std::uint64_t published() const noexcept
+		{
+			return details::get_atomic(_memory.data() + published_offset).load(std::memory_order_acquire);
+		}
+
+		details::shared_memory _memory;
+
+		std::uint32_t _slot_size = 0;
+		std::uint32_t _slots_count = 0;
+		std::uint32_t _depth = 0;
+		std::int64_t _creation_time = 0;
+		std::string _symbol;
+
+		std::vector<unsigned char> _buffer;
+		std::uint64_t _next = 0;
+		std::uint64_t _lost = 0;
+	};
+}
@@ -0,0 +1,500 @@
+/*
+Market data collector for crypto exchanges.
+https://github.com/ilia-funtov/crypto-market-data-collector
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2022 Ilia Funtov.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace lock_free
+{
+	constexpr std::size_t cache_line_size = 64;
+
+	enum class overflow_policy : unsigned int
+	{
+		block, // producer waits until the consumer frees a slot
+		drop_oldest, // the oldest record in the ring is overwritten
+		drop_newest, // the new record is counted and dropped
+		conflate // only the latest record is kept, a record not popped yet is overwritten by the next one
+	};
+
+	inline overflow_policy get_overflow_policy(const std::string & str)
+	{
+		static const std::map<std::string, overflow_policy> name_policy = {
+			{ "block", overflow_policy::block },
+			{ "drop-oldest", overflow_policy::drop_oldest },
+			{ "drop", overflow_policy::drop_newest }
+		};
+
+		const auto iter = name_policy.find(str);
+		if (iter == name_policy.cend())
+			throw std::runtime_error("Unsupported overflow policy: " + str);
+
+		return iter->second;
+	}
+
+	// Bounded single-producer/single-consumer ring of preallocated records.
+	// Slots are constructed once and reused, so records keeping their own buffers
+	// (like vectors with reserved capacity) do not allocate in push() and pop().
+	// A conflating ring is a triple buffer instead: the producer never waits and the consumer gets the latest record.
+	template <typename T>
+	class spsc_ring
+	{
+	public:
+		using slot_initializer_t = std::function<void(T &)>;
+
+		spsc_ring(std::size_t capacity, overflow_policy policy, const slot_initializer_t & initializer = slot_initializer_t{}) :
+			_policy(policy),
+			_slots((policy == overflow_policy::conflate) ? conflating_slots : round_up_capacity(capacity)),
+			_mask(_slots.size() - 1)
+		{
+			if (initializer)
+			{
+				for (auto & slot : _slots)
+				{
+					initializer(slot);
+				}
+			}
+		}
+
+		spsc_ring(const spsc_ring &) = delete;
+		spsc_ring & operator = (const spsc_ring &) = delete;
+		spsc_ring(spsc_ring &&) = delete;
+		spsc_ring & operator = (spsc_ring &&) = delete;
+
+		// Producer side. The fill function writes the record into a free slot.
+		// Returns false when the record was dropped.
+		template <typename fill_t>
+		bool push(fill_t && fill)
+		{
+			if (_policy == overflow_policy::conflate)
+				return push_latest(fill);
+
+			const auto head = _head.load(std::memory_order_relaxed);
+
+			if (head - _cached_tail >= _slots.size())
+			{
+				_cached_tail = _tail.load(std::memory_order_acquire);
+
+				while (head - _cached_tail >= _slots.size())
+				{
+					if (_closed.load(std::memory_order_relaxed))
+					{
+						_dropped.fetch_add(1, std::memory_order_relaxed);
+						return false;
+					}
+
+					switch (_policy)
+					{
+					case overflow_policy::block:
+						std::this_thread::yield();
+						_cached_tail = _tail.load(std::memory_order_acquire);
+						break;
+					case overflow_policy::drop_oldest:
+						if (_tail.compare_exchange_strong(_cached_tail, _cached_tail + 1, std::memory_order_seq_cst))
+						{
+							// the dropped record takes the slot of the new one, wait until the consumer is done copying it
+							while (_reading.load(std::memory_order_seq_cst) == _cached_tail + 1)
+							{
+								std::this_thread::yield();
+							}
+
+							++_cached_tail;
+							_dropped.fetch_add(1, std::memory_order_relaxed);
+						}
+						break;
+					case overflow_policy::drop_newest:
+					case overflow_policy::conflate: // handled by push_latest()
+						_dropped.fetch_add(1, std::memory_order_relaxed);
+						return false;
+					}
+				}
+			}
+
+			fill(_slots[head & _mask]);
+			_head.store(head + 1, std::memory_order_release);
+
+			return true;
+		}
+
+		// Consumer side. Copies the oldest record into the destination.
+		bool pop(T & destination)
+		{
+			if (_policy == overflow_policy::conflate)
+				return pop_latest(destination);
+
+			for (;;)
+			{
+				auto tail = _tail.load(std::memory_order_relaxed);
+
+				// the producer moves tail forward when it drops the oldest records, so it can pass the cached head
+				if (tail >= _cached_head)
+				{
+					_cached_head = _head.load(std::memory_order_acquire);
+					if (tail == _cached_head)
+						return false;
+				}
+
+				if (_policy != overflow_policy::drop_oldest)
+				{
+					destination = _slots[tail & _mask];
+					_tail.store(tail + 1, std::memory_order_release);
+					return true;
+				}
+
+				// the producer drops the oldest record by moving tail, the record being read is announced first,
+				// so the producer either sees the announcement and does not overwrite the slot or has moved tail already
+				_reading.store(tail + 1, std::memory_order_seq_cst);
+				if (_tail.load(std::memory_order_seq_cst) != tail)
+				{
+					_reading.store(0, std::memory_order_release);
+					continue;
+				}
+
+				destination = _slots[tail & _mask];
+
+				const auto taken = _tail.compare_exchange_strong(tail, tail + 1, std::memory_order_seq_cst);
+				_reading.store(0, std::memory_order_release);
+
+				if (taken)
+					return true;
+			}
+		}
+
+		bool empty() const noexcept
+		{
+			if (_policy == overflow_policy::conflate)
+				return (_middle.load(std::memory_order_acquire) & fresh_flag) == 0;
+
+			return _tail.load(std::memory_order_acquire) == _head.load(std::memory_order_acquire);
+		}
+
+		std::size_t size() const noexcept
+		{
+			if (_policy == overflow_policy::conflate)
+				return empty() ? 0 : 1;
+
+			const auto tail = _tail.load(std::memory_order_acquire);
+			const auto head = _head.load(std::memory_order_acquire);
+			return static_cast<std::size_t>(head - tail);
+		}
+
+		std::size_t capacity() const noexcept
+		{
+			return (_policy == overflow_policy::conflate) ? 1 : _slots.size();
+		}
+
+		std::uint64_t dropped() const noexcept
+		{
+			return _dropped.load(std::memory_order_relaxed);
+		}
+
+		// Records of a conflating ring overwritten before they were popped.
+		std::uint64_t conflated() const noexcept
+		{
+			return _conflated.load(std::memory_order_relaxed);
+		}
+
+		// After closing, a blocked producer stops waiting and drops records.
+		void close() noexcept
+		{
+			_closed = true;
+		}
+
+	private:
+		// Back slot written by the producer, middle slot with the latest record and front slot read by the consumer.
+		static constexpr std::size_t conflating_slots = 3;
+		static constexpr std::uint8_t fresh_flag = 0x4; // the middle slot has a record not popped yet
+		static constexpr std::uint8_t slot_mask = 0x3;
+
+		template <typename fill_t>
+		bool push_latest(fill_t & fill)
+		{
+			fill(_slots[_back]);
+			_sequences[_back] = ++_pushed;
+
+			_back = _middle.exchange(static_cast<std::uint8_t>(_back | fresh_flag), std::memory_order_acq_rel) & slot_mask;
+			return true;
+		}
+
+		// Overwritten records are counted by the consumer, so they are in conflated() before the record which replaced them is returned.
+		bool pop_latest(T & destination)
+		{
+			if ((_middle.load(std::memory_order_relaxed) & fresh_flag) == 0)
+				return false;
+
+			_front = _middle.exchange(_front, std::memory_order_acq_rel) & slot_mask;
+
+			const auto sequence = _sequences[_front];
+			if (sequence > _popped + 1)
+			{
+				_conflated.fetch_add(sequence - _popped - 1, std::memory_order_relaxed);
+			}
+
+			_popped = sequence;
+			destination = _slots[_front];
+			return true;
+		}
+
+		static std::size_t round_up_capacity(std::size_t capacity)
+		{
+			if (capacity == 0)
+				throw std::invalid_argument("Ring capacity must not be zero.");
+
+			std::size_t result = 1;
+			while (result < capacity)
+			{
+				result <<= 1;
+			}
+
+			return result;
+		}
+
+		const overflow_policy _policy;
+		std::vector<T> _slots;
+		const std::size_t _mask;
+
+		std::atomic_bool _closed{false};
+
+		alignas(cache_line_size) std::atomic<std::uint64_t> _head{0};
+		std::uint64_t _cached_tail = 0; // producer's copy of tail
+
+		alignas(cache_line_size) std::atomic<std::uint64_t> _tail{0};
+		std::atomic<std::uint64_t> _reading{0}; // position + 1 of the record the consumer copies, 0 when none (drop_oldest)
+		std::uint64_t _cached_head = 0; // consumer's copy of head
+
+		alignas(cache_line_size) std::atomic<std::uint64_t> _dropped{0};
+		std::atomic<std::uint64_t> _conflated{0};
+
+		// slots of a conflating ring
+		alignas(cache_line_size) std::atomic<std::uint8_t> _middle{1};
+		std::uint64_t _sequences[conflating_slots] = {}; // number of the record in a slot, owned with the slot
+
+		alignas(cache_line_size) std::uint8_t _back = 0; // producer's slot
+		std::uint64_t _pushed = 0;
+
+		alignas(cache_line_size) std::uint8_t _front = 2; // consumer's slot
+		std::uint64_t _popped = 0;
+	};
+
+	// One SPSC ring per producer (keyed by producer id) drained by a single consumer.
+	// Producers wake the consumer up only when it sleeps, so a busy consumer costs them no syscalls.
+	// pop_ordered() merges the rings by timestamp, so records of all producers come out in time order as far as every ring is in order.
+	template <typename key_t, typename record_t>
+	class spsc_channel
+	{
+	public:
+		using ring_t = spsc_ring<record_t>;
+		using rings_t = std::map<key_t, std::unique_ptr<ring_t>>;
+
+		template <typename keys_t>
+		spsc_channel(
+			const keys_t & keys,
+			std::size_t capacity,
+			overflow_policy policy,
+			const typename ring_t::slot_initializer_t & initializer = typename ring_t::slot_initializer_t{})
+		{
+			for (const auto & key : keys)
+			{
+				_rings.emplace(key, std::make_unique<ring_t>(capacity, policy, initializer));
+			}
+
+			_heads.resize(_rings.size());
+
+			auto head = _heads.begin();
+			for (auto & ring : _rings)
+			{
+				head->key = ring.first;
+				head->ring = ring.second.get();
+				if (initializer)
+				{
+					initializer(head->record);
+				}
+
+				++head;
+			}
+		}
+
+		spsc_channel(const spsc_channel &) = delete;
+		spsc_channel & operator = (const spsc_channel &) = delete;
+		spsc_channel(spsc_channel &&) = delete;
+		spsc_channel & operator = (spsc_channel &&) = delete;
+
+		template <typename fill_t>
+		bool push(const key_t & key, fill_t && fill)
+		{
+			const auto iter = _rings.find(key);
+			assert(iter != _rings.end());
+
+			const auto result = iter->second->push(std::forward<fill_t>(fill));
+
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (_consumer_waiting.load(std::memory_order_relaxed))
+			{
+				std::lock_guard<std::mutex> lock(_mtx);
+				_var.notify_one();
+			}
+
+			return result;
+		}
+
+		const rings_t & rings() const noexcept
+		{
+			return _rings;
+		}
+
+		// Consumer side: pops up to max_records records of all rings, every time the one with the smallest order key (timestamp).
+		// The record popped last from every ring waits as its head until it is the oldest one: a k-way merge of the ring heads.
+		// The handler gets the ring key, the record and the number of records the ring lost (dropped or conflated) up to it.
+		template <typename order_t, typename handler_t>
+		std::size_t pop_ordered(std::size_t max_records, order_t && order, handler_t && handler)
+		{
+			std::size_t popped = 0;
+
+			while (popped != max_records)
+			{
+				head_entry * oldest = nullptr;
+
+				for (auto & head : _heads)
+				{
+					if (!head.full && head.ring->pop(head.record))
+					{
+						head.full = true;
+						head.lost = head.ring->dropped() + head.ring->conflated();
+						_staged.fetch_add(1, std::memory_order_relaxed);
+					}
+
+					if (head.full && (oldest == nullptr || order(head.record) < order(oldest->record)))
+					{
+						oldest = &head;
+					}
+				}
+
+				if (oldest == nullptr)
+					break;
+
+				handler(oldest->key, oldest->record, oldest->lost);
+
+				oldest->full = false;
+				_staged.fetch_sub(1, std::memory_order_relaxed);
+				++popped;
+			}
+
+			return popped;
+		}
+
+		bool empty() const noexcept
+		{
+			if (_staged.load(std::memory_order_relaxed) != 0)
+				return false;
+
+			for (const auto & ring : _rings)
+			{
+				if (!ring.second->empty())
+					return false;
+			}
+
+			return true;
+		}
+
+		std::size_t size() const noexcept
+		{
+			std::size_t result = _staged.load(std::memory_order_relaxed);
+			for (const auto & ring : _rings)
+			{
+				result += ring.second->size();
+			}
+
+			return result;
+		}
+
+		std::uint64_t dropped() const noexcept
+		{
+			std::uint64_t result = 0;
+			for (const auto & ring : _rings)
+			{
+				result += ring.second->dropped();
+			}
+
+			return result;
+		}
+
+		std::uint64_t conflated() const noexcept
+		{
+			std::uint64_t result = 0;
+			for (const auto & ring : _rings)
+			{
+				result += ring.second->conflated();
+			}
+
+			return result;
+		}
+
+		// Consumer side: sleeps until a record arrives, the stop flag is set or the timeout expires.
+		template <typename rep_t, typename period_t>
+		void wait(const std::atomic_bool & stop, const std::chrono::duration<rep_t, period_t> & timeout)
+		{
+			_consumer_waiting.store(true, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+
+			{
+				std::unique_lock<std::mutex> lock(_mtx);
+				_var.wait_for(lock, timeout, [this, &stop] { return stop.load() || !empty(); });
+			}
+
+			_consumer_waiting.store(false, std::memory_order_relaxed);
+		}
+
+		void notify()
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+			_var.notify_one();
+		}
+
+		void close() noexcept
+		{
+			for (auto & ring : _rings)
+			{
+				ring.second->close();
+			}
+		}
+
+	private:
+		// Consumer's record taken from a ring and not handled yet.
+		struct head_entry
+		{
+			key_t key{};
+			ring_t * ring = nullptr;
+			record_t record;
+			bool full = false;
+			std::uint64_t lost = 0;
+		};
+
+		rings_t _rings;
+		std::vector<head_entry> _heads; // in the order of the rings
+		std::atomic<std::size_t> _staged{0}; // full heads, counted in size() and empty()
+
+		alignas(cache_line_size) std::atomic_bool _consumer_waiting{false};
+		std::mutex _mtx;
+		std::condition_variable _var;
+	};
+}
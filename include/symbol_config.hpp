@@ -0,0 +1,240 @@
+/*
+Market data collector for crypto exchanges.
+https://github.com/ilia-funtov/crypto-market-data-collector
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2022 Ilia Funtov.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <hash_ring.hpp>
+#include <market_data_provider.hpp>
+
+#include <nlohmann/json.hpp>
+#include <json_helpers.hpp>
+
+namespace market_data
+{
+	// "sampling": { "<exchange>": { "mode": "all" | "changes" | "top" | "interval" | "move", "interval_ms": 1000, "min_price_move": 0.5, "min_volume_move": 1 } }
+	inline market_data_common::book_sampling get_book_sampling(const nlohmann::json & config, const std::string & exchange_name)
+	{
+		market_data_common::book_sampling sampling;
+		sampling.mode = market_data_common::get_book_sampling_mode(json_helpers::get_required_value<std::string>(config, "mode"));
+
+		if (sampling.mode == market_data_common::book_sampling_mode::interval)
+		{
+			const auto interval_ms = json_helpers::get_required_value<unsigned int>(config, "interval_ms");
+			if (interval_ms == 0)
+				throw std::runtime_error("Invalid sampling interval of " + exchange_name);
+
+			sampling.interval = std::chrono::milliseconds(interval_ms);
+		}
+		else if (sampling.mode == market_data_common::book_sampling_mode::min_move)
+		{
+			sampling.min_price_move = json_helpers::get_value<double>(config, "min_price_move");
+			sampling.min_volume_move = json_helpers::get_value<double>(config, "min_volume_move");
+
+			if (!(sampling.min_price_move > 0) && !(sampling.min_volume_move > 0))
+				throw std::runtime_error("Sampling by moves of " + exchange_name + " needs min_price_move or min_volume_move");
+		}
+
+		return sampling;
+	}
+
+	// Symbol mapping configs, see config/symbol_mapping.json, config/multi_symbol_mapping.json and config/sharded_symbol_mapping.json.
+	inline general_symbol_description get_symbol_description(
+		const nlohmann::json &config,
+		const std::set<exchange_type> &exchanges,
+		unsigned int depth)
+	{
+		general_symbol_description symbol_description;
+
+		symbol_description.symbol_name = json_helpers::get_required_value<std::string>(config, "symbol");
+		const std::map<std::string, std::string> symbol_mapping = config.at("mapping").get<std::map<std::string, std::string>>();
+
+		std::map<exchange_type, market_data_common::book_sampling> samplings;
+		const auto iter_sampling = config.find("sampling");
+		if (iter_sampling != config.end())
+		{
+			for (const auto & item : iter_sampling->items())
+			{
+				samplings[get_exchange_type(item.key())] = get_book_sampling(item.value(), item.key());
+			}
+		}
+
+		for (const auto &mapping_item : symbol_mapping)
+		{
+			const auto exchange = get_exchange_type(mapping_item.first);
+			if (exchanges.count(exchange))
+			{
+				source_symbol_description desc;
+				desc.symbol_name = mapping_item.second;
+				desc.order_book_size = depth;
+
+				const auto iter_exchange_sampling = samplings.find(exchange);
+				if (iter_exchange_sampling != samplings.cend())
+					desc.sampling = iter_exchange_sampling->second;
+
+				symbol_description.source_exchanges.emplace(exchange, desc);
+			}
+		}
+
+		if (symbol_description.source_exchanges.empty())
+		{
+			throw std::runtime_error("Invalid configuration was provided for symbol mapping: " + symbol_description.symbol_name);
+		}
+
+		symbol_description.price_levels_num = depth;
+
+		return symbol_description;
+	}
+
+	// "sharding": { "nodes": [ "collector-1", { "name": "collector-2", "weight": 2 } ], "replicas": 1, "key": "exchange" | "symbol", "points": 100 }
+	struct shard_config
+	{
+		sharding::hash_ring ring;
+		unsigned int replicas = 1; // nodes collecting every feed, more than one for failover
+		bool by_symbol = false; // all exchanges of a symbol go to the same nodes
+	};
+
+	inline shard_config get_shard_config(const nlohmann::json & config)
+	{
+		shard_config shards;
+		shards.replicas = json_helpers::get_value<unsigned int>(config, "replicas", 1);
+
+		const auto points = json_helpers::get_value<unsigned int>(config, "points", 100);
+		if (points == 0)
+			throw std::runtime_error("Invalid number of hash ring points of shard nodes");
+
+		const auto key = json_helpers::get_value<std::string>(config, "key", "exchange");
+		if (key != "exchange" && key != "symbol")
+			throw std::runtime_error("Invalid sharding key: " + key);
+
+		shards.by_symbol = (key == "symbol");
+
+		for (const auto & node : config.at("nodes"))
+		{
+			if (node.is_string())
+			{
+				shards.ring.add_node(node.get<std::string>(), points);
+			}
+			else
+			{
+				const auto weight = json_helpers::get_value<unsigned int>(node, "weight", 1);
+				shards.ring.add_node(json_helpers::get_required_value<std::string>(node, "name"), points * weight);
+			}
+		}
+
+		if (shards.replicas == 0 || shards.replicas > shards.ring.nodes().size())
+			throw std::runtime_error("Invalid number of shard replicas: " + std::to_string(shards.replicas));
+
+		return shards;
+	}
+
+	// Nodes collecting the feed of the exchange for the symbol, the first one is the primary.
+	inline std::vector<std::string> get_shard_nodes(const shard_config & shards, exchange_type exchange, const std::string & symbol_name)
+	{
+		const auto key = shards.by_symbol ? symbol_name : std::string(get_exchange_name(exchange)) + '/' + symbol_name;
+		return shards.ring.get_nodes(key, shards.replicas);
+	}
+
+	inline nlohmann::json load_symbol_config(const std::string &symbol_config_file)
+	{
+		std::ifstream input(symbol_config_file);
+		if (!input.is_open())
+		{
+			throw std::runtime_error("Could not open config file for symbol mapping");
+		}
+
+		nlohmann::json config;
+		input >> config;
+		return config;
+	}
+
+	// The config has either one "symbol" with its "mapping" or a list of such objects in "symbols".
+	// A config with "sharding" is shared by collector nodes and every node takes the exchanges of symbols assigned to it.
+	inline std::vector<general_symbol_description> get_symbol_descriptions(
+		const nlohmann::json &config,
+		const std::set<exchange_type> &exchanges,
+		unsigned int depth,
+		const std::string &shard_node = {})
+	{
+		using namespace nlohmann;
+
+		std::optional<shard_config> shards;
+
+		const auto iter_sharding = config.find("sharding");
+		if (iter_sharding != config.end())
+		{
+			shards = get_shard_config(*iter_sharding);
+
+			if (shard_node.empty())
+				throw std::runtime_error("Symbols are assigned to shard nodes, the shard node is not defined");
+
+			const auto & nodes = shards->ring.nodes();
+			if (std::find(nodes.cbegin(), nodes.cend(), shard_node) == nodes.cend())
+				throw std::runtime_error("Shard node is not defined in symbol mapping: " + shard_node);
+		}
+		else if (!shard_node.empty())
+		{
+			throw std::runtime_error("Symbol mapping has no sharding for shard node: " + shard_node);
+		}
+
+		std::vector<general_symbol_description> symbol_descriptions;
+		std::set<std::string> symbol_names;
+
+		const auto iter_symbols = config.find("symbols");
+		const auto & symbol_configs = (iter_symbols != config.end()) ? *iter_symbols : json::array({ config });
+
+		for (const auto &symbol_config : symbol_configs)
+		{
+			auto symbol_description = get_symbol_description(symbol_config, exchanges, depth);
+			if (!symbol_names.insert(symbol_description.symbol_name).second)
+			{
+				throw std::runtime_error("Symbol is defined more than once: " + symbol_description.symbol_name);
+			}
+
+			if (shards)
+			{
+				auto & sources = symbol_description.source_exchanges;
+				for (auto iter = sources.begin(); iter != sources.end();)
+				{
+					const auto nodes = get_shard_nodes(*shards, iter->first, symbol_description.symbol_name);
+					iter = (std::find(nodes.cbegin(), nodes.cend(), shard_node) != nodes.cend()) ? std::next(iter) : sources.erase(iter);
+				}
+
+				if (sources.empty())
+					continue;
+			}
+
+			symbol_descriptions.push_back(std::move(symbol_description));
+		}
+
+		if (symbol_descriptions.empty())
+		{
+			throw std::runtime_error(shards ? "No symbols are assigned to shard node: " + shard_node : std::string("No symbols are defined in symbol mapping"));
+		}
+
+		return symbol_descriptions;
+	}
+
+	inline std::vector<general_symbol_description> get_symbol_descriptions(
+		const std::string &symbol_config_file,
+		const std::set<exchange_type> &exchanges,
+		unsigned int depth,
+		const std::string &shard_node = {})
+	{
+		return get_symbol_descriptions(load_symbol_config(symbol_config_file), exchanges, depth, shard_node);
+	}
+}
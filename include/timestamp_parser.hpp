@@ -9,62 +9,139 @@ Copyright (c) 2022 Ilia Funtov.
 #pragma once
 
 #include <cstdint>
-#include <cstdio>
-#include <ctime>
+#include <cstring>
 #include <stdexcept>
-#include <string>
-
-#if (defined(_WIN32) || defined(__WIN32__) || defined(WIN32))
-#define _PLATFORM_WINDOWS_
-#endif
+#include <string_view>
+#include <utility>
 
+// Times of feed messages like 2022-05-01T10:00:00.123456Z, UTC.
+// The fixed layout is parsed in place, the fraction may have any number of digits (only the first 9 are taken)
+// and the trailing Z may be missing.
 namespace timestamp_parser
 {
 	namespace details
-    {
-        inline std::pair<std::uint64_t, std::uint64_t> parse_iso_timestamp(const std::string & iso_time)
-        {
-            unsigned int year = 0, month = 0, day = 0, hour = 0, minute = 0, second = 0, fractional = 0;
-
-    #ifdef _PLATFORM_WINDOWS_
-            const auto result = sscanf_s(iso_time.c_str(), "%u-%u-%uT%u:%u:%u.%uZ", &year, &month, &day, &hour, &minute, &second, &fractional);
-    #else
-            const auto result = sscanf(iso_time.c_str(), "%u-%u-%uT%u:%u:%u.%uZ", &year, &month, &day, &hour, &minute, &second, &fractional);
-    #endif // _PLATFORM_WINDOWS_
-
-            if (result < 6)
-                throw std::runtime_error("Could not parse ISO time string.");
-
-            struct tm timeinfo;
-            timeinfo.tm_year = year - 1900;
-            timeinfo.tm_mon = month - 1;
-            timeinfo.tm_mday = day;
-            timeinfo.tm_hour = hour;
-            timeinfo.tm_min = minute;
-            timeinfo.tm_sec = second;
-
-    #ifdef _PLATFORM_WINDOWS_
-            const auto timestamp_sec = _mkgmtime(&timeinfo);
-    #else
-            const auto timestamp_sec = timegm(&timeinfo);
-    #endif // _PLATFORM_WINDOWS_
-
-            if (timestamp_sec < 0)
-                throw std::runtime_error("Could not make unix timestamp.");
-
-            return std::make_pair(timestamp_sec, fractional);
-        }
-    };
-
-    inline std::uint64_t parse_iso_timestamp_with_milliseconds(const std::string & iso_time)
+	{
+		constexpr std::size_t date_size = 10; // YYYY-MM-DD
+		constexpr std::size_t date_time_size = 19; // YYYY-MM-DDTHH:MM:SS
+		constexpr unsigned int fraction_digits = 9; // nanoseconds
+
+		[[noreturn]] inline void fail()
+		{
+			throw std::runtime_error("Could not parse ISO time string.");
+		}
+
+		inline unsigned int parse_digits(const char * str, std::size_t count)
+		{
+			unsigned int value = 0;
+			for (std::size_t n = 0; n != count; ++n)
+			{
+				const auto digit = static_cast<unsigned int>(str[n]) - '0';
+				if (digit > 9)
+					fail();
+
+				value = value * 10 + digit;
+			}
+
+			return value;
+		}
+
+		// Days since 1970-01-01 of a date of the proleptic Gregorian calendar, see http://howardhinnant.github.io/date_algorithms.html
+		constexpr std::int64_t days_from_civil(std::int64_t year, unsigned int month, unsigned int day) noexcept
+		{
+			year -= (month <= 2) ? 1 : 0;
+			const auto era = (year >= 0 ? year : year - 399) / 400;
+			const auto year_of_era = static_cast<unsigned int>(year - era * 400);
+			const auto day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+			const auto day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+			return era * 146097 + static_cast<std::int64_t>(day_of_era) - 719468;
+		}
+
+		// Seconds of the start of the date, the last date of the thread is reused as messages mostly come from the same day.
+		inline std::int64_t get_date_seconds(const char * date)
+		{
+			struct date_cache
+			{
+				char date[date_size] = {};
+				std::int64_t seconds = -1;
+			};
+
+			thread_local date_cache cache;
+			if (cache.seconds >= 0 && std::memcmp(cache.date, date, date_size) == 0)
+				return cache.seconds;
+
+			if (date[4] != '-' || date[7] != '-')
+				fail();
+
+			const auto year = parse_digits(date, 4);
+			const auto month = parse_digits(date + 5, 2);
+			const auto day = parse_digits(date + 8, 2);
+			if (year < 1970 || month < 1 || month > 12 || day < 1 || day > 31)
+				fail();
+
+			std::memcpy(cache.date, date, date_size);
+			cache.seconds = days_from_civil(year, month, day) * 86400;
+			return cache.seconds;
+		}
+
+		// Seconds since the epoch and nanoseconds of the fraction.
+		inline std::pair<std::uint64_t, std::uint64_t> parse_iso_timestamp(std::string_view iso_time)
+		{
+			if (iso_time.size() < date_time_size)
+				fail();
+
+			const auto str = iso_time.data();
+			if (str[10] != 'T' || str[13] != ':' || str[16] != ':')
+				fail();
+
+			const auto hour = parse_digits(str + 11, 2);
+			const auto minute = parse_digits(str + 14, 2);
+			const auto second = parse_digits(str + 17, 2);
+			if (hour > 23 || minute > 59 || second > 60) // a leap second is the first second of the next minute
+				fail();
+
+			const auto seconds = get_date_seconds(str) + hour * 3600 + minute * 60 + second;
+
+			std::uint64_t nanoseconds = 0;
+			auto pos = date_time_size;
+			if (pos != iso_time.size() && str[pos] == '.')
+			{
+				const auto begin = ++pos;
+				for (; pos != iso_time.size() && str[pos] >= '0' && str[pos] <= '9'; ++pos)
+				{
+					if (pos - begin < fraction_digits)
+						nanoseconds = nanoseconds * 10 + static_cast<std::uint64_t>(str[pos] - '0');
+				}
+
+				if (pos == begin)
+					fail();
+
+				for (auto digits = pos - begin; digits < fraction_digits; ++digits)
+				{
+					nanoseconds *= 10;
+				}
+			}
+
+			if (pos != iso_time.size() && str[pos] == 'Z')
+				++pos;
+
+			if (pos != iso_time.size())
+				fail();
+
+			return std::make_pair(static_cast<std::uint64_t>(seconds), nanoseconds);
+		}
+	}
+
+	// Microseconds since the epoch, the fraction is taken in milliseconds.
+	inline std::uint64_t parse_iso_timestamp_with_milliseconds(std::string_view iso_time)
 	{
 		const auto timestamp_pair = details::parse_iso_timestamp(iso_time);
-		return (timestamp_pair.first * 1000 + timestamp_pair.second) * 1000;
+		return (timestamp_pair.first * 1000 + timestamp_pair.second / 1000000) * 1000;
 	}
 
-    inline std::uint64_t parse_iso_timestamp_with_microseconds(const std::string & iso_time)
-    {
+	// Microseconds since the epoch.
+	inline std::uint64_t parse_iso_timestamp_with_microseconds(std::string_view iso_time)
+	{
 		const auto timestamp_pair = details::parse_iso_timestamp(iso_time);
-        return timestamp_pair.first * 1000000 + timestamp_pair.second;
-    }    
-}
\ No newline at end of file
+		return timestamp_pair.first * 1000000 + timestamp_pair.second / 1000;
+	}
+}
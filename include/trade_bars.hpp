@@ -0,0 +1,264 @@
+/*
+Market data collector for crypto exchanges.
+https://github.com/ilia-funtov/crypto-market-data-collector
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2022 Ilia Funtov.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace market_data_common
+{
+	// Interval like 1s, 5m or 1h.
+	inline std::chrono::seconds get_bar_interval(const std::string & str)
+	{
+		std::size_t pos = 0;
+		unsigned long value = 0;
+
+		try
+		{
+			value = std::stoul(str, &pos);
+		}
+		catch (const std::exception &)
+		{
+			throw std::invalid_argument("Invalid bar interval: " + str);
+		}
+
+		const auto unit = str.substr(pos);
+		std::chrono::seconds interval;
+		if (unit == "s")
+			interval = std::chrono::seconds(value);
+		else if (unit == "m")
+			interval = std::chrono::minutes(value);
+		else if (unit == "h")
+			interval = std::chrono::hours(value);
+		else
+			throw std::invalid_argument("Invalid bar interval: " + str);
+
+		if (interval.count() == 0)
+			throw std::invalid_argument("Invalid bar interval: " + str);
+
+		return interval;
+	}
+
+	struct trade_bar
+	{
+		std::size_t source; // source index or sources number for the bar of all sources
+		std::uint64_t interval; // microseconds
+		std::uint64_t start; // microseconds since epoch, a multiple of the interval
+		double open;
+		double high;
+		double low;
+		double close;
+		double buy_volume; // taker buys
+		double sell_volume;
+		double notional; // sum of price * volume
+		std::uint64_t trades;
+		std::uint64_t open_time; // times of the open and close trades, trades of sources come out of order
+		std::uint64_t close_time;
+
+		double vwap() const noexcept
+		{
+			const auto volume = buy_volume + sell_volume;
+			return (volume > 0) ? notional / volume : 0;
+		}
+	};
+
+	// OHLCV bars of trades of several sources (exchanges) for every interval, per source and of all sources together.
+	// Trades of different sources come out of order, so a bar is closed only when the trade time passed its end
+	// by the close delay. Between trades the trade time moves on with the steady clock, so live bars are closed
+	// in quiet markets too, while replays as fast as possible close bars by the trade times of the capture.
+	// Trades of closed bars are counted as late and skipped. Trades further ahead of the host clock than the maximum clock skew
+	// are counted and skipped before they move the trade time, so one bad timestamp can not close bars of all trades after it.
+	class trade_bar_aggregator
+	{
+	public:
+		trade_bar_aggregator(
+			const std::vector<std::chrono::seconds> & intervals,
+			std::size_t sources_num,
+			std::chrono::microseconds close_delay,
+			std::chrono::microseconds max_clock_skew) :
+			_sources_num(sources_num),
+			_close_delay(static_cast<std::uint64_t>(close_delay.count())),
+			_max_clock_skew(static_cast<std::uint64_t>(max_clock_skew.count()))
+		{
+			assert(!intervals.empty());
+
+			for (const auto interval : intervals)
+			{
+				const auto interval_mcs = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(interval).count());
+				for (std::size_t source = 0; source <= sources_num; ++source)
+				{
+					series bar_series;
+					bar_series.source = source;
+					bar_series.interval = interval_mcs;
+					bar_series.bars.reserve(max_open_bars);
+					_series.push_back(std::move(bar_series));
+				}
+			}
+		}
+
+		trade_bar_aggregator(const trade_bar_aggregator &) = delete;
+		trade_bar_aggregator & operator = (const trade_bar_aggregator &) = delete;
+		trade_bar_aggregator(trade_bar_aggregator &&) = delete;
+		trade_bar_aggregator & operator = (trade_bar_aggregator &&) = delete;
+
+		// Closed bars are passed to the handler.
+		template <typename handler_t>
+		void add(std::size_t source, double price, double volume, std::uint64_t timestamp, bool sell, handler_t && handler)
+		{
+			assert(source < _sources_num);
+
+			if (_max_clock_skew != 0 && timestamp > get_host_time() + _max_clock_skew)
+			{
+				++_future_trades;
+				return;
+			}
+
+			bool late = false;
+			for (auto & bar_series : _series)
+			{
+				if (bar_series.source == source || bar_series.source == _sources_num)
+				{
+					late |= !add(bar_series, price, volume, timestamp, sell);
+				}
+			}
+
+			if (late)
+				++_late_trades;
+
+			if (timestamp > _watermark)
+			{
+				_watermark = timestamp;
+				_watermark_time = std::chrono::steady_clock::now();
+			}
+
+			close(get_trade_time(), handler);
+		}
+
+		// Closes bars by the trade time moved on with the steady clock since the latest trade.
+		template <typename handler_t>
+		void close_expired(handler_t && handler)
+		{
+			if (_watermark != 0)
+			{
+				close(get_trade_time(), handler);
+			}
+		}
+
+		std::uint64_t late_trades() const noexcept
+		{
+			return _late_trades;
+		}
+
+		std::uint64_t future_trades() const noexcept
+		{
+			return _future_trades;
+		}
+
+	private:
+		static constexpr std::size_t max_open_bars = 4;
+
+		struct series
+		{
+			std::size_t source;
+			std::uint64_t interval;
+			std::uint64_t closed_until = 0; // start of the first bar which is not closed yet
+			std::vector<trade_bar> bars; // open bars sorted by start
+		};
+
+		// Returns false for a trade of a closed bar.
+		bool add(series & bar_series, double price, double volume, std::uint64_t timestamp, bool sell)
+		{
+			const auto start = timestamp - timestamp % bar_series.interval;
+			if (start < bar_series.closed_until)
+				return false;
+
+			auto & bars = bar_series.bars;
+			auto iter = std::find_if(bars.begin(), bars.end(), [start](const trade_bar & bar) { return bar.start >= start; });
+			if (iter == bars.end() || iter->start != start)
+			{
+				iter = bars.insert(iter, trade_bar{ bar_series.source, bar_series.interval, start, price, price, price, price, 0, 0, 0, 0, timestamp, timestamp });
+			}
+
+			auto & bar = *iter;
+			bar.high = std::max(bar.high, price);
+			bar.low = std::min(bar.low, price);
+
+			if (timestamp < bar.open_time)
+			{
+				bar.open = price;
+				bar.open_time = timestamp;
+			}
+
+			if (timestamp >= bar.close_time)
+			{
+				bar.close = price;
+				bar.close_time = timestamp;
+			}
+
+			(sell ? bar.sell_volume : bar.buy_volume) += volume;
+			bar.notional += price * volume;
+			++bar.trades;
+
+			return true;
+		}
+
+		static std::uint64_t get_host_time()
+		{
+			return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+		}
+
+		std::uint64_t get_trade_time() const
+		{
+			const auto elapsed = std::chrono::steady_clock::now() - _watermark_time;
+			return _watermark + static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+		}
+
+		template <typename handler_t>
+		void close(std::uint64_t trade_time, handler_t & handler)
+		{
+			for (auto & bar_series : _series)
+			{
+				if (trade_time < _close_delay)
+					continue;
+
+				const auto closed_until = (trade_time - _close_delay) - (trade_time - _close_delay) % bar_series.interval;
+				if (closed_until <= bar_series.closed_until)
+					continue;
+
+				bar_series.closed_until = closed_until;
+
+				auto & bars = bar_series.bars;
+				const auto iter = std::find_if(bars.begin(), bars.end(), [closed_until](const trade_bar & bar) { return bar.start >= closed_until; });
+				for (auto bar_iter = bars.begin(); bar_iter != iter; ++bar_iter)
+				{
+					handler(*bar_iter);
+				}
+
+				bars.erase(bars.begin(), iter);
+			}
+		}
+
+		const std::size_t _sources_num;
+		const std::uint64_t _close_delay;
+		const std::uint64_t _max_clock_skew; // 0 when trade times are not checked
+
+		std::vector<series> _series;
+
+		std::uint64_t _watermark = 0; // the latest trade time
+		std::chrono::steady_clock::time_point _watermark_time;
+		std::uint64_t _late_trades = 0;
+		std::uint64_t _future_trades = 0;
+	};
+}
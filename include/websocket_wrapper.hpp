@@ -9,11 +9,16 @@ Copyright (c) 2022 Ilia Funtov.
 #pragma once
 
 #include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <functional>
+#include <future>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <vector>
 
@@ -25,9 +30,76 @@ Copyright (c) 2022 Ilia Funtov.
 #include <boost/asio/connect.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/ssl/stream.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+
+#include <io_thread_pool.hpp>
+#include <metrics.hpp>
 
 namespace websocket_wrapper
 {
+	// Resolved addresses of hosts shared by all connections of the process, so reconnects do not wait for DNS.
+	// An entry is dropped when connecting to its addresses fails, the next connection resolves the host again.
+	class endpoint_cache
+	{
+	public:
+		using results_t = boost::asio::ip::tcp::resolver::results_type;
+
+		static endpoint_cache & instance()
+		{
+			static endpoint_cache cache;
+			return cache;
+		}
+
+		endpoint_cache(const endpoint_cache &) = delete;
+		endpoint_cache & operator = (const endpoint_cache &) = delete;
+		endpoint_cache(endpoint_cache &&) = delete;
+		endpoint_cache & operator = (endpoint_cache &&) = delete;
+
+		bool find(const std::string & host, unsigned int port, results_t & results)
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+
+			const auto iter = _entries.find(get_key(host, port));
+			if (iter == _entries.end() || std::chrono::steady_clock::now() - iter->second.time > ttl)
+				return false;
+
+			results = iter->second.results;
+			return true;
+		}
+
+		void add(const std::string & host, unsigned int port, const results_t & results)
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+			_entries[get_key(host, port)] = entry{ results, std::chrono::steady_clock::now() };
+		}
+
+		void remove(const std::string & host, unsigned int port)
+		{
+			std::lock_guard<std::mutex> lock(_mtx);
+			_entries.erase(get_key(host, port));
+		}
+
+	private:
+		struct entry
+		{
+			results_t results;
+			std::chrono::steady_clock::time_point time;
+		};
+
+		static constexpr std::chrono::minutes ttl{ 10 };
+
+		endpoint_cache() = default;
+
+		static std::string get_key(const std::string & host, unsigned int port)
+		{
+			return host + ':' + std::to_string(port);
+		}
+
+		std::mutex _mtx;
+		std::map<std::string, entry> _entries;
+	};
+
 	class websocket
 	{
 	public:
@@ -38,23 +110,47 @@ namespace websocket_wrapper
 		};
 
 		using error_handler_t = std::function<void(const std::exception &)>;
-		using read_handler_t = std::function<void(const std::string &)>;
+		// The message is valid only until the handler returns, the buffer is reused for the next one.
+		using read_handler_t = std::function<void(std::string_view)>;
 		using ping_handler_t = std::function<void(control_message_type)>;
+		// Called on every new connection after the handshakes, before its first message.
+		using connected_handler_t = std::function<void()>;
 
+		// Without a pool the websocket runs its own io_context in a dedicated thread,
+		// with a pool all operations run asynchronously on the pool threads.
 		websocket(
 			const std::string & api_address,
 			unsigned int port,
-			const std::string & handshake_target) :
+			const std::string & handshake_target,
+			const std::shared_ptr<io_thread_pool> & pool = nullptr) :
 			_api_address(api_address),
 			_port(port),
-			_handshake_target(handshake_target)
+			_handshake_target(handshake_target),
+			_bytes_received(get_counter("md_websocket_received_bytes_total", "Payload bytes of received websocket messages.")),
+			_messages_received(get_counter("md_websocket_received_messages_total", "Received websocket messages.")),
+			_connections(get_counter("md_websocket_connections_total", "Established websocket connections, every one after the first is a reconnect.")),
+			_connection_errors(get_counter("md_websocket_connection_errors_total", "Failed connection attempts and dropped connections.")),
+			_resolves(get_counter("md_websocket_resolves_total", "Host name resolutions, reconnects take the addresses resolved before.")),
+			_tls_resumptions(get_counter("md_websocket_tls_resumptions_total", "Connections which resumed the TLS session of the previous one.")),
+			_pool(pool)
 		{
+			if (_pool)
+			{
+				_strand = std::make_unique<strand_t>(boost::asio::make_strand(_pool->context()));
+				_reconnect_timer = std::make_unique<boost::asio::steady_timer>(*_strand);
+			}
+
 			_ctx.set_options(
 				boost::asio::ssl::context::default_workarounds |
 				boost::asio::ssl::context::no_sslv2 |
 				boost::asio::ssl::context::no_sslv3);
 
 			_ctx.set_default_verify_paths();
+
+			// sessions (tickets) of TLS 1.3 come after the handshake, so they are taken from the callback
+			SSL_CTX_set_ex_data(_ctx.native_handle(), get_ex_data_index(), this);
+			SSL_CTX_set_session_cache_mode(_ctx.native_handle(), SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+			SSL_CTX_sess_set_new_cb(_ctx.native_handle(), &new_tls_session);
 		}
 
 		websocket(const websocket &) = delete;
@@ -70,22 +166,33 @@ namespace websocket_wrapper
 		void run(
 			read_handler_t read_handler,
 			error_handler_t error_handler,
-			ping_handler_t ping_handler = ping_handler_t{})
+			ping_handler_t ping_handler = ping_handler_t{},
+			connected_handler_t connected_handler = connected_handler_t{})
 		{
 			std::lock_guard<std::mutex> lock(_start_stop_mtx);
-			if (_loop_thread.joinable())
+			if (_loop_thread.joinable() || _session)
 			{
 				throw std::runtime_error("Websocket loop thread is running already.");
 			}
 
 			_running = true;
 
+			_read_handler = read_handler;
+			_error_handler = error_handler;
+			_ping_handler = ping_handler;
+			_connected_handler = connected_handler;
+
+			if (_pool)
+			{
+				auto session = std::make_shared<pool_session>();
+				_session = session;
+				boost::asio::post(*_strand, [this, session]() { connect_async(session); });
+				return;
+			}
+
 			try
 			{
-				_loop_thread = std::thread([this, read_handler, error_handler, ping_handler]()
-				{
-					work_loop(read_handler, error_handler, ping_handler);
-				});
+				_loop_thread = std::thread([this]() { work_loop(); });
 			}
 			catch (...)
 			{
@@ -94,6 +201,7 @@ namespace websocket_wrapper
 			}
 		}
 
+		// With a pool it waits until all operations of the connection complete, so it must not be called from pool threads.
 		void stop()
 		{
 			std::lock_guard<std::mutex> lock(_start_stop_mtx);
@@ -105,7 +213,40 @@ namespace websocket_wrapper
 				_loop_thread.join();
 			}
 
-			_internal_context.reset();
+			if (_session)
+			{
+				auto done = _session->done.get_future();
+
+				boost::asio::post(*_strand, [this, session = std::move(_session)]() { close_connection(); });
+				_session.reset();
+
+				done.wait();
+			}
+
+			std::atomic_store(&_internal_context, internal_context_ptr());
+		}
+
+		// Drops the current connection and connects again without waiting, only with a pool.
+		// The callback runs after the old connection is closed and before its replacement delivers anything.
+		void reconnect(const std::function<void()> & closed_handler = std::function<void()>{})
+		{
+			std::lock_guard<std::mutex> lock(_start_stop_mtx);
+
+			if (_session)
+			{
+				boost::asio::post(*_strand, [this, session = _session, closed_handler]()
+				{
+					close_connection();
+
+					if (closed_handler)
+						closed_handler();
+				});
+			}
+		}
+
+		bool uses_pool() const noexcept
+		{
+			return _pool != nullptr;
 		}
 
 		void write(const std::string & str)
@@ -131,6 +272,13 @@ namespace websocket_wrapper
 			return open;
 		}
 
+		// Time the message passed to the read handler was read, in microseconds since epoch.
+		// Valid inside the read handler only.
+		std::uint64_t receive_timestamp() const noexcept
+		{
+			return _receive_timestamp;
+		}
+
 		void ping()
 		{
 			execute_on_websocket_object<socket_t>([](socket_t & ws) { ws.ping({}); });
@@ -139,15 +287,24 @@ namespace websocket_wrapper
 		using tcp = boost::asio::ip::tcp;
 		using socket_t = boost::beast::websocket::stream<boost::asio::ssl::stream<tcp::socket>>;
 
+		using strand_t = boost::asio::strand<boost::asio::io_context::executor_type>;
+
 		struct internal_context
 		{
-			boost::asio::io_context io_context;
-			boost::beast::multi_buffer buffer;
+			std::unique_ptr<boost::asio::io_context> io_context; // without a pool only
+			std::unique_ptr<tcp::resolver> resolver; // with a pool only
+			boost::beast::flat_buffer buffer; // reused for all messages of the connection
 			std::unique_ptr<socket_t> ws;
+			bool closed = false; // with a pool only, results of operations completed after closing are dropped
 		};
 
 		using internal_context_ptr = std::shared_ptr<internal_context>;
 
+		std::shared_ptr<metrics::counter> get_counter(const std::string & name, const std::string & help) const
+		{
+			return metrics::registry::instance().get_counter(name, help, metrics::labels_t{ { "host", _api_address } });
+		}
+
 		template <typename socket_type>
 		bool execute_on_websocket_object(std::function<void(socket_type&)> func)
 		{
@@ -161,37 +318,92 @@ namespace websocket_wrapper
 			return false;
 		}
 
-		void work_loop(
-			const read_handler_t read_handler,
-			const error_handler_t error_handler,
-			const ping_handler_t ping_handler) noexcept
+		// The application data slot of the context is taken by asio.
+		static int get_ex_data_index()
+		{
+			static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+			return index;
+		}
+
+		// The cached session of the host is offered to the server, which resumes it without a full handshake.
+		static int new_tls_session(SSL * ssl, SSL_SESSION * session)
+		{
+			auto self = static_cast<websocket *>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), get_ex_data_index()));
+
+			std::lock_guard<std::mutex> lock(self->_tls_session_mtx);
+			self->_tls_session.reset(session, &SSL_SESSION_free);
+			return 1; // the session is taken
+		}
+
+		void prepare_tls_handshake(socket_t & ws)
+		{
+			const auto ssl = ws.next_layer().native_handle();
+			if (!SSL_set_tlsext_host_name(ssl, _api_address.c_str()))
+			{
+				throw std::runtime_error("SSL_set_tlsext_host_name failed");
+			}
+
+			std::lock_guard<std::mutex> lock(_tls_session_mtx);
+			if (_tls_session)
+			{
+				SSL_set_session(ssl, _tls_session.get());
+			}
+		}
+
+		void tls_handshake_done(socket_t & ws)
+		{
+			if (SSL_session_reused(ws.next_layer().native_handle()))
+			{
+				_tls_resumptions->add();
+			}
+		}
+
+		void work_loop() noexcept
 		{
 			while (_running)
 			{
 				try
 				{
 					auto internal_context = std::make_shared<struct internal_context>();
-					internal_context->ws = std::make_unique<socket_t>(internal_context->io_context, _ctx);
+					internal_context->io_context = std::make_unique<boost::asio::io_context>();
+					internal_context->ws = std::make_unique<socket_t>(*internal_context->io_context, _ctx);
 
 					{
-						tcp::resolver resolver{ internal_context->io_context };
+						endpoint_cache::results_t results;
+						if (!endpoint_cache::instance().find(_api_address, _port, results))
+						{
+							tcp::resolver resolver{ *internal_context->io_context };
+							results = resolver.resolve(_api_address, std::to_string(_port));
 
-						const auto results = resolver.resolve(_api_address, std::to_string(_port));
+							_resolves->add();
+							endpoint_cache::instance().add(_api_address, _port, results);
+						}
 
-						boost::asio::connect(internal_context->ws->next_layer().next_layer(), results.begin(), results.end());
+						boost::beast::error_code ec;
+						boost::asio::connect(internal_context->ws->next_layer().next_layer(), results.begin(), results.end(), ec);
+						if (ec)
+						{
+							endpoint_cache::instance().remove(_api_address, _port);
+							throw std::system_error(ec);
+						}
 					}
 
-					if (!SSL_set_tlsext_host_name(internal_context->ws->next_layer().native_handle(), _api_address.c_str()))
-					{
-						throw std::runtime_error("SSL_set_tlsext_host_name failed");
-					}
+					prepare_tls_handshake(*internal_context->ws);
 
 					internal_context->ws->next_layer().handshake(boost::asio::ssl::stream_base::client);
 
+					tls_handshake_done(*internal_context->ws);
+
 					internal_context->ws->handshake(_api_address, _handshake_target);
 
+					_connections->add();
 					std::atomic_store(&_internal_context, internal_context);
 
+					if (_connected_handler)
+					{
+						_connected_handler();
+					}
+
 					{
 						std::vector<std::string> to_write;
 
@@ -206,9 +418,9 @@ namespace websocket_wrapper
 						}
 					}
 
-					if (ping_handler)
+					if (_ping_handler)
 					{
-						internal_context->ws->control_callback([ping_handler](
+						internal_context->ws->control_callback([ping_handler = _ping_handler](
 							boost::beast::websocket::frame_type type,
 							boost::beast::string_view)
 						{
@@ -225,15 +437,15 @@ namespace websocket_wrapper
 
 					internal_context->ws->async_read(
 						internal_context->buffer,
-						[internal_context, read_handler, error_handler, this](const boost::beast::error_code & ec, std::size_t)
+						[internal_context, this](const boost::beast::error_code & ec, std::size_t)
 					{
-						async_read_func(internal_context, read_handler, error_handler, ec);
+						async_read_func(internal_context, ec);
 					});
 
 					while (_running)
 					{
-						const auto num_executed = internal_context->io_context.run_one_for(check_running_period);
-						if (num_executed == 0 && internal_context->io_context.stopped())
+						const auto num_executed = internal_context->io_context->run_one_for(check_running_period);
+						if (num_executed == 0 && internal_context->io_context->stopped())
 						{
 							break;
 						}
@@ -241,79 +453,340 @@ namespace websocket_wrapper
 
 					if (!_running)
 					{
-						internal_context->io_context.poll(); // handle last operation from IO queue
+						internal_context->io_context->poll(); // handle last operation from IO queue
 					}
 				}
 				catch (const std::exception & e)
 				{
-					error_handler(e);
+					_connection_errors->add();
+					_error_handler(e);
 					std::this_thread::yield();
 				}
 			}
 		}
 
-		void async_read_func(
-			internal_context_ptr internal_context,
-			const read_handler_t read_handler,
-			const error_handler_t error_handler,
-			const boost::beast::error_code & ec) noexcept
+		void async_read_func(internal_context_ptr internal_context, const boost::beast::error_code & ec) noexcept
 		{
 			try
 			{
 				if (ec)
 				{
-					error_handler(std::system_error(ec));
+					_error_handler(std::system_error(ec));
 					return;
 				}
 
 				if (!internal_context)
 					return;
 
-				read_handler(buffers_to_string(internal_context->buffer.data()));
+				handle_message(*internal_context);
 
 				if (!_running && internal_context->ws->is_open())
 				{
 					internal_context->ws->async_close(
 						boost::beast::websocket::close_code::normal,
-						[internal_context, error_handler](const boost::beast::error_code & ec)
+						[internal_context, this](const boost::beast::error_code & ec)
 					{
-						if (ec) error_handler(std::system_error(ec));
+						if (ec) _error_handler(std::system_error(ec));
 					});
 
 					return;
 				}
 
-				boost::beast::multi_buffer new_buffer;
-				std::swap(internal_context->buffer, new_buffer);
-
 				internal_context->ws->async_read(
 					internal_context->buffer,
-					[internal_context, read_handler, error_handler, this](const boost::beast::error_code & ec, std::size_t)
+					[internal_context, this](const boost::beast::error_code & ec, std::size_t)
+				{
+					async_read_func(internal_context, ec);
+				});
+			}
+			catch (const std::exception & exc)
+			{
+				_error_handler(exc);
+			}
+		}
+
+		// Passes the message in place and empties the buffer keeping its storage for the next read.
+		void handle_message(internal_context & context)
+		{
+			const auto time = std::chrono::system_clock::now().time_since_epoch();
+			_receive_timestamp = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(time).count());
+
+			const auto data = context.buffer.data();
+			const std::string_view message(static_cast<const char *>(data.data()), data.size());
+
+			_bytes_received->add(message.size());
+			_messages_received->add();
+
+			try
+			{
+				_read_handler(message);
+			}
+			catch (...)
+			{
+				context.buffer.clear();
+				throw;
+			}
+
+			context.buffer.clear();
+		}
+
+		// Pool mode: resolve, connect and both handshakes run as a chain of asynchronous operations on the strand.
+		void connect_async(const pool_session_ptr & session)
+		{
+			if (!_running)
+				return;
+
+			auto internal_context = std::make_shared<struct internal_context>();
+			internal_context->ws = std::make_unique<socket_t>(*_strand, _ctx);
+			_connection = internal_context;
+
+			endpoint_cache::results_t results;
+			if (endpoint_cache::instance().find(_api_address, _port, results))
+			{
+				connect_endpoints_async(session, internal_context, results);
+				return;
+			}
+
+			internal_context->resolver = std::make_unique<tcp::resolver>(*_strand);
+			internal_context->resolver->async_resolve(
+				_api_address,
+				std::to_string(_port),
+				[this, session, internal_context](const boost::beast::error_code & ec, const tcp::resolver::results_type & results)
+			{
+				if (ec || internal_context->closed)
+					return connection_failed(session, internal_context, ec ? ec : boost::asio::error::operation_aborted);
+
+				_resolves->add();
+				endpoint_cache::instance().add(_api_address, _port, results);
+
+				connect_endpoints_async(session, internal_context, results);
+			});
+		}
+
+		void connect_endpoints_async(
+			const pool_session_ptr & session,
+			const internal_context_ptr & internal_context,
+			const endpoint_cache::results_t & results)
+		{
+			boost::asio::async_connect(
+				internal_context->ws->next_layer().next_layer(),
+				results.begin(),
+				results.end(),
+				[this, session, internal_context](const boost::beast::error_code & ec, const auto &)
+			{
+				if (ec || internal_context->closed)
+				{
+					if (ec && ec != boost::asio::error::operation_aborted)
+						endpoint_cache::instance().remove(_api_address, _port);
+
+					return connection_failed(session, internal_context, ec ? ec : boost::asio::error::operation_aborted);
+				}
+
+				try
+				{
+					prepare_tls_handshake(*internal_context->ws);
+				}
+				catch (const std::exception & exc)
+				{
+					_error_handler(exc);
+					return connection_failed(session, internal_context, boost::beast::error_code());
+				}
+
+				internal_context->ws->next_layer().async_handshake(
+					boost::asio::ssl::stream_base::client,
+					[this, session, internal_context](const boost::beast::error_code & ec)
 				{
-					async_read_func(internal_context, read_handler, error_handler, ec);
+					if (ec)
+						return connection_failed(session, internal_context, ec);
+
+					tls_handshake_done(*internal_context->ws);
+
+					internal_context->ws->async_handshake(
+						_api_address,
+						_handshake_target,
+						[this, session, internal_context](const boost::beast::error_code & ec)
+					{
+						if (ec || internal_context->closed)
+							return connection_failed(session, internal_context, ec ? ec : boost::asio::error::operation_aborted);
+
+						connected(session, internal_context);
+					});
 				});
+			});
+		}
+
+		void connected(const pool_session_ptr & session, const internal_context_ptr & internal_context)
+		{
+			try
+			{
+				_connections->add();
+				std::atomic_store(&_internal_context, internal_context);
+
+				if (_connected_handler)
+				{
+					_connected_handler();
+				}
+
+				std::vector<std::string> to_write;
+
+				{
+					std::lock_guard<std::mutex> lock(_write_mtx);
+					to_write = std::move(_to_write);
+				}
+
+				for (const auto & item : to_write)
+				{
+					internal_context->ws->write(boost::asio::buffer(item));
+				}
+
+				if (_ping_handler)
+				{
+					internal_context->ws->control_callback([ping_handler = _ping_handler](
+						boost::beast::websocket::frame_type type,
+						boost::beast::string_view)
+					{
+						if (type == boost::beast::websocket::frame_type::ping)
+						{
+							ping_handler(control_message_type::ping);
+						}
+						else if (type == boost::beast::websocket::frame_type::pong)
+						{
+							ping_handler(control_message_type::pong);
+						}
+					});
+				}
+
+				read_async(session, internal_context);
 			}
 			catch (const std::exception & exc)
 			{
-				error_handler(exc);
+				_error_handler(exc);
+				connection_failed(session, internal_context, boost::beast::error_code());
 			}
 		}
 
+		void read_async(const pool_session_ptr & session, const internal_context_ptr & internal_context)
+		{
+			internal_context->ws->async_read(
+				internal_context->buffer,
+				[this, session, internal_context](const boost::beast::error_code & ec, std::size_t)
+			{
+				if (ec || internal_context->closed)
+					return connection_failed(session, internal_context, ec ? ec : boost::asio::error::operation_aborted);
+
+				try
+				{
+					handle_message(*internal_context);
+				}
+				catch (const std::exception & exc)
+				{
+					_error_handler(exc);
+				}
+
+				if (_running)
+				{
+					read_async(session, internal_context);
+				}
+			});
+		}
+
+		// Reports the error and schedules the next connection while the websocket is running.
+		void connection_failed(const pool_session_ptr & session, const internal_context_ptr & internal_context, const boost::beast::error_code & ec)
+		{
+			if (ec && ec != boost::asio::error::operation_aborted)
+			{
+				_connection_errors->add();
+				_error_handler(std::system_error(ec));
+			}
+
+			close_socket(internal_context);
+
+			if (_connection == internal_context)
+			{
+				_connection.reset();
+			}
+
+			if (!_running)
+				return;
+
+			_reconnect_timer->expires_after((ec == boost::asio::error::operation_aborted) ? std::chrono::seconds(0) : reconnect_delay);
+			_reconnect_timer->async_wait([this, session](const boost::beast::error_code & ec)
+			{
+				if (!ec)
+					connect_async(session);
+			});
+		}
+
+		// Runs on the strand: cancels pending operations, which then complete with operation_aborted.
+		void close_connection()
+		{
+			if (!_running)
+			{
+				_reconnect_timer->cancel();
+			}
+
+			if (_connection)
+			{
+				close_socket(_connection);
+
+				if (!_running)
+				{
+					_connection.reset();
+				}
+			}
+		}
+
+		static void close_socket(const internal_context_ptr & internal_context)
+		{
+			internal_context->closed = true;
+
+			if (internal_context->resolver)
+			{
+				internal_context->resolver->cancel();
+			}
+
+			boost::beast::error_code ec;
+			internal_context->ws->next_layer().next_layer().close(ec);
+		}
+
 		const std::chrono::seconds check_running_period = std::chrono::seconds(1);
+		const std::chrono::seconds reconnect_delay = std::chrono::seconds(1);
 
 		const std::string _api_address;
 		const unsigned int _port;
 		const std::string _handshake_target;
 
+		const std::shared_ptr<metrics::counter> _bytes_received;
+		const std::shared_ptr<metrics::counter> _messages_received;
+		const std::shared_ptr<metrics::counter> _connections;
+		const std::shared_ptr<metrics::counter> _connection_errors;
+		const std::shared_ptr<metrics::counter> _resolves;
+		const std::shared_ptr<metrics::counter> _tls_resumptions;
+
 		boost::asio::ssl::context _ctx {boost::asio::ssl::context::tls};
 
 		std::thread _loop_thread;
 		std::mutex _start_stop_mtx;
 		std::atomic_bool _running{ false };
 
+		read_handler_t _read_handler;
+		error_handler_t _error_handler;
+		ping_handler_t _ping_handler;
+		connected_handler_t _connected_handler;
+		std::uint64_t _receive_timestamp = 0;
+
+		std::mutex _tls_session_mtx;
+		std::shared_ptr<SSL_SESSION> _tls_session;
+
 		std::mutex _write_mtx;
 		std::vector<std::string> _to_write;
 
 		internal_context_ptr _internal_context;
+
+		const std::shared_ptr<io_thread_pool> _pool;
+		std::unique_ptr<strand_t> _strand;
+		std::unique_ptr<boost::asio::steady_timer> _reconnect_timer;
+		pool_session_ptr _session;
+		internal_context_ptr _connection; // the one being connected or read, accessed on the strand only
 	};
 } // namespace websocket_wrapper
\ No newline at end of file
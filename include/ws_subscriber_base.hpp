@@ -8,6 +8,7 @@ Copyright (c) 2022 Ilia Funtov.
 
 #pragma once
 
+#include <array>
 #include <atomic>
 #include <cassert>
 #include <chrono>
@@ -15,36 +16,63 @@ Copyright (c) 2022 Ilia Funtov.
 #include <cstdint>
 #include <exception>
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <utility>
+#include <vector>
 
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/strand.hpp>
+
+#include <io_thread_pool.hpp>
+#include <metrics.hpp>
+#include <raw_capture.hpp>
 #include <websocket_wrapper.hpp>
 
 namespace websocket_subscriber
 {
+	// Selects constructors of subscribers which do not connect and get messages through replay_message().
+	struct replay_mode_t
+	{
+	};
+
+	constexpr replay_mode_t replay_mode{};
+
+	struct connection_options
+	{
+		// A second connection is kept connected without subscriptions and takes over when the feed is restarted,
+		// so a restart does not wait for name resolution and the handshakes.
+		bool standby = false;
+	};
+
 	class websocket_subscriber_base
 	{
 	public:
 		using error_handler_t = std::function<void(const std::exception &)>;
 
+		// With a pool the connection and the watchdog run on the pool threads and timers,
+		// otherwise the connection and the watchdog get a thread each.
+		// With a capture stream every received message is recorded before it is handled.
 		websocket_subscriber_base(
 			error_handler_t error_handler,
 			const std::string & api_address,
 			unsigned int port,
-			const std::string & target) :
-			_error_handler(error_handler),
-			_websocket(api_address, port, target)
+			const std::string & target,
+			const std::shared_ptr<websocket_wrapper::io_thread_pool> & pool = nullptr,
+			const std::shared_ptr<raw_capture::stream> & capture = nullptr,
+			const connection_options & options = connection_options{}) :
+			websocket_subscriber_base(error_handler, api_address, port, target, pool, capture, options, false)
 		{
-			assert(_error_handler);
-
-			run_websocket();
+		}
 
-			{
-				std::lock_guard<std::mutex> lock(_watch_thread_mtx);
-				_running = true;
-				_watch_thread = std::thread([this]() { watch_thread_loop(); });
-			}
+		// Replays captured messages instead of connecting, the api address only labels metrics.
+		websocket_subscriber_base(replay_mode_t, error_handler_t error_handler, const std::string & api_address) :
+			websocket_subscriber_base(error_handler, api_address, 0, std::string(), nullptr, nullptr, connection_options{}, true)
+		{
 		}
 
 		websocket_subscriber_base(const websocket_subscriber_base &) = delete;
@@ -57,6 +85,20 @@ namespace websocket_subscriber
 			stop();
 		}
 
+		// Time the message being handled was read from the socket (or captured), valid inside event handlers only.
+		std::uint64_t receive_timestamp() const noexcept
+		{
+			return _receive_timestamp;
+		}
+
+		// Handles a captured message as if it was received now, only in replay mode.
+		void replay_message(std::string_view message, std::uint64_t receive_timestamp)
+		{
+			assert(_replay);
+
+			handle_message(message, receive_timestamp);
+		}
+
 		bool is_working() const noexcept
 		{
 			return is_init_received() && _running;
@@ -64,7 +106,23 @@ namespace websocket_subscriber
 
 		void restart()
 		{
-			if (is_init_received())
+			_restart_requests->add();
+
+			if (_watch_strand)
+			{
+				_restart_websocket_required = true;
+
+				const auto session = std::atomic_load(&_watch_session);
+				if (session && is_init_received() && !_restart_delayed)
+				{
+					boost::asio::post(*_watch_strand, [this, session]()
+					{
+						_watch_timer->cancel();
+						watch_step(session);
+					});
+				}
+			}
+			else if (is_init_received())
 			{
 				std::lock_guard<std::mutex> lock(_watch_thread_signal_mtx);
 				if (!_restart_websocket_required)
@@ -85,6 +143,12 @@ namespace websocket_subscriber
 			if (!_running)
 				return;
 
+			if (_watch_strand)
+			{
+				stop_watch_timer();
+				return;
+			}
+
 			std::lock(_watch_thread_mtx, _watch_thread_signal_mtx);
 
 			std::lock_guard<std::mutex> lock(_watch_thread_mtx, std::adopt_lock);
@@ -101,7 +165,7 @@ namespace websocket_subscriber
 				_watch_thread.join();
 			}
 
-			_websocket.stop();
+			stop_websockets();
 		}
 
 		virtual void init_received(bool set_flag = true) noexcept
@@ -114,49 +178,289 @@ namespace websocket_subscriber
 			return _init_received;
 		}
 
+		// The active connection.
 		websocket_wrapper::websocket & websocket() noexcept
 		{
-			return _websocket;
+			return *_websockets[_active];
+		}
+
+		// Subscribers call it after queueing channels for resubscription, the watch step which resubscribes them
+		// is run now instead of after the watch period. The connection and other channels are not touched.
+		void resubscription_requested()
+		{
+			_resubscription_requests->add();
+
+			if (_replay)
+				return;
+
+			if (_watch_strand)
+			{
+				const auto session = std::atomic_load(&_watch_session);
+				if (session && is_init_received() && !_restart_delayed)
+				{
+					boost::asio::post(*_watch_strand, [this, session]()
+					{
+						_watch_timer->cancel();
+						watch_step(session);
+					});
+				}
+			}
+			else
+			{
+				std::lock_guard<std::mutex> lock(_watch_thread_signal_mtx);
+				_watch_step_required = true;
+				_watch_thread_var.notify_one();
+			}
 		}
 	private:
 		using clock_t = std::chrono::steady_clock;
 
+		websocket_subscriber_base(
+			error_handler_t error_handler,
+			const std::string & api_address,
+			unsigned int port,
+			const std::string & target,
+			const std::shared_ptr<websocket_wrapper::io_thread_pool> & pool,
+			const std::shared_ptr<raw_capture::stream> & capture,
+			const connection_options & options,
+			bool replay) :
+			_error_handler(error_handler),
+			_replay(replay),
+			_websockets{ {
+				std::make_unique<websocket_wrapper::websocket>(api_address, port, target, pool),
+				(options.standby && !replay) ? std::make_unique<websocket_wrapper::websocket>(api_address, port, target, pool) : nullptr } },
+			_capture(capture),
+			_handling_time(metrics::registry::instance().get_histogram(
+				"md_feed_message_handling_nanoseconds",
+				"Time of parsing a feed message and running its handlers.",
+				metrics::labels_t{ { "host", api_address } })),
+			_handler_errors(metrics::registry::instance().get_counter(
+				"md_feed_message_errors_total",
+				"Feed messages which could not be handled.",
+				metrics::labels_t{ { "host", api_address } })),
+			_restart_requests(metrics::registry::instance().get_counter(
+				"md_feed_restart_requests_total",
+				"Requests to restart the feed connection.",
+				metrics::labels_t{ { "host", api_address } })),
+			_resubscription_requests(metrics::registry::instance().get_counter(
+				"md_feed_resubscriptions_total",
+				"Requests to resubscribe channels of the feed connection, e.g. a book after an inconsistency or a sequence gap.",
+				metrics::labels_t{ { "host", api_address } })),
+			_standby_promotions(metrics::registry::instance().get_counter(
+				"md_feed_standby_promotions_total",
+				"Restarts of the feed taken over by the standby connection.",
+				metrics::labels_t{ { "host", api_address } }))
+		{
+			assert(_error_handler);
+
+			if (_replay)
+				return;
+
+			for (std::size_t index = 0; index != _websockets.size(); ++index)
+			{
+				if (_websockets[index])
+					run_websocket(index);
+			}
+
+			if (pool)
+			{
+				_watch_strand = std::make_unique<strand_t>(boost::asio::make_strand(pool->context()));
+				_watch_timer = std::make_unique<boost::asio::steady_timer>(*_watch_strand);
+
+				auto session = std::make_shared<websocket_wrapper::pool_session>();
+				std::atomic_store(&_watch_session, session);
+
+				_running = true;
+				schedule_watch_step(session, std::chrono::seconds(watch_period));
+				return;
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(_watch_thread_mtx);
+				_running = true;
+				_watch_thread = std::thread([this]() { watch_thread_loop(); });
+			}
+		}
+
 		virtual void authenticate() {}
 		virtual void subscribe_events() {}
 		virtual void reset_active_channels() {}
-		virtual void read_handler(const std::string &) {}
+		virtual void read_handler(std::string_view) {}
 
 		void error_handler(const std::exception & exc)
 		{
 			if (_error_handler)
 				_error_handler(exc);
 
-			if (!_websocket.is_open())
+			if (!websocket().is_open())
 			{
 				_restart_websocket_required = true;
 			}
 		}
 
-		void run_websocket()
+		// The standby connection reconnects by itself, its errors do not restart the feed.
+		void connection_error_handler(std::size_t index, const std::exception & exc)
+		{
+			if (index == _active)
+			{
+				error_handler(exc);
+			}
+			else if (_error_handler)
+			{
+				_error_handler(exc);
+			}
+		}
+
+		void handle_message(std::string_view str, std::uint64_t receive_timestamp)
+		{
+			const auto start = std::chrono::steady_clock::now();
+
+			_receive_timestamp = receive_timestamp;
+
+			try
+			{
+				update_last_message_timestamp();
+
+				read_handler(str);
+			}
+			catch (const std::exception & exc)
+			{
+				_handler_errors->add();
+				error_handler(exc);
+			}
+
+			const auto handling_time = std::chrono::steady_clock::now() - start;
+			_handling_time->add(static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(handling_time).count()));
+		}
+
+		void run_websocket(std::size_t index)
 		{
 			update_last_message_timestamp();
 
-			_websocket.run(
-				[this](const std::string & str)
+			_websockets[index]->run(
+				[this, index](std::string_view str) { message_received(index, str); },
+				[this, index](const std::exception & exc) { connection_error_handler(index, exc); },
+				[this, index](websocket_wrapper::websocket::control_message_type)
 				{
-					try
-					{
+					if (index == _active)
 						update_last_message_timestamp();
-
-						read_handler(str);
-					}
-					catch (const std::exception & exc)
-					{
-						error_handler(exc);
-					}
 				},
-				[this](const std::exception & exc) { error_handler(exc); },
-				[this](websocket_wrapper::websocket::control_message_type) { update_last_message_timestamp(); });
+				[this, index]()
+				{
+					if (index != _active)
+						standby_connected();
+				});
+		}
+
+		void message_received(std::size_t index, std::string_view str)
+		{
+			const auto receive_timestamp = _websockets[index]->receive_timestamp();
+
+			if (!_websockets[1])
+			{
+				if (_capture)
+					_capture->write(receive_timestamp, str);
+
+				handle_message(str, receive_timestamp);
+				return;
+			}
+
+			// messages of both connections are handled under the lock, so a promotion does not interleave with them
+			std::lock_guard<std::mutex> lock(_standby_mtx);
+			if (index == _active)
+			{
+				if (_capture)
+					_capture->write(receive_timestamp, str);
+
+				handle_message(str, receive_timestamp);
+			}
+			else if (_standby_messages.size() < max_standby_messages)
+			{
+				_standby_messages.emplace_back(receive_timestamp, std::string(str));
+			}
+		}
+
+		// Messages of the previous connection of the standby websocket are not replayed.
+		void standby_connected()
+		{
+			std::lock_guard<std::mutex> lock(_standby_mtx);
+			_standby_messages.clear();
+		}
+
+		// The standby connection becomes the active one, the old one reconnects and becomes the standby one.
+		bool promote_standby()
+		{
+			if (!_websockets[1])
+				return false;
+
+			const std::size_t old_index = _active;
+			const std::size_t new_index = 1 - old_index;
+			if (!_websockets[new_index]->is_open())
+				return false;
+
+			{
+				std::lock_guard<std::mutex> lock(_standby_mtx);
+
+				_active = new_index;
+
+				init_received(false);
+				_authenticated = false;
+				reset_active_channels();
+				update_last_message_timestamp();
+
+				// messages sent by the exchange before subscriptions, like its info event which the subscriber waits for
+				for (const auto & message : _standby_messages)
+				{
+					if (_capture)
+						_capture->write(message.first, message.second);
+
+					handle_message(message.second, message.first);
+				}
+
+				_standby_messages.clear();
+			}
+
+			_standby_promotions->add();
+
+			auto & old_websocket = *_websockets[old_index];
+			if (old_websocket.uses_pool())
+			{
+				old_websocket.reconnect();
+			}
+			else
+			{
+				old_websocket.stop();
+				run_websocket(old_index);
+			}
+
+			return true;
+		}
+
+		void ping_websockets()
+		{
+			websocket().ping();
+
+			const std::size_t standby_index = 1 - _active;
+			if (_websockets[standby_index])
+			{
+				try
+				{
+					_websockets[standby_index]->ping();
+				}
+				catch (const std::exception &)
+				{
+					// the standby connection is being reconnected
+				}
+			}
+		}
+
+		void stop_websockets()
+		{
+			for (auto & ws : _websockets)
+			{
+				if (ws)
+					ws->stop();
+			}
 		}
 
 		void watch_thread_loop() noexcept
@@ -178,6 +482,8 @@ namespace websocket_subscriber
 			{
 				try
 				{
+					_watch_step_required = false;
+
 					if (_restart_websocket_required.exchange(false))
 					{
 						if (restart_attempt++ >= max_restart_attempts_no_delay)
@@ -191,12 +497,12 @@ namespace websocket_subscriber
 						do_websocket_restart();
 					}
 
-					if (_websocket.is_open() && is_init_received())
+					if (websocket().is_open() && is_init_received())
 					{
 						if (_authenticated)
 						{
 							subscribe_events();
-							_websocket.ping();
+							ping_websockets();
 						}
 						else
 						{
@@ -207,7 +513,7 @@ namespace websocket_subscriber
 
 							restart_attempt = 0;
 
-							wait([this]() -> bool { return !_running || _restart_websocket_required; });
+							wait([this]() -> bool { return !_running || _restart_websocket_required || _watch_step_required; });
 
 							if (!_running)
 								break;
@@ -222,7 +528,7 @@ namespace websocket_subscriber
 						continue;
 					}
 
-					wait([this]() -> bool { return !_running || _restart_websocket_required; });
+					wait([this]() -> bool { return !_running || _restart_websocket_required || _watch_step_required; });
 				}
 				catch (const std::exception & exc)
 				{
@@ -231,16 +537,120 @@ namespace websocket_subscriber
 			}
 		}
 
+		// Pool mode: one iteration of the watch thread loop, the next one is scheduled on the timer.
+		void watch_step(const websocket_wrapper::pool_session_ptr & session) noexcept
+		{
+			if (!_running)
+				return;
+
+			auto delay = std::chrono::seconds(watch_period);
+
+			try
+			{
+				if (_restart_websocket_required.exchange(false))
+				{
+					if (_restart_attempt++ >= max_restart_attempts_no_delay && !_restart_delayed)
+					{
+						// the same pause the watch thread makes after several restarts in a row
+						_restart_delayed = true;
+						_restart_websocket_required = true;
+						schedule_watch_step(session, delay);
+						return;
+					}
+
+					_restart_delayed = false;
+					do_websocket_restart();
+				}
+
+				if (websocket().is_open() && is_init_received())
+				{
+					if (_authenticated)
+					{
+						subscribe_events();
+						ping_websockets();
+					}
+					else
+					{
+						authenticate();
+						_authenticated = true;
+
+						subscribe_events();
+
+						_restart_attempt = 0;
+
+						schedule_watch_step(session, delay);
+						return;
+					}
+				}
+
+				if (is_last_message_time_outdated())
+				{
+					_restart_websocket_required = true;
+					delay = std::chrono::seconds(0);
+				}
+			}
+			catch (const std::exception & exc)
+			{
+				error_handler(exc);
+			}
+
+			schedule_watch_step(session, delay);
+		}
+
+		void schedule_watch_step(const websocket_wrapper::pool_session_ptr & session, std::chrono::seconds delay)
+		{
+			_watch_timer->expires_after(delay);
+			_watch_timer->async_wait([this, session](const boost::system::error_code & ec)
+			{
+				if (!ec)
+					watch_step(session);
+			});
+		}
+
+		void stop_watch_timer()
+		{
+			auto session = std::atomic_exchange(&_watch_session, websocket_wrapper::pool_session_ptr());
+			if (session)
+			{
+				_running = false;
+
+				auto done = session->done.get_future();
+				boost::asio::post(*_watch_strand, [this, session = std::move(session)]() { _watch_timer->cancel(); });
+				done.wait();
+			}
+
+			stop_websockets();
+		}
+
 		void do_websocket_restart()
 		{
-			_websocket.stop();
+			if (promote_standby())
+				return;
+
+			auto & active_websocket = websocket();
+			if (active_websocket.uses_pool())
+			{
+				_authenticated = false;
+
+				// messages of the old connection must not change the state reset for the new one
+				active_websocket.reconnect([this]()
+				{
+					init_received(false);
+					reset_active_channels();
+					update_last_message_timestamp();
+				});
+
+				return;
+			}
+
+			active_websocket.stop();
 
 			init_received(false);
 			_authenticated = false;
 
 			reset_active_channels();
 
-			run_websocket();
+			run_websocket(_active);
 		}
 
 		void update_last_message_timestamp()
@@ -262,13 +672,19 @@ namespace websocket_subscriber
 
 		static constexpr unsigned int watch_period = 3; // seconds
 		static constexpr unsigned int max_restart_attempts_no_delay = 3;
+		static constexpr std::size_t max_standby_messages = 16; // the first ones, exchanges send their info events on connection
+
+		using strand_t = boost::asio::strand<boost::asio::io_context::executor_type>;
 
 		const error_handler_t _error_handler;
+		const bool _replay;
+		std::uint64_t _receive_timestamp = 0;
 
 		std::atomic_bool _running{false};
 		std::atomic_bool _init_received{false};
 		std::atomic_bool _authenticated{false};
 		std::atomic_bool _restart_websocket_required{false};
+		std::atomic_bool _watch_step_required{false};
 
 		std::atomic<std::uint64_t> _last_message_timestamp{0};
 
@@ -277,6 +693,23 @@ namespace websocket_subscriber
 		std::condition_variable _watch_thread_var;
 		std::thread _watch_thread;
 
-		websocket_wrapper::websocket _websocket;
+		std::array<std::unique_ptr<websocket_wrapper::websocket>, 2> _websockets; // the second one only with a standby connection
+		std::atomic<std::size_t> _active{0}; // swapped with the standby one on promotions
+		std::mutex _standby_mtx;
+		std::vector<std::pair<std::uint64_t, std::string>> _standby_messages; // receive time, message
+
+		const std::shared_ptr<raw_capture::stream> _capture;
+
+		const std::shared_ptr<metrics::histogram> _handling_time;
+		const std::shared_ptr<metrics::counter> _handler_errors;
+		const std::shared_ptr<metrics::counter> _restart_requests;
+		const std::shared_ptr<metrics::counter> _resubscription_requests;
+		const std::shared_ptr<metrics::counter> _standby_promotions;
+
+		std::unique_ptr<strand_t> _watch_strand;
+		std::unique_ptr<boost::asio::steady_timer> _watch_timer;
+		websocket_wrapper::pool_session_ptr _watch_session;
+		unsigned int _restart_attempt = 0; // accessed on the watch strand only
+		std::atomic_bool _restart_delayed{false};
 	};
 }
\ No newline at end of file
@@ -24,66 +24,92 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
+#include <algorithm>
+#include <chrono>
+#include <csignal>
 #include <iostream>
 #include <fstream>
+#include <functional>
 #include <map>
+#include <memory>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include <boost/program_options.hpp>
 #include <boost/algorithm/string.hpp>
 
 #include <logger.hpp>
+#include <capture_replay.hpp>
 #include <market_data_provider.hpp>
+#include <metrics.hpp>
+#include <multicast_feed.hpp>
+#include <raw_capture.hpp>
+#include <symbol_config.hpp>
 
-#include <nlohmann/json.hpp>
-#include <json_helpers.hpp>
+// Options of the collection loop besides the dump options.
+struct run_options
+{
+	unsigned int latency_report_period = 0; // seconds, 0 disables reports
+	std::string metrics_file;
+	unsigned int metrics_period = 0; // seconds
+	std::string capture_file; // messages of all connections are recorded when set
+	std::string replay_file; // messages are taken from the capture instead of connecting when set
+	market_data::replay_speed replay_speed = market_data::replay_speed::max;
+	websocket_subscriber::connection_options connection; // of all websocket connections
+	std::chrono::seconds shutdown_timeout{10}; // for writing the queued records after the collection ends
+	std::string shard_node; // name of this collector in the sharding of the symbol config
+};
+
+// Set by SIGINT and SIGTERM, the collection loop checks it.
+volatile std::sig_atomic_t stop_signal = 0;
+
+void handle_stop_signal(int signal)
+{
+	stop_signal = signal;
+	std::signal(signal, SIG_DFL); // a second signal kills the collector
+}
 
-market_data::general_symbol_description get_symbol_description(
-	const std::string &symbol_config_file,
-	const std::set<market_data::exchange_type> &exchanges,
-	unsigned int depth)
+template <typename logger_t, typename provider_t>
+void replay_capture(
+	logger_t logger,
+	const run_options & run,
+	market_data::feed_connections<logger_t> & connections,
+	const std::vector<std::unique_ptr<provider_t>> & quote_providers)
 {
-	using namespace market_data;
-	using namespace nlohmann;
+	raw_capture::reader reader(run.replay_file);
+	market_data::capture_replay<logger_t> replay(reader, connections);
 
-	std::ifstream input(symbol_config_file);
-	if (!input.is_open())
+	const auto counts = replay.run(run.replay_speed);
+	for (const auto & count : counts)
 	{
-		throw std::runtime_error("Could not open config file for symbol mapping");
+		std::cout << market_data::get_exchange_name(count.first) << ": " << count.second << " message(s) replayed" << std::endl;
 	}
 
-	json config;
-	input >> config;
-
-	general_symbol_description symbol_description;
-
-	symbol_description.symbol_name = json_helpers::get_required_value<std::string>(config, "symbol");
-	const std::map<std::string, std::string> symbol_mapping = config.at("mapping").get<std::map<std::string, std::string>>();
-
-	for (const auto &mapping_item : symbol_mapping)
+	// the dump threads stop without draining their queues
+	const auto is_queued = [&quote_providers]()
 	{
-		const auto exchange_type = market_data::get_exchange_type(mapping_item.first);
-		if (exchanges.count(exchange_type))
+		for (const auto & provider : quote_providers)
 		{
-			source_symbol_description desc;
-			desc.symbol_name = mapping_item.second;
-			desc.order_book_size = depth;
-			symbol_description.source_exchanges.emplace(exchange_type, desc);
+			if (provider->get_queued_records() != 0)
+				return true;
 		}
-	}
 
-	if (symbol_description.source_exchanges.empty())
+		return false;
+	};
+
+	while (is_queued())
 	{
-		throw std::runtime_error("Invalid configuration was provided for symbol mapping");
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
 	}
 
-	symbol_description.price_levels_num = depth;
-
-	return symbol_description;
+	if (!run.metrics_file.empty() && !metrics::registry::instance().write_file(run.metrics_file))
+	{
+		LOG_ERROR(logger) << "Could not write metrics file: " << run.metrics_file;
+	}
 }
 
-template <typename logger_t>
+template <typename logger_t, unsigned int fixed_depth>
 void run_loop(
 	logger_t logger,
 	const std::string &quote_dump_path,
@@ -91,23 +117,190 @@ void run_loop(
 	const std::set<market_data::exchange_type> &exchanges,
 	unsigned int duration_minutes,
 	unsigned int blocks_num,
-	unsigned int depth)
+	unsigned int depth,
+	const market_data::dump_options & options,
+	unsigned int io_threads,
+	const std::vector<unsigned int> & io_cpus,
+	const run_options & run)
 {
 	using namespace market_data;
+	using provider_t = market_data_provider<logger_t, fixed_depth>;
+
+	const auto symbol_descriptions = get_symbol_descriptions(symbol_config_file, exchanges, depth, run.shard_node);
+
+	std::shared_ptr<websocket_wrapper::io_thread_pool> io_pool;
+	if (io_threads != 0)
+	{
+		io_pool = std::make_shared<websocket_wrapper::io_thread_pool>(
+			io_threads,
+			io_cpus,
+			[logger](const std::exception & exc) { LOG_ERROR(logger) << "IO thread error: " << exc.what(); });
+	}
+
+	const auto capture = run.capture_file.empty() ? nullptr : std::make_shared<raw_capture::writer>(run.capture_file);
+
+	// all symbols share one connection per exchange
+	const auto connections = run.replay_file.empty() ?
+		std::make_shared<feed_connections<logger_t>>(logger, io_pool, capture, run.connection) :
+		std::make_shared<feed_connections<logger_t>>(logger, websocket_subscriber::replay_mode);
+
+	std::vector<std::unique_ptr<provider_t>> quote_providers;
+
+	for (const auto &symbol_description : symbol_descriptions)
+	{
+		std::cout << "Collecting market data for symbol '" << symbol_description.symbol_name << "'" << std::endl;
+
+		for (const auto &exchange_symbol : symbol_description.source_exchanges)
+		{
+			std::cout << market_data::get_exchange_name(exchange_symbol.first) << ": " << exchange_symbol.second.symbol_name << std::endl;
+		}
+
+		quote_providers.push_back(std::make_unique<provider_t>(logger, symbol_description, market_data_subscriber{}, options, connections));
+		quote_providers.back()->set_dump_quotes(true, quote_dump_path, duration_minutes);
+	}
+
+	if (!run.replay_file.empty())
+	{
+		replay_capture(logger, run, *connections, quote_providers);
+		return;
+	}
+
+	using clock_t = std::chrono::steady_clock;
+
+	// tasks repeated until the collection ends, a zero period disables a task
+	struct periodic_task
+	{
+		std::chrono::seconds period;
+		std::function<void()> run;
+		clock_t::time_point next_time;
+	};
 
-	const auto symbol_description = get_symbol_description(symbol_config_file, exchanges, depth);
+	std::vector<periodic_task> tasks;
 
-	std::cout << "Collecting market data for symbol '" << symbol_description.symbol_name << "'" << std::endl;
+	if (run.latency_report_period != 0)
+	{
+		tasks.push_back(periodic_task{ std::chrono::seconds(run.latency_report_period), [&quote_providers]()
+		{
+			for (const auto & provider : quote_providers)
+			{
+				provider->report_latency();
+			}
+		}});
+	}
+
+	if (!run.metrics_file.empty() && run.metrics_period != 0)
+	{
+		tasks.push_back(periodic_task{ std::chrono::seconds(run.metrics_period), [logger, &run]()
+		{
+			if (!metrics::registry::instance().write_file(run.metrics_file))
+			{
+				LOG_ERROR(logger) << "Could not write metrics file: " << run.metrics_file;
+			}
+		}});
+	}
+
+	// signals end the collection as its time does, with the queued records written
+	constexpr std::chrono::milliseconds signal_check_period{100};
+	std::signal(SIGINT, handle_stop_signal);
+	std::signal(SIGTERM, handle_stop_signal);
 
-	for (const auto &exchange_symbol : symbol_description.source_exchanges)
+	const auto start_time = clock_t::now();
+	const auto stop_time = start_time + std::chrono::minutes(duration_minutes * blocks_num);
+
+	for (auto & task : tasks)
 	{
-		std::cout << market_data::get_exchange_name(exchange_symbol.first) << ": " << exchange_symbol.second.symbol_name << std::endl;
+		task.next_time = start_time + task.period;
 	}
 
-	market_data_provider quote_provider(logger, symbol_description);
-	quote_provider.set_dump_quotes(true, quote_dump_path, duration_minutes);
+	for (;;)
+	{
+		auto wake_time = std::min(stop_time, clock_t::now() + signal_check_period);
+		for (const auto & task : tasks)
+		{
+			wake_time = std::min(wake_time, task.next_time);
+		}
 
-	std::this_thread::sleep_for(std::chrono::minutes(duration_minutes * blocks_num));
+		std::this_thread::sleep_until(wake_time);
+
+		if (stop_signal != 0)
+		{
+			LOG_INFO(logger) << "Stopping on signal " << stop_signal;
+			break;
+		}
+
+		if (clock_t::now() >= stop_time)
+			break;
+
+		for (auto & task : tasks)
+		{
+			if (clock_t::now() >= task.next_time)
+			{
+				task.run();
+				task.next_time += task.period;
+			}
+		}
+	}
+
+	// feed messages are not taken anymore, all providers write their queues and close their files within the timeout
+	std::cout << "Stopping, writing queued records for up to " << run.shutdown_timeout.count() << " s" << std::endl;
+
+	const auto deadline = clock_t::now() + run.shutdown_timeout;
+	for (const auto & provider : quote_providers)
+	{
+		provider->shutdown(deadline);
+	}
+
+	quote_providers.clear();
+
+	if (!run.metrics_file.empty() && !metrics::registry::instance().write_file(run.metrics_file))
+	{
+		LOG_ERROR(logger) << "Could not write metrics file: " << run.metrics_file;
+	}
+}
+
+std::vector<unsigned int> parse_cpus(const std::string &str)
+{
+	std::vector<std::string> substrs;
+	boost::split(substrs, str, boost::is_any_of(","));
+
+	std::vector<unsigned int> result;
+	for (const auto &s : substrs)
+	{
+		if (!s.empty())
+			result.push_back(static_cast<unsigned int>(std::stoul(s)));
+	}
+	return result;
+}
+
+std::vector<std::chrono::seconds> parse_bar_intervals(const std::string &str)
+{
+	std::vector<std::string> substrs;
+	boost::split(substrs, str, boost::is_any_of(","));
+
+	std::vector<std::chrono::seconds> result;
+	for (const auto &s : substrs)
+	{
+		if (!s.empty())
+			result.push_back(market_data_common::get_bar_interval(s));
+	}
+	return result;
+}
+
+// Streams of book states which can be conflated.
+void parse_conflated_streams(const std::string &str, market_data::dump_options &options)
+{
+	std::vector<std::string> substrs;
+	boost::split(substrs, str, boost::is_any_of(","));
+
+	for (const auto &s : substrs)
+	{
+		if (s == "prices")
+			options.conflate_prices = true;
+		else if (s == "consolidated")
+			options.conflate_consolidated = true;
+		else if (!s.empty())
+			throw std::runtime_error("Stream can not be conflated: " + s);
+	}
 }
 
 std::set<market_data::exchange_type> parse_exchanges(const std::string &str)
@@ -132,10 +325,60 @@ int main(int argc, char *argv[])
 	constexpr auto opt_duration = "duration";
 	constexpr auto opt_blocks = "blocks";
 	constexpr auto opt_depth = "depth";
+	constexpr auto opt_prices_mode = "prices-mode";
+	constexpr auto opt_queue_capacity = "queue-capacity";
+	constexpr auto opt_queue_overflow = "queue-overflow";
+	constexpr auto opt_conflate = "conflate";
+	constexpr auto opt_flush_size = "flush-size";
+	constexpr auto opt_flush_period = "flush-period";
+	constexpr auto opt_fsync = "fsync";
+	constexpr auto opt_file_backend = "file-backend";
+	constexpr auto opt_format = "format";
+	constexpr auto opt_compression = "compression";
+	constexpr auto opt_compression_level = "compression-level";
+	constexpr auto opt_io_threads = "io-threads";
+	constexpr auto opt_io_cpus = "io-cpus";
+	constexpr auto opt_standby_connections = "standby-connections";
+	constexpr auto opt_event_timestamps = "event-timestamps";
+	constexpr auto opt_consolidated_book = "consolidated-book";
+	constexpr auto opt_bar_intervals = "bar-intervals";
+	constexpr auto opt_bar_close_delay = "bar-close-delay";
+	constexpr auto opt_bar_max_clock_skew = "bar-max-clock-skew";
+	constexpr auto opt_publish_shm = "publish-shm";
+	constexpr auto opt_publish_shm_slots = "publish-shm-slots";
+	constexpr auto opt_publish_multicast = "publish-multicast";
+	constexpr auto opt_publish_multicast_ttl = "publish-multicast-ttl";
+	constexpr auto opt_latency_report_period = "latency-report-period";
+	constexpr auto opt_metrics_file = "metrics-file";
+	constexpr auto opt_metrics_period = "metrics-period";
+	constexpr auto opt_capture_file = "capture-file";
+	constexpr auto opt_replay_file = "replay-file";
+	constexpr auto opt_replay_speed = "replay-speed";
+	constexpr auto opt_shutdown_timeout = "shutdown-timeout";
+	constexpr auto opt_shard_node = "shard-node";
 
 	constexpr auto default_block_duration_in_minutes = 480; // 8 hours
 	constexpr auto default_depth = 10;
 	constexpr auto default_number_of_blocks = 1;
+	constexpr auto default_prices_mode = "all";
+	constexpr auto default_queue_capacity = 16384;
+	constexpr auto default_queue_overflow = "block";
+	constexpr auto default_flush_size_kb = 1024;
+	constexpr auto default_flush_period_ms = 1000;
+	constexpr auto default_fsync = "none";
+	constexpr auto default_file_backend = "stdio";
+	constexpr auto default_format = "csv";
+	constexpr auto default_compression = "none";
+	constexpr auto default_compression_level = 6;
+	constexpr auto default_io_threads = 0;
+	constexpr auto default_latency_report_period_s = 60;
+	constexpr auto default_metrics_period_s = 10;
+	constexpr auto default_replay_speed = "max";
+	constexpr auto default_shutdown_timeout_s = 10;
+	constexpr auto default_bar_close_delay = 1000u;
+	constexpr auto default_bar_max_clock_skew = 60000u;
+	constexpr auto default_publish_shm_slots = 65536u;
+	constexpr auto default_publish_multicast_ttl = 1u;
 
 	try
 	{
@@ -148,7 +391,38 @@ int main(int argc, char *argv[])
 			(opt_symbol_config, po::value<std::string>(), "Config file for symbols name mapping")
 			(opt_duration, po::value<unsigned int>()->default_value(default_block_duration_in_minutes), "Duration of one block in minutes")
 			(opt_blocks, po::value<unsigned int>()->default_value(default_number_of_blocks), "Number of market data blocks")
-			(opt_depth, po::value<unsigned int>()->default_value(default_depth), "Depth of the order book");
+			(opt_depth, po::value<unsigned int>()->default_value(default_depth), "Depth of the order book")
+			(opt_prices_mode, po::value<std::string>()->default_value(default_prices_mode), "Order book dump mode: all (every update), changes (only when visible levels change), delta (only changed levels)")
+			(opt_queue_capacity, po::value<unsigned int>()->default_value(default_queue_capacity), "Capacity of dump queues in records per exchange")
+			(opt_queue_overflow, po::value<std::string>()->default_value(default_queue_overflow), "Policy for a full dump queue: block, drop-oldest, drop")
+			(opt_conflate, po::value<std::string>(), "Comma separated book streams (prices, consolidated) whose queues keep only the latest book per exchange")
+			(opt_flush_size, po::value<unsigned int>()->default_value(default_flush_size_kb), "Size of dump file buffers in kilobytes")
+			(opt_flush_period, po::value<unsigned int>()->default_value(default_flush_period_ms), "Maximum time data stays in dump file buffers in milliseconds")
+			(opt_fsync, po::value<std::string>()->default_value(default_fsync), "When dump files are synced to disk: none, flush, close")
+			(opt_file_backend, po::value<std::string>()->default_value(default_file_backend), "How dump files are written: stdio, preallocate, direct (preallocated with O_DIRECT)")
+			(opt_format, po::value<std::string>()->default_value(default_format), "Dump files format: csv, binary")
+			(opt_compression, po::value<std::string>()->default_value(default_compression), "Dump files compression: none, gzip")
+			(opt_compression_level, po::value<int>()->default_value(default_compression_level), "Compression level from 1 (fastest) to 9 (smallest)")
+			(opt_io_threads, po::value<unsigned int>()->default_value(default_io_threads), "Number of threads shared by all websocket connections, 0 for a thread per connection")
+			(opt_io_cpus, po::value<std::string>(), "Comma separated list of CPUs to pin shared io threads to")
+			(opt_standby_connections, "Keep a standby connection per exchange connection which takes over on a restart (not for coinbase)")
+			(opt_event_timestamps, "Add exchange and receive timestamps to csv price records")
+			(opt_consolidated_book, "Dump the book merged from all exchanges of a symbol to the consolidated stream")
+			(opt_bar_intervals, po::value<std::string>(), "Comma separated intervals of trade bars like 1s,1m,1h dumped to the bars stream")
+			(opt_bar_close_delay, po::value<unsigned int>()->default_value(default_bar_close_delay), "Delay in milliseconds of writing a bar after its end for late trades")
+			(opt_bar_max_clock_skew, po::value<unsigned int>()->default_value(default_bar_max_clock_skew), "Trades more milliseconds ahead of the host clock are not in bars, 0 takes all trades")
+			(opt_publish_shm, po::value<std::string>(), "Publish books and trades of every symbol to the shared memory feed /<prefix>_<symbol>")
+			(opt_publish_shm_slots, po::value<unsigned int>()->default_value(default_publish_shm_slots), "Number of records kept in a shared memory feed")
+			(opt_publish_multicast, po::value<std::string>(), "Publish books and trades to a UDP multicast group like 239.255.0.1:30001")
+			(opt_publish_multicast_ttl, po::value<unsigned int>()->default_value(default_publish_multicast_ttl), "Time to live of multicast datagrams")
+			(opt_latency_report_period, po::value<unsigned int>()->default_value(default_latency_report_period_s), "Period of order book latency reports in the log in seconds, 0 to disable")
+			(opt_metrics_file, po::value<std::string>(), "File to write metrics to in Prometheus text format, e.g. for the node exporter textfile collector")
+			(opt_metrics_period, po::value<unsigned int>()->default_value(default_metrics_period_s), "Period of writing the metrics file in seconds")
+			(opt_capture_file, po::value<std::string>(), "Record all received websocket messages to a new raw capture file")
+			(opt_replay_file, po::value<std::string>(), "Replay a raw capture file instead of connecting to exchanges, the symbol config has to be the captured one")
+			(opt_replay_speed, po::value<std::string>()->default_value(default_replay_speed), "Replay speed: max (as fast as possible), recorded (at the captured intervals)")
+			(opt_shutdown_timeout, po::value<unsigned int>()->default_value(default_shutdown_timeout_s), "Time in seconds for writing queued records when the collection ends or is stopped with Ctrl+C or SIGTERM")
+			(opt_shard_node, po::value<std::string>(), "Name of this node when the symbol config assigns symbols to collector nodes");
 
 		po::variables_map vm;
 		po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -198,14 +472,123 @@ int main(int argc, char *argv[])
 				throw std::runtime_error("An empty list of exchanges was passed");
 			}
 
+			market_data::dump_options options;
+			options.prices_mode = market_data::get_prices_dump_mode(vm[opt_prices_mode].as<std::string>());
+			options.queue_capacity = vm[opt_queue_capacity].as<unsigned int>();
+			options.queue_overflow = lock_free::get_overflow_policy(vm[opt_queue_overflow].as<std::string>());
+
+			if (options.queue_capacity == 0)
+			{
+				throw std::runtime_error("Invalid capacity of dump queues");
+			}
+
+			if (vm.count(opt_conflate))
+			{
+				parse_conflated_streams(vm[opt_conflate].as<std::string>(), options);
+			}
+
+			options.flush.flush_size = static_cast<std::size_t>(vm[opt_flush_size].as<unsigned int>()) * 1024;
+			options.flush.flush_period = std::chrono::milliseconds(vm[opt_flush_period].as<unsigned int>());
+			options.flush.fsync = dump_writer::get_fsync_policy(vm[opt_fsync].as<std::string>());
+			options.flush.backend = dump_writer::get_file_backend(vm[opt_file_backend].as<std::string>());
+			options.flush.completion_markers = true;
+			options.format = dump_writer::get_file_format(vm[opt_format].as<std::string>());
+			options.flush.compression = dump_writer::get_compression_type(vm[opt_compression].as<std::string>());
+			options.flush.compression_level = vm[opt_compression_level].as<int>();
+			options.event_timestamps = vm.count(opt_event_timestamps) != 0;
+			options.consolidated_book = vm.count(opt_consolidated_book) != 0;
+			options.bar_intervals = vm.count(opt_bar_intervals) ? parse_bar_intervals(vm[opt_bar_intervals].as<std::string>()) : std::vector<std::chrono::seconds>{};
+			options.bar_close_delay = std::chrono::milliseconds(vm[opt_bar_close_delay].as<unsigned int>());
+			options.bar_max_clock_skew = std::chrono::milliseconds(vm[opt_bar_max_clock_skew].as<unsigned int>());
+			options.publish.shm_prefix = vm.count(opt_publish_shm) ? vm[opt_publish_shm].as<std::string>() : std::string{};
+			options.publish.shm_slots = vm[opt_publish_shm_slots].as<unsigned int>();
+			options.publish.multicast_ttl = vm[opt_publish_multicast_ttl].as<unsigned int>();
+
+			if (vm.count(opt_publish_multicast))
+			{
+				options.publish.multicast = multicast_feed::get_endpoint(vm[opt_publish_multicast].as<std::string>());
+			}
+
+			if (options.publish.shm_slots == 0)
+			{
+				throw std::runtime_error("Invalid number of shared memory feed records");
+			}
+
+			if (options.flush.compression_level < 1 || options.flush.compression_level > 9)
+			{
+				throw std::runtime_error("Invalid compression level");
+			}
+
 			const auto dump_path = vm[opt_dump_path].as<std::string>();
 			const auto symbol_config_file = vm[opt_symbol_config].as<std::string>();
 
 			std::cout << "Dump market data to: " << dump_path << std::endl;
 			std::cout << "Symbol config file: " << symbol_config_file << std::endl;
+			if (vm.count(opt_shard_node))
+			{
+				std::cout << "Shard node: " << vm[opt_shard_node].as<std::string>() << std::endl;
+			}
 			std::cout << "Duration of one block: " << duration << " minute(s)" << std::endl;
 			std::cout << "Number of market data blocks: " << blocks_num << std::endl;
 			std::cout << "Depth of the order book: " << depth << std::endl;
+			std::cout << "Order book dump mode: " << vm[opt_prices_mode].as<std::string>() << std::endl;
+			std::cout << "Dump queue capacity: " << options.queue_capacity << ", overflow policy: " << vm[opt_queue_overflow].as<std::string>() <<
+				(vm.count(opt_conflate) ? ", conflated streams: " + vm[opt_conflate].as<std::string>() : std::string{}) << std::endl;
+			std::cout << "Dump buffer: " << vm[opt_flush_size].as<unsigned int>() << " KB, flush period: " << options.flush.flush_period.count() << " ms, fsync: " << vm[opt_fsync].as<std::string>() << ", backend: " << vm[opt_file_backend].as<std::string>() << std::endl;
+			std::cout << "Dump files format: " << vm[opt_format].as<std::string>() << ", compression: " << vm[opt_compression].as<std::string>() << std::endl;
+
+			if (options.publish.enabled())
+			{
+				std::cout << "Publish to shared memory: " << (options.publish.shm_prefix.empty() ? std::string("none") : options.publish.shm_prefix) <<
+					", multicast: " << (vm.count(opt_publish_multicast) ? vm[opt_publish_multicast].as<std::string>() : std::string("none")) << std::endl;
+			}
+			const auto io_threads = vm[opt_io_threads].as<unsigned int>();
+			const auto io_cpus = vm.count(opt_io_cpus) ? parse_cpus(vm[opt_io_cpus].as<std::string>()) : std::vector<unsigned int>{};
+
+			if (io_threads == 0 && !io_cpus.empty())
+			{
+				throw std::runtime_error("CPUs can be set for shared io threads only");
+			}
+
+			run_options run;
+			run.latency_report_period = vm[opt_latency_report_period].as<unsigned int>();
+			run.metrics_file = vm.count(opt_metrics_file) ? vm[opt_metrics_file].as<std::string>() : std::string{};
+			run.metrics_period = vm[opt_metrics_period].as<unsigned int>();
+			run.capture_file = vm.count(opt_capture_file) ? vm[opt_capture_file].as<std::string>() : std::string{};
+			run.replay_file = vm.count(opt_replay_file) ? vm[opt_replay_file].as<std::string>() : std::string{};
+			run.replay_speed = market_data::get_replay_speed(vm[opt_replay_speed].as<std::string>());
+			run.connection.standby = vm.count(opt_standby_connections) != 0;
+			run.shutdown_timeout = std::chrono::seconds(vm[opt_shutdown_timeout].as<unsigned int>());
+			run.shard_node = vm.count(opt_shard_node) ? vm[opt_shard_node].as<std::string>() : std::string{};
+
+			if (!run.metrics_file.empty() && run.metrics_period == 0)
+			{
+				throw std::runtime_error("Invalid period of writing metrics");
+			}
+
+			if (!run.capture_file.empty() && !run.replay_file.empty())
+			{
+				throw std::runtime_error("A capture can not be recorded while replaying one");
+			}
+
+			std::cout << "Shared io threads: " << io_threads << (run.connection.standby ? ", standby connections" : "") << std::endl;
+			std::cout << "Latency report period: " << run.latency_report_period << " s" << std::endl;
+			std::cout << "Shutdown timeout: " << run.shutdown_timeout.count() << " s" << std::endl;
+			if (!run.metrics_file.empty())
+			{
+				std::cout << "Metrics file: " << run.metrics_file << ", period: " << run.metrics_period << " s" << std::endl;
+			}
+
+			if (!run.capture_file.empty())
+			{
+				std::cout << "Capture file: " << run.capture_file << std::endl;
+			}
+
+			if (!run.replay_file.empty())
+			{
+				std::cout << "Replay file: " << run.replay_file << ", speed: " << vm[opt_replay_speed].as<std::string>() << std::endl;
+			}
+
 			std::cout << "Exchanges:" << std::endl;
 			for (const auto &ex : exchanges)
 			{
@@ -214,7 +597,12 @@ int main(int argc, char *argv[])
 
 			std::cout << "Press Ctrl+C to stop." << std::endl;
 
-			run_loop(logger, dump_path, symbol_config_file, exchanges, duration, blocks_num, depth);
+			// common depths get records with inline levels
+			market_data::visit_fixed_depth(depth, [&](auto fixed_depth)
+			{
+				run_loop<decltype(logger), decltype(fixed_depth)::value>(
+					logger, dump_path, symbol_config_file, exchanges, duration, blocks_num, depth, options, io_threads, io_cpus, run);
+			});
 		}
 		catch (const std::exception &exc)
 		{
@@ -0,0 +1,1309 @@
+/*
+Market data collector for crypto exchanges.
+https://github.com/ilia-funtov/crypto-market-data-collector
+
+Licensed under the MIT License <http://opensource.org/licenses/MIT>.
+Copyright (c) 2022 Ilia Funtov.
+
+Permission is hereby  granted, free of charge, to any  person obtaining a copy
+of this software and associated  documentation files (the "Software"), to deal
+in the Software  without restriction, including without  limitation the rights
+to  use, copy,  modify, merge,  publish, distribute,  sublicense, and/or  sell
+copies  of  the Software,  and  to  permit persons  to  whom  the Software  is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE  IS PROVIDED "AS  IS", WITHOUT WARRANTY  OF ANY KIND,  EXPRESS OR
+IMPLIED,  INCLUDING BUT  NOT  LIMITED TO  THE  WARRANTIES OF  MERCHANTABILITY,
+FITNESS FOR  A PARTICULAR PURPOSE AND  NONINFRINGEMENT. IN NO EVENT  SHALL THE
+AUTHORS  OR COPYRIGHT  HOLDERS  BE  LIABLE FOR  ANY  CLAIM,  DAMAGES OR  OTHER
+LIABILITY, WHETHER IN AN ACTION OF  CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE  OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// Converts, filters and merges block files of the collector.
+// Without --merge every input file is converted to a file of the same name in the output directory, files are processed in parallel.
+// With --merge records of all input files are merged by timestamp into one output file: files are read and decoded in parallel,
+// a file is opened when the merge reaches its first record, so memory and open files depend on how many files overlap in time.
+// With --shards inputs are dump paths of collector nodes sharing a symbol config: files of a stream and block are merged
+// across the nodes into one file each, copies of records of feeds collected by more than one node are dropped.
+// Merged outputs are in time order as far as every input file is, and de-duplication finds copies only within time ordered inputs.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/program_options.hpp>
+#include <boost/algorithm/string.hpp>
+
+#include <binary_format.hpp>
+#include <block_reader.hpp>
+#include <dump_writer.hpp>
+#include <timestamp_parser.hpp>
+
+using block_reader::market_record;
+
+namespace
+{
+	struct input_file
+	{
+		std::filesystem::path path;
+		std::filesystem::path output_name; // relative path of the converted file, it keeps the stream directory
+		std::optional<binary_format::record_type> csv_type;
+		std::size_t shard = 0; // index of the shard dump path with --shards
+	};
+
+	struct tool_options
+	{
+		dump_writer::file_format format = dump_writer::file_format::csv;
+		dump_writer::flush_options flush;
+		block_reader::record_filter filter;
+		std::optional<binary_format::record_type> csv_type; // of csv files outside stream directories
+		std::uint32_t depth = 0; // of binary price files, 0 for the depth of the input
+		bool event_timestamps = false; // in csv price files
+		unsigned int threads = 1;
+		std::int64_t dedup_window = 0; // microseconds, 0 keeps copies of records of different shards
+	};
+
+	// Totals of all files, updated by worker threads.
+	struct tool_statistics
+	{
+		std::atomic<std::uint64_t> files{0};
+		std::atomic<std::uint64_t> records{0};
+		std::atomic<std::uint64_t> invalid_records{0};
+		std::atomic<std::uint64_t> duplicate_records{0};
+		std::atomic<std::uint64_t> failed_files{0};
+	};
+
+	std::int64_t parse_time(const std::string & str)
+	{
+		std::int64_t timestamp = 0;
+		if (block_reader::details::parse_number(str, timestamp))
+			return timestamp;
+
+		// 2022-05-01 or 2022-05-01T10:00:00[.fraction], UTC
+		const auto iso_time = (str.find('T') == std::string::npos) ? str + "T00:00:00" : str;
+		return static_cast<std::int64_t>(timestamp_parser::parse_iso_timestamp_with_microseconds(iso_time));
+	}
+
+	std::bitset<256> parse_exchanges(const std::string & str)
+	{
+		std::vector<std::string> names;
+		boost::split(names, str, boost::is_any_of(","));
+
+		std::bitset<256> exchanges;
+		for (auto & name : names)
+		{
+			boost::trim(name);
+			const auto id = block_reader::get_exchange_id(name);
+			if (!id)
+				throw std::runtime_error("Unknown exchange: " + name);
+
+			exchanges.set(*id);
+		}
+
+		return exchanges;
+	}
+
+	binary_format::record_type get_record_type(const std::string & str)
+	{
+		if (str == "trades")
+			return binary_format::record_type::trade;
+
+		if (str == "prices")
+			return binary_format::record_type::price;
+
+		if (str == "bars")
+			return binary_format::record_type::bar;
+
+		throw std::runtime_error("Unsupported record type: " + str);
+	}
+
+	// Block files of the paths, directories are searched recursively. Files are sorted by path, so blocks of a stream are in order.
+	std::vector<input_file> collect_inputs(const std::vector<std::string> & paths, const tool_options & options)
+	{
+		namespace fs = std::filesystem;
+
+		std::vector<input_file> inputs;
+
+		const auto add = [&](const fs::path & path, const fs::path & output_name)
+		{
+			const auto stream_type = block_reader::get_stream_type(path);
+			inputs.push_back(input_file{ path, output_name, stream_type ? stream_type : options.csv_type });
+		};
+
+		for (const auto & str : paths)
+		{
+			const fs::path path(str);
+			if (fs::is_directory(path))
+			{
+				// names are relative to the stream directory parent, whether the stream directory was given or the dump path
+				const auto root = block_reader::get_stream_type(path / "file") ? path.parent_path() : path;
+
+				std::vector<fs::path> files;
+				for (const auto & entry : fs::recursive_directory_iterator(path))
+				{
+					if (entry.is_regular_file() && block_reader::get_file_format(entry.path()))
+						files.push_back(entry.path());
+				}
+
+				std::sort(files.begin(), files.end());
+				for (const auto & file : files)
+				{
+					add(file, file.lexically_relative(root));
+				}
+			}
+			else if (fs::is_regular_file(path))
+			{
+				if (!block_reader::get_file_format(path))
+					throw std::runtime_error("Not a block file: " + str);
+
+				add(path, path.parent_path().filename() / path.filename());
+			}
+			else
+			{
+				throw std::runtime_error("Input file does not exist: " + str);
+			}
+		}
+
+		return inputs;
+	}
+
+	// Writes records to a block file or as csv to the standard output ("-").
+	class record_writer
+	{
+	public:
+		record_writer(const std::string & path, const tool_options & options, binary_format::record_type type, const std::string & symbol, std::uint32_t depth) :
+			_path(path),
+			_type(type),
+			_depth(depth),
+			_event_timestamps(options.event_timestamps),
+			_binary(options.format == dump_writer::file_format::binary)
+		{
+			if (_binary && type == binary_format::record_type::price && depth == 0)
+				throw std::runtime_error("Depth of csv price records is not known, set --depth.");
+
+			if (path == "-")
+			{
+				if (_binary)
+					throw std::runtime_error("Binary records can not be written to the standard output.");
+
+				return;
+			}
+
+			binary_format::file_header header;
+			header.type = type;
+			header.symbol = symbol;
+			header.depth = (type == binary_format::record_type::price) ? depth : 0;
+			header.record_size = (type == binary_format::record_type::price) ? binary_format::price_record_size(depth) :
+				(type == binary_format::record_type::bar) ? binary_format::bar_record_size : binary_format::trade_record_size;
+			header.creation_time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+			_file.emplace(options.flush, options.format, header);
+			if (!_file->open(path))
+				throw std::runtime_error("Could not open output file: " + path);
+		}
+
+		record_writer(const record_writer &) = delete;
+		record_writer & operator = (const record_writer &) = delete;
+		record_writer(record_writer &&) = delete;
+		record_writer & operator = (record_writer &&) = delete;
+
+		void write(const market_record & record)
+		{
+			auto & buffer = _file ? _file->buffer() : _stdout_buffer;
+
+			if (_file)
+			{
+				_file->record_added(record.timestamp);
+			}
+
+			if (_binary)
+			{
+				write_binary(buffer, record);
+			}
+			else
+			{
+				write_csv(buffer, record);
+			}
+
+			if (_file)
+			{
+				if (!_file->flush_if_needed())
+					throw std::runtime_error("Could not write output file: " + _path);
+			}
+			else if (_stdout_buffer.size() >= stdout_flush_size)
+			{
+				flush_stdout();
+			}
+		}
+
+		void close()
+		{
+			if (_file && !_file->close())
+				throw std::runtime_error("Could not write output file: " + _path);
+
+			if (!_file)
+			{
+				flush_stdout();
+			}
+		}
+
+	private:
+		static constexpr std::size_t stdout_flush_size = 1024 * 1024;
+
+		void flush_stdout()
+		{
+			if (fwrite(_stdout_buffer.data(), 1, _stdout_buffer.size(), stdout) != _stdout_buffer.size())
+				throw std::runtime_error("Could not write to the standard output.");
+
+			_stdout_buffer.clear();
+		}
+
+		void write_binary(dump_writer::text_buffer & buffer, const market_record & record) const
+		{
+			switch (_type)
+			{
+			case binary_format::record_type::trade:
+				binary_format::put_trade_record(buffer, record.exchange, record.sell, record.timestamp, record.price, record.volume);
+				break;
+			case binary_format::record_type::price:
+				binary_format::put_price_record(buffer, record.exchange, record.timestamp, record.exchange_timestamp, record.receive_timestamp, _depth, record.levels);
+				break;
+			case binary_format::record_type::bar:
+				binary_format::put_bar_record(
+					buffer,
+					record.exchange,
+					record.interval,
+					record.timestamp,
+					record.open,
+					record.high,
+					record.low,
+					record.close,
+					record.buy_volume,
+					record.sell_volume,
+					record.vwap,
+					record.trades);
+				break;
+			}
+		}
+
+		// Lines as the collector writes them, prices are snapshots.
+		void write_csv(dump_writer::text_buffer & buffer, const market_record & record) const
+		{
+			buffer.append(block_reader::get_exchange_name(record.exchange, _type)).append(',');
+
+			switch (_type)
+			{
+			case binary_format::record_type::trade:
+				buffer.append_fixed(record.price, 2).append(',');
+				buffer.append_fixed(record.sell ? -record.volume : record.volume, 8).append(',');
+				buffer.append_integer(record.timestamp);
+				break;
+			case binary_format::record_type::price:
+				buffer.append_integer(record.timestamp);
+
+				if (_event_timestamps)
+				{
+					buffer.append(',').append_integer(record.exchange_timestamp);
+					buffer.append(',').append_integer(record.receive_timestamp);
+				}
+
+				for (const auto & level : record.levels)
+				{
+					buffer.append(',').append_fixed(level.first, 2).append(',').append_fixed(level.second, 8);
+				}
+
+				break;
+			case binary_format::record_type::bar:
+				buffer.append_integer(record.interval).append(',');
+				buffer.append_integer(record.timestamp);
+
+				for (const auto price : { record.open, record.high, record.low, record.close })
+				{
+					buffer.append(',').append_fixed(price, 2);
+				}
+
+				buffer.append(',').append_fixed(record.buy_volume, 8);
+				buffer.append(',').append_fixed(record.sell_volume, 8);
+				buffer.append(',').append_fixed(record.vwap, 2);
+				buffer.append(',').append_integer(record.trades);
+				break;
+			}
+
+			buffer.append('\n');
+		}
+
+		const std::string _path;
+		const binary_format::record_type _type;
+		const std::uint32_t _depth;
+		const bool _event_timestamps;
+		const bool _binary;
+
+		std::optional<dump_writer::block_file> _file;
+		dump_writer::text_buffer _stdout_buffer;
+	};
+
+	void report_file(const block_reader::file_reader & reader, tool_statistics & statistics)
+	{
+		statistics.files++;
+		statistics.invalid_records += reader.invalid_records();
+
+		if (reader.truncated())
+		{
+			std::cerr << "Truncated file, records up to the break were read: " << reader.path() << std::endl;
+		}
+	}
+
+	// Calls the function for indices from 0 to count on the threads, the first exception is rethrown when all threads are done.
+	template <typename function_t>
+	void parallel_for(std::size_t count, unsigned int threads, function_t function)
+	{
+		std::atomic<std::size_t> next{0};
+		std::mutex error_mutex;
+		std::exception_ptr error;
+
+		std::vector<std::thread> workers;
+		for (unsigned int n = 0; n != std::max(1u, threads); ++n)
+		{
+			workers.emplace_back([&]()
+			{
+				for (auto index = next++; index < count; index = next++)
+				{
+					try
+					{
+						function(index);
+					}
+					catch (...)
+					{
+						std::lock_guard<std::mutex> lock(error_mutex);
+						if (!error)
+						{
+							error = std::current_exception();
+						}
+
+						next = count;
+					}
+				}
+			});
+		}
+
+		for (auto & worker : workers)
+		{
+			worker.join();
+		}
+
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+	// Every input file to its own output file, output files are created for inputs with records passing the filter only.
+	void convert_files(const std::vector<input_file> & inputs, const std::filesystem::path & output_directory, const tool_options & options, tool_statistics & statistics)
+	{
+		const auto extension = dump_writer::get_file_extension(options.format, options.flush.compression);
+
+		parallel_for(inputs.size(), options.threads, [&](std::size_t index)
+		{
+			const auto & input = inputs[index];
+
+			try
+			{
+				block_reader::file_reader reader(input.path, input.csv_type, options.filter);
+
+				const auto output_path = output_directory / input.output_name.parent_path() / (block_reader::get_base_name(input.path) + extension);
+				if (std::filesystem::exists(output_path) && std::filesystem::equivalent(output_path, input.path))
+					throw std::runtime_error("Output file is the input file: " + output_path.string());
+
+				std::optional<record_writer> writer;
+				market_record record;
+				std::uint64_t records = 0;
+
+				while (reader.next(record))
+				{
+					if (!writer)
+					{
+						std::filesystem::create_directories(output_path.parent_path());
+						std::filesystem::remove(output_path);
+						writer.emplace(output_path.string(), options, reader.type(), reader.symbol(), options.depth ? options.depth : reader.depth());
+					}
+
+					writer->write(record);
+					++records;
+				}
+
+				if (writer)
+				{
+					writer->close();
+				}
+
+				report_file(reader, statistics);
+				statistics.records += records;
+			}
+			catch (const std::exception & exc)
+			{
+				statistics.failed_files++;
+				std::cerr << input.path.string() << ": " << exc.what() << std::endl;
+			}
+		});
+	}
+
+	// Bounded queue of record batches between threads.
+	class batch_queue
+	{
+	public:
+		explicit batch_queue(std::size_t capacity) : _capacity(capacity)
+		{
+		}
+
+		// Returns false when the queue was closed.
+		bool push(std::vector<market_record> && batch)
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_not_full.wait(lock, [this]() { return _batches.size() < _capacity || _closed; });
+			if (_closed)
+				return false;
+
+			_batches.push_back(std::move(batch));
+			_not_empty.notify_one();
+			return true;
+		}
+
+		// Returns false when the queue was closed and is empty.
+		bool pop(std::vector<market_record> & batch)
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_not_empty.wait(lock, [this]() { return !_batches.empty() || _closed; });
+			if (_batches.empty())
+				return false;
+
+			batch = std::move(_batches.front());
+			_batches.pop_front();
+			_not_full.notify_one();
+			return true;
+		}
+
+		void close()
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_closed = true;
+			_not_full.notify_all();
+			_not_empty.notify_all();
+		}
+
+	private:
+		const std::size_t _capacity;
+		std::mutex _mutex;
+		std::condition_variable _not_full;
+		std::condition_variable _not_empty;
+		std::deque<std::vector<market_record>> _batches;
+		bool _closed = false;
+	};
+
+	// Drops copies of records of feeds collected by several shards: a record equal to a record of another shard
+	// at most the window before it is a copy, and every record is taken as a copy once per other shard.
+	// Records are found by hash and compared field by field, so a hash collision does not drop a record.
+	// Prices are compared without their local timestamps, which differ from node to node: books without an exchange time
+	// are equal by their levels, and copies of equal books are matched to them in order. Exchanges have their own windows,
+	// as exchange times of trades of different exchanges are apart in a stream.
+	class record_deduplicator
+	{
+	public:
+		static constexpr std::size_t max_shards = 64;
+
+		explicit record_deduplicator(std::int64_t window) : _window(window)
+		{
+		}
+
+		record_deduplicator(const record_deduplicator &) = delete;
+		record_deduplicator & operator = (const record_deduplicator &) = delete;
+		record_deduplicator(record_deduplicator &&) = delete;
+		record_deduplicator & operator = (record_deduplicator &&) = delete;
+
+		// Records of an exchange come in the order of their timestamps.
+		bool duplicate(const market_record & record, std::size_t shard)
+		{
+			auto & window = _exchanges[record.exchange];
+			while (!window.recent.empty() && window.recent.front().record.timestamp < record.timestamp - _window)
+			{
+				window.remove_front();
+			}
+
+			const auto hash = get_hash(record);
+			const auto shard_bit = std::uint64_t(1) << shard;
+
+			const auto range = window.index.equal_range(hash);
+			for (auto iter = range.first; iter != range.second; ++iter)
+			{
+				auto & entry = window.recent[static_cast<std::size_t>(iter->second - window.first_sequence)];
+				if (entry.shard != shard && (entry.matched_shards & shard_bit) == 0 && equal(entry.record, record))
+				{
+					entry.matched_shards |= shard_bit;
+					++_duplicates;
+					return true;
+				}
+			}
+
+			window.index.emplace(hash, window.first_sequence + window.recent.size());
+			window.recent.push_back(entry{ record, hash, shard, 0 });
+			return false;
+		}
+
+		std::uint64_t duplicates() const noexcept
+		{
+			return _duplicates;
+		}
+
+	private:
+		struct entry
+		{
+			market_record record;
+			std::uint64_t hash;
+			std::size_t shard;
+			std::uint64_t matched_shards; // shards whose copy was dropped
+		};
+
+		struct exchange_window
+		{
+			std::deque<entry> recent; // by timestamp
+			std::unordered_multimap<std::uint64_t, std::uint64_t> index; // hash to the sequence number of the entry
+			std::uint64_t first_sequence = 0; // of the first recent entry
+
+			void remove_front()
+			{
+				const auto range = index.equal_range(recent.front().hash);
+				for (auto iter = range.first; iter != range.second; ++iter)
+				{
+					if (iter->second == first_sequence)
+					{
+						index.erase(iter);
+						break;
+					}
+				}
+
+				recent.pop_front();
+				++first_sequence;
+			}
+		};
+
+		static std::uint64_t mix(std::uint64_t hash, std::uint64_t value) noexcept
+		{
+			hash = (hash ^ value) * 0x9e3779b97f4a7c15ull;
+			return hash ^ (hash >> 32);
+		}
+
+		static std::uint64_t mix(std::uint64_t hash, double value) noexcept
+		{
+			std::uint64_t bits;
+			std::memcpy(&bits, &value, sizeof(bits));
+			return mix(hash, bits);
+		}
+
+		static std::uint64_t get_hash(const market_record & record) noexcept
+		{
+			std::uint64_t hash = 0;
+
+			switch (record.type)
+			{
+			case binary_format::record_type::trade:
+				hash = mix(hash, static_cast<std::uint64_t>(record.timestamp));
+				hash = mix(hash, static_cast<std::uint64_t>(record.sell));
+				hash = mix(hash, record.price);
+				hash = mix(hash, record.volume);
+				break;
+			case binary_format::record_type::price:
+				hash = mix(hash, static_cast<std::uint64_t>(record.exchange_timestamp));
+				for (const auto & level : record.levels)
+				{
+					hash = mix(mix(hash, level.first), level.second);
+				}
+				break;
+			case binary_format::record_type::bar:
+				hash = mix(hash, static_cast<std::uint64_t>(record.timestamp));
+				hash = mix(hash, static_cast<std::uint64_t>(record.interval));
+				for (const auto value : { record.open, record.high, record.low, record.close, record.buy_volume, record.sell_volume })
+				{
+					hash = mix(hash, value);
+				}
+				hash = mix(hash, record.trades);
+				break;
+			}
+
+			return hash;
+		}
+
+		// The fields of get_hash(), bars with all their values.
+		static bool equal(const market_record & left, const market_record & right) noexcept
+		{
+			if (left.type != right.type)
+				return false;
+
+			switch (left.type)
+			{
+			case binary_format::record_type::trade:
+				return left.timestamp == right.timestamp && left.sell == right.sell &&
+					left.price == right.price && left.volume == right.volume;
+			case binary_format::record_type::price:
+				return left.exchange_timestamp == right.exchange_timestamp && left.levels == right.levels;
+			case binary_format::record_type::bar:
+				return left.timestamp == right.timestamp && left.interval == right.interval &&
+					left.open == right.open && left.high == right.high && left.low == right.low && left.close == right.close &&
+					left.buy_volume == right.buy_volume && left.sell_volume == right.sell_volume &&
+					left.vwap == right.vwap && left.trades == right.trades;
+			}
+
+			return false;
+		}
+
+		const std::int64_t _window;
+		std::map<std::uint8_t, exchange_window> _exchanges;
+		std::uint64_t _duplicates = 0;
+	};
+
+	// K-way merge of input files by timestamp, records of one file keep their order.
+	class file_merger
+	{
+	public:
+		file_merger(const std::vector<input_file> & inputs, const tool_options & options, tool_statistics & statistics) :
+			_options(options),
+			_statistics(statistics)
+		{
+			if (options.dedup_window != 0)
+			{
+				_deduplicator.emplace(options.dedup_window);
+			}
+
+			probe(inputs);
+		}
+
+		file_merger(const file_merger &) = delete;
+		file_merger & operator = (const file_merger &) = delete;
+		file_merger(file_merger &&) = delete;
+		file_merger & operator = (file_merger &&) = delete;
+
+		void merge(const std::string & output_path)
+		{
+			if (_sources.empty())
+				return;
+
+			record_writer writer(output_path, _options, _type, _symbol, _options.depth ? _options.depth : _depth);
+
+			// the merge has its own thread, so does the writer
+			const auto readers = std::max(1u, (_options.threads > 2) ? _options.threads - 2 : 1u);
+			std::vector<std::thread> threads;
+			for (unsigned int n = 0; n != readers; ++n)
+			{
+				threads.emplace_back([this]() { read_loop(); });
+			}
+
+			batch_queue output(output_queue_capacity);
+			std::exception_ptr write_error;
+			threads.emplace_back([&]()
+			{
+				try
+				{
+					std::vector<market_record> batch;
+					while (output.pop(batch))
+					{
+						for (const auto & record : batch)
+						{
+							writer.write(record);
+						}
+					}
+
+					writer.close();
+				}
+				catch (...)
+				{
+					write_error = std::current_exception();
+					output.close();
+				}
+			});
+
+			try
+			{
+				merge_loop(output);
+
+				if (_deduplicator)
+				{
+					_statistics.duplicate_records += _deduplicator->duplicates();
+				}
+			}
+			catch (...)
+			{
+				stop();
+				output.close();
+
+				for (auto & thread : threads)
+				{
+					thread.join();
+				}
+
+				throw;
+			}
+
+			output.close();
+			stop();
+
+			for (auto & thread : threads)
+			{
+				thread.join();
+			}
+
+			if (write_error)
+				std::rethrow_exception(write_error);
+		}
+
+	private:
+		static constexpr std::size_t batch_size = 2048;
+		static constexpr std::size_t source_batches = 2; // decoded ahead per file
+		static constexpr std::size_t output_queue_capacity = 4;
+
+		struct source
+		{
+			input_file input;
+			std::int64_t first_timestamp = 0;
+
+			// reader threads
+			std::unique_ptr<block_reader::file_reader> reader;
+
+			// guarded by the mutex
+			std::deque<std::vector<market_record>> batches;
+			bool requested = false; // waits for a reader thread or is being read
+			bool finished = false;
+
+			// merge thread
+			std::vector<market_record> current;
+			std::size_t position = 0;
+		};
+
+		// Finds the first record of every file, files without records passing the filter are skipped.
+		void probe(const std::vector<input_file> & inputs)
+		{
+			struct probe_result
+			{
+				std::optional<std::int64_t> first_timestamp;
+				binary_format::record_type type;
+				std::uint32_t depth;
+				std::string symbol;
+			};
+
+			std::vector<probe_result> results(inputs.size());
+
+			parallel_for(inputs.size(), _options.threads, [&](std::size_t index)
+			{
+				try
+				{
+					block_reader::file_reader reader(inputs[index].path, inputs[index].csv_type, _options.filter);
+
+					market_record record;
+					if (reader.next(record))
+					{
+						results[index] = probe_result{ record.timestamp, reader.type(), reader.depth(), reader.symbol() };
+					}
+				}
+				catch (const std::exception & exc)
+				{
+					throw std::runtime_error(inputs[index].path.string() + ": " + exc.what());
+				}
+			});
+
+			for (std::size_t n = 0; n != inputs.size(); ++n)
+			{
+				const auto & result = results[n];
+				if (!result.first_timestamp)
+				{
+					_statistics.files++;
+					continue;
+				}
+
+				if (_sources.empty())
+				{
+					_type = result.type;
+					_symbol = result.symbol;
+				}
+				else if (result.type != _type)
+				{
+					throw std::runtime_error("Files of different record types can not be merged: " + inputs[n].path.string());
+				}
+				else if (result.symbol != _symbol)
+				{
+					_symbol.clear(); // merged symbols
+				}
+
+				_depth = std::max(_depth, result.depth);
+
+				auto & added = _sources.emplace_back(std::make_unique<source>());
+				added->input = inputs[n];
+				added->first_timestamp = *result.first_timestamp;
+			}
+
+			std::stable_sort(_sources.begin(), _sources.end(), [](const auto & left, const auto & right)
+			{
+				return left->first_timestamp < right->first_timestamp;
+			});
+		}
+
+		void request(std::size_t index)
+		{
+			auto & file = *_sources[index];
+			if (file.requested || file.finished || file.batches.size() >= source_batches)
+				return;
+
+			file.requested = true;
+			_requests.push_back(index);
+			_work.notify_one();
+		}
+
+		void prefetch(std::size_t index)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			request(index);
+		}
+
+		void stop()
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stop = true;
+			_work.notify_all();
+			_ready.notify_all();
+		}
+
+		void read_loop()
+		{
+			for (;;)
+			{
+				std::size_t index = 0;
+				{
+					std::unique_lock<std::mutex> lock(_mutex);
+					_work.wait(lock, [this]() { return !_requests.empty() || _stop; });
+					if (_stop)
+						return;
+
+					index = _requests.front();
+					_requests.pop_front();
+				}
+
+				auto & file = *_sources[index];
+				std::vector<market_record> batch;
+				bool finished = false;
+
+				try
+				{
+					if (!file.reader)
+					{
+						file.reader = std::make_unique<block_reader::file_reader>(file.input.path, file.input.csv_type, _options.filter);
+					}
+
+					batch.resize(batch_size);
+
+					std::size_t size = 0;
+					while (size != batch_size && file.reader->next(batch[size]))
+					{
+						++size;
+					}
+
+					batch.resize(size);
+
+					if (size != batch_size)
+					{
+						finished = true;
+						report_file(*file.reader, _statistics);
+						file.reader.reset();
+					}
+				}
+				catch (const std::exception & exc)
+				{
+					std::lock_guard<std::mutex> lock(_mutex);
+					if (!_error)
+					{
+						_error = std::make_exception_ptr(std::runtime_error(file.input.path.string() + ": " + exc.what()));
+					}
+
+					_stop = true;
+					_work.notify_all();
+					_ready.notify_all();
+					return;
+				}
+
+				std::lock_guard<std::mutex> lock(_mutex);
+				if (!batch.empty())
+				{
+					file.batches.push_back(std::move(batch));
+				}
+
+				file.finished = finished;
+				file.requested = false;
+				request(index);
+				_ready.notify_all();
+			}
+		}
+
+		// Moves the next decoded batch of the file to the merge thread, returns false at the end of the file.
+		bool take(std::size_t index)
+		{
+			auto & file = *_sources[index];
+
+			std::unique_lock<std::mutex> lock(_mutex);
+			request(index);
+			_ready.wait(lock, [&]() { return !file.batches.empty() || file.finished || _stop; });
+
+			if (_error)
+				std::rethrow_exception(_error);
+
+			if (file.batches.empty())
+				return false;
+
+			file.current = std::move(file.batches.front());
+			file.batches.pop_front();
+			file.position = 0;
+			request(index);
+
+			return true;
+		}
+
+		void merge_loop(batch_queue & output)
+		{
+			using heap_entry = std::pair<std::int64_t, std::size_t>; // timestamp of the next record, source
+			std::priority_queue<heap_entry, std::vector<heap_entry>, std::greater<heap_entry>> heap;
+
+			std::size_t next_source = 0;
+			std::vector<market_record> batch;
+			batch.reserve(batch_size);
+
+			for (;;)
+			{
+				// files start taking part in the merge when it reaches their first record
+				while (next_source != _sources.size() && (heap.empty() || _sources[next_source]->first_timestamp <= heap.top().first))
+				{
+					const auto index = next_source++;
+					if (take(index))
+					{
+						heap.emplace(_sources[index]->current.front().timestamp, index);
+					}
+
+					if (next_source != _sources.size())
+					{
+						prefetch(next_source);
+					}
+				}
+
+				if (heap.empty())
+					break;
+
+				const auto index = heap.top().second;
+				heap.pop();
+
+				auto & file = *_sources[index];
+				auto & record = file.current[file.position++];
+
+				if (!_deduplicator || !_deduplicator->duplicate(record, file.input.shard))
+				{
+					batch.push_back(std::move(record));
+
+					if (batch.size() == batch_size)
+					{
+						_statistics.records += batch.size();
+						if (!output.push(std::move(batch)))
+							return;
+
+						batch.clear();
+						batch.reserve(batch_size);
+					}
+				}
+
+				if (file.position != file.current.size())
+				{
+					heap.emplace(file.current[file.position].timestamp, index);
+				}
+				else if (take(index))
+				{
+					heap.emplace(file.current.front().timestamp, index);
+				}
+				else
+				{
+					file.current.clear();
+				}
+			}
+
+			_statistics.records += batch.size();
+			output.push(std::move(batch));
+		}
+
+		const tool_options & _options;
+		tool_statistics & _statistics;
+
+		std::vector<std::unique_ptr<source>> _sources; // by the first timestamp
+		binary_format::record_type _type = binary_format::record_type::trade;
+		std::uint32_t _depth = 0;
+		std::string _symbol;
+		std::optional<record_deduplicator> _deduplicator;
+
+		std::mutex _mutex;
+		std::condition_variable _work;
+		std::condition_variable _ready;
+		std::deque<std::size_t> _requests;
+		bool _stop = false;
+		std::exception_ptr _error;
+	};
+
+	// Name of the block a file belongs to, compressed files continued after a restart (BTCUSD_0.1.csv.gz) are parts of the block (BTCUSD_0).
+	std::string get_block_name(const std::filesystem::path & path)
+	{
+		auto name = block_reader::get_base_name(path);
+
+		const auto separator = name.rfind('_');
+		const auto part = name.find('.', (separator != std::string::npos) ? separator : 0);
+		if (part != std::string::npos)
+		{
+			name.resize(part);
+		}
+
+		return name;
+	}
+
+	// Files of the same stream and block in the dump paths of shard nodes are merged into one file each, in the layout of a dump path.
+	void merge_shards(const std::vector<std::string> & shard_paths, const std::filesystem::path & output_directory, const tool_options & options, tool_statistics & statistics)
+	{
+		if (shard_paths.size() > record_deduplicator::max_shards)
+			throw std::runtime_error("At most " + std::to_string(record_deduplicator::max_shards) + " shards can be merged");
+
+		std::map<std::filesystem::path, std::vector<input_file>> blocks;
+
+		for (std::size_t shard = 0; shard != shard_paths.size(); ++shard)
+		{
+			if (!std::filesystem::is_directory(shard_paths[shard]))
+				throw std::runtime_error("Shard dump path is not a directory: " + shard_paths[shard]);
+
+			for (auto & input : collect_inputs({ shard_paths[shard] }, options))
+			{
+				input.shard = shard;
+				blocks[input.output_name.parent_path() / get_block_name(input.path)].push_back(std::move(input));
+			}
+		}
+
+		const auto extension = dump_writer::get_file_extension(options.format, options.flush.compression);
+
+		for (const auto & block : blocks)
+		{
+			const auto output_path = output_directory / (block.first.string() + extension);
+
+			try
+			{
+				for (const auto & input : block.second)
+				{
+					if (std::filesystem::exists(output_path) && std::filesystem::equivalent(output_path, input.path))
+						throw std::runtime_error("Output file is an input file: " + output_path.string());
+				}
+
+				std::filesystem::create_directories(output_path.parent_path());
+				std::filesystem::remove(output_path);
+
+				file_merger merger(block.second, options, statistics);
+				merger.merge(output_path.string());
+			}
+			catch (const std::exception & exc)
+			{
+				statistics.failed_files++;
+				std::cerr << output_path.string() << ": " << exc.what() << std::endl;
+			}
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	constexpr auto opt_help = "help";
+	constexpr auto opt_input = "input";
+	constexpr auto opt_output = "output";
+	constexpr auto opt_merge = "merge";
+	constexpr auto opt_format = "format";
+	constexpr auto opt_compression = "compression";
+	constexpr auto opt_compression_level = "compression-level";
+	constexpr auto opt_from = "from";
+	constexpr auto opt_to = "to";
+	constexpr auto opt_exchanges = "exchanges";
+	constexpr auto opt_type = "type";
+	constexpr auto opt_depth = "depth";
+	constexpr auto opt_event_timestamps = "event-timestamps";
+	constexpr auto opt_threads = "threads";
+	constexpr auto opt_shards = "shards";
+	constexpr auto opt_dedup_window = "dedup-window";
+
+	constexpr auto default_format = "csv";
+	constexpr auto default_compression = "none";
+	constexpr auto default_compression_level = 6;
+	constexpr auto default_dedup_window_ms = 5000u;
+
+	try
+	{
+		namespace po = boost::program_options;
+		po::options_description desc("Options");
+		desc.add_options()
+			(opt_help, "Print help message")
+			(opt_input, po::value<std::vector<std::string>>(), "Block files or directories with block files (searched recursively)")
+			(opt_output, po::value<std::string>(), "Output directory, or the output file with --merge (- for csv to the standard output)")
+			(opt_merge, "Merge records of all input files by timestamp into one output file")
+			(opt_shards, "Inputs are dump paths of shard nodes, files of a stream and block are merged across them into the output directory")
+			(opt_dedup_window, po::value<unsigned int>()->default_value(default_dedup_window_ms), "With --shards, window in milliseconds for dropping copies of records collected by several shards, 0 to keep them")
+			(opt_format, po::value<std::string>()->default_value(default_format), "Output format: csv, binary")
+			(opt_compression, po::value<std::string>()->default_value(default_compression), "Output compression: none, gzip")
+			(opt_compression_level, po::value<int>()->default_value(default_compression_level), "Compression level from 1 (fastest) to 9 (smallest)")
+			(opt_from, po::value<std::string>(), "First time of records: microseconds or UTC time like 2022-05-01T10:00:00")
+			(opt_to, po::value<std::string>(), "Last time of records (inclusive): microseconds or UTC time")
+			(opt_exchanges, po::value<std::string>(), "Comma separated exchanges of records: bitfinex, coinbase, kraken, bitmex, consolidated, all (bars of all exchanges)")
+			(opt_type, po::value<std::string>(), "Record type of csv files outside trades, prices, consolidated and bars directories: trades, prices, bars")
+			(opt_depth, po::value<unsigned int>(), "Depth of binary price files, by default the depth of binary input files")
+			(opt_event_timestamps, "Write exchange and receive timestamps of price records to csv files")
+			(opt_threads, po::value<unsigned int>()->default_value(std::max(1u, std::thread::hardware_concurrency())), "Number of threads");
+
+		po::positional_options_description positional;
+		positional.add(opt_input, -1);
+
+		po::variables_map vm;
+		po::store(po::command_line_parser(argc, argv).options(desc).positional(positional).run(), vm);
+
+		if (vm.count(opt_help))
+		{
+			std::cout << "market-data-tool [options] <input>..." << std::endl
+					  << desc << std::endl;
+			return 0;
+		}
+
+		if (vm.count(opt_input) == 0)
+		{
+			throw std::runtime_error("Input files are not defined");
+		}
+
+		if (vm.count(opt_output) == 0)
+		{
+			throw std::runtime_error("Output is not defined");
+		}
+
+		tool_options options;
+		options.format = dump_writer::get_file_format(vm[opt_format].as<std::string>());
+		options.flush.compression = dump_writer::get_compression_type(vm[opt_compression].as<std::string>());
+		options.flush.compression_level = vm[opt_compression_level].as<int>();
+		options.event_timestamps = vm.count(opt_event_timestamps) != 0;
+		options.threads = vm[opt_threads].as<unsigned int>();
+
+		if (vm.count(opt_shards))
+		{
+			options.dedup_window = static_cast<std::int64_t>(vm[opt_dedup_window].as<unsigned int>()) * 1000;
+		}
+
+		if (options.flush.compression_level < 1 || options.flush.compression_level > 9)
+		{
+			throw std::runtime_error("Invalid compression level");
+		}
+
+		if (options.threads == 0)
+		{
+			throw std::runtime_error("Invalid number of threads");
+		}
+
+		if (vm.count(opt_from))
+		{
+			options.filter.from = parse_time(vm[opt_from].as<std::string>());
+		}
+
+		if (vm.count(opt_to))
+		{
+			options.filter.to = parse_time(vm[opt_to].as<std::string>());
+		}
+
+		if (vm.count(opt_exchanges))
+		{
+			options.filter.exchanges = parse_exchanges(vm[opt_exchanges].as<std::string>());
+		}
+
+		if (vm.count(opt_type))
+		{
+			options.csv_type = get_record_type(vm[opt_type].as<std::string>());
+		}
+
+		if (vm.count(opt_depth))
+		{
+			options.depth = vm[opt_depth].as<unsigned int>();
+			if (options.depth == 0)
+			{
+				throw std::runtime_error("Invalid depth");
+			}
+		}
+
+		const auto input_paths = vm[opt_input].as<std::vector<std::string>>();
+		const auto output = vm[opt_output].as<std::string>();
+
+		if (vm.count(opt_merge) && vm.count(opt_shards))
+		{
+			throw std::runtime_error("Shards are merged into an output directory, --merge can not be used with --shards");
+		}
+
+		if (vm.count(opt_shards) && output == "-")
+		{
+			throw std::runtime_error("Merged shards need an output directory");
+		}
+
+		const auto inputs = vm.count(opt_shards) ? std::vector<input_file>{} : collect_inputs(input_paths, options);
+
+		tool_statistics statistics;
+		const auto start = std::chrono::steady_clock::now();
+
+		if (vm.count(opt_shards))
+		{
+			merge_shards(input_paths, output, options, statistics);
+		}
+		else if (vm.count(opt_merge))
+		{
+			file_merger merger(inputs, options, statistics);
+			merger.merge(output);
+		}
+		else
+		{
+			if (output == "-")
+			{
+				throw std::runtime_error("Converted files need an output directory, use --merge for the standard output");
+			}
+
+			convert_files(inputs, output, options, statistics);
+		}
+
+		const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		std::cerr << "Files: " << statistics.files << ", records: " << statistics.records << ", invalid records: " << statistics.invalid_records
+				  << ", duplicate records: " << statistics.duplicate_records
+				  << ", failed files: " << statistics.failed_files << ", time: " << seconds << " s" << std::endl;
+
+		if (statistics.failed_files != 0)
+		{
+			return 1;
+		}
+	}
+	catch (const std::exception &exc)
+	{
+		std::cerr << exc.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}